@@ -0,0 +1,356 @@
+#include "zpp/x64/hosted/cpu.h"
+#include "zpp/x64/context.h"
+#include "zpp/x64/intel/asm.h"
+#include "zpp/x64/intel/msr.h"
+#include "zpp/x64/intel/vmcs_fields.h"
+#include "zpp/x64/segment_descriptor.h"
+#include <cstdint>
+
+namespace zpp::x64::hosted
+{
+namespace
+{
+/**
+ * The simulated processors.
+ */
+cpu g_cpus[max_cpus];
+
+/**
+ * The selectors of the simulated GDT. The process selectors are the
+ * selectors that a Linux process runs with, and are described as ring 0
+ * segments, so that the process runs as the kernel of the guest.
+ */
+constexpr std::uint16_t kernel_code_selector = 0x10;
+constexpr std::uint16_t kernel_data_selector = 0x18;
+constexpr std::uint16_t process_data_selector = 0x2b;
+constexpr std::uint16_t process_code_selector = 0x33;
+constexpr std::uint16_t task_state_selector = 0x40;
+
+/**
+ * The MSRs of a processor that supports VMX with EPT, VPID, unrestricted
+ * guests and the true controls, where every control may be set.
+ */
+constexpr cpu::msr default_msrs[] = {
+    // Locked, VMX outside of SMX enabled.
+    {intel::msr::ia32_feature_control, 0x5},
+
+    // Eight variable ranges, fixed ranges and write combining.
+    {intel::msr::ia32_mtrr_capability, 0x508},
+
+    // MTRRs and fixed ranges enabled, write back by default.
+    {intel::msr::ia32_mtrr_def_type, 0xc06},
+
+    // Write back below 640KB, uncachable video memory, write protected
+    // option ROMs and BIOS.
+    {intel::msr::mtrr::fix64k_00000, 0x0606060606060606},
+    {intel::msr::mtrr::fix16k_80000, 0x0606060606060606},
+    {intel::msr::mtrr::fix16k_a0000, 0},
+    {intel::msr::mtrr::fix4k_c0000, 0x0505050505050505},
+    {intel::msr::mtrr::fix4k_c8000, 0x0505050505050505},
+    {intel::msr::mtrr::fix4k_d0000, 0},
+    {intel::msr::mtrr::fix4k_d8000, 0},
+    {intel::msr::mtrr::fix4k_e0000, 0},
+    {intel::msr::mtrr::fix4k_e8000, 0},
+    {intel::msr::mtrr::fix4k_f0000, 0x0505050505050505},
+    {intel::msr::mtrr::fix4k_f8000, 0x0505050505050505},
+
+    // Uncachable memory mapped devices at 3GB-4GB of a 39 bit physical
+    // address space, and a write through range that overlaps them.
+    {intel::msr::mtrr::physbase_0, 0xc0000000},
+    {intel::msr::mtrr::physmask_0, 0x7fc0000800},
+    {intel::msr::mtrr::physbase_1, 0xfe000004},
+    {intel::msr::mtrr::physmask_1, 0x7ffe000800},
+
+    {intel::msr::ia32_debug_control, 0},
+    {intel::msr::ia32_extended_feature_enable, 0xd01},
+    {intel::msr::ia32_fs_base, 0},
+    {intel::msr::ia32_gs_base, 0},
+
+    // The local APIC is enabled in x2APIC mode.
+    {intel::msr::ia32_apic_base, 0xfee00c00},
+
+    // Revision 1, 4KB regions, write back, true controls.
+    {intel::msr::vmx::basic,
+     0x1 | (0x1000ull << 32) | (6ull << 50) | (1ull << 54) | (1ull << 55)},
+
+    {intel::msr::vmx::pin_based_controls, 0xffffffff00000016},
+    {intel::msr::vmx::processor_based_contorls, 0xffffffff0401e172},
+    {intel::msr::vmx::exit_controls, 0xffffffff00036dff},
+    {intel::msr::vmx::entry_controls, 0xffffffff000011ff},
+
+    // Preemption timer rate 5, HLT activity state, 4 CR3 targets.
+    {intel::msr::vmx::misc, 0x40045},
+
+    {intel::msr::vmx::cr0_fixed_0, 0x80000021},
+    {intel::msr::vmx::cr0_fixed_1, 0xffffffff},
+    {intel::msr::vmx::cr4_fixed_0, 0x2000},
+    {intel::msr::vmx::cr4_fixed_1, 0x3767ff},
+    {intel::msr::vmx::vmcs_enum, 0x2e},
+    {intel::msr::vmx::processor_based_contorls_2, 0xffffffff00000000},
+    {intel::msr::vmx::vpid_ept_capability, 0xf0106734141},
+    {intel::msr::vmx::true_pin_based_controls, 0xffffffff00000016},
+    {intel::msr::vmx::true_processor_based_controls, 0xffffffff04006172},
+    {intel::msr::vmx::true_exit_controls, 0xffffffff00036dfb},
+    {intel::msr::vmx::true_entry_controls, 0xffffffff000011fb},
+    {intel::msr::vmx::vm_functions, 0x1},
+};
+
+/**
+ * Returns a flat ring 0 segment descriptor of the given type.
+ */
+std::uint64_t flat_segment(segment_descriptor::segment_type type,
+                           bool code_64_bit)
+{
+    segment_descriptor descriptor;
+    descriptor.limit(0xfffff);
+    descriptor.base(0);
+    descriptor.type(type);
+    descriptor.system(false);
+    descriptor.privilege_level(0);
+    descriptor.present(true);
+    descriptor.available_for_system_use(false);
+    descriptor.code_64_bit(code_64_bit);
+    descriptor.default_operation_size(!code_64_bit);
+    descriptor.granularity(true);
+    return descriptor.basic_value();
+}
+} // namespace
+
+extern "C" cpu * zpp_hosted_current = &g_cpus[0];
+
+/**
+ * The scratch space of the simulated VM entry and VM exit, which can use
+ * neither the stack nor a register.
+ */
+extern "C" std::uint64_t zpp_hosted_scratch[2]{};
+
+/**
+ * Executes a VM exit of the current processor with the general purpose
+ * registers of the given context, and returns on VM resume.
+ */
+extern "C" void zpp_hosted_guest_exit(gpr_context * registers);
+
+void cpu::reset()
+{
+    using segment_type = segment_descriptor::segment_type;
+
+    // Start from a cleared processor.
+    *this = cpu{};
+
+    // Protected mode with paging, write protection and caches enabled.
+    cr0 = 0x80050033;
+    cr3 = 0x1000;
+
+    // PAE, PGE, OSFXSR, OSXMMEXCPT, PCIDE, OSXSAVE, SMEP and SMAP.
+    cr4 = 0x3606f0;
+    dr7 = 0x400;
+    xcr0 = 0x7;
+
+    // Build the GDT.
+    gdt[kernel_code_selector >> 3] =
+        flat_segment(segment_type::code_execute_read_accessed, true);
+    gdt[kernel_data_selector >> 3] =
+        flat_segment(segment_type::data_read_write_accessed, false);
+    gdt[process_data_selector >> 3] =
+        flat_segment(segment_type::data_read_write_accessed, false);
+    gdt[process_code_selector >> 3] =
+        flat_segment(segment_type::code_execute_read_accessed, true);
+
+    // Add the task state segment.
+    segment_descriptor task_state_segment;
+    task_state_segment.limit(sizeof(tss) - 1);
+    task_state_segment.base_extended(reinterpret_cast<std::uint64_t>(tss));
+    task_state_segment.type(segment_type::tss_busy);
+    task_state_segment.system(true);
+    task_state_segment.privilege_level(0);
+    task_state_segment.present(true);
+    task_state_segment.available_for_system_use(false);
+    task_state_segment.code_64_bit(false);
+    task_state_segment.default_operation_size(false);
+    task_state_segment.granularity(false);
+    gdt[task_state_selector >> 3] = task_state_segment.basic_value();
+    gdt[(task_state_selector >> 3) + 1] =
+        task_state_segment.extended_value();
+
+    // Load the descriptor table registers.
+    gdtr_base = reinterpret_cast<std::uint64_t>(gdt);
+    gdtr_limit = sizeof(gdt) - 1;
+    idtr_base = reinterpret_cast<std::uint64_t>(idt);
+    idtr_limit = sizeof(idt) - 1;
+    tr = task_state_selector;
+    interrupts_enabled = true;
+
+    // Load the MSRs.
+    for (auto & msr : default_msrs) {
+        wrmsr(msr.index, msr.value);
+    }
+
+    // The x2APIC identifier is the processor index.
+    wrmsr(intel::msr::x2apic::id, this - g_cpus);
+}
+
+cpu & select(std::size_t cpuid)
+{
+    zpp_hosted_current = &g_cpus[cpuid];
+    return *zpp_hosted_current;
+}
+
+void vm_exit(std::uint32_t reason,
+             std::uint64_t qualification,
+             gpr_context & registers)
+{
+    using field = intel::vmcs_fields::vmcs_field;
+
+    auto & cpu = current();
+
+    // Write the exit information.
+    cpu.vmwrite(field::exit_reason, reason);
+    cpu.vmwrite(field::exit_qualification, qualification);
+
+    // Load the host GS base.
+    cpu.vmread(field::host_gs_base, cpu.gs_base);
+
+    // The exit is a call that returns on resume, and therefore has no
+    // instruction to skip.
+    cpu.vmwrite(field::vm_exit_instruction_length, 0);
+
+    // Exit.
+    zpp_hosted_guest_exit(&registers);
+}
+
+void send_ipi(std::uint64_t command)
+{
+    using field = intel::vmcs_fields::vmcs_field;
+
+    // Only NMIs are delivered, to the processor whose x2APIC identifier
+    // is the destination.
+    auto destination = command >> 32;
+    if (0x400 != (command & 0x700) || destination >= max_cpus) {
+        return;
+    }
+
+    // An NMI of another processor that runs the guest exits, and the
+    // sending processor continues once the destination resumes.
+    auto & sender = current();
+    auto & cpu = select(destination);
+    if (&cpu != &sender && cpu.vmx_on &&
+        cpu::invalid_vmcs != cpu.current_vmcs) {
+        // A valid NMI.
+        cpu.vmwrite(field::vm_exit_interruption_information,
+                    (1u << 31) | (2u << 8) | 2);
+
+        gpr_context registers{};
+        vm_exit(0, 0, registers);
+    }
+    zpp_hosted_current = &sender;
+}
+
+extern "C" void __attribute__((naked)) zpp_hosted_vm_entry()
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        mov [rip+zpp_hosted_scratch], rax // Save rax.
+        mov rax, [rip+zpp_hosted_current] // The current processor.
+        mov rsp, [rax+0x8] // Load the guest rsp.
+        mov rax, [rax] // Load the guest rip.
+        mov [rip+zpp_hosted_scratch+0x8], rax // Store the guest rip.
+        mov rax, [rip+zpp_hosted_scratch] // Restore rax.
+        jmp qword ptr [rip+zpp_hosted_scratch+0x8] // Enter the guest.
+    )!!");
+}
+
+extern "C" void __attribute__((naked)) zpp_hosted_vm_exit_entry()
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        mov [rip+zpp_hosted_scratch], rax // Save rax.
+        mov rax, [rip+zpp_hosted_current] // The current processor.
+        pop qword ptr [rax] // Pop the return address as the guest rip.
+        mov [rax+0x8], rsp // Store the guest rsp.
+        mov rsp, [rax+0x18] // Load the host rsp.
+        mov rax, [rax+0x10] // Load the host rip.
+        mov [rip+zpp_hosted_scratch+0x8], rax // Store the host rip.
+        mov rax, [rip+zpp_hosted_scratch] // Restore rax.
+        jmp qword ptr [rip+zpp_hosted_scratch+0x8] // Enter the host.
+    )!!");
+}
+
+extern "C" void __attribute__((naked))
+zpp_hosted_guest_exit(gpr_context *)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        push rbx // Save the callee saved registers.
+        push rbp
+        push r12
+        push r13
+        push r14
+        push r15
+        push rdi // Save the context parameter.
+        mov rax, rdi // The context parameter.
+        mov rbx, [rax+0x8] // context->rbx.
+        mov rcx, [rax+0x10] // context->rcx.
+        mov rdx, [rax+0x18] // context->rdx.
+        mov rbp, [rax+0x28] // context->rbp.
+        mov rsi, [rax+0x30] // context->rsi.
+        mov rdi, [rax+0x38] // context->rdi.
+        mov r8, [rax+0x40] // context->r8.
+        mov r9, [rax+0x48] // context->r9.
+        mov r10, [rax+0x50] // context->r10.
+        mov r11, [rax+0x58] // context->r11.
+        mov r12, [rax+0x60] // context->r12.
+        mov r13, [rax+0x68] // context->r13.
+        mov r14, [rax+0x70] // context->r14.
+        mov r15, [rax+0x78] // context->r15.
+        mov rax, [rax] // context->rax.
+        call zpp_hosted_vm_exit_entry // Exit, resumes after the call.
+        push rax // Save the guest rax.
+        mov rax, [rsp+0x8] // The context parameter.
+        mov [rax+0x8], rbx // context->rbx.
+        mov [rax+0x10], rcx // context->rcx.
+        mov [rax+0x18], rdx // context->rdx.
+        mov [rax+0x28], rbp // context->rbp.
+        mov [rax+0x30], rsi // context->rsi.
+        mov [rax+0x38], rdi // context->rdi.
+        mov [rax+0x40], r8 // context->r8.
+        mov [rax+0x48], r9 // context->r9.
+        mov [rax+0x50], r10 // context->r10.
+        mov [rax+0x58], r11 // context->r11.
+        mov [rax+0x60], r12 // context->r12.
+        mov [rax+0x68], r13 // context->r13.
+        mov [rax+0x70], r14 // context->r14.
+        mov [rax+0x78], r15 // context->r15.
+        pop rcx // The guest rax.
+        mov [rax], rcx // context->rax.
+        pop rdi // Skip the context parameter.
+        pop r15 // Restore the callee saved registers.
+        pop r14
+        pop r13
+        pop r12
+        pop rbp
+        pop rbx
+        ret
+    )!!");
+}
+
+} // namespace zpp::x64::hosted
+
+namespace zpp::x64::intel
+{
+void __attribute__((naked)) vmlaunch()
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        jmp zpp_hosted_vm_entry
+    )!!");
+}
+
+void __attribute__((naked)) vmresume()
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        jmp zpp_hosted_vm_entry
+    )!!");
+}
+
+} // namespace zpp::x64::intel
@@ -0,0 +1,889 @@
+#include "zpp/hypervisor/binary_log.h"
+#include "zpp/hypervisor/guest_profiler.h"
+#include "zpp/hypervisor/hypercall_abi.h"
+#include "zpp/hypervisor/state.h"
+#include "zpp/x64/asm.h"
+#include "zpp/x64/context.h"
+#include "zpp/x64/hosted/cpu.h"
+#include "zpp/x64/intel/ept.h"
+#include "zpp/x64/intel/ept_pointer.h"
+#include "zpp/x64/intel/msr.h"
+#include "zpp/x64/intel/msr_area.h"
+#include "zpp/x64/intel/vmcs_fields.h"
+#include "zpp/x64/intel/vmcs_template.h"
+#include "zpp/x64/intel/vmx.h"
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/mman.h>
+#include <type_traits>
+
+namespace zpp
+{
+extern "C" void zpp_hypervisor_start();
+
+namespace
+{
+namespace hosted = x64::hosted;
+using basic_reason = x64::intel::exit_reason::basic_reason;
+
+/**
+ * A guest operation that causes a VM exit.
+ */
+struct operation
+{
+    /**
+     * The operation name.
+     */
+    const char * name;
+
+    /**
+     * The exit reason.
+     */
+    basic_reason reason;
+
+    /**
+     * Prepares the guest registers of the operation.
+     */
+    void (*prepare)(x64::gpr_context &);
+
+    /**
+     * Returns true if the registers after the exit hold the expected
+     * result.
+     */
+    bool (*verify)(const x64::gpr_context &);
+};
+
+/**
+ * The executed operations.
+ */
+constexpr operation g_operations[] = {
+    {"cpuid.1",
+     basic_reason::cpuid,
+     [](x64::gpr_context & registers) {
+         registers.rax = 0x1;
+         registers.rcx = 0;
+     },
+     [](const x64::gpr_context & registers) {
+         // The hypervisor present and OSXSAVE bits are set.
+         return (registers.rcx & (1u << 31)) &&
+                (registers.rcx & (1u << 27));
+     }},
+    {"cpuid.hv",
+     basic_reason::cpuid,
+     [](x64::gpr_context & registers) {
+         registers.rax = 0x40000000;
+         registers.rcx = 0;
+     },
+     [](const x64::gpr_context & registers) {
+         return 0x5a70705a == registers.rbx &&
+                0x705a7070 == registers.rcx &&
+                0x70705a70 == registers.rdx;
+     }},
+    {"xsetbv",
+     basic_reason::xsetbv,
+     [](x64::gpr_context & registers) {
+         registers.rax = 0x7;
+         registers.rcx = 0;
+         registers.rdx = 0;
+     },
+     [](const x64::gpr_context &) {
+         return 0x7 == hosted::current().xcr0;
+     }},
+    {"rdmsr.fc",
+     basic_reason::rdmsr,
+     [](x64::gpr_context & registers) {
+         registers.rcx = x64::intel::msr::ia32_feature_control;
+     },
+     [](const x64::gpr_context & registers) {
+         // Locked with VMX disabled.
+         return 0x1 == (registers.rax & 0x7);
+     }},
+    {"vmcall",
+     basic_reason::vmcall,
+     [](x64::gpr_context & registers) {
+         registers.rax = ZPP_HYPERCALL_VERSION;
+         registers.rcx = ZPP_HYPERCALL_MAGIC;
+         registers.rdx = 0;
+         registers.r8 = 0;
+     },
+     [](const x64::gpr_context & registers) {
+         return ZPP_HYPERCALL_STATUS_SUCCESS == registers.rax &&
+                ZPP_HYPERCALL_ABI_VERSION == registers.rdx;
+     }},
+};
+
+/**
+ * Execute the operation once, returns the registers after the exit.
+ */
+x64::gpr_context execute(const operation & operation)
+{
+    x64::gpr_context registers{};
+    operation.prepare(registers);
+    hosted::vm_exit(std::uint32_t(operation.reason), 0, registers);
+    return registers;
+}
+
+/**
+ * Launch the hypervisor on the given number of simulated processors,
+ * returns false on failure.
+ */
+bool launch(std::size_t cpus)
+{
+    // The hypervisor entry, as called by the loaders.
+    auto entry = reinterpret_cast<int (*)(
+        std::size_t cpuid,
+        std::uint64_t (*physical_to_virtual)(std::uint64_t),
+        std::size_t number_of_cpus,
+        void * (*allocate_cpu_memory)(std::size_t))>(
+        zpp_hypervisor_start);
+
+    // Allocate the memory of the hypervisor low in the address space,
+    // as the virtual addresses of the process stand in for physical
+    // addresses, which must be below the physical address width. Every
+    // allocation is hinted right after the previous one, as mappings
+    // without a hint are placed near the top of the address space.
+    auto allocate_cpu_memory = [](std::size_t size) -> void * {
+        static std::uintptr_t next = 0x100000000;
+        auto memory = mmap(reinterpret_cast<void *>(next),
+                           size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+        if (MAP_FAILED == memory) {
+            return nullptr;
+        }
+        next = reinterpret_cast<std::uintptr_t>(memory) + size;
+        return memory;
+    };
+
+    for (std::size_t i{}; i < cpus; ++i) {
+        // Reset the processor.
+        hosted::select(i).reset();
+
+        // Launch without a physical to virtual translation, which makes
+        // the virtual addresses of the process its physical addresses.
+        if (auto result = entry(i,
+                                nullptr,
+                                cpus,
+                                static_cast<void * (*)(std::size_t)>(
+                                    allocate_cpu_memory))) {
+            std::printf("zpp: cpu %zu: launch failed: %d\n", i, result);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Verify that the VMCS template was captured and applied to the VMCS of
+ * every processor, and that a template that overflowed is not applied,
+ * returns false otherwise.
+ */
+bool verify_vmcs(std::size_t cpus)
+{
+    auto & shared = hypervisor::g_state.hypervisor.vmcs_template();
+
+    bool result = true;
+    for (std::size_t i{}; i < cpus; ++i) {
+        auto & cpu = hosted::select(i);
+
+        // Every template field holds its value.
+        auto passed = shared.size() && !shared.overflowed();
+        for (auto & entry : shared) {
+            std::uint64_t value{};
+            passed = passed && cpu.vmread(entry.field, value) &&
+                     value == entry.value;
+        }
+
+        // A template with a field that did not fit writes nothing.
+        auto & first = *shared.begin();
+        auto & second = *(shared.begin() + 1);
+        x64::intel::vmcs_template<1> overflow;
+        std::uint64_t value{};
+        passed = passed &&
+                 overflow.set(decltype(overflow)::field(first.field),
+                              ~first.value) &&
+                 !overflow.set(decltype(overflow)::field(second.field),
+                               second.value) &&
+                 !overflow.apply() && cpu.vmread(first.field, value) &&
+                 value == first.value;
+
+        std::printf("zpp: cpu %zu %-8s %s\n",
+                    i,
+                    "vmcs",
+                    passed ? "passed" : "failed");
+        result = result && passed;
+    }
+
+    return result;
+}
+
+/**
+ * Verify that every processor switches MSRs through its areas, and that
+ * the areas add, update and remove MSRs, returns false otherwise.
+ */
+bool verify_msr_switch(std::size_t cpus)
+{
+    using field = x64::intel::vmcs_fields::vmcs_field;
+    constexpr std::uint32_t first = x64::intel::msr::ia32_fs_base;
+    constexpr std::uint32_t second = x64::intel::msr::ia32_gs_base;
+
+    bool result = true;
+    for (std::size_t i{}; i < cpus; ++i) {
+        auto & cpu = hosted::select(i);
+
+        // The guest area is both stored on exit and loaded on entry, and
+        // no MSR is switched.
+        std::uint64_t store{};
+        std::uint64_t load{};
+        std::uint64_t host{};
+        std::uint64_t counts[3]{1, 1, 1};
+        auto passed =
+            cpu.vmread(field::vm_exit_msr_store_address, store) &&
+            cpu.vmread(field::vm_entry_msr_load_address, load) &&
+            cpu.vmread(field::vm_exit_msr_load_address, host) &&
+            cpu.vmread(field::vm_exit_msr_store_count, counts[0]) &&
+            cpu.vmread(field::vm_exit_msr_load_count, counts[1]) &&
+            cpu.vmread(field::vm_entry_msr_load_count, counts[2]) &&
+            store && store == load && host && store != host &&
+            !counts[0] && !counts[1] && !counts[2];
+
+        // Add, update and remove MSRs, the last taking the place of a
+        // removed one, up to the capacity.
+        x64::intel::msr_switch_area<2> area;
+        passed = passed && area.add(first, 1, 2) &&
+                 area.add(second, 3, 4) && area.add(first, 5, 6) &&
+                 !area.add(first - 1, 0, 0) && 2 == area.size() &&
+                 5 == *area.guest_value(first) &&
+                 6 == *area.host_value(first) && area.remove(first) &&
+                 !area.remove(first) && 1 == area.size() &&
+                 !area.guest_value(first) &&
+                 second == area.guest_area()[0].index &&
+                 4 == area.host_area()[0].value &&
+                 !area.guest_area()[1].index;
+
+        std::printf("zpp: cpu %zu %-8s %s\n",
+                    i,
+                    "msrs",
+                    passed ? "passed" : "failed");
+        result = result && passed;
+    }
+
+    return result;
+}
+
+/**
+ * Execute every operation once on every processor, returns false if
+ * an operation did not return the expected result.
+ */
+bool verify(std::size_t cpus)
+{
+    bool result = true;
+
+    for (std::size_t i{}; i < cpus; ++i) {
+        hosted::select(i);
+        for (auto & operation : g_operations) {
+            auto passed = operation.verify(execute(operation));
+            std::printf("zpp: cpu %zu %-8s %s\n",
+                        i,
+                        operation.name,
+                        passed ? "passed" : "failed");
+            result = result && passed;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Find the entry that maps the given guest physical address by walking
+ * the hardware page tables of the given EPT pointer, as virtual
+ * addresses of the process are its physical addresses. Returns null if
+ * the address is not mapped, and sets the number of address bits that
+ * the entry translates.
+ */
+x64::intel::epte * leaf_entry(x64::intel::ept_pointer eptp,
+                              std::uint64_t physical_address,
+                              std::size_t & shift)
+{
+    auto table =
+        reinterpret_cast<x64::intel::epte *>(eptp.page_number() << 12);
+    for (std::size_t level = 4; level; --level) {
+        shift = 12 + 9 * (level - 1);
+        auto & entry = table[(physical_address >> shift) & 0x1ff];
+
+        // Leaves translate the remaining bits, whatever their access.
+        if (1 == level || entry.large()) {
+            return &entry;
+        }
+
+        // Table entries that grant no access are not present.
+        if (!entry.read() && !entry.write() && !entry.execute()) {
+            return nullptr;
+        }
+
+        table = reinterpret_cast<x64::intel::epte *>(entry.page_number()
+                                                     << 12);
+    }
+
+    return nullptr;
+}
+
+/**
+ * Translate the given guest physical address through the hardware page
+ * tables of the given EPT pointer. Returns all ones if the address is
+ * not mapped.
+ */
+std::uint64_t translate(x64::intel::ept_pointer eptp,
+                        std::uint64_t physical_address)
+{
+    std::size_t shift{};
+    auto entry = leaf_entry(eptp, physical_address, shift);
+    if (!entry) {
+        return ~std::uint64_t{};
+    }
+
+    return ((entry->page_number() << 12) & ~((1ull << shift) - 1)) |
+           (physical_address & ((1ull << shift) - 1));
+}
+
+/**
+ * Verify that the EPT pointer of every processor refers to hardware
+ * page tables that map guest physical memory to itself, returns false
+ * otherwise.
+ */
+bool verify_ept(std::size_t cpus)
+{
+    using field = x64::intel::vmcs_fields::vmcs_field;
+
+    // Addresses of the process image and of the hypervisor memory.
+    const std::uint64_t addresses[] = {
+        reinterpret_cast<std::uintptr_t>(&g_operations),
+        reinterpret_cast<std::uintptr_t>(&hypervisor::g_state),
+        0x100000000,
+    };
+
+    bool result = true;
+    for (std::size_t i{}; i < cpus; ++i) {
+        std::uint64_t eptp{};
+        auto passed = hosted::select(i).vmread(field::ept_pointer, eptp);
+        for (auto address : addresses) {
+            passed = passed && address == translate(eptp, address);
+        }
+        std::printf("zpp: cpu %zu %-8s %s\n",
+                    i,
+                    "ept",
+                    passed ? "passed" : "failed");
+        result = result && passed;
+    }
+
+    return result;
+}
+
+/**
+ * The hypercall ring of the simulated processors, with a buffer that
+ * follows the requests.
+ */
+struct alignas(hypervisor::hypervisor::page_size) hypercall_ring
+{
+    /**
+     * The ring header.
+     */
+    zpp_hypercall_ring_header header;
+
+    /**
+     * The requests.
+     */
+    zpp_hypercall_request requests[4];
+
+    /**
+     * The log records buffer.
+     */
+    hypervisor::binary_log::record records[32];
+
+    /**
+     * The profiler samples buffer.
+     */
+    hypervisor::guest_profiler::sample samples[32];
+
+    /**
+     * The dirty page words buffer.
+     */
+    std::uint64_t dirty[8];
+};
+
+/**
+ * Execute a hypercall on the current processor, returns the status and
+ * the result.
+ */
+std::int32_t hypercall(std::uint64_t number,
+                       std::uint64_t first,
+                       std::uint64_t second,
+                       std::uint64_t & result)
+{
+    x64::gpr_context registers{};
+    registers.rax = number;
+    registers.rcx = ZPP_HYPERCALL_MAGIC;
+    registers.rdx = first;
+    registers.r8 = second;
+    hosted::vm_exit(std::uint32_t(basic_reason::vmcall), 0, registers);
+    result = registers.rdx;
+    return std::int32_t(registers.rax);
+}
+
+/**
+ * Register the ring on the current processor, returns false on failure.
+ */
+bool register_ring(hypercall_ring & ring)
+{
+    // Initialize the header.
+    ring.header = {};
+    ring.header.magic = ZPP_HYPERCALL_RING_MAGIC;
+    ring.header.version = ZPP_HYPERCALL_ABI_VERSION;
+    ring.header.capacity = std::extent_v<decltype(ring.requests)>;
+
+    // Register the ring, as physical addresses are virtual addresses.
+    std::uint64_t result{};
+    return ZPP_HYPERCALL_STATUS_SUCCESS ==
+           hypercall(ZPP_HYPERCALL_REGISTER_RING,
+                     reinterpret_cast<std::uintptr_t>(&ring),
+                     sizeof(ring) / hypervisor::hypervisor::page_size,
+                     result);
+}
+
+/**
+ * Submit the request through the ring of the current processor and
+ * drain it, returns the status of the request.
+ */
+std::int32_t submit(hypercall_ring & ring, zpp_hypercall_request & request)
+{
+    // Queue the request.
+    auto & queued =
+        ring.requests[ring.header.head %
+                      std::extent_v<decltype(ring.requests)>];
+    queued = request;
+    ++ring.header.head;
+
+    // Drain the ring.
+    std::uint64_t processed{};
+    if (ZPP_HYPERCALL_STATUS_SUCCESS !=
+            hypercall(ZPP_HYPERCALL_DRAIN_RING, 0, 0, processed) ||
+        1 != processed) {
+        return ZPP_HYPERCALL_STATUS_INVALID_RING;
+    }
+
+    // Return the processed request.
+    request = queued;
+    return request.status;
+}
+
+/**
+ * Print a log record, formatting the replacement fields of its format
+ * string, which uses the Python str.format syntax, in hexadecimal if
+ * their format specification ends with x, and in decimal otherwise.
+ */
+void print_record(std::size_t cpuid,
+                  const hypervisor::binary_log::record & record)
+{
+    std::printf("zpp: cpu %zu log %llu: ",
+                cpuid,
+                static_cast<unsigned long long>(record.tsc));
+
+    std::size_t index{};
+    for (auto format = __start_zpp_log_formats + record.format; *format;
+         ++format) {
+        // Print characters other than replacement fields, where braces
+        // are escaped by doubling them.
+        if ('{' != *format && '}' != *format) {
+            std::putchar(*format);
+            continue;
+        }
+        if (format[0] == format[1]) {
+            std::putchar(*format++);
+            continue;
+        }
+
+        // Find the end of the replacement field.
+        auto end = std::strchr(format, '}');
+        if (!end || index >= record.count) {
+            break;
+        }
+
+        // Print the argument.
+        auto argument = record.arguments[index];
+        if ('x' == end[-1]) {
+            std::printf("0x%llx",
+                        static_cast<unsigned long long>(argument));
+        } else if (record.signed_arguments & (1u << index)) {
+            std::printf("%lld", static_cast<long long>(argument));
+        } else {
+            std::printf("%llu",
+                        static_cast<unsigned long long>(argument));
+        }
+        ++index;
+        format = end;
+    }
+    std::printf("\n");
+}
+
+/**
+ * Print the log records of every processor, read by the first processor
+ * through the log hypercalls, returns false if they failed or if reading
+ * the logs wrote to the log of the first processor.
+ */
+bool print_logs(std::size_t cpus)
+{
+    // Register a ring on the first processor.
+    hosted::select(0);
+    auto ring = std::make_unique<hypercall_ring>();
+    if (!register_ring(*ring)) {
+        std::printf("zpp: cpu 0 %-8s failed\n", "log");
+        return false;
+    }
+
+    // Read the number of records of the first processor.
+    zpp_hypercall_request status{};
+    status.operation = ZPP_HYPERCALL_OPERATION_LOG_STATUS;
+    if (ZPP_HYPERCALL_STATUS_SUCCESS != submit(*ring, status)) {
+        std::printf("zpp: cpu 0 %-8s failed\n", "log");
+        return false;
+    }
+    auto size = status.results[0];
+
+    for (std::size_t i{}; i < cpus; ++i) {
+        std::uint64_t position{};
+        while (true) {
+            // Read the next records into the ring buffer.
+            zpp_hypercall_request read{};
+            read.operation = ZPP_HYPERCALL_OPERATION_LOG_READ;
+            read.arguments[0] = i;
+            read.arguments[1] = position;
+            read.arguments[2] = offsetof(hypercall_ring, records);
+            read.arguments[3] = std::extent_v<decltype(ring->records)>;
+            if (ZPP_HYPERCALL_STATUS_SUCCESS != submit(*ring, read)) {
+                std::printf("zpp: cpu %zu %-8s failed\n", i, "log");
+                return false;
+            }
+            if (!read.results[0]) {
+                break;
+            }
+
+            // Print the records.
+            for (std::size_t j{}; j < read.results[0]; ++j) {
+                print_record(i, ring->records[j]);
+            }
+            position = read.results[1];
+        }
+    }
+
+    // Reading past the last record must copy nothing.
+    zpp_hypercall_request past{};
+    past.operation = ZPP_HYPERCALL_OPERATION_LOG_READ;
+    past.arguments[1] = size + 1;
+    past.arguments[2] = offsetof(hypercall_ring, records);
+    past.arguments[3] = std::extent_v<decltype(ring->records)>;
+    auto passed = ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, past) &&
+                  !past.results[0] && size == past.results[1];
+
+    // Reading the logs must not write to the log.
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, status) &&
+             size == status.results[0];
+    std::printf(
+        "zpp: cpu 0 %-8s %s\n", "log", passed ? "passed" : "failed");
+    return passed;
+}
+
+/**
+ * Record profiler samples on the last processor with VMX preemption timer
+ * exits, then read them from the first processor through the profiler
+ * hypercalls, returns false if they were not read back.
+ */
+bool verify_profiler(std::size_t cpus)
+{
+    constexpr std::size_t count = 8;
+    auto cpuid = cpus - 1;
+
+    // Record the samples.
+    hosted::select(cpuid);
+    auto start = x64::rdtsc();
+    for (std::size_t i{}; i < count; ++i) {
+        x64::gpr_context registers{};
+        hosted::vm_exit(std::uint32_t(basic_reason::vmx_preemption_timer),
+                        0,
+                        registers);
+    }
+    auto end = x64::rdtsc();
+
+    // Register a ring on the first processor.
+    hosted::select(0);
+    auto ring = std::make_unique<hypercall_ring>();
+    auto passed = register_ring(*ring);
+
+    // Read the number of samples.
+    zpp_hypercall_request status{};
+    status.operation = ZPP_HYPERCALL_OPERATION_PROFILE_STATUS;
+    status.arguments[0] = cpuid;
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, status) &&
+             status.results[0] >= count;
+
+    // Read the recorded samples into the ring buffer.
+    zpp_hypercall_request read{};
+    read.operation = ZPP_HYPERCALL_OPERATION_PROFILE_READ;
+    read.arguments[0] = cpuid;
+    read.arguments[1] = status.results[0] - count;
+    read.arguments[2] = offsetof(hypercall_ring, samples);
+    read.arguments[3] = count;
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, read) &&
+             count == read.results[0] &&
+             status.results[0] == read.results[1];
+
+    // Reading past the last sample must copy nothing.
+    zpp_hypercall_request past = read;
+    past.arguments[1] = status.results[0] + 1;
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, past) &&
+             !past.results[0] && status.results[0] == past.results[1];
+
+    // The samples were taken at CPL 0 during the exits.
+    for (std::size_t i{}; passed && i < count; ++i) {
+        auto & sample = ring->samples[i];
+        passed = sample.tsc >= start && sample.tsc <= end && !sample.cpl;
+    }
+
+    std::printf("zpp: cpu %zu %-8s %s\n",
+                cpuid,
+                "profiler",
+                passed ? "passed" : "failed");
+    return passed;
+}
+
+/**
+ * Log writes on the last processor, then read the dirty pages from the
+ * first processor through the dirty page hypercalls, returns false if
+ * the pages were not reported exactly once after a synchronization, if
+ * the synchronization did not interrupt every other processor without
+ * delivering its NMI to the guest, or if a read of a range interrupted
+ * them more than once.
+ */
+bool verify_dirty(std::size_t cpus)
+{
+    using field = x64::intel::vmcs_fields::vmcs_field;
+    constexpr std::uint64_t word_size =
+        64 * hypervisor::hypervisor::page_size;
+    constexpr std::uint64_t addresses[] = {0x10000000,
+                                           0x10000000 + 3 * word_size};
+    constexpr std::size_t words = std::extent_v<decltype(
+        std::declval<hypercall_ring>().dirty)>;
+    auto cpuid = cpus - 1;
+
+    // Log the writes as the processor does, from the last entry down,
+    // and set the dirty bits of the entries that map them.
+    auto & cpu = hosted::select(cpuid);
+    std::uint64_t log{};
+    std::uint64_t index{};
+    std::uint64_t eptp{};
+    auto passed = cpu.vmread(field::pml_address, log) &&
+                  cpu.vmread(field::pml_index, index) &&
+                  cpu.vmwrite(field::pml_index, index - 2) &&
+                  cpu.vmread(field::ept_pointer, eptp);
+    x64::intel::epte * entries[std::extent_v<decltype(addresses)>]{};
+    for (std::size_t i{}; i < std::extent_v<decltype(addresses)>; ++i) {
+        reinterpret_cast<std::uint64_t *>(log)[index - i] = addresses[i];
+        std::size_t shift{};
+        entries[i] = leaf_entry(eptp, addresses[i], shift);
+        passed = passed && entries[i];
+        if (entries[i]) {
+            entries[i]->dirty(true);
+        }
+    }
+
+    // Register a ring on the first processor.
+    hosted::select(0);
+    auto ring = std::make_unique<hypercall_ring>();
+    passed = passed && register_ring(*ring);
+
+    // Returns true if every other processor exited on exactly the given
+    // number of NMIs since the last call.
+    std::uint64_t exits[hosted::max_cpus]{};
+    auto nmi_exits = [&](std::uint64_t nmis) {
+        auto result = true;
+        for (std::size_t i = 1; i < cpus; ++i) {
+            zpp_hypercall_request count{};
+            count.operation = ZPP_HYPERCALL_OPERATION_EXIT_COUNT;
+            count.arguments[0] = i;
+            count.arguments[1] =
+                std::uint64_t(basic_reason::exception_or_nmi);
+            result = result &&
+                     ZPP_HYPERCALL_STATUS_SUCCESS ==
+                         submit(*ring, count) &&
+                     count.results[0] - exits[i] == nmis;
+            exits[i] = count.results[0];
+        }
+        return result;
+    };
+    nmi_exits(0);
+
+    // Synchronize, which interrupts every other processor with an NMI
+    // that is not delivered to the guest.
+    zpp_hypercall_request sync{};
+    sync.operation = ZPP_HYPERCALL_OPERATION_DIRTY_SYNC;
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, sync) &&
+             nmi_exits(1);
+    for (std::size_t i = 1; i < cpus; ++i) {
+        std::uint64_t controls{};
+        std::uint64_t injected{};
+        passed = passed &&
+                 hosted::select(i).vmread(
+                     field::primary_processor_based_vm_execution_controls,
+                     controls) &&
+                 !(controls & x64::intel::vm_execution_controls::primary::
+                                  nmi_window_exiting) &&
+                 hosted::current().vmread(
+                     field::vm_entry_interruption_information_field,
+                     injected) &&
+                 !(injected >> 31);
+        hosted::select(0);
+    }
+
+    // The pages are reported at once, and the dirty bits of their
+    // entries are cleared with a single interruption of every other
+    // processor.
+    zpp_hypercall_request read{};
+    read.operation = ZPP_HYPERCALL_OPERATION_DIRTY_READ;
+    read.arguments[0] = addresses[0];
+    read.arguments[2] = offsetof(hypercall_ring, dirty);
+    read.arguments[3] = words;
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, read) &&
+             words == read.results[0] &&
+             addresses[0] + words * word_size == read.results[1] &&
+             (ring->dirty[0] & 1) && (ring->dirty[3] & 1) &&
+             !entries[0]->dirty() && !entries[1]->dirty() &&
+             (1 == cpus || nmi_exits(1));
+
+    // The pages were cleared, and nothing is left to invalidate.
+    passed = passed &&
+             ZPP_HYPERCALL_STATUS_SUCCESS == submit(*ring, read) &&
+             words == read.results[0] && nmi_exits(0);
+    for (auto word : ring->dirty) {
+        passed = passed && !word;
+    }
+
+    std::printf("zpp: cpu %zu %-8s %s\n",
+                cpuid,
+                "dirty",
+                passed ? "passed" : "failed");
+    return passed;
+}
+
+/**
+ * Exit on an NMI of the guest on the last processor, returns false if
+ * the NMI is not injected on the next NMI window exit, or if the NMI
+ * window exiting does not end once it is.
+ */
+bool verify_nmi(std::size_t cpus)
+{
+    using field = x64::intel::vmcs_fields::vmcs_field;
+    using x64::intel::vm_execution_controls::primary::nmi_window_exiting;
+    constexpr auto controls_field =
+        field::primary_processor_based_vm_execution_controls;
+    constexpr auto injection_field =
+        field::vm_entry_interruption_information_field;
+    constexpr std::uint64_t nmi = (1u << 31) | (2u << 8) | 2;
+    auto cpuid = cpus - 1;
+    auto & cpu = hosted::select(cpuid);
+
+    // The NMI exits, and the guest exits on the next NMI window.
+    x64::gpr_context registers{};
+    std::uint64_t controls{};
+    std::uint64_t injected{};
+    auto passed =
+        cpu.vmwrite(field::vm_exit_interruption_information, nmi);
+    hosted::vm_exit(
+        std::uint32_t(basic_reason::exception_or_nmi), 0, registers);
+    passed = passed && cpu.vmread(controls_field, controls) &&
+             (controls & nmi_window_exiting);
+
+    // The window injects the NMI, and the guest no longer exits on it.
+    hosted::vm_exit(std::uint32_t(basic_reason::nmi_window), 0, registers);
+    passed = passed && cpu.vmread(controls_field, controls) &&
+             !(controls & nmi_window_exiting) &&
+             cpu.vmread(injection_field, injected) && nmi == injected;
+
+    // Consume the injection, as the processor does on entry.
+    passed = passed && cpu.vmwrite(injection_field, 0);
+
+    std::printf("zpp: cpu %zu %-8s %s\n",
+                cpuid,
+                "nmi",
+                passed ? "passed" : "failed");
+    return passed;
+}
+
+/**
+ * Measure the cost of every operation on the first processor.
+ */
+void benchmark(std::size_t iterations)
+{
+    hosted::select(0);
+    for (auto & operation : g_operations) {
+        // Execute back to back.
+        auto start = std::chrono::steady_clock::now();
+        auto start_tsc = x64::rdtsc();
+        for (std::size_t i{}; i < iterations; ++i) {
+            execute(operation);
+        }
+        auto cycles = x64::rdtsc() - start_tsc;
+        auto nanoseconds =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+
+        // Report the average cost of an exit.
+        std::printf("zpp: benchmark: %-8s %8.1f ns %8llu cycles\n",
+                    operation.name,
+                    double(nanoseconds) / double(iterations),
+                    static_cast<unsigned long long>(cycles / iterations));
+    }
+}
+} // namespace
+} // namespace zpp
+
+int main(int argc, char ** argv)
+{
+    // Parse the number of processors and iterations.
+    std::size_t cpus = (argc > 1) ? std::strtoull(argv[1], nullptr, 0) : 4;
+    std::size_t iterations =
+        (argc > 2) ? std::strtoull(argv[2], nullptr, 0) : 1000000;
+    if (!cpus || cpus > zpp::x64::hosted::max_cpus || !iterations) {
+        std::printf("usage: %s [cpus (1-%zu)] [iterations]\n",
+                    argv[0],
+                    zpp::x64::hosted::max_cpus);
+        return EXIT_FAILURE;
+    }
+
+    // Launch, verify the state and the exit handlers, then measure them.
+    if (!zpp::launch(cpus) || !zpp::verify_vmcs(cpus) ||
+        !zpp::verify_msr_switch(cpus) || !zpp::verify_ept(cpus) ||
+        !zpp::verify(cpus) || !zpp::verify_profiler(cpus) ||
+        !zpp::verify_dirty(cpus) || !zpp::verify_nmi(cpus)) {
+        return EXIT_FAILURE;
+    }
+    if (!zpp::print_logs(cpus)) {
+        return EXIT_FAILURE;
+    }
+    zpp::benchmark(iterations);
+    return EXIT_SUCCESS;
+}
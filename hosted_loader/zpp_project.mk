@@ -0,0 +1,76 @@
+ifeq ($(ZPP_PROJECT_SETTINGS), true)
+
+include ../environment.config
+
+ZPP_TARGET_NAME := zpp_hosted
+ZPP_TARGET_TYPES := $(SUPPORTED_ARCHITECTURES)
+ZPP_LINK_TYPE := default
+ZPP_OUTPUT_DIRECTORY_ROOT := ../out
+ZPP_SOURCE_DIRECTORIES := \
+	./src \
+	../hypervisor/src/hypervisor \
+	../hypervisor/src/x64
+ZPP_SOURCE_FILES :=
+ZPP_INCLUDE_PROJECTS :=
+ZPP_COMPILE_COMMANDS_JSON := compile_commands.json
+
+endif
+
+ifeq ($(ZPP_PROJECT_FLAGS), true)
+ZPP_FLAGS := \
+	$(patsubst %, -I%, $(shell find ../hypervisor -type d -name "include")) \
+	-pedantic \
+	-Wall \
+	-Wextra \
+	-Werror \
+	-fno-pie \
+	-mno-red-zone \
+	-DZPP_HYPERVISOR_HOSTED=1 \
+	-DZPP_HYPERVISOR_PROFILER_INTERVAL=$(HYPERVISOR_PROFILER_INTERVAL)
+ZPP_FLAGS_DEBUG := \
+	-g
+ZPP_FLAGS_RELEASE := \
+	-O2 \
+	-g
+ZPP_CFLAGS := \
+	$(ZPP_FLAGS) \
+	-std=c11
+ZPP_CFLAGS_DEBUG := \
+	$(ZPP_FLAGS_DEBUG)
+ZPP_CFLAGS_RELEASE := \
+	$(ZPP_FLAGS_RELEASE)
+ZPP_CXXFLAGS := \
+	$(ZPP_FLAGS) \
+	-std=c++17 \
+	-fno-rtti \
+	-fno-exceptions
+ZPP_CXXFLAGS_DEBUG := \
+	$(ZPP_FLAGS_DEBUG)
+ZPP_CXXFLAGS_RELEASE := \
+	$(ZPP_FLAGS_RELEASE)
+ZPP_ASFLAGS := \
+	$(ZPP_FLAGS) \
+	-x assembler-with-cpp
+ZPP_ASFLAGS_DEBUG := \
+	$(ZPP_FLAGS_DEBUG)
+ZPP_ASFLAGS_RELEASE := \
+	$(ZPP_FLAGS_RELEASE)
+ZPP_LFLAGS := \
+	$(ZPP_FLAGS) \
+	-no-pie
+ZPP_LFLAGS_DEBUG := \
+	$(ZPP_FLAGS_DEBUG)
+ZPP_LFLAGS_RELEASE := \
+	$(ZPP_FLAGS_RELEASE)
+endif
+
+ifeq ($(ZPP_PROJECT_RULES), true)
+endif
+
+ifeq ($(ZPP_TOOLCHAIN_SETTINGS), true)
+ZPP_CC := clang
+ZPP_CXX := clang++
+ZPP_AS := $(ZPP_CC)
+ZPP_LINK := $(ZPP_CXX)
+ZPP_PYTHON := python
+endif
@@ -0,0 +1,236 @@
+#pragma once
+#include "zpp/hypervisor/hypercall_abi.h"
+#include "zpp/x64/asm.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * Log a record into the given binary log, with a format string literal
+ * followed by up to binary_log::max_arguments integral, enumeration or
+ * pointer arguments. The format string is placed into the
+ * zpp_log_formats section of the hypervisor ELF and is never read by the
+ * hypervisor, records hold only its offset within the section and the
+ * raw arguments. The format string uses the Python str.format syntax,
+ * as records are formatted offline, see environment/dump-log.
+ */
+#define ZPP_LOG(log, ...)                                                 \
+    do {                                                                  \
+        __attribute__((section("zpp_log_formats"), used)) static const    \
+            char zpp_log_format[] = ZPP_LOG_FORMAT(__VA_ARGS__, unused);  \
+        (log).write(zpp_log_format, __VA_ARGS__);                         \
+    } while (0)
+
+/**
+ * Expands to the format string of the ZPP_LOG arguments.
+ */
+#define ZPP_LOG_FORMAT(format, ...) format
+
+/**
+ * The start of the format strings section, defined by the linker.
+ */
+extern "C" const char __start_zpp_log_formats[];
+
+namespace zpp::hypervisor
+{
+/**
+ * A binary log of a single CPU, in which every record holds the offset
+ * of its format string within the format strings section, a timestamp,
+ * and the raw arguments. Nothing is formatted in root mode, so that
+ * logging costs a timestamp and a few stores, which allows logging from
+ * the VM exit path.
+ * Records are kept in a ring that a single CPU logs into, and that any
+ * CPU or a debugger may read from concurrently, where the oldest records
+ * are overwritten.
+ */
+class alignas(64) binary_log
+{
+public:
+    /**
+     * The maximum number of arguments of a record.
+     */
+    static constexpr std::size_t max_arguments = 6;
+
+    /**
+     * A log record, of a single cache line.
+     */
+    struct alignas(64) record
+    {
+        /**
+         * The offset of the format string within the format strings
+         * section.
+         */
+        std::uint32_t format;
+
+        /**
+         * The number of arguments.
+         */
+        std::uint16_t count;
+
+        /**
+         * The mask of arguments that are signed, bit i for argument i.
+         */
+        std::uint16_t signed_arguments;
+
+        /**
+         * The TSC at the time of the record.
+         */
+        std::uint64_t tsc;
+
+        /**
+         * The arguments, signed arguments are sign extended.
+         */
+        std::uint64_t arguments[max_arguments];
+    };
+
+    static_assert(sizeof(record) == ZPP_LOG_RECORD_SIZE,
+                  "Record ABI size mismatch.");
+
+    /**
+     * The number of records kept.
+     */
+    static constexpr std::size_t capacity = ZPP_LOG_CAPACITY;
+
+    /**
+     * Construct an empty log.
+     */
+    binary_log() = default;
+
+    /**
+     * Write a record with the given format string, which must reside in
+     * the format strings section, see ZPP_LOG. The format string literal
+     * is ignored, must be called only by the logging CPU.
+     */
+    template <typename... Arguments>
+    void write(const char * format, const char *, Arguments... arguments)
+    {
+        static_assert(sizeof...(Arguments) <= max_arguments,
+                      "Too many log arguments.");
+
+        auto head = m_head.load(std::memory_order_relaxed);
+
+        // Write the record header.
+        auto & record = m_records[head % capacity];
+        record.format = std::uint32_t(format - __start_zpp_log_formats);
+        record.count = sizeof...(Arguments);
+        record.signed_arguments = signed_mask<Arguments...>();
+        record.tsc = x64::rdtsc();
+
+        // Write the arguments.
+        [[maybe_unused]] std::size_t index{};
+        ((record.arguments[index++] = raw_argument(arguments)), ...);
+
+        // Publish the record.
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    /**
+     * Returns the number of records written.
+     */
+    std::uint64_t size() const
+    {
+        return m_head.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Copy up to count records starting at the given position, which is
+     * the number of records written before the first record to copy.
+     * Records that were overwritten are skipped. Returns the number of
+     * copied records, and advances the position past them.
+     */
+    std::size_t read(std::uint64_t & position,
+                     record * records,
+                     std::size_t count) const
+    {
+        auto head = m_head.load(std::memory_order_acquire);
+
+        // A position past the head has nothing to copy, clamp it so that
+        // unwritten records are never copied.
+        if (position > head) {
+            position = head;
+        }
+
+        // Skip records that were overwritten.
+        if (head - position > capacity) {
+            position = head - capacity;
+        }
+
+        // Limit the number of records to the written ones.
+        if (count > head - position) {
+            count = head - position;
+        }
+
+        // Copy the records.
+        for (std::size_t i{}; i < count; ++i) {
+            records[i] = m_records[(position + i) % capacity];
+        }
+
+        // Discard records that were overwritten while copying, the
+        // record being written at the current head overwrites the
+        // record that is capacity records behind it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto last_head = m_head.load(std::memory_order_relaxed);
+        std::size_t discarded{};
+        if (last_head + 1 > position + capacity) {
+            discarded = last_head + 1 - (position + capacity);
+            if (discarded > count) {
+                discarded = count;
+            }
+        }
+
+        // Move the valid records to the beginning.
+        for (std::size_t i = discarded; i < count; ++i) {
+            records[i - discarded] = records[i];
+        }
+
+        // Advance the position.
+        position += count;
+        return count - discarded;
+    }
+
+private:
+    /**
+     * Returns the raw value of an argument.
+     */
+    template <typename Type>
+    static std::uint64_t raw_argument(Type argument)
+    {
+        static_assert(std::is_integral_v<Type> || std::is_enum_v<Type> ||
+                          std::is_pointer_v<Type>,
+                      "Unsupported log argument type.");
+
+        if constexpr (std::is_pointer_v<Type>) {
+            return reinterpret_cast<std::uintptr_t>(argument);
+        } else if constexpr (std::is_signed_v<Type>) {
+            return std::uint64_t(std::int64_t(argument));
+        } else {
+            return std::uint64_t(argument);
+        }
+    }
+
+    /**
+     * Returns the mask of the signed argument types.
+     */
+    template <typename... Arguments>
+    static constexpr std::uint16_t signed_mask()
+    {
+        std::uint16_t mask{};
+        [[maybe_unused]] std::size_t index{};
+        ((mask |= std::uint16_t(std::is_signed_v<Arguments> << index++)),
+         ...);
+        return mask;
+    }
+
+    /**
+     * The number of written records.
+     */
+    std::atomic<std::uint64_t> m_head{};
+
+    /**
+     * The records ring.
+     */
+    record m_records[capacity]{};
+};
+
+} // namespace zpp::hypervisor
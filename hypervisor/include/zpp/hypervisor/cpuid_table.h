@@ -0,0 +1,164 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::hypervisor
+{
+/**
+ * A declarative change to a captured CPUID result. For every register
+ * the bits in the mask are replaced by the bits of the value, that is:
+ *     result = (native & ~mask) | (value & mask)
+ * Overrides of leaves that the processor does not report, such as the
+ * hypervisor leaves, add the leaf with a zero native result.
+ */
+struct cpuid_override
+{
+    /**
+     * Matches every subleaf of the leaf.
+     */
+    static constexpr std::uint32_t any_subleaf = ~std::uint32_t{};
+
+    /**
+     * The leaf, in eax.
+     */
+    std::uint32_t leaf{};
+
+    /**
+     * The subleaf, in ecx, or any_subleaf.
+     */
+    std::uint32_t subleaf{};
+
+    /**
+     * The masks of eax, ebx, ecx and edx.
+     */
+    std::uint32_t mask[4]{};
+
+    /**
+     * The values of eax, ebx, ecx and edx.
+     */
+    std::uint32_t value[4]{};
+};
+
+/**
+ * The CPUID results of a single CPU, captured once at launch with the
+ * overrides applied, so that CPUID exits are answered by a lookup.
+ * Leaves that are not captured, and leaves whose results change at run
+ * time, are not found and need to be executed.
+ */
+class cpuid_table
+{
+public:
+    /**
+     * A captured CPUID result.
+     */
+    struct entry
+    {
+        /**
+         * The leaf.
+         */
+        std::uint32_t leaf;
+
+        /**
+         * The subleaf, zero for leaves that are not subleaf indexed.
+         */
+        std::uint32_t subleaf;
+
+        /**
+         * Whether the result depends on the subleaf.
+         */
+        std::uint32_t subleaf_indexed;
+
+        /**
+         * The eax, ebx, ecx and edx values.
+         */
+        std::uint32_t registers[4];
+    };
+
+    /**
+     * The maximum number of captured results.
+     */
+    static constexpr std::size_t capacity = 160;
+
+    /**
+     * Construct an empty table.
+     */
+    cpuid_table() = default;
+
+    /**
+     * Capture the CPUID results of the current CPU and apply the given
+     * overrides. Returns false if the table capacity was exceeded, in
+     * which case the remaining results are executed on exit.
+     */
+    bool capture(const cpuid_override * overrides,
+                 std::size_t number_of_overrides);
+
+    /**
+     * Find the captured result of the given leaf and subleaf, returns
+     * null if the result must be executed.
+     */
+    const entry * find(std::uint32_t leaf, std::uint32_t subleaf) const
+    {
+        // Binary search the leaf and subleaf.
+        std::size_t begin{};
+        std::size_t end = m_size;
+        while (begin < end) {
+            auto middle = begin + (end - begin) / 2;
+            auto & entry = m_entries[middle];
+            if (entry.leaf < leaf ||
+                (entry.leaf == leaf && entry.subleaf_indexed &&
+                 entry.subleaf < subleaf)) {
+                begin = middle + 1;
+            } else {
+                end = middle;
+            }
+        }
+
+        // Return the entry if found.
+        if (begin == m_size || m_entries[begin].leaf != leaf) {
+            return nullptr;
+        }
+        auto & entry = m_entries[begin];
+        if (entry.subleaf_indexed && entry.subleaf != subleaf) {
+            return nullptr;
+        }
+        return &entry;
+    }
+
+    /**
+     * Returns the number of captured results.
+     */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    /**
+     * Capture the leaves of the range that starts at the given base.
+     */
+    bool capture_range(std::uint32_t base);
+
+    /**
+     * Capture a leaf with all of its subleaves.
+     */
+    bool capture_leaf(std::uint32_t leaf);
+
+    /**
+     * Insert an entry, keeping the entries sorted by leaf and subleaf,
+     * returns the inserted entry, or null if the table is full.
+     */
+    entry * insert(const entry & entry);
+
+private:
+    /**
+     * The captured results, sorted by leaf and subleaf.
+     */
+    entry m_entries[capacity]{};
+
+    /**
+     * The number of captured results.
+     */
+    std::size_t m_size{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace zpp::hypervisor
+{
+/**
+ * A bitmap of the guest physical pages written since they were last
+ * read, below a tracked limit, with a bit per 4KB page. Pages are marked
+ * by any CPU as it drains its page modification log, and are read and
+ * cleared in words of 64 pages, all without locks.
+ */
+class dirty_bitmap
+{
+public:
+    /**
+     * Page size.
+     */
+    static constexpr std::uint64_t page_size = 0x1000;
+
+    /**
+     * The number of pages of a word.
+     */
+    static constexpr std::uint64_t pages_per_word = 64;
+
+    /**
+     * Construct an empty bitmap that tracks no pages.
+     */
+    dirty_bitmap() = default;
+
+    /**
+     * Returns the number of bytes of memory needed to track the given
+     * number of bytes of guest physical memory.
+     */
+    static constexpr std::size_t memory_size(std::uint64_t limit)
+    {
+        return std::size_t(limit / page_size / pages_per_word) *
+               sizeof(std::uint64_t);
+    }
+
+    /**
+     * Track the guest physical memory below the given limit, a multiple
+     * of 64 pages, in the given memory of memory_size(limit) bytes.
+     */
+    void attach(void * memory, std::uint64_t limit)
+    {
+        // Construct the words, clean.
+        m_words = static_cast<std::atomic<std::uint64_t> *>(memory);
+        for (std::size_t i{}; i < limit / page_size / pages_per_word;
+             ++i) {
+            ::new (m_words + i) std::atomic<std::uint64_t>{};
+        }
+        m_limit = limit;
+    }
+
+    /**
+     * Returns the tracked limit.
+     */
+    std::uint64_t limit() const
+    {
+        return m_limit;
+    }
+
+    /**
+     * Mark the pages of the given page aligned range as dirty, pages at
+     * or above the limit are not tracked.
+     */
+    void mark(std::uint64_t physical_address, std::uint64_t size)
+    {
+        // Clip the range to the limit.
+        if (physical_address >= m_limit) {
+            return;
+        }
+        auto end = physical_address + size;
+        if (end > m_limit) {
+            end = m_limit;
+        }
+
+        // Set the bits of the pages, a word at a time.
+        auto page = physical_address / page_size;
+        auto end_page = end / page_size;
+        while (page < end_page) {
+            auto bit = page % pages_per_word;
+            auto count = end_page - page;
+            if (count > pages_per_word - bit) {
+                count = pages_per_word - bit;
+            }
+            auto mask = (pages_per_word == count)
+                            ? ~std::uint64_t{}
+                            : ((1ull << count) - 1) << bit;
+            m_words[page / pages_per_word].fetch_or(
+                mask, std::memory_order_relaxed);
+            page += count;
+        }
+    }
+
+    /**
+     * Read and clear the dirty bits of the 64 pages at the given guest
+     * physical address, which must be aligned to 64 pages and below the
+     * limit, bit i for page i.
+     */
+    std::uint64_t exchange(std::uint64_t physical_address)
+    {
+        return m_words[physical_address / page_size / pages_per_word]
+            .exchange(0, std::memory_order_relaxed);
+    }
+
+private:
+    /**
+     * The bitmap words.
+     */
+    std::atomic<std::uint64_t> * m_words{};
+
+    /**
+     * The tracked limit.
+     */
+    std::uint64_t m_limit{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,221 @@
+#pragma once
+#include "zpp/x64/intel/ept.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::hypervisor
+{
+/**
+ * A pool of 4KB pages for the hardware page tables. Pages are added in
+ * chunks of memory that the loader allocates, each page is recorded with
+ * its physical address, and free pages are tracked by a bitmap, so that
+ * tables are allocated only when they are needed and are found in
+ * constant time by the physical address that the hardware page table
+ * entries hold, through a table indexed by a hash of the page frame.
+ * The pool is not synchronized, and is grown only while the first CPU
+ * performs the one time initialization.
+ */
+class ept_pool
+{
+public:
+    /**
+     * Page size.
+     */
+    static constexpr std::size_t page_size = 0x1000;
+
+    /**
+     * The maximum number of pages, 64MB of tables.
+     */
+    static constexpr std::size_t max_pages = 16384;
+
+    /**
+     * The maximum number of chunks.
+     */
+    static constexpr std::size_t max_chunks = 64;
+
+    /**
+     * The number of slots of the page frame table, twice the maximum
+     * number of pages so that probe sequences stay short.
+     */
+    static constexpr std::size_t frame_slots = 2 * max_pages;
+
+    /**
+     * A chunk of pages added to the pool.
+     */
+    struct chunk
+    {
+        /**
+         * The page aligned base of the chunk.
+         */
+        unsigned char * base;
+
+        /**
+         * The number of pages in the chunk.
+         */
+        std::size_t number_of_pages;
+
+        /**
+         * The index of the first page of the chunk.
+         */
+        std::size_t first_page;
+    };
+
+    /**
+     * Construct an empty pool.
+     */
+    ept_pool() = default;
+
+    /**
+     * Add the given page aligned memory to the pool, the physical
+     * address of every page is obtained with the given virtual to
+     * physical translation. Returns false if the pool cannot hold the
+     * pages, in which case the memory is not added.
+     */
+    template <typename VirtualToPhysical>
+    bool add(void * memory,
+             std::size_t number_of_pages,
+             VirtualToPhysical && virtual_to_physical)
+    {
+        // If the pool cannot hold the pages, fail.
+        if (max_chunks == m_number_of_chunks ||
+            number_of_pages > max_pages - m_size) {
+            return false;
+        }
+
+        // Record the chunk.
+        auto base = static_cast<unsigned char *>(memory);
+        m_chunks[m_number_of_chunks++] = {base, number_of_pages, m_size};
+
+        // Record the pages as free, and index them by page frame.
+        for (std::size_t i{}; i < number_of_pages; ++i) {
+            auto & page = m_pages[m_size];
+            page.virtual_address = base + (i * page_size);
+            page.physical_address =
+                virtual_to_physical(page.virtual_address);
+            m_free[m_size / 64] |= (1ull << (m_size % 64));
+            index_frame(m_size);
+            ++m_size;
+        }
+        m_available += number_of_pages;
+        return true;
+    }
+
+    /**
+     * Allocate a zeroed table and return it along with its physical
+     * address, returns null if the pool is exhausted.
+     */
+    x64::intel::epte * allocate(std::uint64_t & physical_address);
+
+    /**
+     * Return the given table to the pool.
+     */
+    void free(x64::intel::epte * table);
+
+    /**
+     * Returns the table at the given physical address, or null if the
+     * address is not of a page of the pool.
+     */
+    x64::intel::epte * table(std::uint64_t physical_address) const;
+
+    /**
+     * Returns the number of free pages.
+     */
+    std::size_t available() const
+    {
+        return m_available;
+    }
+
+    /**
+     * Returns the number of chunks.
+     */
+    std::size_t number_of_chunks() const
+    {
+        return m_number_of_chunks;
+    }
+
+    /**
+     * Returns the chunk at the given index.
+     */
+    const chunk & chunk_at(std::size_t index) const
+    {
+        return m_chunks[index];
+    }
+
+private:
+    /**
+     * A page of the pool.
+     */
+    struct page
+    {
+        /**
+         * The virtual address of the page.
+         */
+        unsigned char * virtual_address;
+
+        /**
+         * The physical address of the page.
+         */
+        std::uint64_t physical_address;
+    };
+
+    /**
+     * Returns the page frame table slot from which the page of the given
+     * physical address is probed.
+     */
+    static std::size_t frame_slot(std::uint64_t physical_address)
+    {
+        // Fibonacci hashing of the page frame number.
+        static_assert(!(frame_slots & (frame_slots - 1)));
+        return std::size_t(((physical_address >> 12) *
+                            0x9e3779b97f4a7c15ull) >>
+                           (64 - __builtin_ctzll(frame_slots)));
+    }
+
+    /**
+     * Add the page of the given index to the page frame table.
+     */
+    void index_frame(std::size_t index);
+
+    /**
+     * The pages, chunk after chunk.
+     */
+    page m_pages[max_pages]{};
+
+    /**
+     * The page frame table, an open addressing hash table of page indices
+     * plus one, keyed by the page frame, where zero marks an empty slot.
+     */
+    std::uint16_t m_by_frame[frame_slots]{};
+
+    /**
+     * The free pages bitmap, bit i is set if page i is free.
+     */
+    std::uint64_t m_free[max_pages / 64]{};
+
+    /**
+     * The chunks.
+     */
+    chunk m_chunks[max_chunks]{};
+
+    /**
+     * The number of chunks.
+     */
+    std::size_t m_number_of_chunks{};
+
+    /**
+     * The number of pages.
+     */
+    std::size_t m_size{};
+
+    /**
+     * The number of free pages.
+     */
+    std::size_t m_available{};
+
+    /**
+     * The bitmap word from which free pages are searched.
+     */
+    std::size_t m_hint{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,120 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::hypervisor
+{
+/**
+ * The guest access of the 4KB pages that are mapped by large hardware
+ * page table entries, so that restricting a page does not split the
+ * large page that maps it. The large page is given the access that all
+ * of its pages allow, and is split only when the guest performs an
+ * access that the page allows, see hypervisor::ept_violation_exit.
+ * Pages are kept in regions of 2MB, each with a bitmap of the denied
+ * access of its pages, and pages without a region allow every access.
+ * The map is not synchronized.
+ */
+class ept_protection_map
+{
+public:
+    /**
+     * Access rights, the bits match the access bits of the hardware page
+     * table entries and of the EPT violation exit qualification.
+     */
+    enum access : unsigned
+    {
+        none = 0,
+        read = 0x1,
+        write = 0x2,
+        execute = 0x4,
+        all = read | write | execute,
+    };
+
+    /**
+     * The maximum number of regions.
+     */
+    static constexpr std::size_t capacity = 1024;
+
+    /**
+     * The region size, 2MB.
+     */
+    static constexpr std::uint64_t region_size = 1ull << 21;
+
+    /**
+     * Construct an empty map.
+     */
+    ept_protection_map() = default;
+
+    /**
+     * Set the access of the page at the given physical address. Returns
+     * false if the map is full, in which case the access is unchanged.
+     */
+    bool set(std::uint64_t physical_address, unsigned access);
+
+    /**
+     * Returns the access of the page at the given physical address.
+     */
+    unsigned get(std::uint64_t physical_address) const;
+
+    /**
+     * Returns the access that every page of the given size aligned range
+     * allows, the size must be a multiple of the region size.
+     */
+    unsigned common(std::uint64_t physical_address,
+                    std::uint64_t size) const;
+
+    /**
+     * Remove the region of the given physical address, once its pages
+     * are mapped by 4KB entries that hold their access.
+     */
+    void erase(std::uint64_t physical_address);
+
+    /**
+     * Returns the number of regions.
+     */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    /**
+     * The denied access of the pages of a 2MB region.
+     */
+    struct region
+    {
+        /**
+         * The physical address of the region.
+         */
+        std::uint64_t base;
+
+        /**
+         * The bitmaps of the pages that deny read, write and execute
+         * access, bit i for page i.
+         */
+        std::uint64_t denied[3][region_size / 0x1000 / 64];
+    };
+
+    /**
+     * Returns the index of the first region whose base is not below the
+     * given physical address.
+     */
+    std::size_t lower_bound(std::uint64_t physical_address) const;
+
+    /**
+     * Returns the access that every page of the region allows.
+     */
+    static unsigned common(const region & region);
+
+    /**
+     * The regions, sorted by base.
+     */
+    region m_regions[capacity]{};
+
+    /**
+     * The number of regions.
+     */
+    std::size_t m_size{};
+};
+
+} // namespace zpp::hypervisor
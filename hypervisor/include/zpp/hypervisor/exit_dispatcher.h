@@ -0,0 +1,209 @@
+#pragma once
+#include "zpp/hypervisor/exit_handler.h"
+#include "zpp/x64/asm.h"
+#include "zpp/x64/context.h"
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <array>
+#include <cstddef>
+
+namespace zpp::hypervisor
+{
+/**
+ * The policy for exits whose basic reason has no registered handler.
+ */
+enum class unhandled_exit_policy
+{
+    /**
+     * Skip the exiting instruction as if it was executed.
+     */
+    skip_instruction,
+
+    /**
+     * Resume the guest at the exiting instruction.
+     */
+    resume,
+
+    /**
+     * Halt the processor, to be inspected with a debugger.
+     */
+    halt,
+};
+
+/**
+ * Registers an exit handler type for a basic exit reason, to be passed
+ * to the exit dispatcher constructor.
+ */
+template <x64::intel::exit_reason::basic_reason Reason, typename Handler>
+struct on_exit
+{
+};
+
+/**
+ * A dense table of exit handlers indexed by the basic exit reason,
+ * built at compile time from handler registrations.
+ *
+ * Exit handlers are default constructible types with the call operator:
+ *
+ *     exit_action operator()(Context & context,
+ *                            const exit_information & information,
+ *                            x64::gpr_context & guest_context) const;
+ *
+ * Where the information is decoded before dispatching and the guest
+ * context holds the guest general purpose registers, and the guest RIP
+ * in guest_context.rip. Handlers that opted in for the guest extended
+ * state receive an additional x64::extended_state & parameter, see
+ * exit_handler.h.
+ */
+template <typename Context>
+class exit_dispatcher
+{
+public:
+    /**
+     * The basic exit reason type.
+     */
+    using basic_reason = x64::intel::exit_reason::basic_reason;
+
+    /**
+     * The type erased handler stored in the table.
+     */
+    using handler = exit_action (*)(Context &,
+                                    const exit_information &,
+                                    x64::gpr_context &);
+
+    /**
+     * Builds the table from the unhandled exit policy and the handler
+     * registrations, a basic reason may be registered at most once.
+     */
+    template <typename... Registrations>
+    constexpr exit_dispatcher(unhandled_exit_policy policy,
+                              Registrations... registrations) :
+        m_unhandled(unhandled_handler(policy))
+    {
+        // Fill the table with the unhandled handler.
+        for (auto & handler : m_handlers) {
+            handler = m_unhandled;
+        }
+
+        // Register the handlers.
+        (register_handler(registrations), ...);
+    }
+
+    /**
+     * Dispatches the exit to the handler of its basic reason.
+     */
+    exit_action dispatch(Context & context,
+                         const exit_information & information,
+                         x64::gpr_context & guest_context) const
+    {
+        // The table index.
+        auto index = static_cast<std::size_t>(information.basic_reason);
+
+        // Out of range reasons are unhandled.
+        if (index >= m_handlers.size()) {
+            return m_unhandled(context, information, guest_context);
+        }
+
+        // Invoke the handler.
+        return m_handlers[index](context, information, guest_context);
+    }
+
+    /**
+     * Returns true if a handler is registered for the given basic reason,
+     * else false.
+     */
+    constexpr bool handled(basic_reason reason) const
+    {
+        auto index = static_cast<std::size_t>(reason);
+        return index < m_handlers.size() &&
+               m_handlers[index] != m_unhandled;
+    }
+
+private:
+    /**
+     * Registers a handler for a basic reason.
+     */
+    template <basic_reason Reason, typename Handler>
+    constexpr void register_handler(on_exit<Reason, Handler>)
+    {
+        static_assert(static_cast<std::size_t>(Reason) <
+                          x64::intel::exit_reason::basic_reason_count,
+                      "Basic reason out of range.");
+
+        // The table index.
+        auto index = static_cast<std::size_t>(Reason);
+
+        // Registering the same reason twice is not a constant expression.
+        if (m_handlers[index] != m_unhandled) {
+            duplicate_registration();
+        }
+
+        // Register the handler.
+        m_handlers[index] = invoke<Handler>;
+    }
+
+    /**
+     * Called on duplicate registration, intentionally not constexpr.
+     */
+    static void duplicate_registration();
+
+    /**
+     * Invokes the exit handler.
+     */
+    template <typename Handler>
+    static exit_action invoke(Context & context,
+                              const exit_information & information,
+                              x64::gpr_context & guest_context)
+    {
+        return invoke_exit_handler(
+            Handler{}, context, information, guest_context);
+    }
+
+    /**
+     * Returns the handler that implements the unhandled exit policy.
+     */
+    static constexpr handler
+    unhandled_handler(unhandled_exit_policy policy)
+    {
+        switch (policy) {
+        case unhandled_exit_policy::skip_instruction:
+            return unhandled<unhandled_exit_policy::skip_instruction>;
+        case unhandled_exit_policy::resume:
+            return unhandled<unhandled_exit_policy::resume>;
+        case unhandled_exit_policy::halt:
+            return unhandled<unhandled_exit_policy::halt>;
+        }
+        return unhandled<unhandled_exit_policy::skip_instruction>;
+    }
+
+    /**
+     * Implements an unhandled exit policy.
+     */
+    template <unhandled_exit_policy Policy>
+    static exit_action
+    unhandled(Context &, const exit_information &, x64::gpr_context &)
+    {
+        if constexpr (unhandled_exit_policy::skip_instruction == Policy) {
+            return exit_action::skip_instruction;
+        } else if constexpr (unhandled_exit_policy::resume == Policy) {
+            return exit_action::resume;
+        } else {
+            // Interrupts are disabled in root mode, halt forever.
+            while (true) {
+                x64::halt();
+            }
+        }
+    }
+
+    /**
+     * The handler implementing the unhandled exit policy.
+     */
+    handler m_unhandled{};
+
+    /**
+     * The handlers indexed by basic reason.
+     */
+    std::array<handler, x64::intel::exit_reason::basic_reason_count>
+        m_handlers{};
+};
+
+} // namespace zpp::hypervisor
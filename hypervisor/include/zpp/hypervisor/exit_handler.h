@@ -0,0 +1,131 @@
+#pragma once
+#include "zpp/scope_guard.h"
+#include "zpp/x64/asm.h"
+#include "zpp/x64/context.h"
+#include "zpp/x64/intel/vmcs_exit_view.h"
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace zpp::hypervisor
+{
+/**
+ * The action to take once an exit handler returns.
+ */
+enum class exit_action
+{
+    /**
+     * Advance the guest RIP past the exiting instruction and resume.
+     */
+    skip_instruction,
+
+    /**
+     * Resume the guest at the guest RIP found in the context, which is
+     * the exiting instruction unless changed by the handler.
+     */
+    resume,
+};
+
+/**
+ * The exit information decoded once per exit, before dispatching
+ * to the exit handler.
+ */
+struct exit_information
+{
+    /**
+     * The exit scoped VMCS view, exit handlers access the VMCS through
+     * the view, which is written back once before resuming the guest.
+     */
+    x64::intel::vmcs_exit_view & vmcs;
+
+    /**
+     * The index of the exiting CPU.
+     */
+    std::size_t cpuid{};
+
+    /**
+     * The full exit reason.
+     */
+    x64::intel::exit_reason reason;
+
+    /**
+     * The basic exit reason.
+     */
+    x64::intel::exit_reason::basic_reason basic_reason{};
+
+    /**
+     * The exit qualification.
+     */
+    std::uint64_t qualification{};
+};
+
+/**
+ * The VM exit path saves only the general purpose registers of the guest,
+ * and the hypervisor is built to never touch floating point and SIMD
+ * registers. Exit handlers that need to access the guest floating point
+ * and SIMD state opt in by declaring:
+ *
+ *     using extended_state_tag = uses_extended_state_tag;
+ *
+ * In which case they are invoked with the guest extended state as an
+ * additional last parameter, which is saved before and restored after
+ * the handler is invoked.
+ */
+struct uses_extended_state_tag
+{
+};
+
+/**
+ * Determines whether an exit handler opted in for the guest extended
+ * state.
+ */
+template <typename Handler, typename = void>
+struct uses_extended_state : std::false_type
+{
+};
+
+template <typename Handler>
+struct uses_extended_state<
+    Handler,
+    std::void_t<
+        typename std::remove_reference_t<Handler>::extended_state_tag>> :
+    std::is_same<
+        typename std::remove_reference_t<Handler>::extended_state_tag,
+        uses_extended_state_tag>
+{
+};
+
+template <typename Handler>
+constexpr bool uses_extended_state_v = uses_extended_state<Handler>::value;
+
+/**
+ * Invokes an exit handler with the given arguments, and for handlers that
+ * opted in, with the guest extended state.
+ */
+template <typename Handler, typename... Arguments>
+decltype(auto) invoke_exit_handler(Handler && handler,
+                                   Arguments &&... arguments)
+{
+    if constexpr (uses_extended_state_v<Handler>) {
+        // Save the guest extended state.
+        x64::extended_state extended_state;
+        x64::fxsave(&extended_state);
+
+        // Restore the possibly modified guest extended state on return.
+        scope_guard restore_extended_state = [&] {
+            x64::fxrstor(&extended_state);
+        };
+
+        // Invoke the handler.
+        return std::forward<Handler>(handler)(
+            std::forward<Arguments>(arguments)..., extended_state);
+    } else {
+        // Invoke the handler.
+        return std::forward<Handler>(handler)(
+            std::forward<Arguments>(arguments)...);
+    }
+}
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,133 @@
+#pragma once
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace zpp::hypervisor
+{
+/**
+ * Per CPU VM exit statistics, the number of exits of every basic reason
+ * and a histogram of the exit handling latency in TSC cycles.
+ * Updated only by the owning CPU, and read by any CPU or a debugger
+ * without locks, using a sequence counter that is odd while an update
+ * is in progress.
+ */
+class alignas(64) exit_statistics
+{
+public:
+    /**
+     * The basic exit reason type.
+     */
+    using basic_reason = x64::intel::exit_reason::basic_reason;
+
+    /**
+     * The number of latency histogram buckets, bucket i counts exits
+     * whose latency is in the range [2^i, 2^(i+1)) cycles, bucket 0 also
+     * counts zero latency.
+     */
+    static constexpr std::size_t latency_buckets = 64;
+
+    /**
+     * A consistent copy of the statistics.
+     */
+    struct snapshot
+    {
+        /**
+         * The number of exits per basic reason.
+         */
+        std::uint64_t exits[x64::intel::exit_reason::basic_reason_count]{};
+
+        /**
+         * The latency histogram.
+         */
+        std::uint64_t latency[latency_buckets]{};
+    };
+
+    /**
+     * Records an exit of the given basic reason that took the given
+     * number of cycles to handle, must be called only by the owning CPU.
+     */
+    void record(basic_reason reason, std::uint64_t cycles)
+    {
+        // The exit reason index, out of range reasons are not recorded.
+        auto index = static_cast<std::size_t>(reason);
+        if (index >= std::extent_v<decltype(m_exits)>) {
+            return;
+        }
+
+        // The latency bucket, the log2 of the cycles.
+        auto bucket = 63 - __builtin_clzll(cycles | 1);
+
+        // Mark update in progress, ordered before the updates.
+        auto sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        // Update the counters, there is a single writer.
+        m_exits[index].store(
+            m_exits[index].load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        m_latency[bucket].store(
+            m_latency[bucket].load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+
+        // Mark update complete.
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /**
+     * Copies a consistent snapshot of the statistics, retrying while
+     * an update is in progress. May be called concurrently with record.
+     */
+    void read(snapshot & snapshot) const
+    {
+        while (true) {
+            // Read the sequence before the counters, retry if an
+            // update is in progress.
+            auto sequence = m_sequence.load(std::memory_order_acquire);
+            if (sequence & 1) {
+                continue;
+            }
+
+            // Copy the counters.
+            for (std::size_t i{}; i < std::extent_v<decltype(m_exits)>;
+                 ++i) {
+                snapshot.exits[i] =
+                    m_exits[i].load(std::memory_order_relaxed);
+            }
+            for (std::size_t i{};
+                 i < std::extent_v<decltype(m_latency)>;
+                 ++i) {
+                snapshot.latency[i] =
+                    m_latency[i].load(std::memory_order_relaxed);
+            }
+
+            // If the sequence did not change, the copy is consistent.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_sequence.load(std::memory_order_relaxed) == sequence) {
+                return;
+            }
+        }
+    }
+
+private:
+    /**
+     * The sequence counter, odd while an update is in progress.
+     */
+    std::atomic<std::uint64_t> m_sequence{};
+
+    /**
+     * The number of exits per basic reason.
+     */
+    std::atomic<std::uint64_t>
+        m_exits[x64::intel::exit_reason::basic_reason_count]{};
+
+    /**
+     * The latency histogram.
+     */
+    std::atomic<std::uint64_t> m_latency[latency_buckets]{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,217 @@
+#pragma once
+#include "zpp/hypervisor/hypercall_abi.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The default number of TSC cycles between profiler samples, where zero
+ * disables the profiler.
+ */
+#ifndef ZPP_HYPERVISOR_PROFILER_INTERVAL
+#define ZPP_HYPERVISOR_PROFILER_INTERVAL 0
+#endif
+
+namespace zpp::hypervisor
+{
+/**
+ * A statistical guest profiler of a single CPU, sampled on VMX
+ * preemption timer exits. The timer counts down while the guest runs,
+ * including with interrupts disabled, so the overhead is a single VM exit
+ * per interval of guest execution.
+ * Samples are kept in a ring that a single CPU records into, and that
+ * any CPU may read from concurrently, where the oldest samples are
+ * overwritten.
+ */
+class alignas(64) guest_profiler
+{
+public:
+    /**
+     * A guest sample.
+     */
+    struct sample
+    {
+        /**
+         * The guest RIP.
+         */
+        std::uint64_t rip;
+
+        /**
+         * The guest CR3.
+         */
+        std::uint64_t cr3;
+
+        /**
+         * The TSC at the time of the sample.
+         */
+        std::uint64_t tsc;
+
+        /**
+         * The guest CPL.
+         */
+        std::uint32_t cpl;
+
+        /**
+         * Reserved.
+         */
+        std::uint32_t reserved;
+    };
+
+    static_assert(sizeof(sample) == ZPP_PROFILE_SAMPLE_SIZE,
+                  "Sample ABI size mismatch.");
+
+    /**
+     * The number of samples kept.
+     */
+    static constexpr std::size_t capacity = ZPP_PROFILE_CAPACITY;
+
+    /**
+     * Construct a disabled profiler.
+     */
+    guest_profiler() = default;
+
+    /**
+     * Configure the interval in TSC cycles between samples, where zero
+     * disables the profiler. The rate shift is the number of bits the
+     * TSC is shifted by to get the preemption timer rate, found in bits
+     * 4:0 of the VMX miscellaneous MSR.
+     */
+    void configure(std::uint64_t interval, std::uint32_t rate_shift)
+    {
+        // Disabled.
+        if (!interval) {
+            m_timer_value = 0;
+            return;
+        }
+
+        // Convert the interval to timer ticks, the timer value is
+        // 32 bits and must be at least one.
+        auto timer_value = interval >> rate_shift;
+        if (!timer_value) {
+            timer_value = 1;
+        } else if (timer_value > 0xffffffff) {
+            timer_value = 0xffffffff;
+        }
+        m_timer_value = std::uint32_t(timer_value);
+    }
+
+    /**
+     * Returns true if the profiler is enabled.
+     */
+    bool enabled() const
+    {
+        return m_timer_value;
+    }
+
+    /**
+     * Returns the preemption timer value to arm.
+     */
+    std::uint32_t timer_value() const
+    {
+        return m_timer_value;
+    }
+
+    /**
+     * Record a sample, must be called only by the profiled CPU.
+     */
+    void record(std::uint64_t rip,
+                std::uint64_t cr3,
+                std::uint32_t cpl,
+                std::uint64_t tsc)
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+
+        // Write the sample.
+        auto & sample = m_samples[head % capacity];
+        sample.rip = rip;
+        sample.cr3 = cr3;
+        sample.tsc = tsc;
+        sample.cpl = cpl;
+        sample.reserved = 0;
+
+        // Publish the sample.
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    /**
+     * Returns the number of samples recorded.
+     */
+    std::uint64_t size() const
+    {
+        return m_head.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Copy up to count samples starting at the given position, which is
+     * the number of samples recorded before the first sample to copy.
+     * Samples that were overwritten are skipped. Returns the number of
+     * copied samples, and advances the position past them.
+     */
+    std::size_t read(std::uint64_t & position,
+                     sample * samples,
+                     std::size_t count) const
+    {
+        auto head = m_head.load(std::memory_order_acquire);
+
+        // A position past the head has nothing to copy, clamp it so that
+        // unwritten samples are never copied.
+        if (position > head) {
+            position = head;
+        }
+
+        // Skip samples that were overwritten.
+        if (head - position > capacity) {
+            position = head - capacity;
+        }
+
+        // Limit the number of samples to the recorded ones.
+        if (count > head - position) {
+            count = head - position;
+        }
+
+        // Copy the samples.
+        for (std::size_t i{}; i < count; ++i) {
+            samples[i] = m_samples[(position + i) % capacity];
+        }
+
+        // Discard samples that were overwritten while copying, the
+        // sample being recorded at the current head overwrites the
+        // sample that is capacity samples behind it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto last_head = m_head.load(std::memory_order_relaxed);
+        std::size_t discarded{};
+        if (last_head + 1 > position + capacity) {
+            discarded = last_head + 1 - (position + capacity);
+            if (discarded > count) {
+                discarded = count;
+            }
+        }
+
+        // Move the valid samples to the beginning.
+        for (std::size_t i = discarded; i < count; ++i) {
+            samples[i - discarded] = samples[i];
+        }
+
+        // Advance the position.
+        position += count;
+        return count - discarded;
+    }
+
+private:
+    /**
+     * The number of recorded samples.
+     */
+    std::atomic<std::uint64_t> m_head{};
+
+    /**
+     * The preemption timer value, zero if disabled.
+     */
+    std::uint32_t m_timer_value{};
+
+    /**
+     * The samples ring.
+     */
+    sample m_samples[capacity]{};
+};
+
+} // namespace zpp::hypervisor
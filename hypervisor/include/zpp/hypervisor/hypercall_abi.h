@@ -0,0 +1,360 @@
+#pragma once
+#if defined(__KERNEL__)
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+/**
+ * The hypercall ABI of the hypervisor, shared with guest code such as
+ * the loaders, and therefore written in C.
+ *
+ * A hypercall is a vmcall instruction executed at CPL 0 with:
+ *   rcx - ZPP_HYPERCALL_MAGIC.
+ *   rax - The hypercall number, see zpp_hypercall_number.
+ *   rdx - The first hypercall argument.
+ *   r8  - The second hypercall argument.
+ * On return, rax holds the status, see zpp_hypercall_status, and rdx
+ * holds the hypercall result. Other registers are preserved.
+ *
+ * Operations are submitted through a request ring in guest memory that
+ * every CPU registers for itself, then a single ZPP_HYPERCALL_DRAIN_RING
+ * processes all the requests queued since the last drain:
+ *   1. Allocate physically contiguous, page aligned memory of at most
+ *      ZPP_HYPERCALL_RING_MAX_PAGES pages, and initialize the ring header
+ *      with the magic, version and a power of two capacity, such that
+ *      the header followed by the requests fits in the memory.
+ *   2. Execute ZPP_HYPERCALL_REGISTER_RING on the CPU with rdx being the
+ *      ring physical address and r8 being the number of pages.
+ *   3. Fill requests at index (head % capacity) and advance head.
+ *   4. Execute ZPP_HYPERCALL_DRAIN_RING on the same CPU, every request
+ *      up to head gets its status and results written, tail is advanced
+ *      to head, and rdx holds the number of processed requests.
+ * Operations that read more than their results hold copy into a buffer
+ * within the ring memory that follows the requests, given by its byte
+ * offset from the ring physical address.
+ */
+
+/**
+ * The ABI version, incremented on every incompatible change.
+ */
+#define ZPP_HYPERCALL_ABI_VERSION 2
+
+/**
+ * The value of rcx that identifies a hypercall.
+ */
+#define ZPP_HYPERCALL_MAGIC 0x5a707048
+
+/**
+ * The magic of the ring header.
+ */
+#define ZPP_HYPERCALL_RING_MAGIC 0x5a707052
+
+/**
+ * The maximum number of pages of a ring.
+ */
+#define ZPP_HYPERCALL_RING_MAX_PAGES 4
+
+/**
+ * The hypercall numbers, passed in rax.
+ */
+enum zpp_hypercall_number
+{
+    /**
+     * Returns the ABI version in rdx.
+     */
+    ZPP_HYPERCALL_VERSION = 0,
+
+    /**
+     * Registers the ring of the current CPU, rdx is the ring physical
+     * address and r8 is the number of pages.
+     */
+    ZPP_HYPERCALL_REGISTER_RING = 1,
+
+    /**
+     * Unregisters the ring of the current CPU.
+     */
+    ZPP_HYPERCALL_UNREGISTER_RING = 2,
+
+    /**
+     * Processes the queued requests of the ring of the current CPU,
+     * returns the number of processed requests in rdx.
+     */
+    ZPP_HYPERCALL_DRAIN_RING = 3,
+};
+
+/**
+ * The hypercall and request status values.
+ */
+enum zpp_hypercall_status
+{
+    ZPP_HYPERCALL_STATUS_SUCCESS = 0,
+    ZPP_HYPERCALL_STATUS_UNSUPPORTED = -1,
+    ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT = -2,
+    ZPP_HYPERCALL_STATUS_ACCESS_DENIED = -3,
+    ZPP_HYPERCALL_STATUS_NO_RING = -4,
+    ZPP_HYPERCALL_STATUS_INVALID_RING = -5,
+};
+
+/**
+ * The ring request operations.
+ */
+enum zpp_hypercall_operation
+{
+    /**
+     * Does nothing.
+     */
+    ZPP_HYPERCALL_OPERATION_NOP = 0,
+
+    /**
+     * Reads the exit count of a basic exit reason, arguments[0] is the
+     * CPU index and arguments[1] is the basic exit reason, the count is
+     * returned in results[0].
+     */
+    ZPP_HYPERCALL_OPERATION_EXIT_COUNT = 1,
+
+    /**
+     * Reads the exit latency histogram bucket, arguments[0] is the CPU
+     * index and arguments[1] is the bucket, where bucket i counts exits
+     * that took [2^i, 2^(i+1)) cycles, the count is returned in
+     * results[0].
+     */
+    ZPP_HYPERCALL_OPERATION_EXIT_LATENCY = 2,
+
+    /**
+     * Starts tracing the current CPU with the monitor trap flag, from
+     * the instruction that follows the drain hypercall, replacing the
+     * previous trace. arguments[0] and arguments[1] are the traced guest
+     * RIP range [begin, end), arguments[2] is the maximum number of
+     * single steps, whether or not within the range, and arguments[3] is
+     * the mask of recorded registers, see ZPP_TRACE_REGISTER_RAX.
+     */
+    ZPP_HYPERCALL_OPERATION_TRACE_START = 3,
+
+    /**
+     * Stops tracing the current CPU.
+     */
+    ZPP_HYPERCALL_OPERATION_TRACE_STOP = 4,
+
+    /**
+     * Reads the trace status, arguments[0] is the CPU index, the number
+     * of trace bytes is returned in results[0], and the number of records
+     * in results[1].
+     */
+    ZPP_HYPERCALL_OPERATION_TRACE_STATUS = 5,
+
+    /**
+     * Reads trace bytes, arguments[0] is the CPU index and arguments[1]
+     * is the byte offset, up to 16 bytes are returned in results[0] and
+     * results[1], zero padded past the end of the trace.
+     */
+    ZPP_HYPERCALL_OPERATION_TRACE_READ = 6,
+
+    /**
+     * Reads the log status, arguments[0] is the CPU index, the number of
+     * records ever written is returned in results[0], of which only the
+     * last ZPP_LOG_CAPACITY records are kept.
+     */
+    ZPP_HYPERCALL_OPERATION_LOG_STATUS = 7,
+
+    /**
+     * Reads log records into a buffer within the ring memory,
+     * arguments[0] is the CPU index, arguments[1] is the position of the
+     * first record, which is the number of records written before it,
+     * arguments[2] is the buffer offset, aligned to ZPP_LOG_RECORD_SIZE,
+     * and arguments[3] is the maximum number of records, at most
+     * ZPP_LOG_CAPACITY. Records that were overwritten are skipped. The
+     * number of copied records is returned in results[0], and the
+     * position that follows the last copied record in results[1]. Reads
+     * of the current CPU log within a single drain are consistent, as the
+     * log is not written during the drain, and drains of only log status
+     * and log reads are not logged.
+     */
+    ZPP_HYPERCALL_OPERATION_LOG_READ = 8,
+
+    /**
+     * Reads the dirty page tracking status, the number of bytes of guest
+     * physical memory from address zero whose pages are tracked is
+     * returned in results[0], and results[1] is reserved and zero. Fails
+     * with ZPP_HYPERCALL_STATUS_UNSUPPORTED if the processor does not
+     * support page modification logging.
+     */
+    ZPP_HYPERCALL_OPERATION_DIRTY_STATUS = 9,
+
+    /**
+     * Reads and clears the dirty bits of guest physical pages into a
+     * buffer within the ring memory, arguments[0] is the address of the
+     * first page, aligned to 64 pages and within the tracked memory,
+     * arguments[1] is reserved, arguments[2] is the buffer offset,
+     * aligned to 8 bytes, and arguments[3] is the maximum number of 64
+     * bit words, where bit i of a word is set if page i of its 64 pages
+     * was written since last read. Words are read up to the end of the
+     * tracked memory, their number is returned in results[0], and the
+     * address that follows their pages in results[1]. The whole range is
+     * cleared with a single invalidation of every CPU, so large ranges
+     * are best read at once.
+     * Pages are tracked from the launch, in the granularity in which they
+     * are mapped, so a write marks all the pages of its large page. Every
+     * page written before the last ZPP_HYPERCALL_OPERATION_DIRTY_SYNC is
+     * reported, and every write of any CPU that follows the read marks
+     * its page again.
+     */
+    ZPP_HYPERCALL_OPERATION_DIRTY_READ = 10,
+
+    /**
+     * Reads the profiler status, arguments[0] is the CPU index, the
+     * number of samples ever recorded is returned in results[0], of which
+     * only the last ZPP_PROFILE_CAPACITY samples are kept, and the VMX
+     * preemption timer value between samples in results[1], zero if the
+     * profiler is disabled.
+     */
+    ZPP_HYPERCALL_OPERATION_PROFILE_STATUS = 11,
+
+    /**
+     * Reads profiler samples into a buffer within the ring memory,
+     * arguments[0] is the CPU index, arguments[1] is the position of the
+     * first sample, which is the number of samples recorded before it,
+     * arguments[2] is the buffer offset, aligned to
+     * ZPP_PROFILE_SAMPLE_SIZE, and arguments[3] is the maximum number of
+     * samples, at most ZPP_PROFILE_CAPACITY. Samples that were
+     * overwritten are skipped. The number of copied samples is returned
+     * in results[0], and the position that follows the last copied
+     * sample in results[1].
+     */
+    ZPP_HYPERCALL_OPERATION_PROFILE_READ = 12,
+
+    /**
+     * Synchronizes the dirty pages, once complete every page that any CPU
+     * wrote before it is reported by ZPP_HYPERCALL_OPERATION_DIRTY_READ,
+     * as every other CPU is interrupted to report its pages. Fails with
+     * ZPP_HYPERCALL_STATUS_UNSUPPORTED if the processor does not support
+     * page modification logging.
+     */
+    ZPP_HYPERCALL_OPERATION_DIRTY_SYNC = 13,
+};
+
+/**
+ * A log record consists of the 32 bit offset of its format string within
+ * the zpp_log_formats section of the hypervisor ELF, the 16 bit number
+ * of arguments, the 16 bit mask of signed arguments, the 64 bit TSC and
+ * up to six 64 bit arguments, all little endian.
+ */
+#define ZPP_LOG_RECORD_SIZE 64
+#define ZPP_LOG_CAPACITY 1024
+
+/**
+ * A profiler sample consists of the 64 bit guest RIP, the 64 bit guest
+ * CR3, the 64 bit TSC, the 32 bit guest CPL and 32 reserved bits, all
+ * little endian.
+ */
+#define ZPP_PROFILE_SAMPLE_SIZE 32
+#define ZPP_PROFILE_CAPACITY 1024
+
+/**
+ * The trace is a sequence of records, one per traced instruction, each
+ * consisting of the guest RIP of the instruction about to execute,
+ * followed by the recorded registers in the order of their mask bits.
+ * Every value is encoded as the difference from its value in the
+ * previous record, or from zero in the first record, zigzag encoded
+ * into an unsigned value, and written as unsigned LEB128.
+ */
+#define ZPP_TRACE_REGISTER_RAX (1u << 0)
+#define ZPP_TRACE_REGISTER_RBX (1u << 1)
+#define ZPP_TRACE_REGISTER_RCX (1u << 2)
+#define ZPP_TRACE_REGISTER_RDX (1u << 3)
+#define ZPP_TRACE_REGISTER_RSP (1u << 4)
+#define ZPP_TRACE_REGISTER_RBP (1u << 5)
+#define ZPP_TRACE_REGISTER_RSI (1u << 6)
+#define ZPP_TRACE_REGISTER_RDI (1u << 7)
+#define ZPP_TRACE_REGISTER_R8 (1u << 8)
+#define ZPP_TRACE_REGISTER_R9 (1u << 9)
+#define ZPP_TRACE_REGISTER_R10 (1u << 10)
+#define ZPP_TRACE_REGISTER_R11 (1u << 11)
+#define ZPP_TRACE_REGISTER_R12 (1u << 12)
+#define ZPP_TRACE_REGISTER_R13 (1u << 13)
+#define ZPP_TRACE_REGISTER_R14 (1u << 14)
+#define ZPP_TRACE_REGISTER_R15 (1u << 15)
+
+/**
+ * The ring header, at the beginning of the ring memory.
+ */
+struct zpp_hypercall_ring_header
+{
+    /**
+     * Must be ZPP_HYPERCALL_RING_MAGIC.
+     */
+    uint32_t magic;
+
+    /**
+     * Must be ZPP_HYPERCALL_ABI_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * The number of requests, must be a power of two.
+     */
+    uint32_t capacity;
+
+    /**
+     * Reserved, must be zero.
+     */
+    uint32_t reserved0;
+
+    /**
+     * The number of submitted requests, written by the guest.
+     */
+    uint64_t head;
+
+    /**
+     * The number of processed requests, written by the hypervisor.
+     */
+    uint64_t tail;
+
+    /**
+     * Reserved, must be zero.
+     */
+    uint64_t reserved1[4];
+};
+
+/**
+ * A ring request, the requests follow the ring header.
+ */
+struct zpp_hypercall_request
+{
+    /**
+     * The operation, see zpp_hypercall_operation.
+     */
+    uint32_t operation;
+
+    /**
+     * The status, written by the hypervisor, see zpp_hypercall_status.
+     */
+    int32_t status;
+
+    /**
+     * An opaque value for the guest, left untouched.
+     */
+    uint64_t cookie;
+
+    /**
+     * The operation arguments.
+     */
+    uint64_t arguments[4];
+
+    /**
+     * The operation results, written by the hypervisor.
+     */
+    uint64_t results[2];
+};
+
+#if defined(__cplusplus)
+static_assert(sizeof(struct zpp_hypercall_ring_header) == 64,
+              "Ring header ABI size mismatch.");
+static_assert(sizeof(struct zpp_hypercall_request) == 64,
+              "Request ABI size mismatch.");
+#else
+_Static_assert(sizeof(struct zpp_hypercall_ring_header) == 64,
+               "Ring header ABI size mismatch.");
+_Static_assert(sizeof(struct zpp_hypercall_request) == 64,
+               "Request ABI size mismatch.");
+#endif
@@ -0,0 +1,205 @@
+#pragma once
+#include "zpp/hypervisor/hypercall_abi.h"
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace zpp::hypervisor
+{
+/**
+ * The hypervisor side of a guest hypercall ring, see hypercall_abi.h.
+ * The ring memory is shared with the guest, hence every value that is
+ * read from it is read exactly once and validated before use.
+ */
+class hypercall_ring
+{
+public:
+    /**
+     * Construct a detached ring.
+     */
+    hypercall_ring() = default;
+
+    /**
+     * Attach the ring to its mapped memory of the given size, returns
+     * a hypercall status.
+     */
+    std::int32_t attach(void * memory, std::size_t size)
+    {
+        auto header = static_cast<zpp_hypercall_ring_header *>(memory);
+
+        // Detach from a previous ring.
+        detach();
+
+        // Read the header fields once.
+        auto magic = read_once(header->magic);
+        auto version = read_once(header->version);
+        auto capacity = read_once(header->capacity);
+
+        // Validate the header.
+        if (ZPP_HYPERCALL_RING_MAGIC != magic ||
+            ZPP_HYPERCALL_ABI_VERSION != version) {
+            return ZPP_HYPERCALL_STATUS_INVALID_RING;
+        }
+
+        // Validate the capacity.
+        if (size < sizeof(zpp_hypercall_ring_header) || !capacity ||
+            (capacity & (capacity - 1)) ||
+            capacity > (size - sizeof(zpp_hypercall_ring_header)) /
+                           sizeof(zpp_hypercall_request)) {
+            return ZPP_HYPERCALL_STATUS_INVALID_RING;
+        }
+
+        // Attach, starting to process at the current head.
+        m_header = header;
+        m_requests = reinterpret_cast<zpp_hypercall_request *>(header + 1);
+        m_capacity = capacity;
+        m_size = size;
+        m_tail = read_once(header->head);
+        write_once(header->tail, m_tail);
+        return ZPP_HYPERCALL_STATUS_SUCCESS;
+    }
+
+    /**
+     * Detach the ring.
+     */
+    void detach()
+    {
+        m_header = nullptr;
+        m_requests = nullptr;
+        m_capacity = 0;
+        m_size = 0;
+        m_tail = 0;
+    }
+
+    /**
+     * Returns true if the ring is attached.
+     */
+    bool attached() const
+    {
+        return m_header;
+    }
+
+    /**
+     * Returns the buffer of the given size at the given byte offset within
+     * the ring memory, which must follow the requests, or null if out of
+     * range. The buffer is shared with the guest.
+     */
+    void * buffer(std::uint64_t offset, std::uint64_t size) const
+    {
+        // The buffer must follow the requests and be within the memory.
+        if (!m_header ||
+            offset < sizeof(zpp_hypercall_ring_header) +
+                         m_capacity * sizeof(zpp_hypercall_request) ||
+            offset > m_size || size > m_size - offset) {
+            return nullptr;
+        }
+        return reinterpret_cast<std::uint8_t *>(m_header) + offset;
+    }
+
+    /**
+     * Process all the submitted requests by calling the handler with
+     * a private copy of each request, and writing back its status and
+     * results. Returns a hypercall status, and sets the number of
+     * processed requests.
+     */
+    template <typename Handler>
+    std::int32_t drain(Handler && handler, std::uint64_t & processed)
+    {
+        processed = 0;
+
+        // If not attached, fail.
+        if (!m_header) {
+            return ZPP_HYPERCALL_STATUS_NO_RING;
+        }
+
+        // Read the head once.
+        auto head = read_once(m_header->head);
+
+        // Validate the number of submitted requests.
+        if (head - m_tail > m_capacity) {
+            return ZPP_HYPERCALL_STATUS_INVALID_RING;
+        }
+
+        // Process the requests.
+        for (; m_tail != head; ++m_tail, ++processed) {
+            auto & shared_request = m_requests[m_tail & (m_capacity - 1)];
+
+            // Copy the request, so the guest cannot change it while
+            // being processed.
+            zpp_hypercall_request request;
+            request.operation = read_once(shared_request.operation);
+            request.status = ZPP_HYPERCALL_STATUS_SUCCESS;
+            for (std::size_t i{};
+                 i < std::extent_v<decltype(request.arguments)>;
+                 ++i) {
+                request.arguments[i] =
+                    read_once(shared_request.arguments[i]);
+            }
+            for (auto & result : request.results) {
+                result = {};
+            }
+
+            // Process the request.
+            handler(request);
+
+            // Write back the status and results.
+            write_once(shared_request.status, request.status);
+            for (std::size_t i{};
+                 i < std::extent_v<decltype(request.results)>;
+                 ++i) {
+                write_once(shared_request.results[i], request.results[i]);
+            }
+        }
+
+        // Publish the tail.
+        write_once(m_header->tail, m_tail);
+        return ZPP_HYPERCALL_STATUS_SUCCESS;
+    }
+
+private:
+    /**
+     * Read a value shared with the guest exactly once.
+     */
+    template <typename Type>
+    static Type read_once(const Type & value)
+    {
+        return *static_cast<const volatile Type *>(&value);
+    }
+
+    /**
+     * Write a value shared with the guest exactly once.
+     */
+    template <typename Type>
+    static void write_once(Type & destination, Type value)
+    {
+        *static_cast<volatile Type *>(&destination) = value;
+    }
+
+private:
+    /**
+     * The mapped ring header.
+     */
+    zpp_hypercall_ring_header * m_header{};
+
+    /**
+     * The mapped ring requests.
+     */
+    zpp_hypercall_request * m_requests{};
+
+    /**
+     * The validated ring capacity.
+     */
+    std::uint64_t m_capacity{};
+
+    /**
+     * The size of the ring memory.
+     */
+    std::uint64_t m_size{};
+
+    /**
+     * The number of processed requests, owned by the hypervisor.
+     */
+    std::uint64_t m_tail{};
+};
+
+} // namespace zpp::hypervisor
@@ -1,15 +1,32 @@
 #pragma once
+#include "zpp/hypervisor/binary_log.h"
+#include "zpp/hypervisor/cpuid_table.h"
+#include "zpp/hypervisor/dirty_bitmap.h"
+#include "zpp/hypervisor/ept_pool.h"
+#include "zpp/hypervisor/ept_protection_map.h"
+#include "zpp/hypervisor/exit_handler.h"
+#include "zpp/hypervisor/exit_statistics.h"
+#include "zpp/hypervisor/guest_profiler.h"
+#include "zpp/hypervisor/hypercall_abi.h"
+#include "zpp/hypervisor/hypercall_ring.h"
+#include "zpp/hypervisor/mtf_tracer.h"
+#include "zpp/hypervisor/msr_dispatcher.h"
+#include "zpp/hypervisor/msr_shadow_store.h"
+#include "zpp/hypervisor/per_cpu.h"
 #include "zpp/maybe.h"
-#include "zpp/small_map.h"
 #include "zpp/x64/context.h"
 #include "zpp/x64/generic.h"
 #include "zpp/x64/intel/ept.h"
+#include "zpp/x64/intel/local_apic.h"
+#include "zpp/x64/intel/msr_area.h"
 #include "zpp/x64/intel/msr.h"
-#include "zpp/x64/intel/mtrr.h"
+#include "zpp/x64/intel/mtrr_map.h"
 #include "zpp/x64/intel/vmcs.h"
+#include "zpp/x64/intel/vmcs_template.h"
 #include "zpp/x64/intel/vmx.h"
 #include "zpp/x64/os_page_table.h"
 #include "zpp/x64/page_table.h"
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 
@@ -29,27 +46,27 @@ public:
         vmptrld_failed = 3,
         physical_to_virtual_capacity_error = 4,
         out_of_ept_entries = 5,
+        invalid_cpu = 6,
+        out_of_page_tables = 8,
+        allocation_failed = 9,
+        apic_disabled = 10,
     };
 
-    /**
-     * Maximum number of CPUs supported.
-     */
-    static constexpr std::size_t max_cpus = 16;
-
     /**
      * Page size.
      */
     static constexpr std::size_t page_size = 0x1000;
 
     /**
-     * Maximum module size in bytes.
+     * The interrupt enable flag of the RFLAGS register.
      */
-    static constexpr std::size_t max_module_size =
-        50 * 1024 * 1024; // 50 MB.
+    static constexpr std::uint64_t interrupt_enable_flag = 1ull << 9;
 
     /**
      * Launch the hypervisor on a the current CPU, caller must make
-     * sure the context switch to another CPU cannot occur.
+     * sure the context switch to another CPU cannot occur. The first CPU
+     * must finish launching before any other CPU launches, after which
+     * the other CPUs may launch concurrently.
      * The caller context parameter must contain a context where the OS can
      * continue execution. The caller context must contain a zero based CPU
      * identifier in the range [0, num_cpus) in caller_context.rdi. The
@@ -59,16 +76,67 @@ public:
      * this function will be called only during the initialization phase of
      * the hypervisor, after this function returns there shall be no more
      * calls to the function.
+     * The caller context must contain the number of CPUs in
+     * caller_context.rdx, and a function that allocates non paged memory
+     * in caller_context.rcx, which the first CPU calls to allocate the
+     * state of all CPUs and the hardware page tables, with interrupts
+     * enabled and before any other CPU launches. The allocated memory
+     * must be page aligned and is never freed. The CPU identifier must be
+     * below the number of CPUs.
      * On failure this function will restore the context with an error code
      * at caller_context.rax.
      */
     void launch_on_cpu(x64::context & caller_context);
 
+    /**
+     * Copies up to count profiler samples of the given CPU, starting at
+     * the given position, see guest_profiler::read. Returns the number of
+     * copied samples, zero if the CPU identifier is out of range.
+     */
+    std::size_t profiler_samples(std::size_t cpuid,
+                                 std::uint64_t & position,
+                                 guest_profiler::sample * samples,
+                                 std::size_t count) const;
+
+    /**
+     * Copies up to count log records of the given CPU, starting at the
+     * given position, see binary_log::read. Returns the number of copied
+     * records, zero if the CPU identifier is out of range.
+     */
+    std::size_t log_records(std::size_t cpuid,
+                            std::uint64_t & position,
+                            binary_log::record * records,
+                            std::size_t count) const;
+
+    /**
+     * The VM control structure template type.
+     */
+    using vmcs_template_type = x64::intel::vmcs_template<32>;
+
+    /**
+     * Returns the VM control structure template, the fields written
+     * identically on every CPU before the per CPU fields.
+     */
+    const vmcs_template_type & vmcs_template() const
+    {
+        return this->shared_vmcs;
+    }
+
+    /**
+     * Copies a consistent snapshot of the exit statistics of the given
+     * CPU, without locks and while all CPUs keep running. Returns false
+     * if the CPU identifier is out of range.
+     */
+    bool
+    exit_statistics_snapshot(std::size_t cpuid,
+                             exit_statistics::snapshot & snapshot) const;
+
 private:
     /**
-     * Capture important registers for later use of the hypervisor.
+     * Capture important registers of the given CPU for later use of the
+     * hypervisor.
      */
-    void initialize_registers();
+    void initialize_registers(per_cpu & cpu);
 
     /**
      * Find the module base and size.
@@ -76,21 +144,16 @@ private:
     void initialize_module_region();
 
     /**
-     * Initialize the OS page table object, allowing
+     * Initialize the OS page table object of the given CR3, allowing
      * to translate virtual addresses to physical addresses.
      */
-    void initialize_os_page_table();
+    void initialize_os_page_table(std::uint64_t cr3);
 
     /**
      * Initialize the host page table object, which is the page
      * table that is used once all module is mapped to it.
      */
-    void initialize_host_page_table();
-
-    /**
-     * Create physical to virtual mapping for our module.
-     */
-    zpp::error initialize_module_physical_to_virtual();
+    zpp::error initialize_host_page_table(const per_cpu & cpu);
 
     /**
      * Create the host GDT structures that will be used in the hypervisor.
@@ -107,17 +170,17 @@ private:
      * when switching to host page table, but before we launch
      * our VMM and guest.
      */
-    void initialize_intermediate_gdt();
+    void initialize_intermediate_gdt(per_cpu & cpu);
 
     /**
      * Load the intermediate GDT.
      */
-    void load_intermediate_gdt();
+    void load_intermediate_gdt(per_cpu & cpu);
 
     /**
      * Load the OS GDT.
      */
-    void load_os_gdt();
+    void load_os_gdt(per_cpu & cpu);
 
     /**
      * Initialize important VMX MSR registers and structures.
@@ -130,20 +193,182 @@ private:
     std::uint64_t & cached_vmx_msr(std::size_t msr);
 
     /**
-     * Initialize MTRR structures to be used when initializing
-     * the hardware page tables.
+     * Read the physical address width that the hardware page tables
+     * map.
+     */
+    void initialize_physical_address_width();
+
+    /**
+     * Compile the MTRRs into the memory types to be used when
+     * initializing the hardware page tables.
      */
     void initialize_mtrrs();
 
     /**
      * Initialize hardware page table structures.
      */
-    void initialize_ept();
+    zpp::error initialize_ept();
+
+    /**
+     * Initialize guest dirty page tracking, if the processor supports the
+     * hardware page table accessed and dirty bits and the page
+     * modification log, allocating the dirty bitmap.
+     */
+    zpp::error initialize_dirty_tracking();
+
+    /**
+     * Grow the hardware page table pool with the loader allocation
+     * function, if still available. Returns false on failure.
+     */
+    bool grow_ept_pool();
+
+    /**
+     * Allocate a zeroed hardware page table and its physical address,
+     * growing the table pool while the loader allocation function is
+     * available. Returns nullptr on failure.
+     */
+    x64::intel::epte *
+    allocate_ept_table(std::uint64_t & physical_address);
+
+    /**
+     * Split the given large hardware page table entry, that maps a page
+     * of the given size, into a table that maps the page with pages of a
+     * 512th of its size, each with the access that the protection map
+     * allows. Returns false if out of tables.
+     */
+    bool split_ept_entry(x64::intel::epte & entry, std::uint64_t size);
+
+    /**
+     * Set the guest access of the page of the given guest physical
+     * address. A page that is mapped with a large page is recorded in the
+     * protection map and the large page is given the access that all of
+     * its pages allow, the large page is split only if the map is full.
+     * After the launch, use an ept_batch.
+     */
+    zpp::error set_ept_access(std::uint64_t physical_address,
+                              unsigned access);
+
+    /**
+     * Protect the given hypervisor memory from guest access, must be
+     * called before any CPU runs the guest, after which access is changed
+     * with an ept_batch.
+     */
+    zpp::error protect_memory(const void * base, std::size_t size);
 
     /**
-     * Prepare module protection from guest access.
+     * Protect the module, the CPU memory and the hardware page tables
+     * from guest access, and allow access to the unprotected memory.
      */
-    zpp::error protect_module();
+    zpp::error protect_hypervisor_memory();
+
+    /**
+     * Returns the hardware page directory pointer table entry that maps
+     * the given guest physical address, or nullptr if the address is
+     * beyond the hardware page tables.
+     */
+    x64::intel::epte *
+    ept_directory_pointer_entry(std::uint64_t physical_address);
+
+    /**
+     * Returns the hardware page directory entry that maps the given guest
+     * physical address, or nullptr if the address is beyond the hardware
+     * page tables or mapped with a 1GB page.
+     */
+    x64::intel::epte * ept_directory_entry(std::uint64_t physical_address);
+
+    /**
+     * Returns the hardware page table entry that maps the given guest
+     * physical address with a 4KB page, or nullptr if the address is
+     * mapped with a large page, which is never protected.
+     */
+    x64::intel::epte * ept_entry(std::uint64_t physical_address);
+
+    /**
+     * Returns the hardware page table entry that maps the given guest
+     * physical address, whether a 1GB, 2MB or 4KB page, and its page
+     * size, or nullptr if the address is beyond the hardware page
+     * tables.
+     */
+    x64::intel::epte * ept_leaf_entry(std::uint64_t physical_address,
+                                      std::uint64_t & size);
+
+    /**
+     * Returns the guest access of the page of the given guest physical
+     * address, as set by set_ept_access.
+     */
+    unsigned ept_page_access(std::uint64_t physical_address);
+
+    /**
+     * Returns the access of the given hardware page table entry.
+     */
+    static unsigned ept_access(const x64::intel::epte & entry);
+
+    /**
+     * Set the access of the given hardware page table entry.
+     */
+    static void ept_access(x64::intel::epte & entry, unsigned access);
+
+    /**
+     * Invalidate the hardware page table translations of the current CPU,
+     * must be called in root mode.
+     */
+    void invalidate_ept();
+
+    /**
+     * If the given CPU, the current CPU, did not acknowledge the current
+     * hardware page table generation, invalidate its translations, drain
+     * its page modification log if it handles an exit, and acknowledge
+     * the generation, see ept_batch.
+     */
+    void acknowledge_ept(per_cpu & cpu);
+
+    /**
+     * Wait until every CPU has acknowledged the given hardware page table
+     * generation, sending an NMI to every CPU that did not, and again if
+     * it did not within the resend interval, as an NMI that arrives in
+     * root mode after the exit acknowledged is handled on the next exit.
+     * The current CPU acknowledges while waiting, as other CPUs may wait
+     * for it.
+     */
+    void wait_for_ept(std::uint64_t generation);
+
+    /**
+     * Count the NMIs that arrived since the last exit of the given CPU,
+     * the current CPU, those that were not sent for shootdowns are the
+     * guest's, and exit on an NMI window while any is pending injection,
+     * see nmi_window_exit.
+     */
+    void deliver_nmis(x64::intel::vmcs_exit_view & vmcs, per_cpu & cpu);
+
+    /**
+     * Move the guest physical pages logged in the page modification log
+     * of the given CPU, the current CPU, into the dirty bitmap and empty
+     * the log. A write to a large page is logged only when its dirty bit
+     * is set, so all of its pages are marked.
+     */
+    void drain_page_modification_log(x64::intel::vmcs_exit_view & vmcs,
+                                     std::size_t cpuid);
+
+    /**
+     * Read and clear the dirty bits of the pages from the given guest
+     * physical address, aligned to 64 pages and below the tracked limit,
+     * into the given words of 64 pages each, up to the given count or the
+     * tracked limit, see dirty_bitmap::exchange. The dirty bits of the
+     * hardware page table entries that map the dirty pages are cleared
+     * in a single batch, so that their next writes are logged again, and
+     * the function returns once every CPU has invalidated them. Returns
+     * the number of words read.
+     */
+    std::size_t read_dirty_pages(std::uint64_t physical_address,
+                                 std::uint64_t * words,
+                                 std::size_t count);
+
+    /**
+     * Make every CPU drain its page modification log, interrupting the
+     * other CPUs, so that the dirty bitmap holds every page logged before
+     * the synchronization, see wait_for_ept.
+     */
+    void synchronize_dirty_pages();
 
     /**
      * Remove protection for unprotected guest memory.
@@ -152,149 +377,412 @@ private:
     void unprotect_guest_memory();
 
     /**
-     * Initialize needed vmx structures.
+     * A batch of hardware page table edits made after the launch, which
+     * holds the hardware page table lock from its construction until it
+     * is committed, or destroyed, which commits it.
+     * The commit invalidates the translations of the current CPU once.
+     * If an edit removed access or other bits from an entry, the commit
+     * also advances the hardware page table generation, and interrupts
+     * every other CPU with an NMI, which exits and invalidates its
+     * translations, acknowledging the generation in its state. The commit
+     * returns once every CPU has acknowledged, see wait_for_ept.
+     */
+    class ept_batch
+    {
+    public:
+        /**
+         * Open a batch, taking the hardware page table lock.
+         */
+        explicit ept_batch(hypervisor & hypervisor);
+
+        /**
+         * Commit the batch, if not yet committed.
+         */
+        ~ept_batch();
+
+        /**
+         * Disable copy.
+         */
+        ept_batch(const ept_batch &) = delete;
+        ept_batch & operator=(const ept_batch &) = delete;
+
+        /**
+         * Set the guest access of the page of the given guest physical
+         * address, see set_ept_access.
+         */
+        zpp::error set_access(std::uint64_t physical_address,
+                              unsigned access);
+
+        /**
+         * Split the given large entry, see split_ept_entry.
+         */
+        bool split(x64::intel::epte & entry, std::uint64_t size);
+
+        /**
+         * Write the given value to the given entry.
+         */
+        void write(x64::intel::epte & entry, x64::intel::epte value);
+
+        /**
+         * Commit the batch and release the hardware page table lock, and
+         * wait until the edits take effect on every CPU. Returns the
+         * generation that every CPU acknowledged.
+         */
+        std::uint64_t commit();
+
+    private:
+        /**
+         * The hypervisor.
+         */
+        hypervisor & m_hypervisor;
+
+        /**
+         * Whether the batch was committed.
+         */
+        bool m_committed{};
+
+        /**
+         * Whether an entry was edited.
+         */
+        bool m_modified{};
+
+        /**
+         * Whether an edit requires the other CPUs to invalidate their
+         * translations.
+         */
+        bool m_shootdown{};
+    };
+
+    /**
+     * Initialize needed vmx structures of the given CPU.
+     */
+    void initialize_vmx(per_cpu & cpu);
+
+    /**
+     * Enter root mode on the given CPU, which is the current CPU.
      */
-    void initialize_vmx();
+    zpp::error enter_root_mode(per_cpu & cpu);
 
     /**
-     * Enter root mode on the current CPU.
+     * Build the VM control structure template, which holds the fields
+     * whose values are identical on every CPU, fails if a field does not
+     * fit the template.
      */
-    zpp::error enter_root_mode();
+    zpp::error initialize_vmcs_template();
 
     /**
-     * Setup the VM control structure according to the given guest context,
-     * and configured host fields.
+     * Setup the VM control structure of the given CPU according to the
+     * given guest context, and configured host fields.
      */
-    void setup_vmcs(x64::context & guest_context);
+    zpp::error setup_vmcs(per_cpu & cpu, x64::context & guest_context);
 
     /**
      * Configure the RIP and RSP fields of the VM control structure and
-     * launch the VM.
+     * launch the VM. On VM exit, the VMM code is called with the guest
+     * general purpose registers context, the guest floating point and
+     * SIMD state is left in the processor, see exit_handler.h.
      */
     template <typename VmmCode>
     void vm_launch(x64::context & guest_context, VmmCode && vmm_code);
 
     /**
-     * The main function of the hypervisor that will launch it
-     * on the current CPU. This function is already called with
-     * the hypervisor reserved stack.
+     * Dispatches a VM exit to its exit handler, see exit_dispatcher.h.
      */
-    zpp::error main(x64::context & caller_context);
+    exit_action dispatch_exit(const exit_information & information,
+                              x64::gpr_context & guest_context);
 
     /**
-     * Launches the main function of the hypervisor, updates the rax
-     * context value to the returned value from the main function, and
-     * restores the context to the caller context..
+     * VM exit handlers, see exit_dispatcher.h for the handler signature.
+     * @{
      */
-    static void launch_on_cpu_private_stack(hypervisor & hypervisor,
-                                            x64::context & caller_context);
 
     /**
-     * The current index of an available stack.
+     * Handles the cpuid instruction.
      */
-    std::size_t available_stack_index{};
+    struct cpuid_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * Stack storage for the hypervisor, each CPU has its own stack.
+     * Handles the xsetbv instruction.
      */
-    alignas(page_size) std::uint8_t stack[max_cpus][512 * 1024]{};
+    struct xsetbv_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * Convert physical address to virtual address for OS page tables,
-     * must be used only during initialization phase.
+     * Handles the invd instruction.
      */
-    std::uint64_t (*physical_to_virtual)(std::uint64_t){};
+    struct invd_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The OS page tables object, translating virtual addresses to
-     * physical addresses of the OS.
-     * Must be used only during initialization phase.
+     * Handles the vmcall instruction, see hypercall_abi.h.
      */
-    x64::os_page_table os_page_table{};
+    struct vmcall_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The host page tables object, which is assigned to the CPU in
-     * hypervisor mode. Also allows translating virtual addresses
-     * to physical addresses of the hypervisor module.
+     * Handles the rdmsr instruction, see msr_dispatcher.h.
      */
-    x64::page_table host_page_table{};
+    struct rdmsr_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The next virtual processor id that will be assigned
-     * to the VM control structures, starts at 1, and incremented
-     * on every launch of a VM on a specific processor.
+     * Handles the wrmsr instruction, see msr_dispatcher.h.
      */
-    std::size_t next_virtual_processor = 1;
+    struct wrmsr_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The base of the current module.
+     * Handles the VMX preemption timer, recording a profiler sample.
      */
-    const unsigned char * module_base{};
+    struct preemption_timer_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The size of the current module in bytes.
+     * Handles the monitor trap flag, recording a trace step.
      */
-    std::size_t module_size{};
+    struct monitor_trap_flag_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The guest CR0 register.
+     * Handles NMIs, which are counted as arrived in root mode, see
+     * deliver_nmis.
      */
-    std::uint64_t guest_cr0{};
+    struct nmi_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The guest CR3 register.
+     * Handles an NMI window, injecting a pending NMI of the guest.
      */
-    std::uint64_t guest_cr3{};
+    struct nmi_window_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The guest CR4 register.
+     * Handles hardware page table violations, splitting large pages on
+     * accesses that the protection map allows, and skipping accesses to
+     * protected memory.
      */
-    std::uint64_t guest_cr4{};
+    struct ept_violation_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The guest DR7 register.
+     * Handles a full page modification log, draining it into the dirty
+     * bitmap.
      */
-    std::uint64_t guest_dr7{};
+    struct page_modification_log_full_exit
+    {
+        exit_action operator()(hypervisor & hypervisor,
+                               const exit_information & information,
+                               x64::gpr_context & guest_context) const;
+    };
 
     /**
-     * The host CR0 register.
+     * @}
      */
-    std::uint64_t host_cr0{};
 
     /**
-     * The host CR3 register.
+     * MSR handlers, see msr_dispatcher.h for the handler signature.
+     * @{
      */
-    std::uint64_t host_cr3{};
 
     /**
-     * The host CR4 register.
+     * Virtualizes the feature control MSR, reporting VMX as disabled
+     * and locked.
+     */
+    struct feature_control_msr
+    {
+        msr_result read(hypervisor & hypervisor,
+                        const exit_information & information,
+                        std::uint64_t & value) const;
+
+        msr_result write(hypervisor & hypervisor,
+                         const exit_information & information,
+                         std::uint64_t value) const;
+    };
+
+    /**
+     * @}
+     */
+
+    /**
+     * Returns the MSR handlers table.
+     */
+    static const msr_dispatcher<hypervisor> & msr_handlers();
+
+    /**
+     * Build the MSR bitmap from the MSR handlers, so that only
+     * accesses that have a handler cause a VM exit.
+     */
+    void initialize_msr_bitmap();
+
+    /**
+     * Capture the initial shadow MSR values of the given CPU.
+     */
+    void initialize_msr_shadows(std::size_t cpuid);
+
+    /**
+     * Maps the guest physical pages of a hypercall ring into the
+     * hypercall window of the given CPU and attaches the ring of the CPU
+     * to it, returns a hypercall status.
+     */
+    std::int32_t register_hypercall_ring(std::size_t cpuid,
+                                         std::uint64_t physical_address,
+                                         std::uint64_t number_of_pages);
+
+    /**
+     * Processes a single hypercall ring request, drained on the CPU of
+     * the given exit.
+     */
+    void process_hypercall_request(const exit_information & information,
+                                   zpp_hypercall_request & request);
+
+    /**
+     * Sets or clears the monitor trap flag of the current CPU.
+     */
+    static void monitor_trap_flag(const exit_information & information,
+                                  bool enable);
+
+    /**
+     * Sets or clears the NMI window exiting of the current CPU.
+     */
+    static void nmi_window_exiting(x64::intel::vmcs_exit_view & vmcs,
+                                   bool enable);
+
+    /**
+     * If the given exit happened while an IRET unblocked NMIs, and the
+     * guest retries the instruction, block virtual NMIs again.
+     */
+    static void restore_nmi_blocking(const exit_information & information);
+
+    /**
+     * Allocates the state of the given number of CPUs with the given
+     * allocation function, see launch_on_cpu.
+     */
+    zpp::error allocate_cpus(std::size_t number_of_cpus,
+                             void * (*allocate)(std::size_t));
+
+    /**
+     * Allocate the state of all CPUs and build the hardware page tables
+     * that protect the hypervisor memory, performed by the first CPU
+     * before switching to its stack, see launch_on_cpu.
+     */
+    zpp::error initialize_memory(const x64::context & caller_context);
+
+    /**
+     * The main function of the hypervisor that will launch it
+     * on the current CPU. This function is already called with
+     * the hypervisor reserved stack.
+     */
+    zpp::error main(x64::context & caller_context);
+
+    /**
+     * Launches the main function of the hypervisor, updates the rax
+     * context value to the returned value from the main function, and
+     * restores the context to the caller context..
      */
-    std::uint64_t host_cr4{};
+    static void launch_on_cpu_private_stack(hypervisor & hypervisor,
+                                            x64::context & caller_context);
 
     /**
-     * The IDTR register.
+     * The number of CPUs, the per CPU members are arrays of this size
+     * carved out of the CPU memory, see allocate_cpus.
      */
-    x64::idtr idtr{};
+    std::size_t number_of_cpus{};
 
     /**
-     * The GDTR register.
+     * The memory of the per CPU members, allocated by the loader at
+     * launch.
      */
-    x64::gdtr gdtr{};
+    unsigned char * cpu_memory{};
 
     /**
-     * The LDTR register of the guest.
+     * The size of the CPU memory in bytes.
      */
-    std::uint16_t guest_ldtr{};
+    std::size_t cpu_memory_size{};
 
     /**
-     * The TR register of the guest.
+     * Stack storage for the hypervisor, each CPU has its own stack.
      */
-    std::uint16_t guest_tr{};
+    std::uint8_t (*stack)[512 * 1024]{};
 
     /**
-     * The TR register of the OS.
+     * Convert physical address to virtual address for OS page tables,
+     * must be used only during initialization phase.
      */
-    std::uint16_t os_tr{};
+    std::uint64_t (*physical_to_virtual)(std::uint64_t){};
+
+    /**
+     * The OS page tables object, translating virtual addresses to
+     * physical addresses of the OS.
+     * Must be used only during initialization phase.
+     */
+    x64::os_page_table os_page_table{};
+
+    /**
+     * The host page tables object, which is assigned to the CPU in
+     * hypervisor mode. Also allows translating virtual addresses
+     * to physical addresses of the hypervisor module.
+     */
+    x64::page_table host_page_table{};
+
+    /**
+     * The base of the current module.
+     */
+    const unsigned char * module_base{};
+
+    /**
+     * The size of the current module in bytes.
+     */
+    std::size_t module_size{};
+
+    /**
+     * The host CR3 register.
+     */
+    std::uint64_t host_cr3{};
 
     /**
      * The host code segment selector.
@@ -306,12 +794,6 @@ private:
      */
     std::uint16_t host_tr{};
 
-    /**
-     * Mapping of physical address to virtual address of the module.
-     */
-    small_map<std::uint64_t, std::uint64_t, max_module_size / page_size>
-        module_physical_to_virtual{};
-
     /**
      * The GDT that will be used by the host VMM.
      */
@@ -329,10 +811,11 @@ private:
     alignas(page_size) std::uint8_t fs_data[page_size]{};
 
     /**
-     * The data pointed to by the GS register to be used by
-     * the host VMM.
+     * The state of every CPU, pointed to by the host GS base of the CPU.
+     * The other per CPU members are arrays indexed by the CPU identifier
+     * whose elements are cache line aligned as well.
      */
-    alignas(page_size) std::uint8_t gs_data[page_size]{};
+    per_cpu * cpus{};
 
     /**
      * The task segment to be used by the host VMM.
@@ -340,11 +823,10 @@ private:
     alignas(0x10) std::uint32_t host_tss[26]{};
 
     /**
-     * Unprotected memory to be used by guest in UEFI boot.
-     * The size is a multiple of the alignment so the size is guaranteed to
-     * be a multiple of page size.
+     * Unprotected memory to be used by guest in UEFI boot, the page
+     * aligned end of the CPU memory.
      */
-    struct alignas(page_size) unprotected_memory
+    struct unprotected_memory
     {
         /**
          * The intermediate GDT to be loaded after page table switch
@@ -352,110 +834,228 @@ private:
          * Also to be reused in guest in case a new TSS needs to be
          * allocated in UEFI boot.
          */
-        alignas(0x10) std::uint64_t intermediate_gdt[max_cpus][0x2000]{};
+        std::uint64_t (*intermediate_gdt)[0x2000]{};
 
         /**
          * The task segment to be used by the guest in case no TSS.
          */
-        alignas(0x10) std::uint32_t guest_tss[max_cpus][26]{};
+        std::uint32_t (*guest_tss)[26]{};
+
+        /**
+         * The unprotected memory and its size in bytes, a multiple of
+         * page size.
+         */
+        unsigned char * base{};
+        std::size_t size{};
     } unprotected_memory;
 
     /**
-     * Assert that unprotected memory size is multiple of page size.
+     * Intel specific state.
+     * @{
      */
-    static_assert(!(sizeof(unprotected_memory) % page_size));
 
     /**
-     * A pointer to the guest GDT memory.
+     * Cache needed VMX MSRs.
      */
-    std::uint64_t * guest_gdt_pointer{};
+    std::uint64_t vmx_msrs[x64::intel::msr::vmx::size]{};
 
     /**
-     * The guest GDT limit.
+     * An object managing the currently assigned CPU VMCS.
      */
-    std::size_t guest_gdt_limit{};
+    x64::intel::vmcs vmcs{};
 
     /**
-     * The intermediate GDT limit.
+     * The memory types of the physical memory, according to the MTRRs.
      */
-    std::size_t intermediate_gdt_limit{};
+    x64::intel::mtrr_map memory_types;
 
     /**
-     * Intel specific state.
-     * @{
+     * The number of pages by which the hardware page table pool grows.
      */
+    static constexpr std::size_t ept_pool_growth = 512;
 
     /**
-     * The debug control register.
+     * The allocation function of the loader, available only while the
+     * first CPU initializes the memory, see initialize_memory.
      */
-    std::uint64_t ia32_debug_control{};
+    void * (*allocate)(std::size_t){};
 
     /**
-     * The FS data.
+     * The pool of the hardware page tables.
      */
-    std::uint64_t ia32_fs_base{};
+    ept_pool ept_tables;
 
     /**
-     * The GS data.
+     * The guest access of the pages that are mapped by large pages of the
+     * hardware page tables.
      */
-    std::uint64_t ia32_gs_base{};
+    ept_protection_map ept_protections;
 
     /**
-     * Cache needed VMX MSRs.
+     * Serializes changes of the hardware page tables after the
+     * initialization, see ept_batch.
      */
-    std::uint64_t vmx_msrs[x64::intel::msr::vmx::size]{};
+    std::atomic<bool> ept_lock{};
 
     /**
-     * An object managing the currently assigned CPU VMCS.
+     * The generation of the hardware page tables, advanced by every
+     * committed batch that requires the CPUs to invalidate their
+     * translations.
      */
-    x64::intel::vmcs vmcs{};
+    std::atomic<std::uint64_t> ept_generation{};
 
     /**
-     * The MTRR registers values.
+     * The TSC cycles after which a shootdown NMI is sent again to a CPU
+     * that did not acknowledge, see wait_for_ept.
      */
-    x64::intel::mtrr mtrrs[8];
+    static constexpr std::uint64_t shootdown_resend_cycles = 1ull << 20;
 
     /**
-     * The MTRR capabilities values.
+     * The local APIC, which sends the shootdown NMIs.
      */
-    x64::intel::mtrr_capabilities mtrr_capabilities;
+    x64::intel::local_apic local_apic;
 
     /**
-     * The hardware page table structures.
-     * @{
+     * The EPT pointer of the VM control structure, the context of the
+     * hardware page table invalidations.
      */
-    alignas(page_size) x64::intel::epte epml4[512];
-    alignas(page_size) x64::intel::epte epdpt[512];
-    alignas(page_size) x64::intel::epte epd[512][512];
-    alignas(page_size) x64::intel::epte ept[1024][512];
+    std::uint64_t eptp{};
+
     /**
-     * @}
+     * The maximum guest physical memory tracked for dirty pages, 64GB,
+     * with a 2MB dirty bitmap.
+     */
+    static constexpr std::uint64_t dirty_tracking_limit = 1ull << 36;
+
+    /**
+     * The number of entries of the page modification log.
+     */
+    static constexpr std::size_t pml_entries = 512;
+
+    /**
+     * Whether guest dirty pages are tracked, see
+     * initialize_dirty_tracking.
+     */
+    bool dirty_tracking{};
+
+    /**
+     * The dirty bitmap of the guest physical pages.
+     */
+    dirty_bitmap dirty_pages;
+
+    /**
+     * The memory of the dirty bitmap and its size in bytes.
+     */
+    void * dirty_pages_memory{};
+    std::size_t dirty_pages_memory_size{};
+
+    /**
+     * The number of physical address bits that the hardware page tables
+     * map.
      */
+    std::uint64_t physical_address_width{};
+
+    /**
+     * The hardware page table level 4, which has an epdpt for every
+     * 512GB of the physical address space.
+     */
+    x64::intel::epte * epml4{};
 
     /**
      * The VMX regions for every CPU.
      */
-    alignas(page_size) x64::intel::vmx_vmcs vmx[max_cpus];
+    x64::intel::vmx_vmcs * vmx{};
 
     /**
      * The VMCS regions for every CPU.
      */
-    alignas(page_size) x64::intel::vmx_vmcs vmx_vmcs[max_cpus];
+    x64::intel::vmx_vmcs * vmx_vmcs{};
 
     /**
-     * The MSR bitmap of the VM control structure.
+     * The VM control structure template shared by all CPUs.
      */
-    alignas(page_size) std::uint8_t msr_bitmap[page_size]{};
+    vmcs_template_type shared_vmcs;
+
+    /**
+     * The CPUID overrides applied to the CPUID results seen by the guest.
+     */
+    static constexpr cpuid_override cpuid_policy[] = {
+        // Set hypervisor present bit.
+        {0x1,
+         cpuid_override::any_subleaf,
+         {0, 0, 1u << 31, 0},
+         {0, 0, 1u << 31, 0}},
+
+        // HyperVisor Name: ZppZppZppZpp.
+        {0x40000000,
+         cpuid_override::any_subleaf,
+         {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+         {0x40000000, 0x5a70705a, 0x705a7070, 0x70705a70}},
+    };
+
+    /**
+     * The captured CPUID results of every CPU.
+     */
+    cpuid_table * cpuid_tables{};
+
+    /**
+     * The MSR areas of every CPU, switching MSRs that differ between the
+     * guest and the host on VM entry and VM exit. They are empty while
+     * the host only differs in MSRs that have VMCS host state fields.
+     */
+    x64::intel::msr_switch_area<16> * msr_switch{};
+
+    /**
+     * The shadow MSR values of every CPU.
+     */
+    msr_shadow_store * msr_shadows{};
+
+    /**
+     * The hypercall ring of every CPU.
+     */
+    hypercall_ring * hypercall_rings{};
+
+    /**
+     * The virtual memory of every CPU into which the guest hypercall ring
+     * is mapped, the pages are remapped to the ring guest physical pages.
+     */
+    std::uint8_t (*hypercall_window)[ZPP_HYPERCALL_RING_MAX_PAGES]
+                                    [page_size]{};
 
     /**
-     * The physical address of the current VMX region to be assigned.
+     * The instruction tracer of every CPU.
      */
-    std::uint64_t vmx_physical{};
+    mtf_tracer * tracers{};
 
     /**
-     * The physical address of the current VMCS region to be assigned.
+     * The page modification log of every CPU.
      */
-    std::uint64_t vmcs_physical{};
+    std::uint64_t (*pml_buffers)[pml_entries]{};
+
+    /**
+     * Whether the processor supports the profiler VM controls.
+     */
+    bool profiler_supported{};
+
+    /**
+     * The guest profiler of every CPU.
+     */
+    guest_profiler * profilers{};
+
+    /**
+     * The VM exit statistics of every CPU.
+     */
+    exit_statistics * statistics{};
+
+    /**
+     * The binary log of every CPU.
+     */
+    binary_log * logs{};
+
+    /**
+     * The MSR bitmap of the VM control structure.
+     */
+    alignas(page_size) std::uint8_t msr_bitmap[page_size]{};
 
     /**
      * The physical address of the hardware page table level 4.
@@ -493,6 +1093,14 @@ inline const zpp::error_category & category(hypervisor::error)
                 return "Physical to virtual capacity error";
             case hypervisor::error::out_of_ept_entries:
                 return "Out of EPT entries";
+            case hypervisor::error::invalid_cpu:
+                return "Invalid CPU identifier";
+            case hypervisor::error::out_of_page_tables:
+                return "Out of page tables";
+            case hypervisor::error::allocation_failed:
+                return "Allocation failed";
+            case hypervisor::error::apic_disabled:
+                return "Local APIC disabled";
             }
         });
     return error_category;
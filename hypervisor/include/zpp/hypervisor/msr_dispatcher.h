@@ -0,0 +1,276 @@
+#pragma once
+#include "zpp/hypervisor/exit_handler.h"
+#include "zpp/x64/intel/msr_bitmap.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace zpp::hypervisor
+{
+/**
+ * The result of an MSR handler.
+ */
+enum class msr_result
+{
+    /**
+     * The access completed.
+     */
+    success,
+
+    /**
+     * The access faults, the guest receives a general protection fault.
+     */
+    fault,
+};
+
+/**
+ * Registers an MSR handler type for an MSR, to be passed to the MSR
+ * dispatcher constructor.
+ */
+template <std::uint32_t Msr, typename Handler>
+struct on_msr
+{
+};
+
+/**
+ * A table of MSR handlers built at compile time from handler
+ * registrations, from which the MSR bitmap is built so that only
+ * accesses that have a handler cause a VM exit.
+ *
+ * MSR handlers are default constructible types with either or both of:
+ *
+ *     msr_result read(Context & context,
+ *                     const exit_information & information,
+ *                     std::uint64_t & value) const;
+ *
+ *     msr_result write(Context & context,
+ *                      const exit_information & information,
+ *                      std::uint64_t value) const;
+ *
+ * Accesses without a handler of MSRs that the bitmap does not cover
+ * always cause a VM exit, and fault.
+ */
+template <typename Context>
+class msr_dispatcher
+{
+public:
+    /**
+     * The maximum number of registered MSRs.
+     */
+    static constexpr std::size_t capacity = 32;
+
+    /**
+     * The type erased read handler.
+     */
+    using read_handler = msr_result (*)(Context &,
+                                        const exit_information &,
+                                        std::uint64_t &);
+
+    /**
+     * The type erased write handler.
+     */
+    using write_handler = msr_result (*)(Context &,
+                                         const exit_information &,
+                                         std::uint64_t);
+
+    /**
+     * Builds the table from the handler registrations, an MSR may be
+     * registered at most once.
+     */
+    template <typename... Registrations>
+    constexpr msr_dispatcher(Registrations... registrations)
+    {
+        static_assert(sizeof...(Registrations) <= capacity,
+                      "Too many MSR handlers.");
+
+        // Register the handlers.
+        (register_handler(registrations), ...);
+    }
+
+    /**
+     * Intercepts the accesses that have a handler in the given bitmap.
+     */
+    void build_bitmap(x64::intel::msr_bitmap & bitmap) const
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            auto & entry = m_entries[i];
+            if (entry.read) {
+                bitmap.intercept(entry.msr, x64::intel::msr_access::read);
+            }
+            if (entry.write) {
+                bitmap.intercept(entry.msr,
+                                 x64::intel::msr_access::write);
+            }
+        }
+    }
+
+    /**
+     * Dispatches an MSR read to its handler.
+     */
+    msr_result read(Context & context,
+                    const exit_information & information,
+                    std::uint32_t msr,
+                    std::uint64_t & value) const
+    {
+        auto entry = find(msr);
+        if (!entry || !entry->read) {
+            return msr_result::fault;
+        }
+        return entry->read(context, information, value);
+    }
+
+    /**
+     * Dispatches an MSR write to its handler.
+     */
+    msr_result write(Context & context,
+                     const exit_information & information,
+                     std::uint32_t msr,
+                     std::uint64_t value) const
+    {
+        auto entry = find(msr);
+        if (!entry || !entry->write) {
+            return msr_result::fault;
+        }
+        return entry->write(context, information, value);
+    }
+
+private:
+    /**
+     * A registered MSR.
+     */
+    struct entry
+    {
+        /**
+         * The MSR.
+         */
+        std::uint32_t msr{};
+
+        /**
+         * The read handler, or null if reads are not intercepted.
+         */
+        read_handler read{};
+
+        /**
+         * The write handler, or null if writes are not intercepted.
+         */
+        write_handler write{};
+    };
+
+    /**
+     * Returns the registered entry of an MSR, or null.
+     */
+    const entry * find(std::uint32_t msr) const
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_entries[i].msr == msr) {
+                return &m_entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Registers a handler for an MSR.
+     */
+    template <std::uint32_t Msr, typename Handler>
+    constexpr void register_handler(on_msr<Msr, Handler>)
+    {
+        static_assert(has_read<Handler>::value ||
+                          has_write<Handler>::value,
+                      "MSR handler must handle reads or writes.");
+
+        // Registering the same MSR twice is not a constant expression.
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_entries[i].msr == Msr) {
+                duplicate_registration();
+            }
+        }
+
+        // Register the handler.
+        auto & entry = m_entries[m_size++];
+        entry.msr = Msr;
+        if constexpr (has_read<Handler>::value) {
+            entry.read = invoke_read<Handler>;
+        }
+        if constexpr (has_write<Handler>::value) {
+            entry.write = invoke_write<Handler>;
+        }
+    }
+
+    /**
+     * Called on duplicate registration, intentionally not constexpr.
+     */
+    static void duplicate_registration();
+
+    /**
+     * Invokes the read handler.
+     */
+    template <typename Handler>
+    static msr_result invoke_read(Context & context,
+                                  const exit_information & information,
+                                  std::uint64_t & value)
+    {
+        return Handler{}.read(context, information, value);
+    }
+
+    /**
+     * Invokes the write handler.
+     */
+    template <typename Handler>
+    static msr_result invoke_write(Context & context,
+                                   const exit_information & information,
+                                   std::uint64_t value)
+    {
+        return Handler{}.write(context, information, value);
+    }
+
+    /**
+     * Determines whether the handler handles reads.
+     */
+    template <typename Handler, typename = void>
+    struct has_read : std::false_type
+    {
+    };
+
+    template <typename Handler>
+    struct has_read<
+        Handler,
+        std::void_t<decltype(std::declval<const Handler &>().read(
+            std::declval<Context &>(),
+            std::declval<const exit_information &>(),
+            std::declval<std::uint64_t &>()))>> : std::true_type
+    {
+    };
+
+    /**
+     * Determines whether the handler handles writes.
+     */
+    template <typename Handler, typename = void>
+    struct has_write : std::false_type
+    {
+    };
+
+    template <typename Handler>
+    struct has_write<
+        Handler,
+        std::void_t<decltype(std::declval<const Handler &>().write(
+            std::declval<Context &>(),
+            std::declval<const exit_information &>(),
+            std::declval<std::uint64_t>()))>> : std::true_type
+    {
+    };
+
+    /**
+     * The registered MSRs.
+     */
+    std::array<entry, capacity> m_entries{};
+
+    /**
+     * The number of registered MSRs.
+     */
+    std::size_t m_size{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,88 @@
+#pragma once
+#include "zpp/x64/intel/asm.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::hypervisor
+{
+/**
+ * The shadow values of virtualized MSRs of a single CPU, so that
+ * virtualized MSRs are served without accessing the hardware.
+ */
+class msr_shadow_store
+{
+public:
+    /**
+     * The maximum number of shadowed MSRs.
+     */
+    static constexpr std::size_t capacity = 16;
+
+    /**
+     * Construct an empty store.
+     */
+    msr_shadow_store() = default;
+
+    /**
+     * Shadow an MSR with the given initial value, returns false if
+     * the store is full.
+     */
+    bool shadow(std::uint32_t msr, std::uint64_t value)
+    {
+        // If already shadowed, update the value.
+        if (auto shadow_value = find(msr)) {
+            *shadow_value = value;
+            return true;
+        }
+
+        // If the store is full, fail.
+        if (capacity == m_size) {
+            return false;
+        }
+
+        // Add the MSR.
+        m_msrs[m_size] = msr;
+        m_values[m_size] = value;
+        ++m_size;
+        return true;
+    }
+
+    /**
+     * Shadow an MSR with its current hardware value, returns false if
+     * the store is full.
+     */
+    bool capture(std::uint32_t msr)
+    {
+        return shadow(msr, x64::intel::rdmsr(msr));
+    }
+
+    /**
+     * Returns the shadow value of an MSR, or null if not shadowed.
+     */
+    std::uint64_t * find(std::uint32_t msr)
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_msrs[i] == msr) {
+                return &m_values[i];
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    /**
+     * The shadowed MSRs.
+     */
+    std::uint32_t m_msrs[capacity]{};
+
+    /**
+     * The shadow values, in the order of the shadowed MSRs.
+     */
+    std::uint64_t m_values[capacity]{};
+
+    /**
+     * The number of shadowed MSRs.
+     */
+    std::size_t m_size{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,295 @@
+#pragma once
+#include "zpp/x64/context.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace zpp::hypervisor
+{
+/**
+ * An instruction tracer of a single CPU, single stepping the guest with
+ * the monitor trap flag. Every step whose guest RIP is within the traced
+ * range appends a record to a preallocated buffer, see hypercall_abi.h
+ * for the record encoding. The tracer stops itself after the step limit
+ * or when the buffer cannot hold another record, which bounds both the
+ * trace size and the trace overhead.
+ * Records are appended by the traced CPU only, and may be read by any
+ * CPU concurrently, as appended records never change until the next
+ * start.
+ */
+class mtf_tracer
+{
+public:
+    /**
+     * The number of general purpose registers that may be recorded, in
+     * the order of the general purpose register context.
+     */
+    static constexpr std::size_t max_registers = 16;
+
+    /**
+     * The maximum size of an encoded value.
+     */
+    static constexpr std::size_t max_value_size = 10;
+
+    /**
+     * The maximum size of a record, the RIP followed by every register.
+     */
+    static constexpr std::size_t max_record_size =
+        (1 + max_registers) * max_value_size;
+
+    /**
+     * The buffer size in bytes.
+     */
+    static constexpr std::size_t capacity = 0x10000;
+
+    /**
+     * Construct an inactive tracer.
+     */
+    mtf_tracer() = default;
+
+    /**
+     * Start tracing the guest RIP range [begin, end) for at most
+     * the given number of steps, recording the registers whose bits are
+     * set in the register mask. Returns false if the arguments are
+     * invalid, in which case the tracer is left inactive.
+     */
+    bool start(std::uint64_t begin,
+               std::uint64_t end,
+               std::uint64_t step_limit,
+               std::uint64_t register_mask)
+    {
+        // Stop a previous trace.
+        stop();
+
+        // Validate the arguments.
+        if (begin >= end || !step_limit ||
+            (register_mask >> max_registers)) {
+            return false;
+        }
+
+        // Reset the trace, values are encoded relative to zero at first.
+        m_size.store(0, std::memory_order_relaxed);
+        m_records.store(0, std::memory_order_relaxed);
+        m_begin = begin;
+        m_end = end;
+        m_steps_left = step_limit;
+        m_register_mask = std::uint16_t(register_mask);
+        m_last_rip = 0;
+        for (auto & value : m_last_registers) {
+            value = 0;
+        }
+
+        // Activate the tracer.
+        m_active.store(true, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Stop tracing, keeping the recorded trace.
+     */
+    void stop()
+    {
+        m_active.store(false, std::memory_order_release);
+    }
+
+    /**
+     * Returns true if tracing.
+     */
+    bool active() const
+    {
+        return m_active.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Process a single step at the given guest RIP, where the RSP of the
+     * register context is ignored in favor of the given guest RSP.
+     * Returns true if tracing continues, or false if the tracer stopped.
+     */
+    bool step(std::uint64_t rip,
+              const x64::gpr_context & registers,
+              std::uint64_t rsp)
+    {
+        // If stopped, do nothing.
+        if (!active()) {
+            return false;
+        }
+
+        // Record steps within the range.
+        if (rip >= m_begin && rip < m_end) {
+            auto size = m_size.load(std::memory_order_relaxed);
+
+            // Encode the RIP.
+            size = encode(size, rip - m_last_rip);
+            m_last_rip = rip;
+
+            // Encode the selected registers.
+            for (std::size_t i{}; i < max_registers; ++i) {
+                if (!(m_register_mask & (1u << i))) {
+                    continue;
+                }
+                auto value = (4 == i) ? rsp : registers.*m_registers[i];
+                size = encode(size, value - m_last_registers[i]);
+                m_last_registers[i] = value;
+            }
+
+            // Publish the record.
+            m_records.store(m_records.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+            m_size.store(size, std::memory_order_release);
+
+            // Stop if another record may not fit.
+            if (capacity - size < max_record_size) {
+                stop();
+                return false;
+            }
+        }
+
+        // Stop after the last step.
+        if (!--m_steps_left) {
+            stop();
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Returns the number of recorded bytes.
+     */
+    std::size_t size() const
+    {
+        return m_size.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Returns the number of records.
+     */
+    std::uint64_t records() const
+    {
+        return m_records.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Copy up to count recorded bytes starting at the given offset,
+     * returns the number of copied bytes.
+     */
+    std::size_t read(std::size_t offset,
+                     std::uint8_t * data,
+                     std::size_t count) const
+    {
+        auto size = this->size();
+
+        // Limit the count to the recorded bytes.
+        if (offset >= size) {
+            return 0;
+        }
+        if (count > size - offset) {
+            count = size - offset;
+        }
+
+        // Copy the bytes.
+        for (std::size_t i{}; i < count; ++i) {
+            data[i] = m_buffer[offset + i];
+        }
+        return count;
+    }
+
+private:
+    /**
+     * Encode a difference at the given offset as a zigzag LEB128 value,
+     * returns the offset past the encoded value.
+     */
+    std::size_t encode(std::size_t offset, std::uint64_t difference)
+    {
+        // Zigzag encode, so that small negative differences are small.
+        auto value = (difference << 1) ^
+                     std::uint64_t(std::int64_t(difference) >> 63);
+
+        // Write seven bits at a time, low bits first.
+        while (value >= 0x80) {
+            m_buffer[offset++] = std::uint8_t(value | 0x80);
+            value >>= 7;
+        }
+        m_buffer[offset++] = std::uint8_t(value);
+        return offset;
+    }
+
+private:
+    /**
+     * The recordable registers, in the order of the register mask bits.
+     */
+    static constexpr std::uint64_t x64::gpr_context::*m_registers[] = {
+        &x64::gpr_context::rax,
+        &x64::gpr_context::rbx,
+        &x64::gpr_context::rcx,
+        &x64::gpr_context::rdx,
+        &x64::gpr_context::rsp,
+        &x64::gpr_context::rbp,
+        &x64::gpr_context::rsi,
+        &x64::gpr_context::rdi,
+        &x64::gpr_context::r8,
+        &x64::gpr_context::r9,
+        &x64::gpr_context::r10,
+        &x64::gpr_context::r11,
+        &x64::gpr_context::r12,
+        &x64::gpr_context::r13,
+        &x64::gpr_context::r14,
+        &x64::gpr_context::r15,
+    };
+
+    static_assert(std::extent_v<decltype(m_registers)> == max_registers,
+                  "Every register must be recordable.");
+
+    /**
+     * Whether tracing.
+     */
+    std::atomic<bool> m_active{};
+
+    /**
+     * The number of recorded bytes.
+     */
+    std::atomic<std::size_t> m_size{};
+
+    /**
+     * The number of records.
+     */
+    std::atomic<std::uint64_t> m_records{};
+
+    /**
+     * The first traced RIP.
+     */
+    std::uint64_t m_begin{};
+
+    /**
+     * The end of the traced RIP range.
+     */
+    std::uint64_t m_end{};
+
+    /**
+     * The number of steps left before stopping.
+     */
+    std::uint64_t m_steps_left{};
+
+    /**
+     * The recorded registers mask.
+     */
+    std::uint16_t m_register_mask{};
+
+    /**
+     * The last recorded RIP.
+     */
+    std::uint64_t m_last_rip{};
+
+    /**
+     * The last recorded register values.
+     */
+    std::uint64_t m_last_registers[max_registers]{};
+
+    /**
+     * The records buffer.
+     */
+    std::uint8_t m_buffer[capacity]{};
+};
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,147 @@
+#pragma once
+#include "zpp/x64/asm.h"
+#include "zpp/x64/generic.h"
+#include "zpp/x64/intel/vmcs_exit_view.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::hypervisor
+{
+/**
+ * The state of a single CPU, captured and used while launching on the
+ * CPU and while handling its exits. Every CPU touches only its own
+ * state, which is cache line aligned so that CPUs do not share lines.
+ * In root mode the host GS base of the CPU points to its state, which
+ * starts with a pointer to itself, see current().
+ */
+struct alignas(64) per_cpu
+{
+    /**
+     * Returns the state of the current CPU, must be called in root mode.
+     */
+    static per_cpu & current()
+    {
+        return *reinterpret_cast<per_cpu *>(x64::read_gs_qword(0));
+    }
+
+    /**
+     * A pointer to this state, read through the host GS base.
+     */
+    per_cpu * self{};
+
+    /**
+     * The number of NMIs that arrived in root mode, counted by the host
+     * NMI entry through the host GS base, see x64::nmi_entry.
+     */
+    std::atomic<std::uint64_t> nmis{};
+
+    /**
+     * The zero based CPU identifier.
+     */
+    std::size_t cpuid{};
+
+    /**
+     * The virtual processor identifier of the VM control structure.
+     */
+    std::uint16_t virtual_processor{};
+
+    /**
+     * The physical addresses of the VMX and VMCS regions.
+     */
+    std::uint64_t vmx_physical{};
+    std::uint64_t vmcs_physical{};
+
+    /**
+     * The guest control and debug registers, captured at launch.
+     */
+    std::uint64_t guest_cr0{};
+    std::uint64_t guest_cr3{};
+    std::uint64_t guest_cr4{};
+    std::uint64_t guest_dr7{};
+
+    /**
+     * The host CR0 and CR4 registers, the guest registers adjusted to
+     * the VMX restrictions.
+     */
+    std::uint64_t host_cr0{};
+    std::uint64_t host_cr4{};
+
+    /**
+     * The debug control, FS base and GS base MSRs, captured at launch.
+     */
+    std::uint64_t ia32_debug_control{};
+    std::uint64_t ia32_fs_base{};
+    std::uint64_t ia32_gs_base{};
+
+    /**
+     * The OS descriptor table registers, captured at launch.
+     */
+    x64::gdtr gdtr{};
+    x64::idtr idtr{};
+
+    /**
+     * The LDTR and TR registers of the guest.
+     */
+    std::uint16_t guest_ldtr{};
+    std::uint16_t guest_tr{};
+
+    /**
+     * The TR register of the OS.
+     */
+    std::uint16_t os_tr{};
+
+    /**
+     * A pointer to the guest GDT memory, and the guest GDT limit.
+     */
+    std::uint64_t * guest_gdt_pointer{};
+    std::size_t guest_gdt_limit{};
+
+    /**
+     * The intermediate GDT limit.
+     */
+    std::size_t intermediate_gdt_limit{};
+
+    /**
+     * The APIC identifier, to which shootdown NMIs are sent.
+     */
+    std::uint32_t apic_id{};
+
+    /**
+     * The hardware page table generation whose translations this CPU
+     * has invalidated, see hypervisor::ept_batch. All ones until the
+     * first exit, so that no CPU waits for a CPU that cannot be
+     * interrupted yet.
+     */
+    std::atomic<std::uint64_t> ept_generation = ~std::uint64_t{};
+
+    /**
+     * The number of NMIs sent to this CPU for shootdowns and not yet
+     * counted as arrived, which are not delivered to the guest.
+     */
+    std::atomic<std::uint64_t> shootdown_nmis{};
+
+    /**
+     * The number of NMIs of the guest that are pending injection.
+     */
+    std::uint64_t guest_nmis{};
+
+    /**
+     * Whether the guest exits on an NMI window, which the VMCS template
+     * enables so that the first exit happens at launch.
+     */
+    bool nmi_window = true;
+
+    /**
+     * The VMCS view of the exit that this CPU handles, null in the guest.
+     */
+    x64::intel::vmcs_exit_view * exit_vmcs{};
+};
+
+static_assert(0 == offsetof(per_cpu, self),
+              "The self pointer must be first.");
+
+static_assert(8 == offsetof(per_cpu, nmis),
+              "The NMI count must be at the offset of the NMI entry.");
+
+} // namespace zpp::hypervisor
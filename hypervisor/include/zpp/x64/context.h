@@ -56,4 +56,56 @@ struct alignas(0x10) context
 
 static_assert(sizeof(context) == 0x3a0, "Context size mismatch.");
 
+/**
+ * Represents the general purpose register state of the processor
+ * execution context, without the floating point and SIMD state.
+ * Used by paths that do not touch the floating point and SIMD state,
+ * such as the VM exit path, where saving and restoring the full context
+ * dominates the cost.
+ */
+struct alignas(0x10) gpr_context
+{
+    // register - offset
+    std::uint64_t rax{};    // 0x00
+    std::uint64_t rbx{};    // 0x08
+    std::uint64_t rcx{};    // 0x10
+    std::uint64_t rdx{};    // 0x18
+    std::uint64_t rsp{};    // 0x20
+    std::uint64_t rbp{};    // 0x28
+    std::uint64_t rsi{};    // 0x30
+    std::uint64_t rdi{};    // 0x38
+    std::uint64_t r8{};     // 0x40
+    std::uint64_t r9{};     // 0x48
+    std::uint64_t r10{};    // 0x50
+    std::uint64_t r11{};    // 0x58
+    std::uint64_t r12{};    // 0x60
+    std::uint64_t r13{};    // 0x68
+    std::uint64_t r14{};    // 0x70
+    std::uint64_t r15{};    // 0x78
+    std::uint64_t rip{};    // 0x80
+    std::uint64_t rflags{}; // 0x88
+    std::uint16_t cs{};     // 0x90
+    std::uint16_t ds{};     // 0x92
+    std::uint16_t es{};     // 0x94
+    std::uint16_t fs{};     // 0x96
+    std::uint16_t gs{};     // 0x98
+    std::uint16_t ss{};     // 0x9a
+    // size: 0xa0
+};
+
+static_assert(sizeof(gpr_context) == 0xa0, "GPR context size mismatch.");
+
+/**
+ * Represents the floating point and SIMD state of the processor, in
+ * the 64 bit fxsave format, which includes xmm0-xmm15 and mxcsr.
+ */
+struct alignas(0x10) extended_state
+{
+    std::uint8_t fxsave[0x200]{}; // 0x00
+    // size: 0x200
+};
+
+static_assert(sizeof(extended_state) == 0x200,
+              "Extended state size mismatch.");
+
 } // namespace zpp::x64
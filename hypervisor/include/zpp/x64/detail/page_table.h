@@ -19,7 +19,7 @@ constexpr bool operator&(page_table::protection left,
 }
 
 template <typename PageTable>
-void page_table::map_page_from(std::uint64_t address,
+bool page_table::map_page_from(std::uint64_t address,
                                std::uint64_t physical_address,
                                protection protection,
                                PageTable && other_page_table)
@@ -27,38 +27,43 @@ void page_table::map_page_from(std::uint64_t address,
     // Parse the virtual address.
     auto address_structure = virtual_address(address);
 
-    // The pml4e entry inside the pml4 table.
-    auto & pml4e = pml4[address_structure.pml4e()];
+    // Assign a page directory pointer table to the pml4e.
+    auto & pdpt_index = pdpt_indices[address_structure.pml4e()];
+    if (!assign_table(pdpt_index, pdpt_count, max_pdpts)) {
+        return false;
+    }
+    auto & pdpt = pdpts[pdpt_index - 1];
 
-    // Map to the single page directory pointer table that we have.
+    // Map the pml4e to the page directory pointer table, make present
+    // and writable.
+    auto & pml4e = pml4[address_structure.pml4e()];
     pml4e.page_number(other_page_table.virtual_to_physical(pdpt) >> 12);
-
-    // Mark pml4e as present and writable.
     pml4e.write(true);
     pml4e.present(true);
 
-    // Fetch the page directory pointer table entry.
-    auto & pdpte = pdpt[address_structure.pdpte()];
-
-    // Fetch the page directory according to how many page directories we
-    // have.
-    auto pd_index =
-        address_structure.pdpte() /
-        (std::extent_v<decltype(pdpt)> / std::extent_v<decltype(pds)>);
-    auto & pd = pds[pd_index];
+    // Assign a page directory to the pdpte.
+    auto & pd_index =
+        pd_indices[pdpt_index - 1][address_structure.pdpte()];
+    if (!assign_table(pd_index, pd_count, max_pds)) {
+        return false;
+    }
+    auto & pd = pds[pd_index - 1];
 
-    // Map to the page directory, make present and writable.
+    // Map the pdpte to the page directory, make present and writable.
+    auto & pdpte = pdpt[address_structure.pdpte()];
     pdpte.page_number(other_page_table.virtual_to_physical(pd) >> 12);
     pdpte.write(true);
     pdpte.present(true);
 
-    // Fetch the page directory entry.
-    auto & pde = pd[address_structure.pde()];
-
-    // Fetch the page table according to how many page tables we have.
-    auto & pt = pts[pd_index][address_structure.pde()];
+    // Assign a page table to the pde.
+    auto & pt_index = pt_indices[pd_index - 1][address_structure.pde()];
+    if (!assign_table(pt_index, pt_count, max_pts)) {
+        return false;
+    }
+    auto & pt = pts[pt_index - 1];
 
-    // Map to the page table, make present and writable.
+    // Map the pde to the page table, make present and writable.
+    auto & pde = pd[address_structure.pde()];
     pde.page_number(other_page_table.virtual_to_physical(pt) >> 12);
     pde.write(true);
     pde.present(true);
@@ -71,10 +76,11 @@ void page_table::map_page_from(std::uint64_t address,
     pte.write(protection & page_table::protection::write);
     pte.execute_disable(!(protection & page_table::protection::execute));
     pte.present(true);
+    return true;
 }
 
 template <typename PageTable>
-void page_table::map_from(std::uint64_t base_address,
+bool page_table::map_from(std::uint64_t base_address,
                           std::size_t size,
                           protection protection,
                           PageTable && other_page_table)
@@ -92,12 +98,16 @@ void page_table::map_from(std::uint64_t base_address,
             other_page_table.virtual_to_physical(address);
 
         // Map the page.
-        map_page(address, physical_address, protection);
+        if (!map_page(address, physical_address, protection)) {
+            return false;
+        }
     }
+
+    return true;
 }
 
 template <typename PageTable>
-void page_table::map_from(const void * base_address,
+bool page_table::map_from(const void * base_address,
                           std::size_t size,
                           protection protection,
                           PageTable && other_page_table)
@@ -110,7 +120,7 @@ void page_table::map_from(const void * base_address,
 }
 
 template <typename PageTable>
-void page_table::self_map_from(std::uint64_t base_address,
+bool page_table::self_map_from(std::uint64_t base_address,
                                std::size_t size,
                                protection protection,
                                PageTable && other_page_table)
@@ -128,13 +138,17 @@ void page_table::self_map_from(std::uint64_t base_address,
             other_page_table.virtual_to_physical(address);
 
         // Map the page from the other page table.
-        map_page_from(
-            address, physical_address, protection, other_page_table);
+        if (!map_page_from(
+                address, physical_address, protection, other_page_table)) {
+            return false;
+        }
     }
+
+    return true;
 }
 
 template <typename PageTable>
-void page_table::self_map_from(const void * base_address,
+bool page_table::self_map_from(const void * base_address,
                                std::size_t size,
                                protection protection,
                                PageTable && other_page_table)
@@ -147,31 +161,37 @@ void page_table::self_map_from(const void * base_address,
 }
 
 template <typename PageTable>
-void page_table::map_self(PageTable && other_page_table)
+bool page_table::map_self(PageTable && other_page_table)
 {
     // Map the pml4 from other page table.
-    self_map_from(pml4,
-                  sizeof(pml4),
-                  protection::read | protection::write,
-                  std::forward<PageTable>(other_page_table));
-
-    // Map the pdpt from other page table.
-    self_map_from(pdpt,
-                  sizeof(pdpt),
-                  protection::read | protection::write,
-                  std::forward<PageTable>(other_page_table));
-
-    // Map the pd from other page table.
-    self_map_from(pds,
-                  sizeof(pds),
-                  protection::read | protection::write,
-                  std::forward<PageTable>(other_page_table));
-
-    // Map the pt from other page table.
-    self_map_from(pts,
-                  sizeof(pts),
-                  protection::read | protection::write,
-                  std::forward<PageTable>(other_page_table));
+    if (!self_map_from(pml4,
+                       sizeof(pml4),
+                       protection::read | protection::write,
+                       other_page_table)) {
+        return false;
+    }
+
+    // Map the pdpts from other page table.
+    if (!self_map_from(pdpts,
+                       sizeof(pdpts),
+                       protection::read | protection::write,
+                       other_page_table)) {
+        return false;
+    }
+
+    // Map the pds from other page table.
+    if (!self_map_from(pds,
+                       sizeof(pds),
+                       protection::read | protection::write,
+                       other_page_table)) {
+        return false;
+    }
+
+    // Map the pts from other page table.
+    return self_map_from(pts,
+                         sizeof(pts),
+                         protection::read | protection::write,
+                         std::forward<PageTable>(other_page_table));
 }
 
 } // namespace zpp::x64
@@ -0,0 +1,235 @@
+#pragma once
+#include "zpp/x64/context.h"
+#include "zpp/x64/hosted/cpu.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace zpp::x64
+{
+inline std::uint64_t cr0()
+{
+    return hosted::current().cr0;
+}
+
+inline std::uint64_t cr3()
+{
+    return hosted::current().cr3;
+}
+
+inline std::uint64_t cr4()
+{
+    return hosted::current().cr4;
+}
+
+inline std::uint64_t cr0(std::uint64_t value)
+{
+    return hosted::current().cr0 = value;
+}
+
+inline std::uint64_t cr3(std::uint64_t value)
+{
+    return hosted::current().cr3 = value;
+}
+
+inline std::uint64_t cr4(std::uint64_t value)
+{
+    return hosted::current().cr4 = value;
+}
+
+inline void invlpg(const void *)
+{
+    // There is no simulated TLB.
+}
+
+inline void sgdt(void * operand)
+{
+    auto & cpu = hosted::current();
+    std::memcpy(operand, &cpu.gdtr_limit, sizeof(cpu.gdtr_limit));
+    std::memcpy(static_cast<std::uint8_t *>(operand) +
+                    sizeof(cpu.gdtr_limit),
+                &cpu.gdtr_base,
+                sizeof(cpu.gdtr_base));
+}
+
+inline void sidt(void * operand)
+{
+    auto & cpu = hosted::current();
+    std::memcpy(operand, &cpu.idtr_limit, sizeof(cpu.idtr_limit));
+    std::memcpy(static_cast<std::uint8_t *>(operand) +
+                    sizeof(cpu.idtr_limit),
+                &cpu.idtr_base,
+                sizeof(cpu.idtr_base));
+}
+
+inline void lgdt(void * operand)
+{
+    auto & cpu = hosted::current();
+    std::memcpy(&cpu.gdtr_limit, operand, sizeof(cpu.gdtr_limit));
+    std::memcpy(&cpu.gdtr_base,
+                static_cast<std::uint8_t *>(operand) +
+                    sizeof(cpu.gdtr_limit),
+                sizeof(cpu.gdtr_base));
+}
+
+inline void lidt(void * operand)
+{
+    auto & cpu = hosted::current();
+    std::memcpy(&cpu.idtr_limit, operand, sizeof(cpu.idtr_limit));
+    std::memcpy(&cpu.idtr_base,
+                static_cast<std::uint8_t *>(operand) +
+                    sizeof(cpu.idtr_limit),
+                sizeof(cpu.idtr_base));
+}
+
+inline void sldt(void * selector)
+{
+    std::memcpy(selector, &hosted::current().ldtr, sizeof(std::uint16_t));
+}
+
+inline void str(void * selector)
+{
+    std::memcpy(selector, &hosted::current().tr, sizeof(std::uint16_t));
+}
+
+inline void ltr(void * selector)
+{
+    std::memcpy(&hosted::current().tr, selector, sizeof(std::uint16_t));
+}
+
+inline std::uint64_t dr7()
+{
+    return hosted::current().dr7;
+}
+
+inline std::uint64_t read_gs_qword(std::uintptr_t offset)
+{
+    std::uint64_t value{};
+    std::memcpy(&value,
+                reinterpret_cast<const void *>(hosted::current().gs_base +
+                                               offset),
+                sizeof(value));
+    return value;
+}
+
+inline void disable_interrupts()
+{
+    hosted::current().interrupts_enabled = false;
+}
+
+inline void enable_interrupts()
+{
+    hosted::current().interrupts_enabled = true;
+}
+
+inline void halt()
+{
+    // A halt never resumes, as there are no simulated interrupts.
+    std::abort();
+}
+
+/**
+ * Restores the context like the native restore, except that the segment
+ * selectors of the process are kept, as a user space process cannot
+ * load the selectors of the hypervisor.
+ */
+inline void __attribute__((naked)) restore_context(const x64::context *)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        mov rax, rdi // The context parameter.
+        mov rbx, [rax+0x8] // context->rbx.
+        mov rdx, [rax+0x18] // context->rdx.
+        mov rbp, [rax+0x28] // context->rbp.
+        mov rsi, [rax+0x30] // context->rsi.
+        mov rdi, [rax+0x38] // context->rdi.
+        mov r8, [rax+0x40] // context->r8.
+        mov r9, [rax+0x48] // context->r9.
+        mov r10, [rax+0x50] // context->r10.
+        mov r11, [rax+0x58] // context->r11.
+        mov r12, [rax+0x60] // context->r12.
+        mov r13, [rax+0x68] // context->r13.
+        mov r14, [rax+0x70] // context->r14.
+        mov r15, [rax+0x78] // context->r15.
+        ldmxcsr [rax+0x390] // context->mxcsr.
+        fxrstor [rax+0x190] // context->fxsave.
+        movdqa xmm0, [rax+0x90] // context->xmm0.
+        movdqa xmm1, [rax+0xa0] // context->xmm1.
+        movdqa xmm2, [rax+0xb0] // context->xmm2.
+        movdqa xmm3, [rax+0xc0] // context->xmm3.
+        movdqa xmm4, [rax+0xd0] // context->xmm4.
+        movdqa xmm5, [rax+0xe0] // context->xmm5.
+        movdqa xmm6, [rax+0xf0] // context->xmm6.
+        movdqa xmm7, [rax+0x100] // context->xmm7.
+        movdqa xmm8, [rax+0x110] // context->xmm8.
+        movdqa xmm9, [rax+0x120] // context->xmm9.
+        movdqa xmm10, [rax+0x130] // context->xmm10.
+        movdqa xmm11, [rax+0x140] // context->xmm11.
+        movdqa xmm12, [rax+0x150] // context->xmm12.
+        movdqa xmm13, [rax+0x160] // context->xmm13.
+        movdqa xmm14, [rax+0x170] // context->xmm14.
+        movdqa xmm15, [rax+0x180] // context->xmm15.
+        mov cx, ss // Keep the current stack segment.
+        sub rsp, 0x6 // Align stack for stack segment.
+        push cx // Push the stack segment.
+        mov rcx, [rax+0x20] // Load context->rsp into rcx.
+        push rcx // Push context->rsp.
+        mov rcx, [rax+0x88] // Load context->rflags into rcx.
+        push rcx // Push context->rflags.
+        mov cx, cs // Keep the current code segment.
+        sub rsp, 0x6 // Align stack for code segment.
+        push cx // Push the code segment.
+        mov rcx, [rax+0x80] // Load context->rip into rcx.
+        push rcx // Push context->rip as return address.
+        mov rcx, [rax] // Load context->rax into rcx.
+        push rcx // Push context->rax.
+        mov rcx, [rax+0x10] // Load context->rcx.
+        pop rax // Pop context->rax.
+        iretq // Pop ss, context->rsp, context->rflags, cs, context->rip.
+    )!!");
+}
+
+/**
+ * Restores the context like the native restore, except that the segment
+ * selectors of the process are kept, see restore_context().
+ */
+inline void __attribute__((naked))
+restore_gpr_context(const x64::gpr_context *)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        mov rax, rdi // The context parameter.
+        mov rbx, [rax+0x8] // context->rbx.
+        mov rdx, [rax+0x18] // context->rdx.
+        mov rbp, [rax+0x28] // context->rbp.
+        mov rsi, [rax+0x30] // context->rsi.
+        mov rdi, [rax+0x38] // context->rdi.
+        mov r8, [rax+0x40] // context->r8.
+        mov r9, [rax+0x48] // context->r9.
+        mov r10, [rax+0x50] // context->r10.
+        mov r11, [rax+0x58] // context->r11.
+        mov r12, [rax+0x60] // context->r12.
+        mov r13, [rax+0x68] // context->r13.
+        mov r14, [rax+0x70] // context->r14.
+        mov r15, [rax+0x78] // context->r15.
+        mov cx, ss // Keep the current stack segment.
+        sub rsp, 0x6 // Align stack for stack segment.
+        push cx // Push the stack segment.
+        mov rcx, [rax+0x20] // Load context->rsp into rcx.
+        push rcx // Push context->rsp.
+        mov rcx, [rax+0x88] // Load context->rflags into rcx.
+        push rcx // Push context->rflags.
+        mov cx, cs // Keep the current code segment.
+        sub rsp, 0x6 // Align stack for code segment.
+        push cx // Push the code segment.
+        mov rcx, [rax+0x80] // Load context->rip into rcx.
+        push rcx // Push context->rip as return address.
+        mov rcx, [rax] // Load context->rax into rcx.
+        push rcx // Push context->rax.
+        mov rcx, [rax+0x10] // Load context->rcx.
+        pop rax // Pop context->rax.
+        iretq // Pop ss, context->rsp, context->rflags, cs, context->rip.
+    )!!");
+}
+
+} // namespace zpp::x64
@@ -0,0 +1,345 @@
+#pragma once
+#include "zpp/x64/context.h"
+#include "zpp/x64/intel/vmcs_fields.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::hosted
+{
+/**
+ * A simulated logical processor, holding the privileged state that the
+ * hosted backend of the x64 and VMX instructions operates on, so that
+ * the hypervisor runs unmodified inside a user space process.
+ * The entry registers are accessed by the simulated VM entry and VM
+ * exit code at fixed offsets and must therefore be first.
+ */
+struct cpu
+{
+    /**
+     * The maximum number of simulated MSRs.
+     */
+    static constexpr std::size_t max_msrs = 0x40;
+
+    /**
+     * The number of VMCS field slots, see vmcs_slot().
+     */
+    static constexpr std::size_t vmcs_slots = 0x2000;
+
+    /**
+     * The number of simulated GDT entries.
+     */
+    static constexpr std::size_t gdt_entries = 0x10;
+
+    /**
+     * The number of simulated IDT entries, two per vector.
+     */
+    static constexpr std::size_t idt_entries = 0x200;
+
+    /**
+     * A simulated MSR.
+     */
+    struct msr
+    {
+        /**
+         * The MSR index.
+         */
+        std::uint32_t index;
+
+        /**
+         * The MSR value.
+         */
+        std::uint64_t value;
+    };
+
+    /**
+     * Reset the processor into the state of a kernel running with
+     * paging, with VMX supported and off. Defined by the hosted loader.
+     */
+    void reset();
+
+    /**
+     * Returns the VMCS slot of the given field encoding, or vmcs_slots
+     * if the encoding is invalid. The slot compacts the width, type and
+     * index of the encoding, the high access of a 64 bit field shares
+     * the slot of its full access.
+     */
+    static std::size_t vmcs_slot(std::uint64_t field)
+    {
+        // Reserved bits must be clear.
+        if (field & ~std::uint64_t{0x6fff}) {
+            return vmcs_slots;
+        }
+
+        // High access is valid only for 64 bit fields.
+        if ((field & 1) && 1 != ((field >> 13) & 0x3)) {
+            return vmcs_slots;
+        }
+
+        return (((field >> 13) & 0x3) << 11) |
+               (((field >> 10) & 0x3) << 9) | ((field >> 1) & 0x1ff);
+    }
+
+    /**
+     * Returns the entry register that holds the given field, or null if
+     * the field is held by the field store.
+     */
+    std::uint64_t * entry_register(std::uint64_t field)
+    {
+        using field_type = intel::vmcs_fields::vmcs_field;
+
+        switch (field) {
+        case field_type::guest_rip:
+            return &guest_rip;
+        case field_type::guest_rsp:
+            return &guest_rsp;
+        case field_type::host_rip:
+            return &host_rip;
+        case field_type::host_rsp:
+            return &host_rsp;
+        default:
+            return nullptr;
+        }
+    }
+
+    /**
+     * Read a field of the current VMCS, returns false on failure.
+     */
+    bool vmread(std::uint64_t field, std::uint64_t & value)
+    {
+        // There must be a current VMCS.
+        if (!vmx_on || invalid_vmcs == current_vmcs) {
+            return false;
+        }
+
+        // Read the entry registers.
+        if (auto entry = entry_register(field)) {
+            value = *entry;
+            return true;
+        }
+
+        // Find the field slot.
+        auto slot = vmcs_slot(field);
+        if (vmcs_slots == slot) {
+            return false;
+        }
+
+        // Read the field, the high access reads the upper half.
+        value = vmcs[slot];
+        if (field & 1) {
+            value >>= 32;
+        }
+        return true;
+    }
+
+    /**
+     * Write a field of the current VMCS, returns false on failure.
+     */
+    bool vmwrite(std::uint64_t field, std::uint64_t value)
+    {
+        // There must be a current VMCS.
+        if (!vmx_on || invalid_vmcs == current_vmcs) {
+            return false;
+        }
+
+        // Write the entry registers.
+        if (auto entry = entry_register(field)) {
+            *entry = value;
+            return true;
+        }
+
+        // Find the field slot.
+        auto slot = vmcs_slot(field);
+        if (vmcs_slots == slot) {
+            return false;
+        }
+
+        // Truncate the value to the field width.
+        switch ((field >> 13) & 0x3) {
+        case 0:
+            value &= 0xffff;
+            break;
+        case 2:
+            value &= 0xffffffff;
+            break;
+        }
+
+        // Write the field, the high access writes the upper half.
+        if (field & 1) {
+            value = (vmcs[slot] & 0xffffffff) | (value << 32);
+        }
+        vmcs[slot] = value;
+        return true;
+    }
+
+    /**
+     * Returns the simulated MSR with the given index, or null if the
+     * MSR is not simulated.
+     */
+    msr * find_msr(std::uint32_t index)
+    {
+        for (std::size_t i{}; i < msr_count; ++i) {
+            if (msrs[i].index == index) {
+                return &msrs[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Read an MSR, MSRs that are not simulated read as zero.
+     */
+    std::uint64_t rdmsr(std::uint32_t index)
+    {
+        auto msr = find_msr(index);
+        return msr ? msr->value : 0;
+    }
+
+    /**
+     * Write an MSR, adding it if not simulated yet. Writes beyond the
+     * simulated MSR capacity are dropped.
+     */
+    void wrmsr(std::uint32_t index, std::uint64_t value)
+    {
+        // Update an existing MSR.
+        if (auto msr = find_msr(index)) {
+            msr->value = value;
+            return;
+        }
+
+        // Add the MSR.
+        if (msr_count < max_msrs) {
+            msrs[msr_count++] = {index, value};
+        }
+    }
+
+    /**
+     * The value of the VMCS pointer when there is no current VMCS.
+     */
+    static constexpr std::uint64_t invalid_vmcs = ~std::uint64_t{};
+
+    // entry register - offset
+    std::uint64_t guest_rip{}; // 0x00
+    std::uint64_t guest_rsp{}; // 0x08
+    std::uint64_t host_rip{};  // 0x10
+    std::uint64_t host_rsp{};  // 0x18
+
+    /**
+     * The control registers.
+     */
+    std::uint64_t cr0{};
+    std::uint64_t cr3{};
+    std::uint64_t cr4{};
+
+    /**
+     * The debug control register.
+     */
+    std::uint64_t dr7{};
+
+    /**
+     * The GS base, loaded from the host GS base on VM exit.
+     */
+    std::uint64_t gs_base{};
+
+    /**
+     * The extended control register.
+     */
+    std::uint64_t xcr0{};
+
+    /**
+     * The descriptor table registers.
+     */
+    std::uint64_t gdtr_base{};
+    std::uint16_t gdtr_limit{};
+    std::uint64_t idtr_base{};
+    std::uint16_t idtr_limit{};
+    std::uint16_t ldtr{};
+    std::uint16_t tr{};
+
+    /**
+     * Whether interrupts are enabled.
+     */
+    bool interrupts_enabled{};
+
+    /**
+     * Whether in VMX operation, and the physical address of the VMXON
+     * region.
+     */
+    bool vmx_on{};
+    std::uint64_t vmxon_region{};
+
+    /**
+     * The physical address of the current VMCS, the field store is
+     * shared by every VMCS of the processor.
+     */
+    std::uint64_t current_vmcs = invalid_vmcs;
+
+    /**
+     * The VMCS field store.
+     */
+    std::uint64_t vmcs[vmcs_slots]{};
+
+    /**
+     * The simulated MSRs.
+     */
+    msr msrs[max_msrs]{};
+    std::size_t msr_count{};
+
+    /**
+     * The simulated OS descriptor tables and task state segment.
+     */
+    std::uint64_t gdt[gdt_entries]{};
+    std::uint64_t idt[idt_entries]{};
+    std::uint8_t tss[0x68]{};
+};
+
+static_assert(offsetof(cpu, guest_rip) == 0x00 &&
+                  offsetof(cpu, guest_rsp) == 0x08 &&
+                  offsetof(cpu, host_rip) == 0x10 &&
+                  offsetof(cpu, host_rsp) == 0x18,
+              "Entry registers offsets mismatch.");
+
+/**
+ * The maximum number of simulated processors.
+ */
+constexpr std::size_t max_cpus = 128;
+
+/**
+ * The processor that executes the privileged instructions, accessed by
+ * the simulated VM entry and VM exit code.
+ */
+extern "C" cpu * zpp_hosted_current;
+
+/**
+ * Returns the processor that executes the privileged instructions.
+ */
+inline cpu & current()
+{
+    return *zpp_hosted_current;
+}
+
+/**
+ * Select the processor that executes the privileged instructions,
+ * returns the selected processor. Defined by the hosted loader.
+ */
+cpu & select(std::size_t cpuid);
+
+/**
+ * Cause a VM exit on the current processor with the given exit reason
+ * and qualification, with the guest general purpose registers taken from
+ * the given context except for rsp. On VM resume, the context holds the
+ * guest registers as left by the hypervisor. Defined by the hosted
+ * loader.
+ */
+void vm_exit(std::uint32_t reason,
+             std::uint64_t qualification,
+             gpr_context & registers);
+
+/**
+ * Send the inter processor interrupt of the given x2APIC interrupt
+ * command from the current processor. Only NMIs are delivered, as a VM
+ * exit of the destination processor, if it runs the guest, after which
+ * the current processor is selected again. Defined by the hosted loader.
+ */
+void send_ipi(std::uint64_t command);
+
+} // namespace zpp::x64::hosted
@@ -0,0 +1,182 @@
+#pragma once
+#include "zpp/x64/hosted/cpu.h"
+#include "zpp/x64/intel/msr.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace zpp::x64::intel
+{
+inline int vmxon(void * region)
+{
+    auto & cpu = hosted::current();
+
+    // VMX must be off and enabled by cr4.vmxe.
+    if (cpu.vmx_on || !(cpu.cr4 & (1ull << 13))) {
+        return 1;
+    }
+
+    // Enter VMX operation.
+    std::memcpy(&cpu.vmxon_region, region, sizeof(cpu.vmxon_region));
+    cpu.vmx_on = true;
+    return 0;
+}
+
+/**
+ * Enters the guest at the guest rip and rsp of the current processor,
+ * keeping all general purpose registers. Defined by the hosted loader.
+ */
+void __attribute__((naked)) vmlaunch();
+
+inline int vmxoff()
+{
+    auto & cpu = hosted::current();
+
+    // VMX must be on.
+    if (!cpu.vmx_on) {
+        return 1;
+    }
+
+    // Leave VMX operation.
+    cpu.vmx_on = false;
+    cpu.current_vmcs = hosted::cpu::invalid_vmcs;
+    return 0;
+}
+
+inline int vmptrld(void * pointer)
+{
+    auto & cpu = hosted::current();
+    std::uint64_t physical_address{};
+    std::memcpy(&physical_address, pointer, sizeof(physical_address));
+
+    // VMX must be on, and the VMXON region cannot be loaded.
+    if (!cpu.vmx_on || physical_address == cpu.vmxon_region) {
+        return 1;
+    }
+
+    // Make the VMCS current.
+    cpu.current_vmcs = physical_address;
+    return 0;
+}
+
+inline int vmptrst(void * pointer)
+{
+    auto & cpu = hosted::current();
+
+    // VMX must be on.
+    if (!cpu.vmx_on) {
+        return 1;
+    }
+
+    // Store the current VMCS pointer.
+    std::memcpy(pointer, &cpu.current_vmcs, sizeof(cpu.current_vmcs));
+    return 0;
+}
+
+inline int vmclear(void * pointer)
+{
+    auto & cpu = hosted::current();
+    std::uint64_t physical_address{};
+    std::memcpy(&physical_address, pointer, sizeof(physical_address));
+
+    // VMX must be on, and the VMXON region cannot be cleared.
+    if (!cpu.vmx_on || physical_address == cpu.vmxon_region) {
+        return 1;
+    }
+
+    // Clear the field store, a cleared current VMCS is no longer
+    // current.
+    std::memset(cpu.vmcs, 0, sizeof(cpu.vmcs));
+    if (physical_address == cpu.current_vmcs) {
+        cpu.current_vmcs = hosted::cpu::invalid_vmcs;
+    }
+    return 0;
+}
+
+inline int vmread(std::uint64_t field, void * value)
+{
+    std::uint64_t result{};
+    if (!hosted::current().vmread(field, result)) {
+        return 1;
+    }
+    std::memcpy(value, &result, sizeof(result));
+    return 0;
+}
+
+inline int vmwrite(std::uint64_t field, std::uint64_t value)
+{
+    return !hosted::current().vmwrite(field, value);
+}
+
+inline int vmread_batch(const std::uint64_t * fields,
+                        std::uint64_t * values,
+                        std::size_t count)
+{
+    auto & cpu = hosted::current();
+    for (std::size_t i{}; i < count; ++i) {
+        if (!cpu.vmread(fields[i], values[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+inline int vmwrite_batch(const std::uint64_t * pairs, std::size_t count)
+{
+    auto & cpu = hosted::current();
+    for (std::size_t i{}; i < count; ++i) {
+        if (!cpu.vmwrite(pairs[2 * i], pairs[2 * i + 1])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+inline int invept(void *, void *)
+{
+    // There is no simulated TLB, only VMX operation is required.
+    return !hosted::current().vmx_on;
+}
+
+inline int invvpid(void *, void *)
+{
+    // There is no simulated TLB, only VMX operation is required.
+    return !hosted::current().vmx_on;
+}
+
+/**
+ * Resumes the guest at the guest rip and rsp of the current processor,
+ * keeping all general purpose registers. Defined by the hosted loader.
+ */
+void __attribute__((naked)) vmresume();
+
+inline std::uint64_t rdmsr(std::uint32_t index)
+{
+    return hosted::current().rdmsr(index);
+}
+
+inline void wrmsr(std::uint32_t index, std::uint64_t value)
+{
+    // Interrupt commands are sent to the other processors.
+    if (msr::x2apic::interrupt_command == index) {
+        hosted::send_ipi(value);
+        return;
+    }
+
+    hosted::current().wrmsr(index, value);
+}
+
+inline void xsetbv(std::uint32_t index, std::uint64_t value)
+{
+    // Only XCR0 exists.
+    if (!index) {
+        hosted::current().xcr0 = value;
+    }
+}
+
+inline void invd()
+{
+    // There are no simulated caches.
+}
+
+} // namespace zpp::x64::intel
@@ -1,6 +1,10 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
+#if ZPP_HYPERVISOR_HOSTED
+#include "zpp/x64/hosted/intel/asm.h"
+#else
 namespace zpp::x64::intel
 {
 inline int __attribute__((naked)) vmxon(void *)
@@ -110,6 +114,53 @@ inline int __attribute__((naked)) vmwrite(std::uint64_t, std::uint64_t)
     )!!");
 }
 
+inline int __attribute__((naked))
+vmread_batch(const std::uint64_t *, std::uint64_t *, std::size_t)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        test rdx, rdx // If there are no fields, succeed.
+        jz vmread_batch_success
+    vmread_batch_loop:
+        mov rax, [rdi] // Load the field.
+        vmread [rsi], rax // Read the field into the value.
+        jbe vmread_batch_fail // Fail on either CF or ZF.
+        add rdi, 0x8 // Advance to the next field.
+        add rsi, 0x8 // Advance to the next value.
+        dec rdx // Decrement the count.
+        jnz vmread_batch_loop
+    vmread_batch_success:
+        mov eax, 0
+        ret
+    vmread_batch_fail:
+        mov eax, 1
+        ret
+    )!!");
+}
+
+inline int __attribute__((naked))
+vmwrite_batch(const std::uint64_t *, std::size_t)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        test rsi, rsi // If there are no fields, succeed.
+        jz vmwrite_batch_success
+    vmwrite_batch_loop:
+        mov rax, [rdi] // Load the field.
+        vmwrite rax, [rdi+0x8] // Write the value to the field.
+        jbe vmwrite_batch_fail // Fail on either CF or ZF.
+        add rdi, 0x10 // Advance to the next field and value pair.
+        dec rsi // Decrement the count.
+        jnz vmwrite_batch_loop
+    vmwrite_batch_success:
+        mov eax, 0
+        ret
+    vmwrite_batch_fail:
+        mov eax, 1
+        ret
+    )!!");
+}
+
 inline int __attribute__((naked)) invept(void *, void *)
 {
     asm(R"!!(
@@ -195,3 +246,4 @@ inline void __attribute__((naked)) invd()
 }
 
 } // namespace zpp::x64::intel
+#endif
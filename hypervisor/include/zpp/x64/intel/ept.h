@@ -123,6 +123,22 @@ public:
         m_value = (m_value & ~(0x1ull << 8)) | (std::uint64_t{value} << 8);
     }
 
+    /**
+     * Returns the dirty bit.
+     */
+    constexpr bool dirty() const
+    {
+        return m_value & (1 << 9);
+    }
+
+    /**
+     * Sets the dirty bit to the specified value.
+     */
+    constexpr void dirty(bool value)
+    {
+        m_value = (m_value & ~(0x1ull << 9)) | (std::uint64_t{value} << 9);
+    }
+
     /**
      * Returns the execute user bit.
      */
@@ -66,7 +66,7 @@ public:
      */
     constexpr bool access_and_dirty() const
     {
-        return m_value & (1 << 8);
+        return m_value & (1 << 6);
     }
 
     /**
@@ -74,7 +74,7 @@ public:
      */
     constexpr void access_and_dirty(bool value)
     {
-        m_value = ((m_value & ~(0x7 << 8)) | (((value - 1) & 0x7) << 8));
+        m_value = (m_value & ~(0x1ull << 6)) | (std::uint64_t{value} << 6);
     }
 
     /**
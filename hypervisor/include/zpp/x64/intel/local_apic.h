@@ -0,0 +1,135 @@
+#pragma once
+#include "zpp/x64/intel/asm.h"
+#include "zpp/x64/intel/msr.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::intel
+{
+/**
+ * Sends inter processor interrupts through the local APIC of the current
+ * CPU, in x2APIC mode through its MSRs, and in xAPIC mode through its
+ * registers page, which must be mapped at its physical address.
+ */
+class local_apic
+{
+public:
+    /**
+     * Initialize from the APIC base MSR of the current CPU, returns false
+     * if the local APIC is disabled.
+     */
+    bool initialize()
+    {
+        auto base = rdmsr(msr::ia32_apic_base);
+        m_x2apic = base & x2apic_enable;
+        m_physical_address = base & 0xffffffffff000;
+        return base & global_enable;
+    }
+
+    /**
+     * Returns true if the local APIC is in x2APIC mode, in which case its
+     * registers page is not used.
+     */
+    bool x2apic() const
+    {
+        return m_x2apic;
+    }
+
+    /**
+     * Returns the physical address of the registers page.
+     */
+    std::uint64_t physical_address() const
+    {
+        return m_physical_address;
+    }
+
+    /**
+     * Returns the APIC identifier of the current CPU.
+     */
+    std::uint32_t id() const
+    {
+        if (m_x2apic) {
+            return std::uint32_t(rdmsr(msr::x2apic::id));
+        }
+        return reg(id_register) >> 24;
+    }
+
+    /**
+     * Send an NMI to the CPU of the given APIC identifier.
+     */
+    void send_nmi(std::uint32_t id) const
+    {
+        // In x2APIC mode the command is written at once.
+        if (m_x2apic) {
+            wrmsr(msr::x2apic::interrupt_command,
+                  (std::uint64_t{id} << 32) | nmi_command);
+            return;
+        }
+
+        // Wait for a command of the guest to be sent, and save the
+        // destination, which the guest may have written without yet
+        // writing its command.
+        wait_for_delivery();
+        auto destination = reg(interrupt_command_high);
+
+        // Send the NMI.
+        reg(interrupt_command_high) = id << 24;
+        reg(interrupt_command_low) = nmi_command;
+        wait_for_delivery();
+
+        // Restore the destination of the guest.
+        reg(interrupt_command_high) = destination;
+    }
+
+private:
+    /**
+     * The APIC base MSR bits.
+     */
+    static constexpr std::uint64_t x2apic_enable = 1ull << 10;
+    static constexpr std::uint64_t global_enable = 1ull << 11;
+
+    /**
+     * The xAPIC register offsets.
+     */
+    static constexpr std::size_t id_register = 0x20;
+    static constexpr std::size_t interrupt_command_low = 0x300;
+    static constexpr std::size_t interrupt_command_high = 0x310;
+
+    /**
+     * The interrupt command of an asserted NMI, and the delivery status
+     * of a command that was not yet sent.
+     */
+    static constexpr std::uint32_t nmi_command = (4u << 8) | (1u << 14);
+    static constexpr std::uint32_t send_pending = 1u << 12;
+
+    /**
+     * Returns the xAPIC register at the given offset.
+     */
+    volatile std::uint32_t & reg(std::size_t offset) const
+    {
+        return *reinterpret_cast<volatile std::uint32_t *>(
+            m_physical_address + offset);
+    }
+
+    /**
+     * Wait until the last interrupt command was sent.
+     */
+    void wait_for_delivery() const
+    {
+        while (reg(interrupt_command_low) & send_pending) {
+            asm("pause");
+        }
+    }
+
+    /**
+     * Whether the local APIC is in x2APIC mode.
+     */
+    bool m_x2apic{};
+
+    /**
+     * The physical address of the registers page.
+     */
+    std::uint64_t m_physical_address{};
+};
+
+} // namespace zpp::x64::intel
@@ -12,13 +12,28 @@ namespace msr
 enum type : std::size_t
 {
     ia32_extended_feature_enable = 0xc0000080,
+    ia32_feature_control = 0x3a,
     ia32_mtrr_capability = 0xfe,
+    ia32_mtrr_def_type = 0x2ff,
     ia32_debug_control = 0x1d9,
     ia32_fs_base = 0xC0000100,
     ia32_gs_base = 0xC0000101,
+    ia32_apic_base = 0x1b,
 };
 } // namespace msr
 
+/**
+ * The x2APIC MSR addresses.
+ */
+namespace msr::x2apic
+{
+enum type : std::size_t
+{
+    id = 0x802,
+    interrupt_command = 0x830,
+};
+} // namespace msr::x2apic
+
 /**
  * VMX MSR addresses
  */
@@ -74,6 +89,17 @@ enum type : std::size_t
     physmask_6,
     physbase_7,
     physmask_7,
+    fix64k_00000 = 0x250,
+    fix16k_80000 = 0x258,
+    fix16k_a0000 = 0x259,
+    fix4k_c0000 = 0x268,
+    fix4k_c8000 = 0x269,
+    fix4k_d0000 = 0x26a,
+    fix4k_d8000 = 0x26b,
+    fix4k_e0000 = 0x26c,
+    fix4k_e8000 = 0x26d,
+    fix4k_f0000 = 0x26e,
+    fix4k_f8000 = 0x26f,
 };
 } // namespace msr::mtrr
 
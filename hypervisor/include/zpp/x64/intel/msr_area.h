@@ -0,0 +1,185 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::intel
+{
+/**
+ * An entry of a VM entry or VM exit MSR load or store area.
+ */
+struct msr_area_entry
+{
+    /**
+     * The MSR index.
+     */
+    std::uint32_t index;
+
+    /**
+     * Reserved, must be zero.
+     */
+    std::uint32_t reserved;
+
+    /**
+     * The MSR value.
+     */
+    std::uint64_t value;
+};
+
+static_assert(sizeof(msr_area_entry) == 0x10);
+
+/**
+ * The MSR areas of a single CPU that switch MSRs between the guest and
+ * the host by the processor. The guest area serves as both the VM exit
+ * store area and the VM entry load area, so the guest values are saved
+ * on exit and restored on entry, and the host area serves as the VM exit
+ * load area.
+ * The areas are used by the processor through their physical addresses
+ * and counts written in the VM control structure, hence MSRs should be
+ * added or removed before the VM control structure is set up, or the
+ * counts rewritten after. Each area is aligned to its size so that it is
+ * physically contiguous.
+ */
+template <std::size_t Capacity>
+class msr_switch_area
+{
+public:
+    static_assert(Capacity && !(Capacity & (Capacity - 1)) &&
+                      Capacity * sizeof(msr_area_entry) <= 0x1000,
+                  "The capacity must be a power of two, up to a page.");
+
+    /**
+     * Construct an empty area.
+     */
+    msr_switch_area() = default;
+
+    /**
+     * Disable copy constructor due to address sensitivity.
+     */
+    msr_switch_area(const msr_switch_area &) = delete;
+
+    /**
+     * Disable copy assignment due to address sensitivity.
+     */
+    msr_switch_area & operator=(const msr_switch_area &) = delete;
+
+    /**
+     * Switch an MSR with the given guest and host values, returns false
+     * if the area is full.
+     */
+    bool add(std::uint32_t msr,
+             std::uint64_t guest_value,
+             std::uint64_t host_value)
+    {
+        // If already switched, update the values.
+        if (auto guest = this->guest_value(msr)) {
+            *guest = guest_value;
+            *this->host_value(msr) = host_value;
+            return true;
+        }
+
+        // If the area is full, fail.
+        if (Capacity == m_size) {
+            return false;
+        }
+
+        // Add the MSR.
+        m_guest[m_size] = {msr, 0, guest_value};
+        m_host[m_size] = {msr, 0, host_value};
+        ++m_size;
+        return true;
+    }
+
+    /**
+     * Stop switching an MSR, returns false if not switched. The last MSR
+     * takes its place in both areas.
+     */
+    bool remove(std::uint32_t msr)
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_guest[i].index != msr) {
+                continue;
+            }
+
+            // Move the last MSR into the place of the removed one.
+            --m_size;
+            m_guest[i] = m_guest[m_size];
+            m_host[i] = m_host[m_size];
+            m_guest[m_size] = {};
+            m_host[m_size] = {};
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Returns the guest value of a switched MSR, or null if not switched.
+     * In root mode, this is the value the guest had on the last VM exit,
+     * and the value the guest will have on the next VM entry.
+     */
+    std::uint64_t * guest_value(std::uint32_t msr)
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_guest[i].index == msr) {
+                return &m_guest[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Returns the host value of a switched MSR, or null if not switched.
+     */
+    std::uint64_t * host_value(std::uint32_t msr)
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_host[i].index == msr) {
+                return &m_host[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Returns the number of switched MSRs.
+     */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Returns the guest area.
+     */
+    const msr_area_entry * guest_area() const
+    {
+        return m_guest;
+    }
+
+    /**
+     * Returns the host area.
+     */
+    const msr_area_entry * host_area() const
+    {
+        return m_host;
+    }
+
+private:
+    /**
+     * The guest area, stored on VM exit and loaded on VM entry.
+     */
+    alignas(Capacity * sizeof(msr_area_entry))
+        msr_area_entry m_guest[Capacity]{};
+
+    /**
+     * The host area, loaded on VM exit.
+     */
+    alignas(Capacity * sizeof(msr_area_entry))
+        msr_area_entry m_host[Capacity]{};
+
+    /**
+     * The number of switched MSRs.
+     */
+    std::size_t m_size{};
+};
+
+} // namespace zpp::x64::intel
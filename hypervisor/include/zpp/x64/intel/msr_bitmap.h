@@ -0,0 +1,123 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::intel
+{
+/**
+ * The MSR accesses that can be intercepted.
+ */
+enum class msr_access : int
+{
+    read = (1 << 0),
+    write = (1 << 1),
+    read_write = read | write,
+};
+
+/**
+ * Utility to build the MSR bitmap of the VM control structure.
+ * The bitmap holds a bit per MSR in the low range [0, 0x1fff] and
+ * the high range [0xc0000000, 0xc0001fff], for reads and for writes,
+ * accesses to MSRs outside both ranges always cause a VM exit.
+ */
+class msr_bitmap
+{
+public:
+    /**
+     * The size of the MSR bitmap.
+     */
+    static constexpr std::size_t size = 0x1000;
+
+    /**
+     * Construct the utility over the given bitmap.
+     */
+    explicit msr_bitmap(std::uint8_t (&bitmap)[size]) : m_bitmap(bitmap)
+    {
+    }
+
+    /**
+     * Returns true if the MSR is covered by the bitmap, else false,
+     * in which case its accesses always cause a VM exit.
+     */
+    static constexpr bool covers(std::uint32_t msr)
+    {
+        return msr <= 0x1fff || (msr >= 0xc0000000 && msr <= 0xc0001fff);
+    }
+
+    /**
+     * Clear the bitmap, no access is intercepted.
+     */
+    void clear()
+    {
+        for (auto & byte : m_bitmap) {
+            byte = 0;
+        }
+    }
+
+    /**
+     * Intercept the given accesses of an MSR. Returns false if the MSR is
+     * not covered by the bitmap.
+     */
+    bool intercept(std::uint32_t msr, msr_access access)
+    {
+        // If not covered, accesses are always intercepted.
+        if (!covers(msr)) {
+            return false;
+        }
+
+        // Set the read bit.
+        if (static_cast<int>(access) &
+            static_cast<int>(msr_access::read)) {
+            auto offset = bit_offset(msr, msr_access::read);
+            m_bitmap[offset / 8] |= std::uint8_t(1 << (offset % 8));
+        }
+
+        // Set the write bit.
+        if (static_cast<int>(access) &
+            static_cast<int>(msr_access::write)) {
+            auto offset = bit_offset(msr, msr_access::write);
+            m_bitmap[offset / 8] |= std::uint8_t(1 << (offset % 8));
+        }
+
+        return true;
+    }
+
+    /**
+     * Returns true if the given access of an MSR causes a VM exit.
+     */
+    bool intercepted(std::uint32_t msr, msr_access access) const
+    {
+        // If not covered, accesses are always intercepted.
+        if (!covers(msr)) {
+            return true;
+        }
+
+        auto offset = bit_offset(msr, access);
+        return m_bitmap[offset / 8] & (1 << (offset % 8));
+    }
+
+private:
+    /**
+     * Returns the bit offset of a covered MSR for a single access.
+     * The bitmap is made of four 1KB parts, reads of the low range,
+     * reads of the high range, writes of the low range, and writes of
+     * the high range.
+     */
+    static constexpr std::size_t bit_offset(std::uint32_t msr,
+                                            msr_access access)
+    {
+        auto part = (msr >= 0xc0000000) ? 1 : 0;
+        if (msr_access::write == access) {
+            part += 2;
+        }
+        return (part * 0x400 * 8) + (msr & 0x1fff);
+    }
+
+private:
+    /**
+     * The MSR bitmap.
+     */
+    std::uint8_t (&m_bitmap)[size];
+};
+
+} // namespace zpp::x64::intel
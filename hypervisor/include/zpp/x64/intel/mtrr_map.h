@@ -0,0 +1,129 @@
+#pragma once
+#include "zpp/x64/intel/mtrr.h"
+#include "zpp/x64/memory_type.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::intel
+{
+/**
+ * The effective memory types of the physical address space, compiled
+ * from the fixed range MTRRs, the variable range MTRRs and the default
+ * type into a sorted list of non overlapping ranges, in which adjacent
+ * ranges have different types. Where variable ranges overlap, uncachable
+ * wins, and write through wins over write back, other overlaps are
+ * undefined and are resolved as uncachable.
+ * Variable range masks are assumed to be contiguous.
+ */
+class mtrr_map
+{
+public:
+    /**
+     * A range of physical addresses of a single memory type.
+     */
+    struct range
+    {
+        /**
+         * The first address of the range.
+         */
+        std::uint64_t begin;
+
+        /**
+         * The address past the end of the range.
+         */
+        std::uint64_t end;
+
+        /**
+         * The memory type of the range.
+         */
+        memory_type type;
+    };
+
+    /**
+     * The maximum number of variable ranges that are read.
+     */
+    static constexpr std::size_t max_variable_ranges = 32;
+
+    /**
+     * The number of fixed ranges.
+     */
+    static constexpr std::size_t fixed_ranges = 88;
+
+    /**
+     * The end of the fixed ranges, 1MB.
+     */
+    static constexpr std::uint64_t fixed_ranges_end = 0x100000;
+
+    /**
+     * The maximum number of ranges.
+     */
+    static constexpr std::size_t capacity =
+        fixed_ranges + 2 * max_variable_ranges + 2;
+
+    /**
+     * Construct an empty map.
+     */
+    mtrr_map() = default;
+
+    /**
+     * Read the MTRRs of the current CPU, and compile the ranges of the
+     * physical addresses below the given end, which must be page aligned
+     * and above the fixed ranges.
+     */
+    void read(std::uint64_t end);
+
+    /**
+     * Returns the range at the given index.
+     */
+    const range & operator[](std::size_t index) const
+    {
+        return m_ranges[index];
+    }
+
+    /**
+     * Returns the number of ranges.
+     */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Returns the index of the range that contains the given address,
+     * which must be below the end of the map.
+     */
+    std::size_t find(std::uint64_t address) const
+    {
+        // Binary search the first range that ends after the address.
+        std::size_t begin{};
+        std::size_t end = m_size;
+        while (begin < end) {
+            auto middle = begin + (end - begin) / 2;
+            if (m_ranges[middle].end <= address) {
+                begin = middle + 1;
+            } else {
+                end = middle;
+            }
+        }
+        return begin;
+    }
+
+private:
+    /**
+     * Append a range, merging it into the last range if of the same
+     * type.
+     */
+    void append(std::uint64_t begin, std::uint64_t end, memory_type type);
+
+    /**
+     * The ranges, sorted by address.
+     */
+    range m_ranges[capacity]{};
+
+    /**
+     * The number of ranges.
+     */
+    std::size_t m_size{};
+};
+
+} // namespace zpp::x64::intel
@@ -1279,6 +1279,66 @@ public:
         return write(field::cr3_target_value_3, value);
     }
 
+    zpp::maybe<std::uint64_t> exit_qualification() const
+    {
+        return read(field::exit_qualification);
+    }
+
+    zpp::error exit_qualification(std::uint64_t value) const
+    {
+        return write(field::exit_qualification, value);
+    }
+
+    zpp::maybe<std::uint64_t> io_rcx() const
+    {
+        return read(field::io_rcx);
+    }
+
+    zpp::error io_rcx(std::uint64_t value) const
+    {
+        return write(field::io_rcx, value);
+    }
+
+    zpp::maybe<std::uint64_t> io_rsi() const
+    {
+        return read(field::io_rsi);
+    }
+
+    zpp::error io_rsi(std::uint64_t value) const
+    {
+        return write(field::io_rsi, value);
+    }
+
+    zpp::maybe<std::uint64_t> io_rdi() const
+    {
+        return read(field::io_rdi);
+    }
+
+    zpp::error io_rdi(std::uint64_t value) const
+    {
+        return write(field::io_rdi, value);
+    }
+
+    zpp::maybe<std::uint64_t> io_rip() const
+    {
+        return read(field::io_rip);
+    }
+
+    zpp::error io_rip(std::uint64_t value) const
+    {
+        return write(field::io_rip, value);
+    }
+
+    zpp::maybe<std::uint64_t> guest_linear_address() const
+    {
+        return read(field::guest_linear_address);
+    }
+
+    zpp::error guest_linear_address(std::uint64_t value) const
+    {
+        return write(field::guest_linear_address, value);
+    }
+
     zpp::maybe<std::uint64_t> guest_cr0() const
     {
         return read(field::guest_cr0);
@@ -0,0 +1,530 @@
+#pragma once
+#include "zpp/x64/intel/asm.h"
+#include "zpp/x64/intel/vmcs.h"
+#include "zpp/x64/intel/vmcs_fields.h"
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace zpp::x64::intel
+{
+/**
+ * An exit scoped view of the currently assigned CPU VMCS.
+ * The exit information field group is read once in a single batch when
+ * the view is loaded, other fields are read lazily at most once, and
+ * written fields are cached and marked dirty, to be written back in a
+ * single batch by flush() just before resuming the guest.
+ * The view assumes that the VMCS is accessed solely through it
+ * during the exit.
+ */
+class vmcs_exit_view
+{
+public:
+    /**
+     * The VMCS error type.
+     */
+    using error = vmcs_error;
+
+    /**
+     * The VMCS field type.
+     */
+    using field = vmcs_fields::vmcs_field;
+
+    /**
+     * The fields cached by the view.
+     */
+    enum class cached_field : std::size_t
+    {
+        // The exit information field group, read on load.
+        exit_reason,
+        exit_qualification,
+        vm_exit_instruction_length,
+        guest_rip,
+
+        // Fields read on first access.
+        vm_exit_instruction_information,
+        vm_exit_interruption_information,
+        vm_exit_interruption_error_code,
+        idt_vectoring_information_field,
+        idt_vectoring_error_code,
+        guest_physical_address,
+        guest_linear_address,
+        guest_rsp,
+        guest_rflags,
+        guest_cr0,
+        guest_cr3,
+        guest_cr4,
+        guest_ss_access_rights,
+        guest_interruptibility_state,
+        vm_entry_interruption_information_field,
+        vm_entry_exception_error_code,
+        vm_entry_instruction_length,
+        vmx_preemption_timer_value,
+        primary_processor_based_vm_execution_controls,
+        pml_index,
+
+        // The number of cached fields.
+        count,
+    };
+
+    /**
+     * The number of cached fields.
+     */
+    static constexpr std::size_t cached_field_count =
+        static_cast<std::size_t>(cached_field::count);
+
+    /**
+     * The number of fields in the exit information field group, which
+     * are the first cached fields.
+     */
+    static constexpr std::size_t exit_information_field_count = 4;
+
+    /**
+     * Construct the exit view, the view must be loaded before use.
+     */
+    vmcs_exit_view() = default;
+
+    /**
+     * Load the view, invalidating any cached field and reading the
+     * exit information field group.
+     */
+    zpp::error load()
+    {
+        // Only the exit information field group is valid.
+        m_valid = (1u << exit_information_field_count) - 1;
+        m_dirty = 0;
+
+        // Read the exit information field group.
+        if (vmread_batch(
+                m_fields, m_values, exit_information_field_count)) {
+            m_valid = 0;
+            return error::fail;
+        }
+
+        return error::success;
+    }
+
+    /**
+     * Write back the dirty fields in a single batch.
+     */
+    zpp::error flush()
+    {
+        // The field and value pairs to write.
+        std::uint64_t pairs[cached_field_count * 2];
+        std::size_t count{};
+
+        // Collect the dirty fields.
+        for (auto dirty = m_dirty; dirty; dirty &= dirty - 1) {
+            auto index = __builtin_ctz(dirty);
+            pairs[count * 2] = m_fields[index];
+            pairs[count * 2 + 1] = m_values[index];
+            ++count;
+        }
+
+        // Nothing remains dirty.
+        m_dirty = 0;
+
+        // Write the dirty fields.
+        if (count && vmwrite_batch(pairs, count)) {
+            return error::fail;
+        }
+
+        return error::success;
+    }
+
+    /**
+     * Read a cached field, reading it from the VMCS on first access.
+     */
+    std::uint64_t read(cached_field cached)
+    {
+        auto index = static_cast<std::size_t>(cached);
+        auto bit = 1u << index;
+
+        // Read the field from the VMCS if not yet valid.
+        if (!(m_valid & bit)) {
+            m_values[index] = {};
+            vmread(m_fields[index], &m_values[index]);
+            m_valid |= bit;
+        }
+
+        return m_values[index];
+    }
+
+    /**
+     * Write a cached field, the field is written back on flush,
+     * only if its value changed.
+     */
+    void write(cached_field cached, std::uint64_t value)
+    {
+        auto index = static_cast<std::size_t>(cached);
+        auto bit = 1u << index;
+
+        // If the value is known and unchanged, there is nothing to do.
+        if ((m_valid & bit) && value == m_values[index]) {
+            return;
+        }
+
+        // Cache the value and mark it dirty.
+        m_values[index] = value;
+        m_valid |= bit;
+        m_dirty |= bit;
+    }
+
+    /**
+     * Returns true if there are fields pending write back.
+     */
+    bool dirty() const
+    {
+        return m_dirty;
+    }
+
+    /**
+     * Returns the exit reason.
+     */
+    intel::exit_reason exit_reason() const
+    {
+        return m_values[std::size_t(cached_field::exit_reason)];
+    }
+
+    /**
+     * Returns the exit qualification.
+     */
+    std::uint64_t exit_qualification() const
+    {
+        return m_values[std::size_t(cached_field::exit_qualification)];
+    }
+
+    /**
+     * Returns the exiting instruction length.
+     */
+    std::uint64_t vm_exit_instruction_length() const
+    {
+        return m_values[std::size_t(
+            cached_field::vm_exit_instruction_length)];
+    }
+
+    /**
+     * Returns the guest RIP.
+     */
+    std::uint64_t guest_rip()
+    {
+        return read(cached_field::guest_rip);
+    }
+
+    /**
+     * Sets the guest RIP.
+     */
+    void guest_rip(std::uint64_t value)
+    {
+        write(cached_field::guest_rip, value);
+    }
+
+    /**
+     * Returns the exiting instruction information.
+     */
+    std::uint64_t vm_exit_instruction_information()
+    {
+        return read(cached_field::vm_exit_instruction_information);
+    }
+
+    /**
+     * Returns the exit interruption information.
+     */
+    std::uint64_t vm_exit_interruption_information()
+    {
+        return read(cached_field::vm_exit_interruption_information);
+    }
+
+    /**
+     * Returns the exit interruption error code.
+     */
+    std::uint64_t vm_exit_interruption_error_code()
+    {
+        return read(cached_field::vm_exit_interruption_error_code);
+    }
+
+    /**
+     * Returns the IDT vectoring information.
+     */
+    std::uint64_t idt_vectoring_information_field()
+    {
+        return read(cached_field::idt_vectoring_information_field);
+    }
+
+    /**
+     * Returns the IDT vectoring error code.
+     */
+    std::uint64_t idt_vectoring_error_code()
+    {
+        return read(cached_field::idt_vectoring_error_code);
+    }
+
+    /**
+     * Returns the guest physical address.
+     */
+    std::uint64_t guest_physical_address()
+    {
+        return read(cached_field::guest_physical_address);
+    }
+
+    /**
+     * Returns the guest linear address.
+     */
+    std::uint64_t guest_linear_address()
+    {
+        return read(cached_field::guest_linear_address);
+    }
+
+    /**
+     * Returns the guest RSP.
+     */
+    std::uint64_t guest_rsp()
+    {
+        return read(cached_field::guest_rsp);
+    }
+
+    /**
+     * Sets the guest RSP.
+     */
+    void guest_rsp(std::uint64_t value)
+    {
+        write(cached_field::guest_rsp, value);
+    }
+
+    /**
+     * Returns the guest RFLAGS.
+     */
+    std::uint64_t guest_rflags()
+    {
+        return read(cached_field::guest_rflags);
+    }
+
+    /**
+     * Sets the guest RFLAGS.
+     */
+    void guest_rflags(std::uint64_t value)
+    {
+        write(cached_field::guest_rflags, value);
+    }
+
+    /**
+     * Returns the guest CR0.
+     */
+    std::uint64_t guest_cr0()
+    {
+        return read(cached_field::guest_cr0);
+    }
+
+    /**
+     * Sets the guest CR0.
+     */
+    void guest_cr0(std::uint64_t value)
+    {
+        write(cached_field::guest_cr0, value);
+    }
+
+    /**
+     * Returns the guest CR3.
+     */
+    std::uint64_t guest_cr3()
+    {
+        return read(cached_field::guest_cr3);
+    }
+
+    /**
+     * Sets the guest CR3.
+     */
+    void guest_cr3(std::uint64_t value)
+    {
+        write(cached_field::guest_cr3, value);
+    }
+
+    /**
+     * Returns the guest CR4.
+     */
+    std::uint64_t guest_cr4()
+    {
+        return read(cached_field::guest_cr4);
+    }
+
+    /**
+     * Sets the guest CR4.
+     */
+    void guest_cr4(std::uint64_t value)
+    {
+        write(cached_field::guest_cr4, value);
+    }
+
+    /**
+     * Returns the guest SS access rights, whose DPL is the guest CPL.
+     */
+    std::uint64_t guest_ss_access_rights()
+    {
+        return read(cached_field::guest_ss_access_rights);
+    }
+
+    /**
+     * Returns the guest interruptibility state.
+     */
+    std::uint64_t guest_interruptibility_state()
+    {
+        return read(cached_field::guest_interruptibility_state);
+    }
+
+    /**
+     * Sets the guest interruptibility state.
+     */
+    void guest_interruptibility_state(std::uint64_t value)
+    {
+        write(cached_field::guest_interruptibility_state, value);
+    }
+
+    /**
+     * Sets the entry interruption information.
+     */
+    void vm_entry_interruption_information_field(std::uint64_t value)
+    {
+        write(cached_field::vm_entry_interruption_information_field,
+              value);
+    }
+
+    /**
+     * Sets the entry exception error code.
+     */
+    void vm_entry_exception_error_code(std::uint64_t value)
+    {
+        write(cached_field::vm_entry_exception_error_code, value);
+    }
+
+    /**
+     * Sets the entry instruction length.
+     */
+    void vm_entry_instruction_length(std::uint64_t value)
+    {
+        write(cached_field::vm_entry_instruction_length, value);
+    }
+
+    /**
+     * Sets the VMX preemption timer value.
+     */
+    void vmx_preemption_timer_value(std::uint64_t value)
+    {
+        write(cached_field::vmx_preemption_timer_value, value);
+    }
+
+    /**
+     * Returns the primary processor based execution controls.
+     */
+    std::uint64_t primary_processor_based_vm_execution_controls()
+    {
+        return read(
+            cached_field::primary_processor_based_vm_execution_controls);
+    }
+
+    /**
+     * Sets the primary processor based execution controls.
+     */
+    void primary_processor_based_vm_execution_controls(std::uint64_t value)
+    {
+        write(cached_field::primary_processor_based_vm_execution_controls,
+              value);
+    }
+
+    /**
+     * Returns the page modification log index.
+     */
+    std::uint64_t pml_index()
+    {
+        return read(cached_field::pml_index);
+    }
+
+    /**
+     * Sets the page modification log index.
+     */
+    void pml_index(std::uint64_t value)
+    {
+        write(cached_field::pml_index, value);
+    }
+
+    /**
+     * Inject a hardware exception to the guest on the next entry,
+     * the exiting instruction must not be skipped.
+     */
+    void inject_hardware_exception(std::uint8_t vector)
+    {
+        // Valid hardware exception without an error code.
+        vm_entry_interruption_information_field(
+            (1u << 31) | (3u << 8) | vector);
+    }
+
+    /**
+     * Inject a hardware exception with an error code to the guest on the
+     * next entry, the exiting instruction must not be skipped.
+     */
+    void inject_hardware_exception(std::uint8_t vector,
+                                   std::uint32_t error_code)
+    {
+        // Valid hardware exception that delivers an error code.
+        vm_entry_interruption_information_field(
+            (1u << 31) | (1u << 11) | (3u << 8) | vector);
+        vm_entry_exception_error_code(error_code);
+    }
+
+private:
+    /**
+     * The VMCS field encodings of the cached fields, in the
+     * order of the cached field enumeration.
+     */
+    static constexpr std::uint64_t m_fields[] = {
+        std::uint64_t(field::exit_reason),
+        std::uint64_t(field::exit_qualification),
+        std::uint64_t(field::vm_exit_instruction_length),
+        std::uint64_t(field::guest_rip),
+        std::uint64_t(field::vm_exit_instruction_information),
+        std::uint64_t(field::vm_exit_interruption_information),
+        std::uint64_t(field::vm_exit_interruption_error_code),
+        std::uint64_t(field::idt_vectoring_information_field),
+        std::uint64_t(field::idt_vectoring_error_code),
+        std::uint64_t(field::guest_physical_address),
+        std::uint64_t(field::guest_linear_address),
+        std::uint64_t(field::guest_rsp),
+        std::uint64_t(field::guest_rflags),
+        std::uint64_t(field::guest_cr0),
+        std::uint64_t(field::guest_cr3),
+        std::uint64_t(field::guest_cr4),
+        std::uint64_t(field::guest_ss_access_rights),
+        std::uint64_t(field::guest_interruptibility_state),
+        std::uint64_t(field::vm_entry_interruption_information_field),
+        std::uint64_t(field::vm_entry_exception_error_code),
+        std::uint64_t(field::vm_entry_instruction_length),
+        std::uint64_t(field::vmx_preemption_timer_value),
+        std::uint64_t(
+            field::primary_processor_based_vm_execution_controls),
+        std::uint64_t(field::pml_index),
+    };
+
+    static_assert(std::extent_v<decltype(m_fields)> == cached_field_count,
+                  "Every cached field must have an encoding.");
+
+    /**
+     * The cached field values.
+     */
+    std::uint64_t m_values[cached_field_count]{};
+
+    /**
+     * The mask of cached fields that hold the current field value.
+     */
+    std::uint32_t m_valid{};
+
+    /**
+     * The mask of cached fields pending write back.
+     */
+    std::uint32_t m_dirty{};
+
+    static_assert(cached_field_count <= sizeof(m_valid) * 8 &&
+                      cached_field_count <= sizeof(m_dirty) * 8,
+                  "Every cached field must have a bit in the masks.");
+};
+
+} // namespace zpp::x64::intel
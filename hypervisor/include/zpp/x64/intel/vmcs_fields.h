@@ -128,6 +128,12 @@ enum vmcs_field : std::uint64_t
     cr3_target_value_1 = 0x600a,
     cr3_target_value_2 = 0x600c,
     cr3_target_value_3 = 0x600e,
+    exit_qualification = 0x6400,
+    io_rcx = 0x6402,
+    io_rsi = 0x6404,
+    io_rdi = 0x6406,
+    io_rip = 0x6408,
+    guest_linear_address = 0x640a,
     guest_cr0 = 0x6800,
     guest_cr3 = 0x6802,
     guest_cr4 = 0x6804,
@@ -0,0 +1,180 @@
+#pragma once
+#include "zpp/x64/intel/asm.h"
+#include "zpp/x64/intel/vmcs.h"
+#include "zpp/x64/intel/vmcs_fields.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::intel
+{
+/**
+ * A compact table of VMCS field and value pairs, which is built once and
+ * then applied to the currently assigned CPU VMCS in a single batch.
+ * A field that does not fit fails the template, which is then never
+ * applied, so that no field is silently left out.
+ */
+template <std::size_t Capacity>
+class vmcs_template
+{
+public:
+    /**
+     * The VMCS error type.
+     */
+    using error = vmcs_error;
+
+    /**
+     * The VMCS field type.
+     */
+    using field = vmcs_fields::vmcs_field;
+
+    /**
+     * A template entry, laid out as expected by vmwrite_batch.
+     */
+    struct entry
+    {
+        /**
+         * The VMCS field encoding.
+         */
+        std::uint64_t field;
+
+        /**
+         * The value to write to the field.
+         */
+        std::uint64_t value;
+    };
+
+    static_assert(sizeof(entry) == 2 * sizeof(std::uint64_t));
+
+    /**
+     * Construct an empty template.
+     */
+    constexpr vmcs_template() = default;
+
+    /**
+     * Set the value of a field, replacing the existing value if the field
+     * is already in the template.
+     */
+    zpp::error set(field field, std::uint64_t value)
+    {
+        // If the field exists, replace the value.
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_entries[i].field == std::uint64_t(field)) {
+                m_entries[i].value = value;
+                return error::success;
+            }
+        }
+
+        // If the template is full, fail, along with the template.
+        if (m_size == Capacity) {
+            m_overflowed = true;
+            return error::fail;
+        }
+
+        // Append the entry.
+        m_entries[m_size++] = {std::uint64_t(field), value};
+        return error::success;
+    }
+
+    /**
+     * Find the entry of a field, returns null if the field is not in the
+     * template.
+     */
+    const entry * find(field field) const
+    {
+        for (std::size_t i{}; i < m_size; ++i) {
+            if (m_entries[i].field == std::uint64_t(field)) {
+                return &m_entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Write the template to the currently assigned CPU VMCS, fails
+     * without writing if a field did not fit the template.
+     */
+    zpp::error apply() const
+    {
+        // If a field was left out, fail.
+        if (m_overflowed) {
+            return error::fail;
+        }
+
+        // Write all the entries in a single batch.
+        if (vmwrite_batch(reinterpret_cast<const std::uint64_t *>(
+                              m_entries),
+                          m_size)) {
+            return error::fail;
+        }
+
+        return error::success;
+    }
+
+    /**
+     * Remove all entries.
+     */
+    void clear()
+    {
+        m_size = 0;
+        m_overflowed = false;
+    }
+
+    /**
+     * Returns true if a field did not fit the template since it was last
+     * cleared.
+     */
+    bool overflowed() const
+    {
+        return m_overflowed;
+    }
+
+    /**
+     * Returns the number of entries.
+     */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Returns the maximum number of entries.
+     */
+    static constexpr std::size_t capacity()
+    {
+        return Capacity;
+    }
+
+    /**
+     * Returns the first entry.
+     */
+    const entry * begin() const
+    {
+        return m_entries;
+    }
+
+    /**
+     * Returns one past the last entry.
+     */
+    const entry * end() const
+    {
+        return m_entries + m_size;
+    }
+
+private:
+    /**
+     * The template entries.
+     */
+    entry m_entries[Capacity]{};
+
+    /**
+     * The number of entries.
+     */
+    std::size_t m_size{};
+
+    /**
+     * Whether a field did not fit the template.
+     */
+    bool m_overflowed{};
+};
+
+} // namespace zpp::x64::intel
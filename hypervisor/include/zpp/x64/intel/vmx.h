@@ -13,6 +13,19 @@ struct vmx_vmcs
     std::uint8_t data[0x1000 - (sizeof(std::uint32_t) * 2)]{};
 };
 
+/**
+ * The pin based execution controls.
+ */
+namespace vm_execution_controls::pin_based
+{
+enum type : std::uint64_t
+{
+    nmi_exiting = (1ull << 3),
+    virtual_nmis = (1ull << 5),
+    activate_vmx_preemption_timer = (1ull << 6),
+};
+} // namespace vm_execution_controls::pin_based
+
 /**
  * The primary execution controls.
  */
@@ -20,6 +33,8 @@ namespace vm_execution_controls::primary
 {
 enum type : std::uint64_t
 {
+    nmi_window_exiting = (1ull << 22),
+    monitor_trap_flag = (1ull << 27),
     enable_msr_bitmaps = (1ull << 28),
     enable_secondary_controls = (1ull << 31),
 };
@@ -36,6 +51,7 @@ enum type : std::uint64_t
     enable_rdtscp = (1ull << 3),
     enable_vpid = (1ull << 5),
     enable_invpcid = (1ull << 12),
+    enable_pml = (1ull << 17),
     enable_xsaves_xrstors = (1ull << 20),
     mode_based_execute_control = (1ull << 22),
 };
@@ -49,6 +65,7 @@ namespace vm_exit_controls
 enum type : std::uint64_t
 {
     host_address_space_size = (1ull << 9),
+    save_vmx_preemption_timer_value = (1ull << 22),
 };
 } // namespace vm_exit_controls
 
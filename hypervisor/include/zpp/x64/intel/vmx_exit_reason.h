@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 namespace zpp::x64::intel
@@ -14,6 +15,12 @@ public:
      */
     enum class basic_reason : int;
 
+    /**
+     * The number of basic reasons, one above the highest defined basic
+     * reason.
+     */
+    static constexpr std::size_t basic_reason_count = 67;
+
     /**
      * Construct an empty exit reason, value is unspecified.
      */
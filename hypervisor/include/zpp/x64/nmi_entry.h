@@ -0,0 +1,12 @@
+#pragma once
+
+namespace zpp::x64
+{
+/**
+ * The host NMI entry, which atomically increments the 64 bit counter at
+ * offset 8 from the GS base and returns, leaving the handling of the
+ * NMI to the code that reads the counter.
+ */
+void __attribute__((naked)) nmi_entry();
+
+} // namespace zpp::x64
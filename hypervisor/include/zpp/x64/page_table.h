@@ -34,45 +34,51 @@ public:
     enum class protection : int;
 
     /**
-     * Converts a virtual address to physical address.
+     * Converts a virtual address to physical address, returns zero if
+     * the address is not mapped.
      */
     std::uint64_t virtual_to_physical(std::uint64_t value) const;
 
     /**
-     * Converts a virtual address to physical address.
+     * Converts a virtual address to physical address, returns zero if
+     * the address is not mapped.
      */
     std::uint64_t virtual_to_physical(const void * value) const;
 
     /**
      * Maps a single page to the page table with a given protection.
+     * Returns false if out of tables.
      */
-    void map_page(std::uint64_t address,
-                  std::uint64_t physical_address,
-                  protection protection);
+    [[nodiscard]] bool map_page(std::uint64_t address,
+                                std::uint64_t physical_address,
+                                protection protection);
 
     /**
      * Maps the page table itself using another page table.
+     * Returns false if out of tables.
      */
     template <typename PageTable>
-    void map_self(PageTable && other_page_table);
+    [[nodiscard]] bool map_self(PageTable && other_page_table);
 
     /**
      * Maps an address from another page table.
+     * Returns false if out of tables.
      */
     template <typename PageTable>
-    void map_from(std::uint64_t base_address,
-                  std::size_t size,
-                  protection protection,
-                  PageTable && other_page_table);
+    [[nodiscard]] bool map_from(std::uint64_t base_address,
+                                std::size_t size,
+                                protection protection,
+                                PageTable && other_page_table);
 
     /**
      * Maps an address from another page table.
+     * Returns false if out of tables.
      */
     template <typename PageTable>
-    void map_from(const void * base_address,
-                  std::size_t size,
-                  protection protection,
-                  PageTable && other_page_table);
+    [[nodiscard]] bool map_from(const void * base_address,
+                                std::size_t size,
+                                protection protection,
+                                PageTable && other_page_table);
 
     /**
      * Returns the head of the initial page table in the translation.
@@ -80,16 +86,18 @@ public:
     const x64::pte & head() const;
 
     /**
-     * Returns the page table entry of a given address.
+     * Returns the page table entry of a given address, the address must
+     * be mapped.
      */
     x64::pte & page_table_entry(std::uint64_t address);
 
 private:
     /**
      * Maps a single page from another page table.
+     * Returns false if out of tables.
      */
     template <typename PageTable>
-    void map_page_from(std::uint64_t address,
+    bool map_page_from(std::uint64_t address,
                        std::uint64_t physical_address,
                        protection protection,
                        PageTable && other_page_table);
@@ -97,9 +105,10 @@ private:
     /**
      * Maps an address from another page table while the
      * object has not completed initialization for self mapping.
+     * Returns false if out of tables.
      */
     template <typename PageTable>
-    void self_map_from(std::uint64_t base_address,
+    bool self_map_from(std::uint64_t base_address,
                        std::size_t size,
                        protection protection,
                        PageTable && other_page_table);
@@ -107,38 +116,83 @@ private:
     /**
      * Maps an address from another page table while the
      * object has not completed initialization for self mapping.
+     * Returns false if out of tables.
      */
     template <typename PageTable>
-    void self_map_from(const void * base_address,
+    bool self_map_from(const void * base_address,
                        std::size_t size,
                        protection protection,
                        PageTable && other_page_table);
 
+    /**
+     * Assigns the next unused table to the given table index, unless
+     * it already has a table. Returns false if out of tables.
+     */
+    static bool assign_table(std::uint16_t & index,
+                             std::size_t & count,
+                             std::size_t capacity);
+
 private:
     /**
      * The page size.
      */
     static constexpr auto page_size = 0x1000;
 
+    /**
+     * The number of tables of every level, which are assigned to
+     * entries on demand, so that any set of addresses may be mapped as
+     * long as the tables suffice.
+     * @{
+     */
+    static constexpr std::size_t max_pdpts = 4;
+    static constexpr std::size_t max_pds = 16;
+    static constexpr std::size_t max_pts = 1024;
+    /**
+     * @}
+     */
+
     /**
      * The page table level 4 page.
      */
     alignas(page_size) x64::pte pml4[512];
 
     /**
-     * The page directory pointer table.
+     * The page directory pointer tables.
      */
-    alignas(page_size) x64::pte pdpt[512];
+    alignas(page_size) x64::pte pdpts[max_pdpts][512];
 
     /**
      * The page directory tables.
      */
-    alignas(page_size) x64::pte pds[2][512];
+    alignas(page_size) x64::pte pds[max_pds][512];
 
     /**
      * The page tables.
      */
-    alignas(page_size) x64::pte pts[2][512][512];
+    alignas(page_size) x64::pte pts[max_pts][512];
+
+    /**
+     * The index plus one of the table that each entry points to, or
+     * zero if the entry points to no table.
+     * @{
+     */
+    std::uint16_t pdpt_indices[512];
+    std::uint16_t pd_indices[max_pdpts][512];
+    std::uint16_t pt_indices[max_pds][512];
+    /**
+     * @}
+     */
+
+    /**
+     * The number of assigned tables of every level.
+     * @{
+     */
+    std::size_t pdpt_count;
+    std::size_t pd_count;
+    std::size_t pt_count;
+    /**
+     * @}
+     */
 };
 
 enum class page_table::protection : int
@@ -7,4 +7,11 @@ namespace zpp::x64
  */
 void __attribute__((naked)) vm_exit_entry();
 
+/**
+ * The VM-Exit entry function that saves only the general purpose
+ * registers of the guest, leaving the floating point and SIMD state
+ * in the processor.
+ */
+void __attribute__((naked)) gpr_vm_exit_entry();
+
 } // namespace zpp::x64
@@ -0,0 +1,211 @@
+#include "zpp/hypervisor/cpuid_table.h"
+#include "zpp/x64/asm.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::hypervisor
+{
+namespace
+{
+/**
+ * The maximum number of leaves captured in a range.
+ */
+constexpr std::uint32_t max_leaves_per_range = 0x30;
+
+/**
+ * The maximum number of subleaves captured in a leaf.
+ */
+constexpr std::uint32_t max_subleaves = 0x10;
+
+/**
+ * The extended state enumeration leaf, which depends on XCR0 and
+ * IA32_XSS and therefore is never captured.
+ */
+constexpr std::uint32_t extended_state_leaf = 0xd;
+} // namespace
+
+bool cpuid_table::capture(const cpuid_override * overrides,
+                          std::size_t number_of_overrides)
+{
+    bool result = true;
+
+    // Start from an empty table.
+    m_size = 0;
+
+    // Capture the standard and extended ranges.
+    result = capture_range(0) && result;
+    result = capture_range(0x80000000) && result;
+
+    // Apply the overrides.
+    for (std::size_t i{}; i < number_of_overrides; ++i) {
+        auto & change = overrides[i];
+        bool found = false;
+
+        // Apply the override to every matching entry.
+        for (std::size_t j{}; j < m_size; ++j) {
+            auto & entry = m_entries[j];
+            if (entry.leaf != change.leaf ||
+                (entry.subleaf_indexed &&
+                 cpuid_override::any_subleaf != change.subleaf &&
+                 entry.subleaf != change.subleaf)) {
+                continue;
+            }
+
+            for (std::size_t k{}; k < 4; ++k) {
+                entry.registers[k] =
+                    (entry.registers[k] & ~change.mask[k]) |
+                    (change.value[k] & change.mask[k]);
+            }
+            found = true;
+        }
+
+        // If the leaf was not reported, add it.
+        if (!found) {
+            auto any_subleaf =
+                cpuid_override::any_subleaf == change.subleaf;
+            if (!insert({change.leaf,
+                         any_subleaf ? 0 : change.subleaf,
+                         !any_subleaf,
+                         {change.value[0] & change.mask[0],
+                          change.value[1] & change.mask[1],
+                          change.value[2] & change.mask[2],
+                          change.value[3] & change.mask[3]}})) {
+                result = false;
+            }
+        }
+    }
+
+    return result;
+}
+
+bool cpuid_table::capture_range(std::uint32_t base)
+{
+    std::uint32_t registers[4]{};
+
+    // Fetch the last leaf of the range.
+    x64::cpuid(base, 0, registers);
+    auto last = registers[0];
+
+    // If the range is not reported, there is nothing to capture.
+    if (last < base || last - base >= 0x10000) {
+        return true;
+    }
+
+    // Limit the number of captured leaves.
+    if (last - base >= max_leaves_per_range) {
+        last = base + max_leaves_per_range - 1;
+    }
+
+    // Capture the leaves.
+    for (auto leaf = base; leaf <= last; ++leaf) {
+        if (!capture_leaf(leaf)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool cpuid_table::capture_leaf(std::uint32_t leaf)
+{
+    entry entry{leaf, 0, false, {}};
+
+    // The extended state leaf is executed on every exit.
+    if (extended_state_leaf == leaf) {
+        return true;
+    }
+
+    // Execute the first subleaf.
+    x64::cpuid(leaf, 0, entry.registers);
+
+    // Compute the number of subleaves of subleaf indexed leaves, leaves
+    // with more subleaves are executed on exit beyond this limit.
+    std::uint32_t subleaves = 1;
+    switch (leaf) {
+    case 0x4:
+    case 0xb:
+    case 0x1f:
+        // Subleaves end with a null type, computed while capturing.
+        subleaves = max_subleaves;
+        break;
+    case 0x7:
+    case 0x14:
+    case 0x17:
+    case 0x18:
+    case 0x1d:
+    case 0x20:
+        // The last subleaf is reported in eax of the first subleaf.
+        subleaves = entry.registers[0] + 1;
+        break;
+    case 0xf:
+    case 0x10:
+    case 0x12:
+    case 0x1e:
+    case 0x23:
+    case 0x24:
+        // Capture the first subleaves.
+        subleaves = 4;
+        break;
+    default:
+        // Not subleaf indexed.
+        return insert(entry);
+    }
+
+    // Limit the number of captured subleaves.
+    if (subleaves > max_subleaves) {
+        subleaves = max_subleaves;
+    }
+
+    // Capture the subleaves.
+    entry.subleaf_indexed = true;
+    for (std::uint32_t subleaf{}; subleaf < subleaves; ++subleaf) {
+        // Execute the subleaf.
+        entry.subleaf = subleaf;
+        if (subleaf) {
+            x64::cpuid(leaf, subleaf, entry.registers);
+        }
+
+        // Insert the entry.
+        if (!insert(entry)) {
+            return false;
+        }
+
+        // Stop after the null cache type.
+        if (0x4 == leaf && !(entry.registers[0] & 0x1f)) {
+            break;
+        }
+
+        // Stop after the invalid topology level type.
+        if ((0xb == leaf || 0x1f == leaf) &&
+            !((entry.registers[2] >> 8) & 0xff)) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+cpuid_table::entry * cpuid_table::insert(const entry & entry)
+{
+    // If the table is full, fail.
+    if (capacity == m_size) {
+        return nullptr;
+    }
+
+    // Find the position of the entry.
+    auto position = m_size;
+    while (position &&
+           (m_entries[position - 1].leaf > entry.leaf ||
+            (m_entries[position - 1].leaf == entry.leaf &&
+             m_entries[position - 1].subleaf > entry.subleaf))) {
+        m_entries[position] = m_entries[position - 1];
+        --position;
+    }
+
+    // Place the entry.
+    m_entries[position] = entry;
+    ++m_size;
+    return &m_entries[position];
+}
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,85 @@
+#include "zpp/hypervisor/ept_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace zpp::hypervisor
+{
+x64::intel::epte * ept_pool::allocate(std::uint64_t & physical_address)
+{
+    // If there are no free pages, fail.
+    if (!m_available) {
+        return nullptr;
+    }
+
+    // Find a bitmap word with a free page, starting at the hint.
+    constexpr auto words = max_pages / 64;
+    auto word = m_hint;
+    while (!m_free[word]) {
+        word = (word + 1) % words;
+    }
+
+    // Take the lowest free page of the word.
+    auto index = word * 64 + __builtin_ctzll(m_free[word]);
+    m_free[word] &= m_free[word] - 1;
+    m_hint = word;
+    --m_available;
+
+    // Zero the page and return it.
+    auto & page = m_pages[index];
+    std::memset(page.virtual_address, 0, page_size);
+    physical_address = page.physical_address;
+    return reinterpret_cast<x64::intel::epte *>(page.virtual_address);
+}
+
+void ept_pool::free(x64::intel::epte * table)
+{
+    auto address = reinterpret_cast<unsigned char *>(table);
+
+    // Find the chunk of the table and mark its page as free.
+    for (std::size_t i{}; i < m_number_of_chunks; ++i) {
+        auto & chunk = m_chunks[i];
+        if (address < chunk.base ||
+            address >= chunk.base + chunk.number_of_pages * page_size) {
+            continue;
+        }
+
+        auto index = chunk.first_page +
+                     std::size_t(address - chunk.base) / page_size;
+        m_free[index / 64] |= (1ull << (index % 64));
+        ++m_available;
+        return;
+    }
+}
+
+x64::intel::epte * ept_pool::table(std::uint64_t physical_address) const
+{
+    // Probe the page frame table until the page or an empty slot is
+    // found.
+    for (auto slot = frame_slot(physical_address);;
+         slot = (slot + 1) % frame_slots) {
+        auto index = m_by_frame[slot];
+        if (!index) {
+            return nullptr;
+        }
+
+        auto & page = m_pages[index - 1];
+        if (page.physical_address == physical_address) {
+            return reinterpret_cast<x64::intel::epte *>(
+                page.virtual_address);
+        }
+    }
+}
+
+void ept_pool::index_frame(std::size_t index)
+{
+    // Take the first empty slot of the probe sequence, the table is never
+    // more than half full.
+    auto slot = frame_slot(m_pages[index].physical_address);
+    while (m_by_frame[slot]) {
+        slot = (slot + 1) % frame_slots;
+    }
+    m_by_frame[slot] = std::uint16_t(index + 1);
+}
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,138 @@
+#include "zpp/hypervisor/ept_protection_map.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace zpp::hypervisor
+{
+bool ept_protection_map::set(std::uint64_t physical_address,
+                             unsigned access)
+{
+    auto base = physical_address & ~(region_size - 1);
+    auto index = lower_bound(base);
+    bool found = (index < m_size && m_regions[index].base == base);
+
+    // Pages without a region allow every access.
+    if (!found && all == (access & all)) {
+        return true;
+    }
+
+    // Insert the region if missing.
+    if (!found) {
+        if (capacity == m_size) {
+            return false;
+        }
+        std::memmove(&m_regions[index + 1],
+                     &m_regions[index],
+                     (m_size - index) * sizeof(region));
+        m_regions[index] = {};
+        m_regions[index].base = base;
+        ++m_size;
+    }
+
+    // Update the denied bits of the page.
+    auto & region = m_regions[index];
+    auto page = (physical_address - base) >> 12;
+    for (std::size_t i{}; i < 3; ++i) {
+        auto & word = region.denied[i][page / 64];
+        word &= ~(1ull << (page % 64));
+        if (!(access & (1u << i))) {
+            word |= (1ull << (page % 64));
+        }
+    }
+
+    // Remove the region once every page allows every access.
+    if (all == common(region)) {
+        erase(base);
+    }
+    return true;
+}
+
+unsigned ept_protection_map::get(std::uint64_t physical_address) const
+{
+    auto base = physical_address & ~(region_size - 1);
+    auto index = lower_bound(base);
+
+    // Pages without a region allow every access.
+    if (index == m_size || m_regions[index].base != base) {
+        return all;
+    }
+
+    // Collect the access of the page.
+    auto & region = m_regions[index];
+    auto page = (physical_address - base) >> 12;
+    unsigned access = all;
+    for (std::size_t i{}; i < 3; ++i) {
+        if (region.denied[i][page / 64] & (1ull << (page % 64))) {
+            access &= ~(1u << i);
+        }
+    }
+    return access;
+}
+
+unsigned ept_protection_map::common(std::uint64_t physical_address,
+                                    std::uint64_t size) const
+{
+    unsigned access = all;
+
+    // Intersect the access of the regions within the range.
+    for (auto index = lower_bound(physical_address);
+         index < m_size &&
+         m_regions[index].base < physical_address + size;
+         ++index) {
+        access &= common(m_regions[index]);
+    }
+    return access;
+}
+
+void ept_protection_map::erase(std::uint64_t physical_address)
+{
+    auto base = physical_address & ~(region_size - 1);
+    auto index = lower_bound(base);
+
+    // If there is no region, there is nothing to remove.
+    if (index == m_size || m_regions[index].base != base) {
+        return;
+    }
+
+    // Remove the region.
+    std::memmove(&m_regions[index],
+                 &m_regions[index + 1],
+                 (m_size - index - 1) * sizeof(region));
+    --m_size;
+}
+
+std::size_t
+ept_protection_map::lower_bound(std::uint64_t physical_address) const
+{
+    // Binary search the physical address.
+    std::size_t begin{};
+    std::size_t end = m_size;
+    while (begin < end) {
+        auto middle = begin + (end - begin) / 2;
+        if (m_regions[middle].base < physical_address) {
+            begin = middle + 1;
+        } else {
+            end = middle;
+        }
+    }
+    return begin;
+}
+
+unsigned ept_protection_map::common(const region & region)
+{
+    unsigned access = all;
+
+    // An access is denied if any page denies it.
+    for (std::size_t i{}; i < 3; ++i) {
+        for (auto word : region.denied[i]) {
+            if (word) {
+                access &= ~(1u << i);
+                break;
+            }
+        }
+    }
+    return access;
+}
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,515 @@
+#include "zpp/hypervisor/exit_dispatcher.h"
+#include "zpp/hypervisor/hypercall_abi.h"
+#include "zpp/hypervisor/msr_dispatcher.h"
+#include "zpp/hypervisor/hypervisor.h"
+#include "zpp/x64/asm.h"
+#include "zpp/x64/intel/asm.h"
+#include "zpp/x64/intel/msr.h"
+#include "zpp/x64/intel/msr_bitmap.h"
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <cstdint>
+#include <type_traits>
+
+namespace zpp::hypervisor
+{
+exit_action hypervisor::dispatch_exit(const exit_information & information,
+                                      x64::gpr_context & guest_context)
+{
+    using basic_reason = x64::intel::exit_reason::basic_reason;
+
+    // The exit handlers table, exits without a registered handler skip
+    // the exiting instruction.
+    static constexpr exit_dispatcher<hypervisor> dispatcher{
+        unhandled_exit_policy::skip_instruction,
+        on_exit<basic_reason::exception_or_nmi, nmi_exit>{},
+        on_exit<basic_reason::nmi_window, nmi_window_exit>{},
+        on_exit<basic_reason::cpuid, cpuid_exit>{},
+        on_exit<basic_reason::xsetbv, xsetbv_exit>{},
+        on_exit<basic_reason::invd, invd_exit>{},
+        on_exit<basic_reason::vmcall, vmcall_exit>{},
+        on_exit<basic_reason::rdmsr, rdmsr_exit>{},
+        on_exit<basic_reason::wrmsr, wrmsr_exit>{},
+        on_exit<basic_reason::vmx_preemption_timer,
+                preemption_timer_exit>{},
+        on_exit<basic_reason::monitor_trap_flag, monitor_trap_flag_exit>{},
+        on_exit<basic_reason::ept_violation, ept_violation_exit>{},
+        on_exit<basic_reason::page_modification_log_full,
+                page_modification_log_full_exit>{},
+    };
+
+    // Dispatch the exit.
+    return dispatcher.dispatch(*this, information, guest_context);
+}
+
+const msr_dispatcher<hypervisor> & hypervisor::msr_handlers()
+{
+    namespace msr = x64::intel::msr;
+
+    // The MSR handlers table, only accesses of these MSRs cause a VM
+    // exit, except for accesses to MSRs outside of the bitmap ranges.
+    static constexpr msr_dispatcher<hypervisor> handlers{
+        on_msr<msr::ia32_feature_control, feature_control_msr>{},
+    };
+
+    return handlers;
+}
+
+void hypervisor::initialize_msr_bitmap()
+{
+    x64::intel::msr_bitmap bitmap{this->msr_bitmap};
+
+    // Intercept only the accesses that have a handler.
+    bitmap.clear();
+    msr_handlers().build_bitmap(bitmap);
+}
+
+void hypervisor::initialize_msr_shadows(std::size_t cpuid)
+{
+    namespace msr = x64::intel::msr;
+
+    auto & shadows = this->msr_shadows[cpuid];
+
+    // Report VMX as disabled both inside and outside of SMX, and lock
+    // the feature control MSR so that the guest cannot enable it.
+    shadows.shadow(msr::ia32_feature_control,
+                   (x64::intel::rdmsr(msr::ia32_feature_control) &
+                    ~std::uint64_t(0x6)) |
+                       0x1);
+}
+
+exit_action hypervisor::cpuid_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    auto leaf = std::uint32_t(guest_context.rax);
+    auto subleaf = std::uint32_t(guest_context.rcx);
+    std::uint32_t cpuid_result[4]{};
+
+    // Find the captured result, otherwise execute the cpuid instruction.
+    if (auto entry = hypervisor.cpuid_tables[information.cpuid].find(
+            leaf, subleaf)) {
+        cpuid_result[0] = entry->registers[0];
+        cpuid_result[1] = entry->registers[1];
+        cpuid_result[2] = entry->registers[2];
+        cpuid_result[3] = entry->registers[3];
+    } else {
+        x64::cpuid(leaf, subleaf, cpuid_result);
+    }
+
+    // Reflect the OSXSAVE and OSPKE bits from the current guest CR4.
+    if (0x1 == leaf) {
+        auto osxsave = std::uint32_t(1) << 27;
+        cpuid_result[2] &= ~osxsave;
+        if (information.vmcs.guest_cr4() & (1ull << 18)) {
+            cpuid_result[2] |= osxsave;
+        }
+    } else if (0x7 == leaf && !subleaf) {
+        auto ospke = std::uint32_t(1) << 4;
+        cpuid_result[2] &= ~ospke;
+        if (information.vmcs.guest_cr4() & (1ull << 22)) {
+            cpuid_result[2] |= ospke;
+        }
+    }
+
+    // Place the cpuid result into the context.
+    guest_context.rax = cpuid_result[0];
+    guest_context.rbx = cpuid_result[1];
+    guest_context.rcx = cpuid_result[2];
+    guest_context.rdx = cpuid_result[3];
+    return exit_action::skip_instruction;
+}
+
+exit_action hypervisor::xsetbv_exit::operator()(
+    hypervisor &,
+    const exit_information &,
+    x64::gpr_context & guest_context) const
+{
+    // Activate CR4 xsave bit.
+    auto cr4 = x64::cr4();
+    if (!(cr4 & (1ull << 18))) {
+        x64::cr4(cr4 | (1ull << 18));
+    }
+
+    // Execute the xsetbv instruction.
+    x64::intel::xsetbv(guest_context.rcx,
+                       guest_context.rax | (guest_context.rdx << 32));
+    return exit_action::skip_instruction;
+}
+
+exit_action hypervisor::invd_exit::operator()(hypervisor &,
+                                              const exit_information &,
+                                              x64::gpr_context &) const
+{
+    // Execute the invd instruction.
+    x64::intel::invd();
+    return exit_action::skip_instruction;
+}
+
+exit_action hypervisor::vmcall_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    // If this is not a hypercall, fail it.
+    if (ZPP_HYPERCALL_MAGIC != (guest_context.rcx & 0xffffffff)) {
+        guest_context.rax = std::uint64_t(
+            std::int64_t(ZPP_HYPERCALL_STATUS_UNSUPPORTED));
+        return exit_action::skip_instruction;
+    }
+
+    // Hypercalls are allowed only from CPL 0, which is the SS DPL.
+    if ((information.vmcs.guest_ss_access_rights() >> 5) & 0x3) {
+        guest_context.rax = std::uint64_t(
+            std::int64_t(ZPP_HYPERCALL_STATUS_ACCESS_DENIED));
+        return exit_action::skip_instruction;
+    }
+
+    std::int32_t status = ZPP_HYPERCALL_STATUS_SUCCESS;
+    std::uint64_t result{};
+
+    // Whether to log the hypercall, drains that only read the log are
+    // not logged, so that reading the log does not write it.
+    bool log = true;
+
+    // Perform the hypercall.
+    switch (guest_context.rax) {
+    case ZPP_HYPERCALL_VERSION:
+        result = ZPP_HYPERCALL_ABI_VERSION;
+        break;
+    case ZPP_HYPERCALL_REGISTER_RING:
+        status = hypervisor.register_hypercall_ring(
+            information.cpuid, guest_context.rdx, guest_context.r8);
+        break;
+    case ZPP_HYPERCALL_UNREGISTER_RING:
+        if (information.cpuid < hypervisor.number_of_cpus) {
+            hypervisor.hypercall_rings[information.cpuid].detach();
+        }
+        break;
+    case ZPP_HYPERCALL_DRAIN_RING:
+        if (information.cpuid >= hypervisor.number_of_cpus) {
+            status = ZPP_HYPERCALL_STATUS_NO_RING;
+            break;
+        }
+        log = false;
+        status = hypervisor.hypercall_rings[information.cpuid].drain(
+            [&](auto & request) {
+                switch (request.operation) {
+                case ZPP_HYPERCALL_OPERATION_LOG_STATUS:
+                case ZPP_HYPERCALL_OPERATION_LOG_READ:
+                    break;
+                default:
+                    log = true;
+                    break;
+                }
+                hypervisor.process_hypercall_request(information,
+                                                     request);
+            },
+            result);
+        log = log || ZPP_HYPERCALL_STATUS_SUCCESS != status;
+        break;
+    default:
+        status = ZPP_HYPERCALL_STATUS_UNSUPPORTED;
+        break;
+    }
+
+    // Log the hypercall.
+    if (log) {
+        ZPP_LOG(hypervisor.logs[information.cpuid],
+                "hypercall {} status {} result {:#x}",
+                guest_context.rax,
+                status,
+                result);
+    }
+
+    // Place the status and result into the context.
+    guest_context.rax = std::uint64_t(std::int64_t(status));
+    guest_context.rdx = result;
+    return exit_action::skip_instruction;
+}
+
+exit_action hypervisor::rdmsr_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    std::uint64_t value{};
+
+    // Dispatch the read, fault if not handled.
+    if (msr_result::success !=
+        msr_handlers().read(hypervisor,
+                            information,
+                            std::uint32_t(guest_context.rcx),
+                            value)) {
+        // Log the fault.
+        ZPP_LOG(hypervisor.logs[information.cpuid],
+                "rdmsr {:#x} faulted at rip {:#x}",
+                std::uint32_t(guest_context.rcx),
+                guest_context.rip);
+
+        // Inject a general protection fault.
+        information.vmcs.inject_hardware_exception(13, 0);
+        return exit_action::resume;
+    }
+
+    // Place the value into the context.
+    guest_context.rax = value & 0xffffffff;
+    guest_context.rdx = value >> 32;
+    return exit_action::skip_instruction;
+}
+
+exit_action hypervisor::wrmsr_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    // The written value.
+    auto value = (guest_context.rax & 0xffffffff) |
+                 (guest_context.rdx << 32);
+
+    // Dispatch the write, fault if not handled.
+    if (msr_result::success !=
+        msr_handlers().write(hypervisor,
+                             information,
+                             std::uint32_t(guest_context.rcx),
+                             value)) {
+        // Log the fault.
+        ZPP_LOG(hypervisor.logs[information.cpuid],
+                "wrmsr {:#x} value {:#x} faulted at rip {:#x}",
+                std::uint32_t(guest_context.rcx),
+                value,
+                guest_context.rip);
+
+        // Inject a general protection fault.
+        information.vmcs.inject_hardware_exception(13, 0);
+        return exit_action::resume;
+    }
+
+    return exit_action::skip_instruction;
+}
+
+exit_action hypervisor::preemption_timer_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    auto & profiler = hypervisor.profilers[information.cpuid];
+    auto & vmcs = information.vmcs;
+
+    // Record the sample, the CPL is the SS DPL.
+    profiler.record(guest_context.rip,
+                    vmcs.guest_cr3(),
+                    (vmcs.guest_ss_access_rights() >> 5) & 0x3,
+                    x64::rdtsc());
+
+    // Re-arm the timer.
+    vmcs.vmx_preemption_timer_value(profiler.timer_value());
+
+    // No instruction caused the exit.
+    return exit_action::resume;
+}
+
+exit_action hypervisor::monitor_trap_flag_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    // Record the step, and stop stepping once the tracer stops.
+    if (!hypervisor.tracers[information.cpuid].step(
+            guest_context.rip,
+            guest_context,
+            information.vmcs.guest_rsp())) {
+        // Log the end of the trace.
+        ZPP_LOG(hypervisor.logs[information.cpuid],
+                "trace stopped at rip {:#x}",
+                guest_context.rip);
+        monitor_trap_flag(information, false);
+    }
+
+    // The exit happens after the instruction completed.
+    return exit_action::resume;
+}
+
+exit_action hypervisor::nmi_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context &) const
+{
+    // Count the NMI, only NMIs exit as the exception bitmap is empty.
+    if (2 == ((information.vmcs.vm_exit_interruption_information() >> 8) &
+              0x7)) {
+        hypervisor.cpus[information.cpuid].nmis.fetch_add(
+            1, std::memory_order_relaxed);
+    }
+
+    // The NMI arrived before the guest instruction.
+    return exit_action::resume;
+}
+
+exit_action hypervisor::nmi_window_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context &) const
+{
+    // Inject a pending NMI of the guest, the window exiting is updated
+    // when the exit ends, see deliver_nmis.
+    if (auto & cpu = hypervisor.cpus[information.cpuid]; cpu.guest_nmis) {
+        // A valid NMI.
+        information.vmcs.vm_entry_interruption_information_field(
+            (1u << 31) | (2u << 8) | 2);
+        --cpu.guest_nmis;
+    }
+
+    // The window opened before the guest instruction.
+    return exit_action::resume;
+}
+
+exit_action hypervisor::ept_violation_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context & guest_context) const
+{
+    auto physical_address = information.vmcs.guest_physical_address();
+
+    // Edit the hardware page tables in a batch, committed on return.
+    ept_batch batch{hypervisor};
+
+    // Get the entry that maps the page, if missing, the address is
+    // beyond the hardware page tables and there is nothing to resolve.
+    std::uint64_t size{};
+    auto entry = hypervisor.ept_leaf_entry(physical_address, size);
+    if (!entry) {
+        restore_nmi_blocking(information);
+        return exit_action::resume;
+    }
+
+    // Split the large pages that deny an access that the page allows,
+    // until the page is mapped with the access of its own.
+    auto access = unsigned(information.qualification) &
+                  ept_protection_map::all;
+    bool split = false;
+    while (page_size != size &&
+           (hypervisor.ept_access(*entry) & access) != access &&
+           (hypervisor.ept_protections.get(physical_address) & access) ==
+               access) {
+        if (!batch.split(*entry, size)) {
+            // The launch reserves the tables of every split, see
+            // protect_hypervisor_memory. Skipping an allowed access would
+            // corrupt the guest, so log the failure and halt forever, as
+            // interrupts are disabled in root mode.
+            ZPP_LOG(hypervisor.logs[information.cpuid],
+                    "out of tables to split {:#x} at rip {:#x}",
+                    physical_address,
+                    guest_context.rip);
+            while (true) {
+                x64::halt();
+            }
+        }
+        entry = hypervisor.ept_leaf_entry(physical_address, size);
+        split = true;
+    }
+
+    // Skip accesses to protected memory as if they were executed.
+    if ((hypervisor.ept_access(*entry) & access) != access) {
+        return exit_action::skip_instruction;
+    }
+
+    // The page allows the access. A split made here is invalidated by
+    // the commit, otherwise the large page was split by another CPU and
+    // the translation of this CPU is stale. Retry the access.
+    if (!split) {
+        hypervisor.invalidate_ept();
+    }
+    restore_nmi_blocking(information);
+    return exit_action::resume;
+}
+
+exit_action hypervisor::page_modification_log_full_exit::operator()(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    x64::gpr_context &) const
+{
+    // Drain the log and retry the write that did not fit.
+    hypervisor.drain_page_modification_log(information.vmcs,
+                                           information.cpuid);
+    restore_nmi_blocking(information);
+    return exit_action::resume;
+}
+
+void hypervisor::monitor_trap_flag(const exit_information & information,
+                                   bool enable)
+{
+    auto & vmcs = information.vmcs;
+    auto controls = vmcs.primary_processor_based_vm_execution_controls();
+
+    // Update the monitor trap flag control.
+    if (enable) {
+        controls |= x64::intel::vm_execution_controls::primary::
+            monitor_trap_flag;
+    } else {
+        controls &= ~std::uint64_t(x64::intel::vm_execution_controls::
+                                       primary::monitor_trap_flag);
+    }
+    vmcs.primary_processor_based_vm_execution_controls(controls);
+}
+
+void hypervisor::nmi_window_exiting(x64::intel::vmcs_exit_view & vmcs,
+                                    bool enable)
+{
+    auto controls = vmcs.primary_processor_based_vm_execution_controls();
+
+    // Update the NMI window exiting control.
+    if (enable) {
+        controls |= x64::intel::vm_execution_controls::primary::
+            nmi_window_exiting;
+    } else {
+        controls &= ~std::uint64_t(x64::intel::vm_execution_controls::
+                                       primary::nmi_window_exiting);
+    }
+    vmcs.primary_processor_based_vm_execution_controls(controls);
+}
+
+void hypervisor::restore_nmi_blocking(const exit_information & information)
+{
+    // The qualification bit is set if the guest executed an IRET that
+    // unblocked NMIs, which it executes again.
+    if (information.qualification & (1ull << 12)) {
+        auto & vmcs = information.vmcs;
+        vmcs.guest_interruptibility_state(
+            vmcs.guest_interruptibility_state() | (1u << 3));
+    }
+}
+
+msr_result hypervisor::feature_control_msr::read(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    std::uint64_t & value) const
+{
+    // Read the shadow value.
+    auto shadow = hypervisor.msr_shadows[information.cpuid].find(
+        x64::intel::msr::ia32_feature_control);
+    if (!shadow) {
+        return msr_result::fault;
+    }
+
+    value = *shadow;
+    return msr_result::success;
+}
+
+msr_result hypervisor::feature_control_msr::write(
+    hypervisor & hypervisor,
+    const exit_information & information,
+    std::uint64_t value) const
+{
+    // Writes fault once locked, as in hardware.
+    auto shadow = hypervisor.msr_shadows[information.cpuid].find(
+        x64::intel::msr::ia32_feature_control);
+    if (!shadow || (*shadow & 0x1)) {
+        return msr_result::fault;
+    }
+
+    *shadow = value;
+    return msr_result::success;
+}
+
+} // namespace zpp::hypervisor
@@ -0,0 +1,291 @@
+#include "zpp/hypervisor/binary_log.h"
+#include "zpp/hypervisor/hypercall_abi.h"
+#include "zpp/hypervisor/hypervisor.h"
+#include "zpp/x64/asm.h"
+#include "zpp/x64/intel/vmx_exit_reason.h"
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace zpp::hypervisor
+{
+std::int32_t
+hypervisor::register_hypercall_ring(std::size_t cpuid,
+                                    std::uint64_t physical_address,
+                                    std::uint64_t number_of_pages)
+{
+    // If the CPU identifier is out of range, fail.
+    if (cpuid >= this->number_of_cpus) {
+        return ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+    }
+
+    auto & ring = this->hypercall_rings[cpuid];
+    auto & window = this->hypercall_window[cpuid];
+
+    // Detach the current ring.
+    ring.detach();
+
+    // Validate the ring memory.
+    if (!number_of_pages ||
+        number_of_pages > ZPP_HYPERCALL_RING_MAX_PAGES ||
+        (physical_address & (page_size - 1))) {
+        return ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+    }
+
+    // Make sure that the ring does not overlap the hypervisor memory,
+    // which is protected from guest access, so that the guest cannot use
+    // it to write there.
+    for (std::size_t i{}; i < number_of_pages; ++i) {
+        if (!(ept_page_access(physical_address + i * page_size) &
+              ept_protection_map::read)) {
+            return ZPP_HYPERCALL_STATUS_ACCESS_DENIED;
+        }
+    }
+
+#if ZPP_HYPERVISOR_HOSTED
+    // The virtual addresses of the hosted process are its physical
+    // addresses, and the host page tables do not translate them.
+    static_cast<void>(window);
+    return ring.attach(reinterpret_cast<void *>(physical_address),
+                       number_of_pages * page_size);
+#else
+    // Remap the window pages to the ring pages.
+    for (std::size_t i{}; i < number_of_pages; ++i) {
+        // Update the page table entry of the window page.
+        auto & pte = this->host_page_table.page_table_entry(
+            reinterpret_cast<std::uint64_t>(window[i]));
+        pte.page_number((physical_address >> 12) + i);
+
+        // Flush the stale translation.
+        x64::invlpg(window[i]);
+    }
+
+    // Attach the ring to the window.
+    return ring.attach(window, number_of_pages * page_size);
+#endif
+}
+
+void hypervisor::process_hypercall_request(
+    const exit_information & information, zpp_hypercall_request & request)
+{
+    switch (request.operation) {
+    case ZPP_HYPERCALL_OPERATION_NOP:
+        return;
+    case ZPP_HYPERCALL_OPERATION_EXIT_COUNT:
+    case ZPP_HYPERCALL_OPERATION_EXIT_LATENCY: {
+        exit_statistics::snapshot snapshot;
+
+        // Read the statistics of the requested CPU.
+        if (!exit_statistics_snapshot(request.arguments[0], snapshot)) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Select the requested counters.
+        auto counters = snapshot.exits;
+        auto number_of_counters =
+            std::extent_v<decltype(snapshot.exits)>;
+        if (ZPP_HYPERCALL_OPERATION_EXIT_LATENCY == request.operation) {
+            counters = snapshot.latency;
+            number_of_counters =
+                std::extent_v<decltype(snapshot.latency)>;
+        }
+
+        // Read the requested counter.
+        if (request.arguments[1] >= number_of_counters) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+        request.results[0] = counters[request.arguments[1]];
+        return;
+    }
+    case ZPP_HYPERCALL_OPERATION_TRACE_START:
+        // Start tracing the current CPU.
+        if (auto & tracer = this->tracers[information.cpuid];
+            !tracer.start(request.arguments[0],
+                          request.arguments[1],
+                          request.arguments[2],
+                          request.arguments[3])) {
+            monitor_trap_flag(information, false);
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+        monitor_trap_flag(information, true);
+        return;
+    case ZPP_HYPERCALL_OPERATION_TRACE_STOP:
+        // Stop tracing the current CPU.
+        this->tracers[information.cpuid].stop();
+        monitor_trap_flag(information, false);
+        return;
+    case ZPP_HYPERCALL_OPERATION_TRACE_STATUS:
+    case ZPP_HYPERCALL_OPERATION_TRACE_READ: {
+        // Validate the CPU identifier.
+        if (request.arguments[0] >= this->number_of_cpus) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+        auto & tracer = this->tracers[request.arguments[0]];
+
+        // Read the status.
+        if (ZPP_HYPERCALL_OPERATION_TRACE_STATUS == request.operation) {
+            request.results[0] = tracer.size();
+            request.results[1] = tracer.records();
+            return;
+        }
+
+        // Read the bytes at the offset into the zeroed results.
+        if (request.arguments[1] >= tracer.size()) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+        tracer.read(request.arguments[1],
+                    reinterpret_cast<std::uint8_t *>(request.results),
+                    sizeof(request.results));
+        return;
+    }
+    case ZPP_HYPERCALL_OPERATION_LOG_STATUS:
+        // Validate the CPU identifier.
+        if (request.arguments[0] >= this->number_of_cpus) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Read the number of written records.
+        request.results[0] = this->logs[request.arguments[0]].size();
+        return;
+    case ZPP_HYPERCALL_OPERATION_LOG_READ: {
+        auto position = request.arguments[1];
+        auto offset = request.arguments[2];
+        auto count = request.arguments[3];
+
+        // Validate the number of records and the buffer alignment.
+        if (count > binary_log::capacity ||
+            (offset % sizeof(binary_log::record))) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Find the buffer within the ring memory.
+        auto records = static_cast<binary_log::record *>(
+            this->hypercall_rings[information.cpuid].buffer(
+                offset, count * sizeof(binary_log::record)));
+        if (!records || request.arguments[0] >= this->number_of_cpus) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Copy the records into the buffer.
+        request.results[0] =
+            log_records(request.arguments[0], position, records, count);
+        request.results[1] = position;
+        return;
+    }
+    case ZPP_HYPERCALL_OPERATION_DIRTY_STATUS:
+        // Dirty pages must be tracked.
+        if (!this->dirty_tracking) {
+            request.status = ZPP_HYPERCALL_STATUS_UNSUPPORTED;
+            return;
+        }
+
+        // Read the tracked memory.
+        request.results[0] = this->dirty_pages.limit();
+        return;
+    case ZPP_HYPERCALL_OPERATION_DIRTY_READ: {
+        auto physical_address = request.arguments[0];
+        auto offset = request.arguments[2];
+        auto count = request.arguments[3];
+        constexpr auto word_size =
+            dirty_bitmap::pages_per_word * page_size;
+
+        // Dirty pages must be tracked.
+        if (!this->dirty_tracking) {
+            request.status = ZPP_HYPERCALL_STATUS_UNSUPPORTED;
+            return;
+        }
+
+        // Validate the address, the number of words and the buffer
+        // alignment.
+        if ((physical_address & (word_size - 1)) ||
+            physical_address >= this->dirty_pages.limit() ||
+            count > this->dirty_pages.limit() / word_size ||
+            (offset % sizeof(std::uint64_t))) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Find the buffer within the ring memory.
+        auto words = static_cast<std::uint64_t *>(
+            this->hypercall_rings[information.cpuid].buffer(
+                offset, count * sizeof(std::uint64_t)));
+        if (!words) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Report the pages logged by the current CPU.
+        drain_page_modification_log(information.vmcs, information.cpuid);
+
+        // Read and clear the dirty pages into the buffer.
+        request.results[0] =
+            read_dirty_pages(physical_address, words, count);
+        request.results[1] =
+            physical_address + request.results[0] * word_size;
+        return;
+    }
+    case ZPP_HYPERCALL_OPERATION_PROFILE_STATUS: {
+        // Validate the CPU identifier.
+        if (request.arguments[0] >= this->number_of_cpus) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+        auto & profiler = this->profilers[request.arguments[0]];
+
+        // Read the number of recorded samples and the timer value.
+        request.results[0] = profiler.size();
+        request.results[1] = profiler.timer_value();
+        return;
+    }
+    case ZPP_HYPERCALL_OPERATION_PROFILE_READ: {
+        auto position = request.arguments[1];
+        auto offset = request.arguments[2];
+        auto count = request.arguments[3];
+
+        // Validate the number of samples and the buffer alignment.
+        if (count > guest_profiler::capacity ||
+            (offset % sizeof(guest_profiler::sample))) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Find the buffer within the ring memory.
+        auto samples = static_cast<guest_profiler::sample *>(
+            this->hypercall_rings[information.cpuid].buffer(
+                offset, count * sizeof(guest_profiler::sample)));
+        if (!samples || request.arguments[0] >= this->number_of_cpus) {
+            request.status = ZPP_HYPERCALL_STATUS_INVALID_ARGUMENT;
+            return;
+        }
+
+        // Copy the samples into the buffer.
+        request.results[0] = profiler_samples(
+            request.arguments[0], position, samples, count);
+        request.results[1] = position;
+        return;
+    }
+    case ZPP_HYPERCALL_OPERATION_DIRTY_SYNC:
+        // Dirty pages must be tracked.
+        if (!this->dirty_tracking) {
+            request.status = ZPP_HYPERCALL_STATUS_UNSUPPORTED;
+            return;
+        }
+
+        // Make every CPU report its pages.
+        synchronize_dirty_pages();
+        return;
+    default:
+        request.status = ZPP_HYPERCALL_STATUS_UNSUPPORTED;
+        return;
+    }
+}
+
+} // namespace zpp::hypervisor
@@ -8,7 +8,9 @@
 #include "zpp/x64/intel/asm.h"
 #include "zpp/x64/intel/ept_pointer.h"
 #include "zpp/x64/intel/vmcs.h"
-#include "zpp/x64/intel/vmx_exit_reason.h"
+#include "zpp/x64/intel/vmcs_exit_view.h"
+#include "zpp/x64/intel/vmcs_template.h"
+#include "zpp/x64/nmi_entry.h"
 #include "zpp/x64/page_table.h"
 #include "zpp/x64/segment_descriptor.h"
 #include "zpp/x64/vm_exit_entry.h"
@@ -21,37 +23,37 @@
 
 namespace zpp::hypervisor
 {
-void hypervisor::initialize_registers()
+void hypervisor::initialize_registers(per_cpu & cpu)
 {
     // Load control registers.
-    this->guest_cr0 = x64::cr0();
-    this->guest_cr3 = x64::cr3();
-    this->guest_cr4 = x64::cr4();
-    this->guest_dr7 = x64::dr7();
+    cpu.guest_cr0 = x64::cr0();
+    cpu.guest_cr3 = x64::cr3();
+    cpu.guest_cr4 = x64::cr4();
+    cpu.guest_dr7 = x64::dr7();
 
     // Load debug control register.
-    this->ia32_debug_control =
+    cpu.ia32_debug_control =
         x64::intel::rdmsr(x64::intel::msr::ia32_debug_control);
 
     // Get the FS and GS base.
-    this->ia32_fs_base = x64::intel::rdmsr(x64::intel::msr::ia32_fs_base);
-    this->ia32_gs_base = x64::intel::rdmsr(x64::intel::msr::ia32_gs_base);
+    cpu.ia32_fs_base = x64::intel::rdmsr(x64::intel::msr::ia32_fs_base);
+    cpu.ia32_gs_base = x64::intel::rdmsr(x64::intel::msr::ia32_gs_base);
 
     // Fetch the GDT register.
     x64::gdt_layout sgdt_layout{};
     x64::sgdt(sgdt_layout.data());
-    this->gdtr.limit = sgdt_layout.limit;
-    this->gdtr.base = sgdt_layout.base;
+    cpu.gdtr.limit = sgdt_layout.limit;
+    cpu.gdtr.base = sgdt_layout.base;
 
     // Fetch the IDT register.
     x64::idt_layout sidt_layout{};
     x64::sidt(sidt_layout.data());
-    this->idtr.limit = sidt_layout.limit;
-    this->idtr.base = sidt_layout.base;
+    cpu.idtr.limit = sidt_layout.limit;
+    cpu.idtr.base = sidt_layout.base;
 
     // Load the LDTR and TR register.
-    x64::sldt(&this->guest_ldtr);
-    x64::str(&this->os_tr);
+    x64::sldt(&cpu.guest_ldtr);
+    x64::str(&cpu.os_tr);
 }
 
 void hypervisor::initialize_module_region()
@@ -64,59 +66,83 @@ void hypervisor::initialize_module_region()
         elf_file(this->module_base, elf_file::state::loaded).memory_size();
 }
 
-void hypervisor::initialize_os_page_table()
+void hypervisor::initialize_os_page_table(std::uint64_t cr3)
 {
     this->os_page_table =
-        x64::os_page_table(this->guest_cr3, this->physical_to_virtual);
+        x64::os_page_table(cr3, this->physical_to_virtual);
 }
 
-void hypervisor::initialize_host_page_table()
+zpp::error hypervisor::initialize_host_page_table(const per_cpu & cpu)
 {
     // Map the host page table into its own.
-    this->host_page_table.map_self(this->os_page_table);
+    if (!this->host_page_table.map_self(this->os_page_table)) {
+        return error::out_of_page_tables;
+    }
 
     // Map module pages.
-    this->host_page_table.map_from(
-        this->module_base,
-        this->module_size,
-        x64::page_table::protection::read |
-            x64::page_table::protection::write |
-            x64::page_table::protection::execute,
-        this->os_page_table);
-
-    // Assign the host cr3.
-    this->host_cr3 = this->host_page_table.virtual_to_physical(
-                         &this->host_page_table.head()) |
-                     (this->guest_cr3 & 0xfff);
-}
-
-zpp::error hypervisor::initialize_module_physical_to_virtual()
-{
-    // The number of pages inside the module.
-    auto number_of_pages = this->module_size / page_size;
-
-    // If there are more pages than possible, return error.
-    if (number_of_pages >= this->module_physical_to_virtual.capacity()) {
-        return error::physical_to_virtual_capacity_error;
+    if (!this->host_page_table.map_from(
+            this->module_base,
+            this->module_size,
+            x64::page_table::protection::read |
+                x64::page_table::protection::write |
+                x64::page_table::protection::execute,
+            this->os_page_table)) {
+        return error::out_of_page_tables;
     }
 
-    // The module base.
-    auto module_base = reinterpret_cast<std::uintptr_t>(this->module_base);
+    // Map the CPU memory pages.
+    if (!this->host_page_table.map_from(
+            this->cpu_memory,
+            this->cpu_memory_size,
+            x64::page_table::protection::read |
+                x64::page_table::protection::write,
+            this->os_page_table)) {
+        return error::out_of_page_tables;
+    }
 
-    // Iterate all pages and perform the virtual to physical conversion.
-    for (std::size_t i{}; i < number_of_pages; ++i) {
-        // Calculate the virtual address.
-        auto address = module_base + (page_size * i);
+    // Map the hardware page table pages.
+    for (std::size_t i{}; i < this->ept_tables.number_of_chunks(); ++i) {
+        auto & chunk = this->ept_tables.chunk_at(i);
+        if (!this->host_page_table.map_from(
+                chunk.base,
+                chunk.number_of_pages * page_size,
+                x64::page_table::protection::read |
+                    x64::page_table::protection::write,
+                this->os_page_table)) {
+            return error::out_of_page_tables;
+        }
+    }
 
-        // Calculate the physical address.
-        auto physical_address =
-            this->host_page_table.virtual_to_physical(address);
+    // Map the dirty bitmap pages, if dirty pages are tracked.
+    if (this->dirty_pages_memory &&
+        !this->host_page_table.map_from(
+            this->dirty_pages_memory,
+            this->dirty_pages_memory_size,
+            x64::page_table::protection::read |
+                x64::page_table::protection::write,
+            this->os_page_table)) {
+        return error::out_of_page_tables;
+    }
 
-        // Insert the mapping.
-        this->module_physical_to_virtual.emplace(physical_address,
-                                                 address);
+    // Map the local APIC registers uncached at their physical address,
+    // unless they are accessed through MSRs.
+    if (!this->local_apic.x2apic()) {
+        auto address = this->local_apic.physical_address();
+        if (!this->host_page_table.map_page(
+                address,
+                address,
+                x64::page_table::protection::read |
+                    x64::page_table::protection::write)) {
+            return error::out_of_page_tables;
+        }
+        this->host_page_table.page_table_entry(address)
+            .page_level_cache_disable(true);
     }
 
+    // Assign the host cr3.
+    this->host_cr3 = this->host_page_table.virtual_to_physical(
+                         &this->host_page_table.head()) |
+                     (cpu.guest_cr3 & 0xfff);
     return error::success;
 }
 
@@ -163,59 +189,64 @@ void hypervisor::initialize_host_gdt()
 
 void hypervisor::initialize_host_idt()
 {
-    // Do nothing for now.
+    // Route NMIs that arrive in root mode to the NMI entry, through a
+    // present 64 bit interrupt gate of the host code segment.
+    auto entry = reinterpret_cast<std::uint64_t>(x64::nmi_entry);
+    auto nmi_index = 2 * 2;
+    this->host_idt[nmi_index] = (entry & 0xffff) |
+                                (std::uint64_t{this->host_cs} << 16) |
+                                (0x8eull << 40) |
+                                (((entry >> 16) & 0xffff) << 48);
+    this->host_idt[nmi_index + 1] = entry >> 32;
 }
 
-void hypervisor::initialize_intermediate_gdt()
+void hypervisor::initialize_intermediate_gdt(per_cpu & cpu)
 {
     // Fetch the intermediate GDT.
     auto & intermediate_gdt =
-        this->unprotected_memory
-            .intermediate_gdt[this->next_virtual_processor - 1];
+        this->unprotected_memory.intermediate_gdt[cpu.cpuid];
 
     // Fetch the guest TSS.
-    auto & guest_tss = this->unprotected_memory
-                           .guest_tss[this->next_virtual_processor - 1];
+    auto & guest_tss = this->unprotected_memory.guest_tss[cpu.cpuid];
 
     // Copy OS Created GDT into our intermediate GDT.
     std::memcpy(intermediate_gdt,
-                reinterpret_cast<const char *>(this->gdtr.base),
-                this->gdtr.limit + 1);
+                reinterpret_cast<const char *>(cpu.gdtr.base),
+                cpu.gdtr.limit + 1);
 
     // If the TSS segment is present, just use the current OS GDT.
     if (auto task_state_segment = x64::segment_descriptor::from_memory(
             reinterpret_cast<std::uint64_t>(intermediate_gdt),
-            this->os_tr);
+            cpu.os_tr);
         task_state_segment.present()) {
         // Use the current gdtr base as guest GDT pointer.
-        this->guest_gdt_pointer =
-            reinterpret_cast<std::uint64_t *>(this->gdtr.base);
+        cpu.guest_gdt_pointer =
+            reinterpret_cast<std::uint64_t *>(cpu.gdtr.base);
 
         // Use the guest GDT as current gdtr limit.
-        this->guest_gdt_limit = this->gdtr.limit;
+        cpu.guest_gdt_limit = cpu.gdtr.limit;
 
         // Set the intermediate GDT limit as current gdtr limit.
-        this->intermediate_gdt_limit = this->gdtr.limit;
+        cpu.intermediate_gdt_limit = cpu.gdtr.limit;
 
         // Use the current TR as the guest TR.
-        this->guest_tr = this->os_tr;
+        cpu.guest_tr = cpu.os_tr;
         return;
     }
 
     // Set the guest GDT pointer to the intermediate GDT.
-    this->guest_gdt_pointer =
-        this->unprotected_memory
-            .intermediate_gdt[this->next_virtual_processor - 1];
+    cpu.guest_gdt_pointer =
+        this->unprotected_memory.intermediate_gdt[cpu.cpuid];
 
     // Increase the intermediate GDT limit by one entry.
-    this->intermediate_gdt_limit =
-        this->gdtr.limit + (2 * sizeof(std::uint64_t));
+    cpu.intermediate_gdt_limit =
+        cpu.gdtr.limit + (2 * sizeof(std::uint64_t));
 
     // Guest GDT limit is the same as intermediate GDT limit.
-    this->guest_gdt_limit = this->intermediate_gdt_limit;
+    cpu.guest_gdt_limit = cpu.intermediate_gdt_limit;
 
     // The index of the TSS segment.
-    auto tr_index = (this->gdtr.limit + 1) / sizeof(std::uint64_t);
+    auto tr_index = (cpu.gdtr.limit + 1) / sizeof(std::uint64_t);
 
     // Create a task state segment.
     x64::segment_descriptor task_state_segment;
@@ -235,36 +266,35 @@ void hypervisor::initialize_intermediate_gdt()
     // Assign the task state segment.
     intermediate_gdt[tr_index] = task_state_segment.basic_value();
     intermediate_gdt[tr_index + 1] = task_state_segment.extended_value();
-    this->guest_tr = tr_index << 3;
+    cpu.guest_tr = tr_index << 3;
 }
 
-void hypervisor::load_intermediate_gdt()
+void hypervisor::load_intermediate_gdt(per_cpu & cpu)
 {
     // Load the intermediate GDT.
     x64::gdt_layout lgdt_layout{};
     lgdt_layout.base = reinterpret_cast<std::uint64_t>(
-        this->unprotected_memory
-            .intermediate_gdt[this->next_virtual_processor - 1]);
-    lgdt_layout.limit = this->intermediate_gdt_limit;
+        this->unprotected_memory.intermediate_gdt[cpu.cpuid]);
+    lgdt_layout.limit = cpu.intermediate_gdt_limit;
     x64::lgdt(lgdt_layout.data());
 
     // Load TSS segment if changed.
-    if (this->guest_tr != this->os_tr) {
-        x64::ltr(&this->guest_tr);
+    if (cpu.guest_tr != cpu.os_tr) {
+        x64::ltr(&cpu.guest_tr);
     }
 }
 
-void hypervisor::load_os_gdt()
+void hypervisor::load_os_gdt(per_cpu & cpu)
 {
     // Load the OS GDT.
     x64::gdt_layout lgdt_layout{};
-    lgdt_layout.base = reinterpret_cast<std::uint64_t>(this->gdtr.base);
-    lgdt_layout.limit = this->gdtr.limit;
+    lgdt_layout.base = reinterpret_cast<std::uint64_t>(cpu.gdtr.base);
+    lgdt_layout.limit = cpu.gdtr.limit;
     x64::lgdt(lgdt_layout.data());
 
     // Load OS TSS segment if changed.
-    if (this->guest_tr != this->os_tr) {
-        x64::ltr(&this->os_tr);
+    if (cpu.guest_tr != cpu.os_tr) {
+        x64::ltr(&cpu.os_tr);
     }
 }
 
@@ -282,324 +312,822 @@ std::uint64_t & hypervisor::cached_vmx_msr(std::size_t msr)
     return this->vmx_msrs[msr - x64::intel::msr::vmx::begin];
 }
 
+void hypervisor::initialize_physical_address_width()
+{
+    // Read the physical address width, 36 bits if not reported.
+    std::uint32_t cpuid_result[4]{};
+    x64::cpuid(0x80000000, 0, cpuid_result);
+    this->physical_address_width = 36;
+    if (cpuid_result[0] >= 0x80000008) {
+        x64::cpuid(0x80000008, 0, cpuid_result);
+        this->physical_address_width = cpuid_result[0] & 0xff;
+    }
+
+    // The four level hardware page tables map at most 48 bits.
+    if (this->physical_address_width > 48) {
+        this->physical_address_width = 48;
+    }
+}
+
 void hypervisor::initialize_mtrrs()
 {
-    // Read the MTRR capabilities MSR.
-    this->mtrr_capabilities = x64::intel::mtrr_capabilities(
-        x64::intel::rdmsr(x64::intel::msr::ia32_mtrr_capability));
-
-    // The MTRR variable count.
-    auto variable_count =
-        this->mtrr_capabilities.variable_range_register_count();
-
-    // Iterate all MTRR registers, and read them.
-    for (std::size_t i{}; i < variable_count; ++i) {
-        // Read the base value.
-        auto mtrr_base = x64::intel::mtrr_variable_base(
-            x64::intel::rdmsr(x64::intel::msr::mtrr::physbase_0 + i * 2));
-
-        // Read the mask value.
-        auto mtrr_mask = x64::intel::mtrr_variable_mask(
-            x64::intel::rdmsr(x64::intel::msr::mtrr::physmask_0 + i * 2));
-
-        // Initialize the MTRR object.
-        auto & mtrr = this->mtrrs[i];
-        mtrr.type = mtrr_base.memory_type();
-        mtrr.valid = mtrr_mask.valid();
-        mtrr.physical_base = (mtrr_base.page_number() << 12);
-
-        // If the mask is zero, continue.
-        if (!mtrr_mask.physical_mask()) {
-            mtrr.size = {};
-            continue;
+    // Compile the memory types of the physical address space.
+    this->memory_types.read(1ull << this->physical_address_width);
+}
+
+zpp::error hypervisor::initialize_ept()
+{
+    // Allocate the epml4.
+    this->epml4 = allocate_ept_table(this->epml4_physical);
+    if (!this->epml4) {
+        return error::out_of_ept_entries;
+    }
+
+    // Whether the processor supports 1GB pages.
+    bool huge_pages = this->cached_vmx_msr(
+                          x64::intel::msr::vmx::vpid_ept_capability) &
+                      (1ull << 17);
+
+    // Fill a temporary RWX non leaf entry.
+    x64::intel::epte rwx_table;
+    rwx_table.read(true);
+    rwx_table.write(true);
+    rwx_table.execute(true);
+    rwx_table.execute_user(true);
+
+    // Fill a temporary RWX leaf entry.
+    x64::intel::epte rwx_page = rwx_table;
+
+    // The memory types are walked in address order, with the range of
+    // the last address as a cursor.
+    auto & memory_types = this->memory_types;
+    std::size_t range{};
+
+    // Returns true if the page at the given address has a single memory
+    // type, which is placed in the given entry.
+    auto uniform = [&](std::uint64_t address,
+                       std::uint64_t size,
+                       x64::intel::epte & entry) {
+        while (memory_types[range].end <= address) {
+            ++range;
+        }
+        entry.type(memory_types[range].type);
+        return memory_types[range].end >= address + size;
+    };
+
+    // Map the physical address space, an epdpt for every 512GB.
+    auto end = 1ull << this->physical_address_width;
+    for (std::uint64_t physical_address{}; physical_address < end;) {
+        // Allocate the epdpt.
+        std::uint64_t epdpt_physical{};
+        auto epdpt = allocate_ept_table(epdpt_physical);
+        if (!epdpt) {
+            return error::out_of_ept_entries;
         }
+        auto & epml4e = this->epml4[physical_address >> 39];
+        epml4e = rwx_table;
+        epml4e.page_number(epdpt_physical >> 12);
+
+        // Map every epdpt entry with a 1GB page where the memory type is
+        // uniform, else with an epd of 2MB pages, where pages whose
+        // memory type is not uniform are mapped with an ept of 4KB pages.
+        for (std::size_t i{}; i < 512 && physical_address < end; ++i) {
+            // Map with a 1GB page if possible.
+            auto & epdpte = epdpt[i];
+            epdpte = rwx_page;
+            auto uniform_type =
+                uniform(physical_address, 1ull << 30, epdpte);
+            if (uniform_type && huge_pages) {
+                epdpte.large(true);
+                epdpte.page_number(physical_address >> 12);
+                physical_address += (1ull << 30);
+                continue;
+            }
 
-        // Compute the size of the MTRR according to the number of 0s at
-        // the lower bits of the physical mask. The rule is that
-        // (address_in_range & mask == mask & base). Each found zero bit
-        // multiples the size by 2, where the minimum size is a page size,
-        // until 1 is reached.
-        mtrr.size = page_size;
-        for (auto i = mtrr_mask.physical_mask(); !(i & 1); i = (i >> 1)) {
-            mtrr.size <<= 1;
+            // Allocate the epd.
+            std::uint64_t epd_physical{};
+            auto epd = allocate_ept_table(epd_physical);
+            if (!epd) {
+                return error::out_of_ept_entries;
+            }
+            epdpte = rwx_table;
+            epdpte.page_number(epd_physical >> 12);
+
+            // Fill the epd.
+            for (std::size_t j{}; j < 512;
+                 ++j, physical_address += (1ull << 21)) {
+                // Map with a 2MB page if possible.
+                auto & epde = epd[j];
+                epde = rwx_page;
+                if (uniform(physical_address, 1ull << 21, epde)) {
+                    epde.large(true);
+                    epde.page_number(physical_address >> 12);
+                    continue;
+                }
+
+                // Allocate the ept.
+                std::uint64_t ept_physical{};
+                auto ept = allocate_ept_table(ept_physical);
+                if (!ept) {
+                    return error::out_of_ept_entries;
+                }
+                epde = rwx_table;
+                epde.page_number(ept_physical >> 12);
+
+                // Fill the ept, MTRR ranges are page aligned.
+                for (std::size_t k{}; k < 512; ++k) {
+                    auto & epte = ept[k];
+                    epte = rwx_page;
+                    uniform(
+                        physical_address + k * page_size, page_size, epte);
+                    epte.page_number((physical_address >> 12) + k);
+                }
+            }
         }
     }
+
+    return error::success;
 }
 
-void hypervisor::initialize_ept()
+zpp::error hypervisor::initialize_dirty_tracking()
 {
-    // Fill the first epml4e for 512 GB of ram.
-    this->epml4->read(true);
-    this->epml4->write(true);
-    this->epml4->execute(true);
-    this->epml4->execute_user(true);
-    this->epml4->page_number(
-        this->host_page_table.virtual_to_physical(&this->epdpt) >> 12);
-
-    // Fill a temporary RWX pdpte.
-    x64::intel::epte rwx_pdpte;
-    rwx_pdpte.read(true);
-    rwx_pdpte.write(true);
-    rwx_pdpte.execute(true);
-    rwx_pdpte.execute_user(true);
-
-    // Map every epdpt entry to a unique epd.
-    for (std::size_t i{}; i < std::extent_v<decltype(this->epdpt)>; ++i) {
-        this->epdpt[i] = rwx_pdpte;
-        this->epdpt[i].page_number(
-            this->host_page_table.virtual_to_physical(this->epd[i]) >> 12);
-    }
-
-    // Fill a temporary RWX pde.
-    x64::intel::epte rwx_pde;
-    rwx_pde.read(true);
-    rwx_pde.write(true);
-    rwx_pde.execute(true);
-    rwx_pde.execute_user(true);
-    rwx_pde.large(true);
-
-    // Fill the page directory table entries with large pages.
-    std::size_t large_page_number{};
-    for (std::size_t i{}; i < std::extent_v<decltype(this->epd)>; ++i) {
-        for (std::size_t j{};
-             j <
-             std::extent_v<std::remove_reference_t<decltype(*this->epd)>>;
-             ++j) {
-            // Calculate the physical address from the large page number.
-            auto physical_address = (large_page_number << 21);
-
-            // The current epde.
-            auto & epde = this->epd[i][j];
-            epde = rwx_pde;
-            epde.large_page_number(large_page_number);
-
-            // Advance to the next large page number.
-            ++large_page_number;
-
-            // Find MTRR.
-            auto mtrr = std::find_if(
-                std::begin(this->mtrrs),
-                std::end(this->mtrrs),
-                [&](auto & mtrr) {
-                    // If MTRR is not valid, continue.
-                    if (!mtrr.valid) {
-                        return false;
-                    }
+    namespace msr = x64::intel::msr;
+    using x64::intel::vm_execution_controls::secondary::enable_pml;
+
+    // Dirty pages are tracked if the hardware page table accessed and
+    // dirty bits are supported and the page modification log control is
+    // allowed.
+    this->dirty_tracking =
+        (this->cached_vmx_msr(msr::vmx::vpid_ept_capability) &
+         (1ull << 21)) &&
+        ((this->cached_vmx_msr(msr::vmx::processor_based_contorls_2) >>
+          32) &
+         enable_pml);
+    if (!this->dirty_tracking) {
+        return error::success;
+    }
 
-                    // If below base, continue.
-                    if (physical_address + ((1ull << 21) - 1) <
-                        mtrr.physical_base) {
-                        return false;
-                    }
+    // Allocate the dirty bitmap of the tracked memory, which must be
+    // page aligned.
+    auto limit = std::min<std::uint64_t>(
+        dirty_tracking_limit, 1ull << this->physical_address_width);
+    auto size = (dirty_bitmap::memory_size(limit) + page_size - 1) &
+                ~(page_size - 1);
+    auto memory = this->allocate(size);
+    if (!memory ||
+        (reinterpret_cast<std::uintptr_t>(memory) & (page_size - 1))) {
+        return error::allocation_failed;
+    }
 
-                    // If above end, continue.
-                    if (physical_address >=
-                        mtrr.physical_base + mtrr.size) {
-                        return false;
-                    }
-                    return true;
-                });
+    // Track the memory below the limit.
+    this->dirty_pages_memory = memory;
+    this->dirty_pages_memory_size = size;
+    this->dirty_pages.attach(memory, limit);
+    return error::success;
+}
 
-            // If MTRR not found, set to write back.
-            if (std::end(this->mtrrs) == mtrr) {
-                epde.type(x64::memory_type::write_back);
-                continue;
-            }
+bool hypervisor::grow_ept_pool()
+{
+    // If the pool can no longer grow, fail.
+    if (!this->allocate) {
+        return false;
+    }
+
+    // Allocate the memory, which must be page aligned.
+    auto memory = this->allocate(ept_pool_growth * page_size);
+    if (!memory ||
+        (reinterpret_cast<std::uintptr_t>(memory) & (page_size - 1))) {
+        return false;
+    }
+
+    // Add the memory to the pool.
+    return this->ept_tables.add(
+        memory, ept_pool_growth, [&](auto address) {
+            return this->os_page_table.virtual_to_physical(address);
+        });
+}
+
+x64::intel::epte *
+hypervisor::allocate_ept_table(std::uint64_t & physical_address)
+{
+    // Allocate from the pool.
+    if (auto table = this->ept_tables.allocate(physical_address)) {
+        return table;
+    }
+
+    // Grow the pool and allocate from it.
+    if (!grow_ept_pool()) {
+        return nullptr;
+    }
+    return this->ept_tables.allocate(physical_address);
+}
+
+bool hypervisor::split_ept_entry(x64::intel::epte & entry,
+                                 std::uint64_t size)
+{
+    // Allocate the table.
+    std::uint64_t table_physical_address{};
+    auto table = allocate_ept_table(table_physical_address);
+    if (!table) {
+        return false;
+    }
+
+    // Map the page with pages of a 512th of its size, keeping the memory
+    // type of the page, with the access that the protection map allows.
+    auto entry_size = size / 512;
+    auto physical_address = (entry.page_number() << 12) & ~(size - 1);
+    auto & protections = this->ept_protections;
+    for (std::size_t i{}; i < 512; ++i) {
+        auto & table_entry = table[i];
+        auto table_entry_address = physical_address + i * entry_size;
+        table_entry = entry;
+        table_entry.large(page_size != entry_size);
+        table_entry.page_number(table_entry_address >> 12);
+        ept_access(table_entry,
+                   (page_size == entry_size)
+                       ? protections.get(table_entry_address)
+                       : protections.common(table_entry_address,
+                                            entry_size));
+    }
+
+    // Make the entry point to the table, written at once as other CPUs
+    // may walk it.
+    x64::intel::epte table_pointer;
+    ept_access(table_pointer, ept_protection_map::all);
+    table_pointer.page_number(table_physical_address >> 12);
+    entry = table_pointer;
+
+    // The access of 4KB pages is held by their entries.
+    if (page_size == entry_size) {
+        protections.erase(physical_address);
+    }
+    return true;
+}
+
+zpp::error hypervisor::set_ept_access(std::uint64_t physical_address,
+                                      unsigned access)
+{
+    // Get the entry that maps the page, the page must be within the
+    // hardware page tables.
+    std::uint64_t size{};
+    auto entry = ept_leaf_entry(physical_address, size);
+    if (!entry) {
+        return error::out_of_ept_entries;
+    }
 
-            // Set the type to be the MTRR type.
-            epde.type(mtrr->type);
+    // If the page is large, record the access in the protection map and
+    // give the large page the access that all of its pages allow.
+    if (page_size != size &&
+        this->ept_protections.set(physical_address, access)) {
+        ept_access(*entry,
+                   this->ept_protections.common(
+                       physical_address & ~(size - 1), size));
+        return error::success;
+    }
+
+    // The map is full, split the large pages down to a 4KB page.
+    while (page_size != size) {
+        if (!split_ept_entry(*entry, size)) {
+            return error::out_of_ept_entries;
         }
+        entry = ept_leaf_entry(physical_address, size);
     }
+
+    // Set the access of the 4KB page.
+    ept_access(*entry, access);
+    return error::success;
 }
 
-zpp::error hypervisor::protect_module()
+zpp::error hypervisor::protect_memory(const void * base, std::size_t size)
 {
-    std::size_t ept_index = 0;
-    auto ept_count = std::extent_v<decltype(this->ept)>;
-    auto number_of_pages = this->module_size / page_size;
-    auto & host_page_table = this->host_page_table;
+    auto number_of_pages = size / page_size;
 
     // Iterate all pages.
-    for (std::size_t i{}; i < number_of_pages;) {
+    for (std::size_t i{}; i < number_of_pages; ++i) {
         // Calculate the address.
-        auto address = this->module_base + (i * page_size);
+        auto address =
+            static_cast<const unsigned char *>(base) + (i * page_size);
 
         // Get the physical address.
         auto physical_address =
-            host_page_table.virtual_to_physical(address);
-
-        // Get the epde.
-        auto & epde = this->epd[physical_address >> 30]
-                               [(physical_address >> 21) & 0x1ff];
-
-        // If the epde is not large, get the relevant epte and update it.
-        if (!epde.large()) {
-            // The ept physical address.
-            auto ept_physical_address = epde.page_number() << 12;
-
-            // Find the virtual address of the ept.
-            auto ept = reinterpret_cast<x64::intel::epte *>(
-                this->module_physical_to_virtual
-                    .find(ept_physical_address)
-                    ->second);
-
-            // Protect the epte.
-            auto & epte = ept[(physical_address >> 12) & 0x1ff];
-            epte.read(false);
-            epte.write(false);
-            epte.execute(false);
-            epte.execute_user(false);
-
-            // Continue to the next page.
-            ++i;
-            continue;
-        }
+            this->os_page_table.virtual_to_physical(address);
 
-        // Convert large epde into ept table.
-        auto & ept = this->ept[ept_index];
-        auto memory_type = epde.type();
-        auto page_number = (epde.large_page_number() << (21 - 12));
-        for (std::size_t j{}; j < 512; ++j) {
-            auto & epte = ept[j];
-            epte.read(true);
-            epte.write(true);
-            epte.execute(true);
-            epte.execute_user(true);
-            epte.page_number(page_number + j);
-            epte.type(memory_type);
+        // Deny any guest access to the page.
+        if (auto error = set_ept_access(physical_address,
+                                        ept_protection_map::none);
+            !error) {
+            return error;
         }
+    }
 
-        // Make the epde point to ept.
-        epde.large(false);
-        epde.type({});
-        epde.page_number(host_page_table.virtual_to_physical(ept) >> 12);
+    return error::success;
+}
 
-        // Move to the next ept.
-        ++ept_index;
+zpp::error hypervisor::protect_hypervisor_memory()
+{
+    // Protect module.
+    if (auto error = protect_memory(this->module_base, this->module_size);
+        !error) {
+        return error;
+    }
 
-        // If out of ept entries, return error.
-        if (ept_index == ept_count) {
-            return error::out_of_ept_entries;
-        }
+    // Protect the CPU memory.
+    if (auto error =
+            protect_memory(this->cpu_memory, this->cpu_memory_size);
+        !error) {
+        return error;
+    }
+
+    // Protect the dirty bitmap.
+    if (auto error = protect_memory(this->dirty_pages_memory,
+                                    this->dirty_pages_memory_size);
+        !error) {
+        return error;
+    }
 
-        // Protect our module epte.
-        auto & epte = ept[(physical_address >> 12) & 0x1ff];
-        epte.read(false);
-        epte.write(false);
-        epte.execute(false);
-        epte.execute_user(false);
+    // Protect the hardware page tables, the pool may grow while its own
+    // chunks are protected, which adds chunks to protect. Once all
+    // chunks are protected, keep a reserve of tables for the splits made
+    // after the initialization, when the pool can no longer grow. A
+    // region of the protection map splits at most its 2MB page and its
+    // 1GB page, so the splits never run out of tables.
+    for (std::size_t i{};; ++i) {
+        if (i == this->ept_tables.number_of_chunks()) {
+            if (this->ept_tables.available() >=
+                2 * this->ept_protections.size()) {
+                break;
+            }
+            if (!grow_ept_pool()) {
+                return error::out_of_ept_entries;
+            }
+        }
 
-        // Move to the next page.
-        ++i;
+        auto & chunk = this->ept_tables.chunk_at(i);
+        if (auto error = protect_memory(chunk.base,
+                                        chunk.number_of_pages * page_size);
+            !error) {
+            return error;
+        }
     }
 
+    // Allow guest access to unprotected memory.
+    unprotect_guest_memory();
     return error::success;
 }
 
+void hypervisor::drain_page_modification_log(
+    x64::intel::vmcs_exit_view & vmcs, std::size_t cpuid)
+{
+    // If dirty pages are not tracked, there is no log.
+    if (!this->dirty_tracking) {
+        return;
+    }
+
+    // The log is filled from its last entry down, the index is of the
+    // next entry to fill, and wraps around once the log is full.
+    auto first = std::size_t((vmcs.pml_index() + 1) & 0xffff);
+    if (first >= pml_entries) {
+        return;
+    }
+
+    // Mark the pages of the logged guest physical addresses, walking the
+    // hardware page tables without the lock, where a concurrent split
+    // only makes the marked range larger.
+    auto & log = this->pml_buffers[cpuid];
+    for (auto i = first; i < pml_entries; ++i) {
+        auto physical_address = log[i] & ~(page_size - 1);
+        std::uint64_t size = page_size;
+        ept_leaf_entry(physical_address, size);
+        this->dirty_pages.mark(physical_address & ~(size - 1), size);
+    }
+
+    // Empty the log.
+    vmcs.pml_index(pml_entries - 1);
+}
+
+std::size_t hypervisor::read_dirty_pages(std::uint64_t physical_address,
+                                         std::uint64_t * words,
+                                         std::size_t count)
+{
+    constexpr auto word_size = dirty_bitmap::pages_per_word * page_size;
+
+    // Read up to the tracked limit.
+    count = std::min<std::uint64_t>(
+        count, (this->dirty_pages.limit() - physical_address) / word_size);
+
+    // Clear the dirty bits of the entries that map the dirty pages, in a
+    // single batch, whose commit waits for every CPU to invalidate.
+    ept_batch batch{*this};
+    for (std::size_t i{}; i < count; ++i) {
+        auto address = physical_address + i * word_size;
+
+        // Read and clear the dirty bits first. A write that lands before
+        // the entry dirty bit is cleared below is not logged, but it
+        // precedes the guest reading the reported page.
+        auto dirty = this->dirty_pages.exchange(address);
+        words[i] = dirty;
+
+        // Clear the entry of every dirty page, once per large page.
+        for (auto pages = dirty; pages;) {
+            auto page = address + __builtin_ctzll(pages) * page_size;
+            std::uint64_t size = page_size;
+            auto entry = ept_leaf_entry(page, size);
+            if (entry && entry->dirty()) {
+                auto value = *entry;
+                value.dirty(false);
+                batch.write(*entry, value);
+            }
+
+            // Skip the other pages of the entry within the word.
+            auto next = (page | (size - 1)) + 1;
+            pages = (next - address >= word_size)
+                        ? 0
+                        : pages & ~((1ull << ((next - address) /
+                                               page_size)) -
+                                    1);
+        }
+    }
+
+    // Commit, and report the pages once every CPU has invalidated.
+    batch.commit();
+    return count;
+}
+
+void hypervisor::synchronize_dirty_pages()
+{
+    // Advance the generation and wait for every CPU, which drains its
+    // log when it acknowledges.
+    wait_for_ept(
+        this->ept_generation.fetch_add(1, std::memory_order_seq_cst) + 1);
+}
+
 void hypervisor::unprotect_guest_memory()
 {
-    auto number_of_pages = sizeof(this->unprotected_memory) / page_size;
+    auto number_of_pages = this->unprotected_memory.size / page_size;
 
     // Iterate all pages.
     for (std::size_t i{}; i < number_of_pages; ++i) {
         // Calculate the address.
-        auto address =
-            reinterpret_cast<unsigned char *>(&this->unprotected_memory) +
-            (i * page_size);
+        auto address = this->unprotected_memory.base + (i * page_size);
 
         // Get the physical address.
         auto physical_address =
-            this->host_page_table.virtual_to_physical(address);
+            this->os_page_table.virtual_to_physical(address);
+
+        // Allow any guest access to the page, which was protected, so
+        // this never needs a table.
+        set_ept_access(physical_address, ept_protection_map::all);
+    }
+}
 
-        // Get the epde.
-        auto & epde = this->epd[physical_address >> 30]
-                               [(physical_address >> 21) & 0x1ff];
+x64::intel::epte *
+hypervisor::ept_directory_pointer_entry(std::uint64_t physical_address)
+{
+    // If the address is beyond the hardware page tables, there is no
+    // epdpte.
+    if (!this->epml4 ||
+        (physical_address >> this->physical_address_width)) {
+        return nullptr;
+    }
 
-        // The ept physical address.
-        auto ept_physical_address = epde.page_number() << 12;
+    // Find the virtual address of the epdpt.
+    auto epdpt = this->ept_tables.table(
+        this->epml4[physical_address >> 39].page_number() << 12);
 
-        // Find the virtual address of the ept.
-        auto ept = reinterpret_cast<x64::intel::epte *>(
-            this->module_physical_to_virtual.find(ept_physical_address)
-                ->second);
+    // Return the epdpte.
+    return &epdpt[(physical_address >> 30) & 0x1ff];
+}
 
-        // Make epte accessible.
-        auto & epte = ept[(physical_address >> 12) & 0x1ff];
-        epte.read(true);
-        epte.write(true);
-        epte.execute(true);
-        epte.execute_user(true);
+x64::intel::epte *
+hypervisor::ept_directory_entry(std::uint64_t physical_address)
+{
+    // Get the epdpte, if missing, empty or a 1GB page, there is no epde.
+    auto epdpte = ept_directory_pointer_entry(physical_address);
+    if (!epdpte || !epdpte->value() || epdpte->large()) {
+        return nullptr;
     }
+
+    // Find the virtual address of the epd.
+    auto epd = this->ept_tables.table(epdpte->page_number() << 12);
+
+    // Return the epde.
+    return &epd[(physical_address >> 21) & 0x1ff];
 }
 
-void hypervisor::initialize_vmx()
+x64::intel::epte * hypervisor::ept_entry(std::uint64_t physical_address)
+{
+    // Get the epde, if missing or large, there is no epte.
+    auto epde = ept_directory_entry(physical_address);
+    if (!epde || epde->large()) {
+        return nullptr;
+    }
+
+    // Find the virtual address of the ept.
+    auto ept = this->ept_tables.table(epde->page_number() << 12);
+
+    // Return the epte.
+    return &ept[(physical_address >> 12) & 0x1ff];
+}
+
+void hypervisor::invalidate_ept()
+{
+    // Invalidate the translations of the EPT pointer, or of every EPT
+    // pointer if single context invalidation is not supported.
+    bool single_context = this->cached_vmx_msr(
+                              x64::intel::msr::vmx::vpid_ept_capability) &
+                          (1ull << 25);
+    std::uint64_t descriptor[2]{this->eptp};
+    x64::intel::invept(reinterpret_cast<void *>(single_context ? 1 : 2),
+                       descriptor);
+}
+
+void hypervisor::acknowledge_ept(per_cpu & cpu)
+{
+    // If the current generation was acknowledged, there is nothing to do.
+    auto generation = this->ept_generation.load(std::memory_order_seq_cst);
+    if (cpu.ept_generation.load(std::memory_order_relaxed) == generation) {
+        return;
+    }
+
+    // Invalidate, drain the page modification log so that the dirty
+    // pages of the CPU are reported, and acknowledge.
+    invalidate_ept();
+    if (cpu.exit_vmcs) {
+        drain_page_modification_log(*cpu.exit_vmcs, cpu.cpuid);
+    }
+    cpu.ept_generation.store(generation, std::memory_order_seq_cst);
+}
+
+void hypervisor::wait_for_ept(std::uint64_t generation)
+{
+    auto & current = per_cpu::current();
+    std::uint64_t resend_tsc{};
+
+    while (true) {
+        // Acknowledge on the current CPU.
+        acknowledge_ept(current);
+
+        // Find the CPUs that did not acknowledge, and send them an NMI
+        // when due, counting it first so that it is not delivered to the
+        // guest.
+        bool resend = x64::rdtsc() >= resend_tsc;
+        bool acknowledged = true;
+        for (std::size_t i{}; i < this->number_of_cpus; ++i) {
+            auto & cpu = this->cpus[i];
+            if (cpu.ept_generation.load(std::memory_order_seq_cst) >=
+                generation) {
+                continue;
+            }
+
+            acknowledged = false;
+            if (resend) {
+                cpu.shootdown_nmis.fetch_add(1, std::memory_order_release);
+                this->local_apic.send_nmi(cpu.apic_id);
+            }
+        }
+
+        // Done once every CPU acknowledged.
+        if (acknowledged) {
+            return;
+        }
+
+        // Schedule the next resend.
+        if (resend) {
+            resend_tsc = x64::rdtsc() + shootdown_resend_cycles;
+        }
+        asm("pause");
+    }
+}
+
+void hypervisor::deliver_nmis(x64::intel::vmcs_exit_view & vmcs,
+                              per_cpu & cpu)
+{
+    // The NMIs beyond those sent for shootdowns are the guest's, as the
+    // NMIs that arrive together are merged into one.
+    if (auto nmis = cpu.nmis.exchange(0, std::memory_order_acquire)) {
+        auto sent =
+            cpu.shootdown_nmis.exchange(0, std::memory_order_acquire);
+        if (nmis > sent) {
+            cpu.guest_nmis += nmis - sent;
+        }
+    }
+
+    // Exit on an NMI window while an NMI of the guest is pending.
+    if (bool(cpu.guest_nmis) != cpu.nmi_window) {
+        cpu.nmi_window = !cpu.nmi_window;
+        nmi_window_exiting(vmcs, cpu.nmi_window);
+    }
+}
+
+hypervisor::ept_batch::ept_batch(hypervisor & hypervisor) :
+    m_hypervisor(hypervisor)
+{
+    // Lock the hardware page tables.
+    while (m_hypervisor.ept_lock.exchange(true,
+                                          std::memory_order_acquire)) {
+        asm("pause");
+    }
+}
+
+hypervisor::ept_batch::~ept_batch()
+{
+    if (!m_committed) {
+        commit();
+    }
+}
+
+zpp::error
+hypervisor::ept_batch::set_access(std::uint64_t physical_address,
+                                  unsigned access)
+{
+    // Removing access requires the other CPUs to invalidate.
+    if (m_hypervisor.ept_page_access(physical_address) & ~access) {
+        m_shootdown = true;
+    }
+    m_modified = true;
+    return m_hypervisor.set_ept_access(physical_address, access);
+}
+
+bool hypervisor::ept_batch::split(x64::intel::epte & entry,
+                                  std::uint64_t size)
+{
+    // A split keeps the access of the pages, stale large translations of
+    // other CPUs are invalidated when they fault.
+    m_modified = true;
+    return m_hypervisor.split_ept_entry(entry, size);
+}
+
+void hypervisor::ept_batch::write(x64::intel::epte & entry,
+                                  x64::intel::epte value)
+{
+    // Clearing bits or remapping requires the other CPUs to invalidate.
+    if ((entry.value() & ~value.value()) ||
+        entry.page_number() != value.page_number()) {
+        m_shootdown = true;
+    }
+    m_modified = true;
+    entry = value;
+}
+
+std::uint64_t hypervisor::ept_batch::commit()
+{
+    auto & hypervisor = m_hypervisor;
+    m_committed = true;
+
+    // Without a shootdown, invalidate the translations of the current
+    // CPU, and release the lock.
+    if (!m_shootdown) {
+        if (m_modified) {
+            hypervisor.invalidate_ept();
+        }
+        hypervisor.ept_lock.store(false, std::memory_order_release);
+        return hypervisor.ept_generation.load(std::memory_order_relaxed);
+    }
+
+    // Advance the generation, and release the lock before waiting, so
+    // that a CPU that waits for the lock is not waited for in turn.
+    auto generation =
+        hypervisor.ept_generation.fetch_add(1, std::memory_order_seq_cst) +
+        1;
+    hypervisor.ept_lock.store(false, std::memory_order_release);
+
+    // Wait for every CPU, including the current CPU, to invalidate.
+    hypervisor.wait_for_ept(generation);
+    return generation;
+}
+
+x64::intel::epte *
+hypervisor::ept_leaf_entry(std::uint64_t physical_address,
+                           std::uint64_t & size)
+{
+    // Get the epdpte, if missing, there is no entry.
+    auto epdpte = ept_directory_pointer_entry(physical_address);
+    if (!epdpte) {
+        return nullptr;
+    }
+
+    // A 1GB page.
+    if (epdpte->large()) {
+        size = 1ull << 30;
+        return epdpte;
+    }
+
+    // A 2MB page.
+    auto epde = ept_directory_entry(physical_address);
+    if (epde->large()) {
+        size = 1ull << 21;
+        return epde;
+    }
+
+    // A 4KB page.
+    size = page_size;
+    return ept_entry(physical_address);
+}
+
+unsigned hypervisor::ept_page_access(std::uint64_t physical_address)
+{
+    // Get the entry that maps the page, if missing, the page is beyond
+    // the hardware page tables and has any access.
+    std::uint64_t size{};
+    auto entry = ept_leaf_entry(physical_address, size);
+    if (!entry) {
+        return ept_protection_map::all;
+    }
+
+    // The access of a page within a large page is in the protection map.
+    if (page_size != size) {
+        return this->ept_protections.get(physical_address);
+    }
+    return ept_access(*entry);
+}
+
+unsigned hypervisor::ept_access(const x64::intel::epte & entry)
+{
+    unsigned access = ept_protection_map::none;
+    if (entry.read()) {
+        access |= ept_protection_map::read;
+    }
+    if (entry.write()) {
+        access |= ept_protection_map::write;
+    }
+    if (entry.execute()) {
+        access |= ept_protection_map::execute;
+    }
+    return access;
+}
+
+void hypervisor::ept_access(x64::intel::epte & entry, unsigned access)
+{
+    entry.read(access & ept_protection_map::read);
+    entry.write(access & ept_protection_map::write);
+    entry.execute(access & ept_protection_map::execute);
+    entry.execute_user(access & ept_protection_map::execute);
+}
+
+void hypervisor::initialize_vmx(per_cpu & cpu)
 {
     namespace msr = x64::intel::msr;
 
     // The VMX and VMCS regions.
-    auto & vmx = this->vmx[this->next_virtual_processor - 1];
-    auto & vmx_vmcs = this->vmx_vmcs[this->next_virtual_processor - 1];
+    auto & vmx = this->vmx[cpu.cpuid];
+    auto & vmx_vmcs = this->vmx_vmcs[cpu.cpuid];
 
     // Get the value of the basic VMX msr.
     const auto & basic_msr = this->cached_vmx_msr(msr::vmx::basic);
 
     // Convert virtual addresses to physical addresses for VMX state.
-    this->vmx_physical = this->host_page_table.virtual_to_physical(&vmx);
-    this->vmcs_physical =
+    cpu.vmx_physical = this->host_page_table.virtual_to_physical(&vmx);
+    cpu.vmcs_physical =
         this->host_page_table.virtual_to_physical(&vmx_vmcs);
-    this->epml4_physical =
-        this->host_page_table.virtual_to_physical(&this->epml4);
-    this->msr_bitmap_physical =
-        this->host_page_table.virtual_to_physical(&this->msr_bitmap);
 
     // Assign the revision IDs for the VMX and VMCS regions.
     vmx.revision_id = basic_msr & 0xffffffff;
     vmx_vmcs.revision_id = basic_msr & 0xffffffff;
 
     // Set host cr0 and cr4 to guest values.
-    this->host_cr0 = this->guest_cr0;
-    this->host_cr4 = this->guest_cr4;
+    cpu.host_cr0 = cpu.guest_cr0;
+    cpu.host_cr4 = cpu.guest_cr4;
 
     // Adjust the cr0 according to the MSR restrictions.
-    this->host_cr0 &=
+    cpu.host_cr0 &=
         this->cached_vmx_msr(msr::vmx::cr0_fixed_1) & 0xffffffff;
-    this->host_cr0 |=
+    cpu.host_cr0 |=
         this->cached_vmx_msr(msr::vmx::cr0_fixed_0) & 0xffffffff;
 
     // Adjust the cr4 according to the MSR restrictions.
-    this->host_cr4 &=
+    cpu.host_cr4 &=
         this->cached_vmx_msr(msr::vmx::cr4_fixed_1) & 0xffffffff;
-    this->host_cr4 |=
+    cpu.host_cr4 |=
         this->cached_vmx_msr(msr::vmx::cr4_fixed_0) & 0xffffffff;
 }
 
-zpp::error hypervisor::enter_root_mode()
+zpp::error hypervisor::enter_root_mode(per_cpu & cpu)
 {
     // Backup cr0 and cr4.
     auto cr0 = x64::cr0();
     auto cr4 = x64::cr4();
 
     // Change cr0.
-    x64::cr0(this->host_cr0);
+    x64::cr0(cpu.host_cr0);
     scope_guard restore_cr0 = [&] { x64::cr0(cr0); };
 
     // Change cr4.
-    x64::cr4(this->host_cr4);
+    x64::cr4(cpu.host_cr4);
     scope_guard restore_cr4 = [&] { x64::cr4(cr4); };
 
     // Turn on vmx.
-    if (x64::intel::vmxon(&this->vmx_physical)) {
+    if (x64::intel::vmxon(&cpu.vmx_physical)) {
         return error::vmxon_failed;
     }
     scope_guard turn_off_vmx{x64::intel::vmxoff};
 
     // Clear the vmcs.
-    if (x64::intel::vmclear(&this->vmcs_physical)) {
+    if (x64::intel::vmclear(&cpu.vmcs_physical)) {
         return error::vmclear_failed;
     }
 
     // Load the vmcs structure.
-    if (x64::intel::vmptrld(&this->vmcs_physical)) {
+    if (x64::intel::vmptrld(&cpu.vmcs_physical)) {
         return error::vmptrld_failed;
     }
 
@@ -610,30 +1138,46 @@ zpp::error hypervisor::enter_root_mode()
     return error::success;
 }
 
-void hypervisor::setup_vmcs(x64::context & guest_context)
+zpp::error hypervisor::initialize_vmcs_template()
 {
     namespace msr = x64::intel::msr;
+    using field = x64::intel::vmcs_fields::vmcs_field;
 
-    auto & vmcs = this->vmcs;
+    auto & vmcs = this->shared_vmcs;
 
-    // Set invalid link pointer.
-    vmcs.vmcs_link_pointer(0xffffffffffffffffull);
+    // Convert virtual addresses to physical addresses for shared state,
+    // the EPML4 physical address was set by its allocation.
+    this->msr_bitmap_physical =
+        this->host_page_table.virtual_to_physical(&this->msr_bitmap);
 
-    // Set virtual processor id.
-    vmcs.vpid(this->next_virtual_processor);
+    // Start from an empty template.
+    vmcs.clear();
+
+    // Set invalid link pointer.
+    vmcs.set(field::vmcs_link_pointer, 0xffffffffffffffffull);
 
     // Setup the EPT pointer.
     x64::intel::ept_pointer eptp;
     eptp.memory_type(x64::memory_type::write_back);
     eptp.page_walk_length(4);
     eptp.page_number(this->epml4_physical >> 12);
-    vmcs.ept_pointer(eptp);
+    eptp.access_and_dirty(this->dirty_tracking);
+    vmcs.set(field::ept_pointer, eptp);
+    this->eptp = eptp;
 
     // Set msr bitmap.
-    vmcs.msr_bitmap(this->msr_bitmap_physical);
+    vmcs.set(field::msr_bitmap, this->msr_bitmap_physical);
+
+    // Log the modified pages if dirty pages are tracked.
+    std::uint64_t secondary_controls{};
+    if (this->dirty_tracking) {
+        secondary_controls =
+            x64::intel::vm_execution_controls::secondary::enable_pml;
+    }
 
     // Secondary execution control.
-    vmcs.secondary_processor_based_vm_execution_controls(
+    vmcs.set(
+        field::secondary_processor_based_vm_execution_controls,
         x64::intel::adjust_msr(
             this->cached_vmx_msr(msr::vmx::processor_based_contorls_2),
             x64::intel::vm_execution_controls::secondary::enable_ept |
@@ -645,134 +1189,249 @@ void hypervisor::setup_vmcs(x64::context & guest_context)
                 x64::intel::vm_execution_controls::secondary::
                     enable_xsaves_xrstors |
                 x64::intel::vm_execution_controls::secondary::
-                    mode_based_execute_control));
+                    mode_based_execute_control |
+                secondary_controls));
+
+    // The profiler uses the VMX preemption timer, whose value is saved
+    // on exit so that it counts only guest execution. It is supported
+    // only if both controls may be set, in which case both are set.
+    using x64::intel::vm_exit_controls::save_vmx_preemption_timer_value;
+    using x64::intel::vm_execution_controls::pin_based::
+        activate_vmx_preemption_timer;
+    this->profiler_supported =
+        ZPP_HYPERVISOR_PROFILER_INTERVAL &&
+        ((this->cached_vmx_msr(msr::vmx::true_pin_based_controls) >> 32) &
+         activate_vmx_preemption_timer) &&
+        ((this->cached_vmx_msr(msr::vmx::true_exit_controls) >> 32) &
+         save_vmx_preemption_timer_value);
+    std::uint64_t pin_based_controls{};
+    std::uint64_t exit_controls{};
+    if (this->profiler_supported) {
+        pin_based_controls = activate_vmx_preemption_timer;
+        exit_controls = save_vmx_preemption_timer_value;
+    }
 
-    // Pin based execution controls.
-    vmcs.pin_based_vm_execution_controls(x64::intel::adjust_msr(
-        this->cached_vmx_msr(msr::vmx::true_pin_based_controls), 0));
+    // NMIs exit, so that shootdown NMIs are not delivered to the guest,
+    // whose own NMIs are injected when it can take them.
+    pin_based_controls |=
+        x64::intel::vm_execution_controls::pin_based::nmi_exiting |
+        x64::intel::vm_execution_controls::pin_based::virtual_nmis;
 
-    // Primary execution controls.
-    vmcs.primary_processor_based_vm_execution_controls(
+    // Pin based execution controls.
+    pin_based_controls = x64::intel::adjust_msr(
+        this->cached_vmx_msr(msr::vmx::true_pin_based_controls),
+        pin_based_controls);
+    vmcs.set(field::pin_based_vm_execution_controls, pin_based_controls);
+
+    // Primary execution controls. The guest exits on an NMI window before
+    // its first instruction, and once a CPU exits it can be interrupted
+    // by shootdowns, see per_cpu::ept_generation.
+    vmcs.set(
+        field::primary_processor_based_vm_execution_controls,
         x64::intel::adjust_msr(
             this->cached_vmx_msr(msr::vmx::true_processor_based_controls),
             x64::intel::vm_execution_controls::primary::
                     enable_secondary_controls |
                 x64::intel::vm_execution_controls::primary::
-                    enable_msr_bitmaps));
+                    enable_msr_bitmaps |
+                x64::intel::vm_execution_controls::primary::
+                    nmi_window_exiting));
 
     // VM exit in 64 bit address space.
-    vmcs.vm_exit_controls(x64::intel::adjust_msr(
+    exit_controls = x64::intel::adjust_msr(
         this->cached_vmx_msr(msr::vmx::true_exit_controls),
-        x64::intel::vm_exit_controls::host_address_space_size));
+        x64::intel::vm_exit_controls::host_address_space_size |
+            exit_controls);
+    vmcs.set(field::vm_exit_controls, exit_controls);
 
     // VM entry in 64 bit address space.
-    vmcs.vm_entry_controls(x64::intel::adjust_msr(
-        this->cached_vmx_msr(msr::vmx::true_entry_controls),
-        x64::intel::vm_entry_controls::ia_32e_mode_guest));
+    vmcs.set(field::vm_entry_controls,
+             x64::intel::adjust_msr(
+                 this->cached_vmx_msr(msr::vmx::true_entry_controls),
+                 x64::intel::vm_entry_controls::ia_32e_mode_guest));
+
+    // Host segment selectors.
+    vmcs.set(field::host_cs_selector, this->host_cs);
+    vmcs.set(field::host_ds_selector, 0);
+    vmcs.set(field::host_es_selector, 0);
+    vmcs.set(field::host_fs_selector, 0);
+    vmcs.set(field::host_gs_selector, 0);
+    vmcs.set(field::host_ss_selector, 0);
+    vmcs.set(field::host_tr_selector, this->host_tr);
+
+    // Host segment bases, the host GS base is per CPU.
+    vmcs.set(field::host_fs_base,
+             reinterpret_cast<std::uint64_t>(this->fs_data));
+    vmcs.set(field::host_tr_base,
+             reinterpret_cast<std::uint64_t>(this->host_tss));
+
+    // Host descriptor tables.
+    vmcs.set(field::host_gdtr_base,
+             reinterpret_cast<std::uint64_t>(this->host_gdt));
+    vmcs.set(field::host_idtr_base,
+             reinterpret_cast<std::uintptr_t>(this->host_idt));
+
+    // Host CR3.
+    vmcs.set(field::host_cr3, this->host_cr3);
+
+    // Fail if a field did not fit.
+    if (vmcs.overflowed()) {
+        return x64::intel::vmcs_error::fail;
+    }
+
+    return error::success;
+}
+
+zpp::error hypervisor::setup_vmcs(per_cpu & cpu,
+                                  x64::context & guest_context)
+{
+    using field = x64::intel::vmcs_fields::vmcs_field;
+
+    // Write the fields that are identical on every CPU.
+    if (auto error = this->shared_vmcs.apply(); !error) {
+        return error;
+    }
+
+    // The fields of this CPU, written in a single batch.
+    x64::intel::vmcs_template<64> vmcs;
+
+    // Set virtual processor id.
+    vmcs.set(field::vpid, cpu.virtual_processor);
+
+    // Point the host GS base to the state of this CPU.
+    vmcs.set(field::host_gs_base, reinterpret_cast<std::uint64_t>(&cpu));
+
+    // Set the empty page modification log of this CPU.
+    if (this->dirty_tracking) {
+        vmcs.set(field::pml_address,
+                 this->host_page_table.virtual_to_physical(
+                     &this->pml_buffers[cpu.cpuid]));
+        vmcs.set(field::pml_index, pml_entries - 1);
+    }
 
     // Get the GDT base.
     auto intermediate_gdt_base = reinterpret_cast<std::uint64_t>(
-        this->unprotected_memory
-            .intermediate_gdt[this->next_virtual_processor - 1]);
+        this->unprotected_memory.intermediate_gdt[cpu.cpuid]);
 
     // Write segment information.
     auto descriptor = x64::segment_descriptor::from_memory(
         intermediate_gdt_base, guest_context.cs);
-    vmcs.guest_cs_selector(guest_context.cs);
-    vmcs.guest_cs_limit(descriptor.limit());
-    vmcs.guest_cs_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_cs_base(descriptor.context_dependent_base());
-    vmcs.host_cs_selector(this->host_cs);
+    vmcs.set(field::guest_cs_selector, guest_context.cs);
+    vmcs.set(field::guest_cs_limit, descriptor.limit());
+    vmcs.set(field::guest_cs_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_cs_base, descriptor.context_dependent_base());
 
     descriptor = x64::segment_descriptor::from_memory(
         intermediate_gdt_base, guest_context.ds);
-    vmcs.guest_ds_selector(guest_context.ds);
-    vmcs.guest_ds_limit(descriptor.limit());
-    vmcs.guest_ds_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_ds_base(descriptor.context_dependent_base());
-    vmcs.host_ds_selector(0);
+    vmcs.set(field::guest_ds_selector, guest_context.ds);
+    vmcs.set(field::guest_ds_limit, descriptor.limit());
+    vmcs.set(field::guest_ds_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_ds_base, descriptor.context_dependent_base());
 
     descriptor = x64::segment_descriptor::from_memory(
         intermediate_gdt_base, guest_context.es);
-    vmcs.guest_es_selector(guest_context.es);
-    vmcs.guest_es_limit(descriptor.limit());
-    vmcs.guest_es_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_es_base(descriptor.context_dependent_base());
-    vmcs.host_es_selector(0);
+    vmcs.set(field::guest_es_selector, guest_context.es);
+    vmcs.set(field::guest_es_limit, descriptor.limit());
+    vmcs.set(field::guest_es_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_es_base, descriptor.context_dependent_base());
 
     descriptor = x64::segment_descriptor::from_memory(
         intermediate_gdt_base, guest_context.fs);
-    vmcs.guest_fs_selector(guest_context.fs);
-    vmcs.guest_fs_limit(descriptor.limit());
-    vmcs.guest_fs_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_fs_base(descriptor.context_dependent_base());
-    vmcs.host_fs_base(reinterpret_cast<std::uint64_t>(this->fs_data));
-    vmcs.host_fs_selector(0);
+    vmcs.set(field::guest_fs_selector, guest_context.fs);
+    vmcs.set(field::guest_fs_limit, descriptor.limit());
+    vmcs.set(field::guest_fs_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_fs_base, descriptor.context_dependent_base());
 
     descriptor = x64::segment_descriptor::from_memory(
         intermediate_gdt_base, guest_context.gs);
-    vmcs.guest_gs_selector(guest_context.gs);
-    vmcs.guest_gs_limit(descriptor.limit());
-    vmcs.guest_gs_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_gs_base(this->ia32_gs_base);
-    vmcs.host_gs_base(reinterpret_cast<std::uint64_t>(this->gs_data));
-    vmcs.host_gs_selector(0);
+    vmcs.set(field::guest_gs_selector, guest_context.gs);
+    vmcs.set(field::guest_gs_limit, descriptor.limit());
+    vmcs.set(field::guest_gs_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_gs_base, cpu.ia32_gs_base);
 
     descriptor = x64::segment_descriptor::from_memory(
         intermediate_gdt_base, guest_context.ss);
-    vmcs.guest_ss_selector(guest_context.ss);
-    vmcs.guest_ss_limit(descriptor.limit());
-    vmcs.guest_ss_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_ss_base(descriptor.context_dependent_base());
-    vmcs.host_ss_selector(0);
+    vmcs.set(field::guest_ss_selector, guest_context.ss);
+    vmcs.set(field::guest_ss_limit, descriptor.limit());
+    vmcs.set(field::guest_ss_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_ss_base, descriptor.context_dependent_base());
 
     descriptor = x64::segment_descriptor::from_memory(
-        intermediate_gdt_base, this->guest_tr);
-    vmcs.guest_tr_selector(this->guest_tr);
-    vmcs.guest_tr_limit(descriptor.limit());
-    vmcs.guest_tr_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_tr_base(descriptor.context_dependent_base());
-    vmcs.host_tr_base(reinterpret_cast<std::uint64_t>(this->host_tss));
-    vmcs.host_tr_selector(this->host_tr);
+        intermediate_gdt_base, cpu.guest_tr);
+    vmcs.set(field::guest_tr_selector, cpu.guest_tr);
+    vmcs.set(field::guest_tr_limit, descriptor.limit());
+    vmcs.set(field::guest_tr_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_tr_base, descriptor.context_dependent_base());
 
     descriptor = x64::segment_descriptor::from_memory(
-        intermediate_gdt_base, this->guest_ldtr);
-    vmcs.guest_ldtr_selector(this->guest_ldtr);
-    vmcs.guest_ldtr_limit(descriptor.limit());
-    vmcs.guest_ldtr_access_rights(descriptor.vmx_access_rights());
-    vmcs.guest_ldtr_base(descriptor.context_dependent_base());
+        intermediate_gdt_base, cpu.guest_ldtr);
+    vmcs.set(field::guest_ldtr_selector, cpu.guest_ldtr);
+    vmcs.set(field::guest_ldtr_limit, descriptor.limit());
+    vmcs.set(field::guest_ldtr_access_rights,
+             descriptor.vmx_access_rights());
+    vmcs.set(field::guest_ldtr_base,
+             descriptor.context_dependent_base());
 
     // Set gdtr information.
-    vmcs.guest_gdtr_limit(this->guest_gdt_limit);
-    vmcs.guest_gdtr_base(
-        reinterpret_cast<std::uint64_t>(this->guest_gdt_pointer));
-    vmcs.host_gdtr_base(reinterpret_cast<std::uint64_t>(this->host_gdt));
+    vmcs.set(field::guest_gdtr_limit, cpu.guest_gdt_limit);
+    vmcs.set(field::guest_gdtr_base,
+             reinterpret_cast<std::uint64_t>(cpu.guest_gdt_pointer));
 
     // Set idtr information.
-    vmcs.guest_idtr_limit(this->idtr.limit);
-    vmcs.guest_idtr_base(this->idtr.base);
-    vmcs.host_idtr_base(reinterpret_cast<std::uintptr_t>(this->host_idt));
+    vmcs.set(field::guest_idtr_limit, cpu.idtr.limit);
+    vmcs.set(field::guest_idtr_base, cpu.idtr.base);
 
     // Load CR0
-    vmcs.cr0_read_shadow(this->guest_cr0);
-    vmcs.guest_cr0(this->host_cr0);
-    vmcs.host_cr0(this->host_cr0);
+    vmcs.set(field::cr0_read_shadow, cpu.guest_cr0);
+    vmcs.set(field::guest_cr0, cpu.host_cr0);
+    vmcs.set(field::host_cr0, cpu.host_cr0);
 
     // Load CR3
-    vmcs.guest_cr3(this->guest_cr3);
-    vmcs.host_cr3(this->host_cr3);
+    vmcs.set(field::guest_cr3, cpu.guest_cr3);
 
     // Load CR4
-    vmcs.cr4_read_shadow(this->guest_cr4);
-    vmcs.guest_cr4(this->host_cr4);
-    vmcs.host_cr4(this->host_cr4);
+    vmcs.set(field::cr4_read_shadow, cpu.guest_cr4);
+    vmcs.set(field::guest_cr4, cpu.host_cr4);
+    vmcs.set(field::host_cr4, cpu.host_cr4);
 
     // Load debug MSR and register.
-    vmcs.guest_ia32_debugctl(this->ia32_debug_control);
-    vmcs.guest_dr7(this->guest_dr7);
+    vmcs.set(field::guest_ia32_debugctl, cpu.ia32_debug_control);
+    vmcs.set(field::guest_dr7, cpu.guest_dr7);
 
     // Load rflags.
-    vmcs.guest_rflags(guest_context.rflags);
+    vmcs.set(field::guest_rflags, guest_context.rflags);
+
+    // Arm the profiler.
+    if (auto & profiler = this->profilers[cpu.cpuid];
+        profiler.enabled()) {
+        vmcs.set(field::vmx_preemption_timer_value,
+                 profiler.timer_value());
+    }
+
+    // Switch MSRs on VM entry and VM exit.
+    auto & msr_switch = this->msr_switch[cpu.cpuid];
+    vmcs.set(field::vm_exit_msr_store_address,
+             this->host_page_table.virtual_to_physical(
+                 msr_switch.guest_area()));
+    vmcs.set(field::vm_exit_msr_store_count, msr_switch.size());
+    vmcs.set(field::vm_exit_msr_load_address,
+             this->host_page_table.virtual_to_physical(
+                 msr_switch.host_area()));
+    vmcs.set(field::vm_exit_msr_load_count, msr_switch.size());
+    vmcs.set(field::vm_entry_msr_load_address,
+             this->host_page_table.virtual_to_physical(
+                 msr_switch.guest_area()));
+    vmcs.set(field::vm_entry_msr_load_count, msr_switch.size());
+
+    // Write the fields of this CPU.
+    return vmcs.apply();
 }
 
 template <typename VmmCode>
@@ -786,19 +1445,20 @@ void hypervisor::vm_launch(x64::context & guest_context,
 
     // The host VM exit rsp.
     auto host_rsp = reinterpret_cast<std::uint64_t>(
-        std::end(host_vm_launch_stack) - (2 * sizeof(x64::context)));
+        std::end(host_vm_launch_stack) - (2 * sizeof(x64::gpr_context)));
 
-    // Construct the guest context on the host stack.
+    // Construct the guest context on the host stack, only the general
+    // purpose registers are saved on VM exit.
     auto & local_guest_context =
-        *::new (reinterpret_cast<void *>(host_rsp)) x64::context;
+        *::new (reinterpret_cast<void *>(host_rsp)) x64::gpr_context;
 
     // Construct the host context on the host stack.
-    auto & host_context =
-        *::new (reinterpret_cast<void *>(host_rsp + sizeof(x64::context)))
-            x64::context;
+    auto & host_context = *::new (reinterpret_cast<void *>(
+        host_rsp + sizeof(x64::gpr_context))) x64::gpr_context;
 
     // Write host rip.
-    vmcs.host_rip(reinterpret_cast<std::uint64_t>(x64::vm_exit_entry));
+    vmcs.host_rip(
+        reinterpret_cast<std::uint64_t>(x64::gpr_vm_exit_entry));
 
     // Write host rsp.
     vmcs.host_rsp(host_rsp);
@@ -829,7 +1489,7 @@ void hypervisor::vm_launch(x64::context & guest_context,
     host_context.rbx = reinterpret_cast<std::uint64_t>(&guest_context);
 
     // Capture host context.
-    x64::capture_context(&host_context);
+    x64::capture_gpr_context(&host_context);
 
     // If VM exit, call the VMM code.
     if (vm_exit_flag) {
@@ -848,9 +1508,6 @@ void hypervisor::vm_launch(x64::context & guest_context,
     host_context.gs = 0;
     host_context.ss = 0;
 
-    // Increment the virtual processor id.
-    ++this->next_virtual_processor;
-
     // The next time we arrive after the capture context is due to VM
     // exit.
     vm_exit_flag = true;
@@ -869,183 +1526,355 @@ void hypervisor::vm_launch(x64::context & guest_context,
     x64::restore_context(&guest_context);
 }
 
-zpp::error hypervisor::main(x64::context & caller_context)
+zpp::error hypervisor::allocate_cpus(std::size_t number_of_cpus,
+                                     void * (*allocate)(std::size_t))
+{
+    // If the number of CPUs is out of range, fail, every CPU has a
+    // non zero 16 bit virtual processor identifier.
+    if (!number_of_cpus || number_of_cpus > 0xffff) {
+        return error::invalid_cpu;
+    }
+
+    // Lays out the per CPU arrays, placing them in the given memory if
+    // not null, and returns the size of the memory.
+    auto layout = [&](unsigned char * memory) {
+        std::size_t size{};
+
+        // Places an array of every CPU at the given alignment, class
+        // elements are constructed, other elements are left zeroed.
+        auto place = [&](auto *& array, std::size_t alignment) {
+            using type = std::remove_reference_t<decltype(*array)>;
+            size = (size + alignment - 1) & ~(alignment - 1);
+            if (memory) {
+                array = reinterpret_cast<type *>(memory + size);
+                if constexpr (std::is_class_v<type>) {
+                    for (std::size_t i{}; i < number_of_cpus; ++i) {
+                        ::new (array + i) type{};
+                    }
+                }
+            }
+            size += sizeof(type) * number_of_cpus;
+        };
+
+        // Place the protected arrays.
+        place(this->cpus, alignof(per_cpu));
+        place(this->stack, page_size);
+        place(this->vmx, page_size);
+        place(this->vmx_vmcs, page_size);
+        place(this->hypercall_window, page_size);
+        place(this->msr_switch, alignof(decltype(*this->msr_switch)));
+        place(this->cpuid_tables, alignof(cpuid_table));
+        place(this->msr_shadows, alignof(msr_shadow_store));
+        place(this->hypercall_rings, alignof(hypercall_ring));
+        place(this->tracers, alignof(mtf_tracer));
+        place(this->pml_buffers, page_size);
+        place(this->profilers, alignof(guest_profiler));
+        place(this->statistics, alignof(exit_statistics));
+        place(this->logs, alignof(binary_log));
+
+        // Place the unprotected arrays in their own pages at the end.
+        size = (size + page_size - 1) & ~(page_size - 1);
+        auto unprotected_offset = size;
+        place(this->unprotected_memory.intermediate_gdt, 0x10);
+        place(this->unprotected_memory.guest_tss, 0x10);
+        size = (size + page_size - 1) & ~(page_size - 1);
+        if (memory) {
+            this->unprotected_memory.base = memory + unprotected_offset;
+            this->unprotected_memory.size = size - unprotected_offset;
+        }
+
+        return size;
+    };
+
+    // Allocate the memory, which must be page aligned.
+    auto size = layout(nullptr);
+    auto memory = static_cast<unsigned char *>(allocate(size));
+    if (!memory ||
+        (reinterpret_cast<std::uintptr_t>(memory) & (page_size - 1))) {
+        return error::allocation_failed;
+    }
+
+    // Zero the memory and place the arrays.
+    std::memset(memory, 0, size);
+    layout(memory);
+
+    // Publish the CPU memory.
+    this->cpu_memory = memory;
+    this->cpu_memory_size = size;
+    this->number_of_cpus = number_of_cpus;
+    return error::success;
+}
+
+zpp::error
+hypervisor::initialize_memory(const x64::context & caller_context)
 {
     // Fetch parameters.
-    auto cpuid = caller_context.rdi;
     auto physical_to_virtual =
         reinterpret_cast<std::uint64_t (*)(std::uint64_t)>(
             caller_context.rsi);
+    auto allocate =
+        reinterpret_cast<void * (*)(std::size_t)>(caller_context.rcx);
 
-    // Disable interrupts.
-    x64::disable_interrupts();
-
-    // Guard to enable interrupts.
-    scope_guard restore_interrupts{x64::enable_interrupts};
+    // Allocate the state of all CPUs.
+    if (auto error = allocate_cpus(caller_context.rdx, allocate); !error) {
+        return error;
+    }
 
     // Initialize page table operations.
     this->physical_to_virtual = physical_to_virtual;
 
+    // Initialize memory region.
+    initialize_module_region();
+
+    // Initialize OS page table.
+    initialize_os_page_table(x64::cr3());
+
+    // Allow the hardware page table pool to grow until the memory is
+    // protected.
+    this->allocate = allocate;
+    scope_guard stop_allocating = [&] { this->allocate = nullptr; };
+
+    // Initialize VMX MSRS.
+    initialize_vmx_msrs();
+
+    // Initialize the physical address width.
+    initialize_physical_address_width();
+
+    // Initialize MTRRS.
+    initialize_mtrrs();
+
+    // Initialize the EPT.
+    if (auto error = initialize_ept(); !error) {
+        return error;
+    }
+
+    // Initialize dirty page tracking.
+    if (auto error = initialize_dirty_tracking(); !error) {
+        return error;
+    }
+
+    // Protect the hypervisor memory.
+    return protect_hypervisor_memory();
+}
+
+zpp::error hypervisor::main(x64::context & caller_context)
+{
+    // Fetch parameters.
+    auto cpuid = caller_context.rdi;
+
+    // Initialize the state of this CPU.
+    auto & cpu = this->cpus[cpuid];
+    cpu.self = &cpu;
+    cpu.cpuid = cpuid;
+    cpu.virtual_processor = cpuid + 1;
+
+    // Disable interrupts.
+    x64::disable_interrupts();
+
+    // Guard to enable interrupts, only if the caller had them enabled,
+    // as the caller may be an inter processor interrupt callback.
+    scope_guard restore_interrupts = [&] {
+        if (caller_context.rflags & interrupt_enable_flag) {
+            x64::enable_interrupts();
+        }
+    };
+
     // Initialize special registers.
-    initialize_registers();
+    initialize_registers(cpu);
 
     // Perform only on first CPU load.
     if (0 == cpuid) {
-        // Initialize memory region.
-        initialize_module_region();
-
-        // Initialize OS page table.
-        initialize_os_page_table();
+        // Initialize the local APIC.
+        if (!this->local_apic.initialize()) {
+            return error::apic_disabled;
+        }
 
         // Initialize host page table.
-        initialize_host_page_table();
-
-        // Initialize module physical to virtual translation.
-        if (auto error = initialize_module_physical_to_virtual(); !error) {
+        if (auto error = initialize_host_page_table(cpu); !error) {
             return error;
         }
 
-        // Initialize host IDT.
-        initialize_host_idt();
-
         // Initialize host GDT.
         initialize_host_gdt();
+
+        // Initialize host IDT, which uses the host code segment.
+        initialize_host_idt();
     }
 
     // Initialize intermediate GDT.
-    initialize_intermediate_gdt();
+    initialize_intermediate_gdt(cpu);
 
     // Load intermediate GDT.
-    load_intermediate_gdt();
+    load_intermediate_gdt(cpu);
 
     // Guard to restore GDT.
-    scope_guard restore_gdt = [&] { load_os_gdt(); };
+    scope_guard restore_gdt = [&] { load_os_gdt(cpu); };
 
     // Switch page tables.
     x64::cr3(this->host_cr3);
 
     // Guard to restore cr3.
-    scope_guard restore_cr3 = [&] { x64::cr3(this->guest_cr3); };
+    scope_guard restore_cr3 = [&] { x64::cr3(cpu.guest_cr3); };
+
+    // Record the APIC identifier, to which shootdown NMIs are sent.
+    cpu.apic_id = this->local_apic.id();
 
     // Perform only on first CPU load.
     if (0 == cpuid) {
-        // Initialize VMX MSRS.
-        initialize_vmx_msrs();
-
-        // Initialize MTRRS.
-        initialize_mtrrs();
+        // Initialize the MSR bitmap.
+        initialize_msr_bitmap();
+    }
 
-        // Initialize the EPT.
-        initialize_ept();
+    // Initialize vmx.
+    initialize_vmx(cpu);
 
-        // Protect module.
-        if (auto error = protect_module(); !error) {
+    // Perform only on first CPU load.
+    if (0 == cpuid) {
+        // Initialize the VMCS template.
+        if (auto error = initialize_vmcs_template(); !error) {
             return error;
         }
-
-        // Allow guest access to unprotected memory.
-        unprotect_guest_memory();
     }
 
-    // Initialize vmx.
-    initialize_vmx();
-
     // Enter root mode.
-    if (auto error = enter_root_mode(); !error) {
+    if (auto error = enter_root_mode(cpu); !error) {
         return error;
     }
 
     // Guard to turn off vmx.
     scope_guard turn_off_vmx{x64::intel::vmxoff};
 
+    // Invalidate stale hardware page table translations, the generation
+    // is acknowledged on the first exit, see acknowledge_ept.
+    invalidate_ept();
+
+    // Capture the shadow MSR values of this CPU.
+    initialize_msr_shadows(cpuid);
+
+    // Configure the profiler of this CPU.
+    this->profilers[cpuid].configure(
+        this->profiler_supported ? ZPP_HYPERVISOR_PROFILER_INTERVAL : 0,
+        this->cached_vmx_msr(x64::intel::msr::vmx::misc) & 0x1f);
+
+    // Capture the CPUID results of this CPU.
+    this->cpuid_tables[cpuid].capture(
+        cpuid_policy, std::extent_v<decltype(cpuid_policy)>);
+
+    // Log the launch.
+    ZPP_LOG(this->logs[cpuid],
+            "launching, profiler timer value {}",
+            this->profilers[cpuid].timer_value());
+
     // Setup vmcs.
-    setup_vmcs(caller_context);
+    if (auto error = setup_vmcs(cpu, caller_context); !error) {
+        return error;
+    }
 
     // Launch VM.
     vm_launch(caller_context, [&](auto & context) {
-        using basic_reason = x64::intel::exit_reason::basic_reason;
-        auto & vmcs = this->vmcs;
-
-        // Virtual processor id.
-        auto vpid = vmcs.vpid().value();
-        static_cast<void>(vpid);
+        // The TSC at exit entry.
+        auto exit_tsc = x64::rdtsc();
 
-        // The basic exit reason.
-        basic_reason reason{};
+        // The exit scoped VMCS view.
+        x64::intel::vmcs_exit_view vmcs;
 
-        // Get the exit reason.
-        if (auto exit_reason = vmcs.exit_reason(); !exit_reason) {
+        // Load the exit information.
+        if (!vmcs.load()) {
             return;
-        } else {
-            reason = x64::intel::exit_reason(exit_reason.value()).basic();
         }
 
+        // The state of the exiting CPU, found through the host GS base,
+        // which refers to the VMCS view until the exit ends.
+        auto & exiting_cpu = per_cpu::current();
+        exiting_cpu.exit_vmcs = &vmcs;
+
+        // The decoded exit information.
+        exit_information information{
+            vmcs, exiting_cpu.cpuid, vmcs.exit_reason()};
+        information.basic_reason = information.reason.basic();
+        information.qualification = vmcs.exit_qualification();
+
         // Get the guest RIP.
-        context.rip = vmcs.guest_rip().value();
-
-        // Check the exit reason.
-        switch (reason) {
-        case basic_reason::cpuid: {
-            std::uint32_t cpuid_result[4]{};
-
-            // Execute the cpuid instruction.
-            x64::cpuid(context.rax, context.rcx, cpuid_result);
-
-            // If needs to set hypervisor present bit.
-            if (1 == context.rax) {
-                // Set hypervisor present bit.
-                cpuid_result[2] |= (1 << 31);
-            } else if ((1 << 30) == context.rax) {
-                // HyperVisor Name: ZppZppZppZpp.
-                cpuid_result[1] = 0x5a70705a;
-                cpuid_result[2] = 0x705a7070;
-                cpuid_result[3] = 0x70705a70;
-            }
+        context.rip = vmcs.guest_rip();
 
-            // Place the cpuid result into the context.
-            context.rax = cpuid_result[0];
-            context.rbx = cpuid_result[1];
-            context.rcx = cpuid_result[2];
-            context.rdx = cpuid_result[3];
-            break;
+        // Dispatch the exit to its handler, and skip the exiting
+        // instruction if requested.
+        if (exit_action::skip_instruction ==
+            dispatch_exit(information, context)) {
+            context.rip += vmcs.vm_exit_instruction_length();
         }
-        case basic_reason::xsetbv: {
-            // Activate CR4 xsave bit.
-            auto cr4 = x64::cr4();
-            if (!(cr4 & (1ull << 18))) {
-                x64::cr4(cr4 | (1ull << 18));
-            }
 
-            // Execute the xsetbv instruction.
-            x64::intel::xsetbv(context.rcx,
-                               context.rax | (context.rdx << 32));
-            break;
-        }
-        case basic_reason::invd: {
-            // Execute the invd instruction.
-            x64::intel::invd();
-            break;
-        }
-        default: {
-            break;
-        }
-        }
+        // Invalidate the translations of the hardware page table edits
+        // committed by other CPUs since the last exit, and acknowledge.
+        acknowledge_ept(exiting_cpu);
+
+        // Deliver the NMIs of the guest.
+        deliver_nmis(vmcs, exiting_cpu);
+        exiting_cpu.exit_vmcs = nullptr;
 
         // Update RIP.
-        context.rip += vmcs.vm_exit_instruction_length().value();
         vmcs.guest_rip(context.rip);
 
+        // Write back the dirty VMCS fields.
+        vmcs.flush();
+
         // Resume the VM.
         context.rip =
             reinterpret_cast<std::uint64_t>(x64::intel::vmresume);
 
+        // Record the exit statistics.
+        this->statistics[information.cpuid].record(
+            information.basic_reason, x64::rdtsc() - exit_tsc);
+
         // Restore VM.
-        x64::restore_context(&context);
+        x64::restore_gpr_context(&context);
     });
 
     return error::success;
 }
 
+bool hypervisor::exit_statistics_snapshot(
+    std::size_t cpuid, exit_statistics::snapshot & snapshot) const
+{
+    // If the CPU identifier is out of range, return false.
+    if (cpuid >= this->number_of_cpus) {
+        return false;
+    }
+
+    // Read the statistics.
+    this->statistics[cpuid].read(snapshot);
+    return true;
+}
+
+std::size_t
+hypervisor::profiler_samples(std::size_t cpuid,
+                             std::uint64_t & position,
+                             guest_profiler::sample * samples,
+                             std::size_t count) const
+{
+    // If the CPU identifier is out of range, there are no samples.
+    if (cpuid >= this->number_of_cpus) {
+        return 0;
+    }
+
+    // Read the samples.
+    return this->profilers[cpuid].read(position, samples, count);
+}
+
+std::size_t hypervisor::log_records(std::size_t cpuid,
+                                    std::uint64_t & position,
+                                    binary_log::record * records,
+                                    std::size_t count) const
+{
+    // If the CPU identifier is out of range, there are no records.
+    if (cpuid >= this->number_of_cpus) {
+        return 0;
+    }
+
+    // Read the records.
+    return this->logs[cpuid].read(position, records, count);
+}
+
 void hypervisor::launch_on_cpu_private_stack(hypervisor & hypervisor,
                                              x64::context & caller_context)
 {
@@ -1061,8 +1890,25 @@ void hypervisor::launch_on_cpu_private_stack(hypervisor & hypervisor,
 
 void hypervisor::launch_on_cpu(x64::context & caller_context)
 {
-    // Fetch the stack the hypervisor will launch with.
-    auto & stack = this->stack[this->available_stack_index];
+    // The CPU identifier.
+    auto cpuid = caller_context.rdi;
+
+    // Perform only on first CPU load, initialize the memory before
+    // switching to the stack of this CPU.
+    if (0 == cpuid) {
+        if (auto error = initialize_memory(caller_context); !error) {
+            // Restore context to caller.
+            caller_context.rax = error.code();
+            x64::restore_context(&caller_context);
+        }
+    } else if (cpuid >= this->number_of_cpus) {
+        // If the CPU identifier is out of range, fail.
+        caller_context.rax = zpp::error(error::invalid_cpu).code();
+        x64::restore_context(&caller_context);
+    }
+
+    // Fetch the stack of the CPU that the hypervisor will launch with.
+    auto & stack = this->stack[cpuid];
 
     // Compute the stack top.
     auto stack_top = stack + sizeof(stack) - sizeof(x64::context);
@@ -1091,9 +1937,6 @@ void hypervisor::launch_on_cpu(x64::context & caller_context)
     launch_context.rsi =
         reinterpret_cast<std::uint64_t>(copied_caller_context);
 
-    // Increment stack index.
-    ++this->available_stack_index;
-
     // Restore context to launch context.
     x64::restore_context(&launch_context);
 }
@@ -22,7 +22,12 @@ extern "C" void zpp_hypervisor_main(x64::context & caller_context)
     g_state.hypervisor.launch_on_cpu(caller_context);
 }
 
+#if ZPP_HYPERVISOR_HOSTED
+// The hosted process has its own _start, the hosted loader calls this.
+extern "C" void __attribute__((naked)) zpp_hypervisor_start()
+#else
 extern "C" void __attribute__((naked)) _start()
+#endif
 {
     asm(R"!!(
         .intel_syntax noprefix
@@ -10,10 +10,26 @@ state & g_state = *reinterpret_cast<state *>(&g_state_storage);
 
 void state::create_once()
 {
-    static bool created = false;
-    if (!created) {
+    // The creation state, CPUs may launch concurrently.
+    enum creation_state : int
+    {
+        not_created,
+        creating,
+        created,
+    };
+    static std::atomic<int> creation{not_created};
+
+    // The first CPU creates the state.
+    int expected = not_created;
+    if (creation.compare_exchange_strong(expected, creating)) {
         ::new (&g_state) state{};
-        created = true;
+        creation.store(created, std::memory_order_release);
+        return;
+    }
+
+    // Wait for the state to be created.
+    while (created != creation.load(std::memory_order_acquire)) {
+        asm("pause");
     }
 }
 
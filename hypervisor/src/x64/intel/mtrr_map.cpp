@@ -0,0 +1,207 @@
+#include "zpp/x64/intel/mtrr_map.h"
+#include "zpp/x64/intel/asm.h"
+#include "zpp/x64/intel/msr.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace zpp::x64::intel
+{
+namespace
+{
+/**
+ * A fixed range MTRR, holding the types of eight ranges of the given
+ * size that start at the given base.
+ */
+struct fixed_range_register
+{
+    std::size_t msr;
+    std::uint64_t base;
+    std::uint64_t size;
+};
+
+/**
+ * The fixed range MTRRs, in address order.
+ */
+constexpr fixed_range_register fixed_range_registers[] = {
+    {msr::mtrr::fix64k_00000, 0x00000, 0x10000},
+    {msr::mtrr::fix16k_80000, 0x80000, 0x4000},
+    {msr::mtrr::fix16k_a0000, 0xa0000, 0x4000},
+    {msr::mtrr::fix4k_c0000, 0xc0000, 0x1000},
+    {msr::mtrr::fix4k_c8000, 0xc8000, 0x1000},
+    {msr::mtrr::fix4k_d0000, 0xd0000, 0x1000},
+    {msr::mtrr::fix4k_d8000, 0xd8000, 0x1000},
+    {msr::mtrr::fix4k_e0000, 0xe0000, 0x1000},
+    {msr::mtrr::fix4k_e8000, 0xe8000, 0x1000},
+    {msr::mtrr::fix4k_f0000, 0xf0000, 0x1000},
+    {msr::mtrr::fix4k_f8000, 0xf8000, 0x1000},
+};
+
+/**
+ * Returns the index of the fixed range that contains the given address,
+ * which must be below the end of the fixed ranges.
+ */
+std::size_t fixed_range_index(std::uint64_t address)
+{
+    if (address < 0x80000) {
+        return address / 0x10000;
+    }
+    if (address < 0xc0000) {
+        return 8 + (address - 0x80000) / 0x4000;
+    }
+    return 24 + (address - 0xc0000) / 0x1000;
+}
+
+/**
+ * Returns the type of two overlapping variable ranges.
+ */
+memory_type overlap(memory_type first, memory_type second)
+{
+    // Identical types.
+    if (first == second) {
+        return first;
+    }
+
+    // Write through wins over write back.
+    if ((memory_type::write_through == first &&
+         memory_type::write_back == second) ||
+        (memory_type::write_back == first &&
+         memory_type::write_through == second)) {
+        return memory_type::write_through;
+    }
+
+    // Uncachable wins, and other overlaps are undefined.
+    return memory_type::uncachable;
+}
+} // namespace
+
+void mtrr_map::read(std::uint64_t end)
+{
+    // Start from an empty map.
+    m_size = 0;
+
+    // Read the default type, if MTRRs are disabled, everything is
+    // uncachable.
+    auto default_type_register = rdmsr(msr::ia32_mtrr_def_type);
+    if (!(default_type_register & (1 << 11))) {
+        append(0, end, memory_type::uncachable);
+        return;
+    }
+    auto default_type = memory_type(default_type_register & 0xff);
+
+    // Read the MTRR capabilities.
+    auto capabilities =
+        mtrr_capabilities(rdmsr(msr::ia32_mtrr_capability));
+
+    // Addresses at which the type may change.
+    std::uint64_t boundaries[capacity + 1];
+    std::size_t number_of_boundaries{};
+    boundaries[number_of_boundaries++] = 0;
+    boundaries[number_of_boundaries++] = end;
+
+    // Read the fixed range types, if enabled.
+    bool fixed = capabilities.fixed_range_registers_supported() &&
+                 (default_type_register & (1 << 10));
+    memory_type fixed_types[fixed_ranges];
+    if (fixed) {
+        std::size_t index{};
+        for (auto & fixed_range : fixed_range_registers) {
+            auto value = rdmsr(fixed_range.msr);
+            for (std::size_t i{}; i < 8; ++i) {
+                fixed_types[index++] =
+                    memory_type((value >> (i * 8)) & 0xff);
+                boundaries[number_of_boundaries++] =
+                    fixed_range.base + i * fixed_range.size;
+            }
+        }
+        boundaries[number_of_boundaries++] = fixed_ranges_end;
+    }
+
+    // Read the valid variable ranges.
+    mtrr variable[max_variable_ranges];
+    std::size_t number_of_variable{};
+    auto variable_count = std::min<std::size_t>(
+        capabilities.variable_range_register_count(), max_variable_ranges);
+    for (std::size_t i{}; i < variable_count; ++i) {
+        // Read the base and mask.
+        auto base =
+            mtrr_variable_base(rdmsr(msr::mtrr::physbase_0 + i * 2));
+        auto mask =
+            mtrr_variable_mask(rdmsr(msr::mtrr::physmask_0 + i * 2));
+
+        // Skip invalid ranges.
+        if (!mask.valid() || !mask.physical_mask()) {
+            continue;
+        }
+
+        // Compute the size of the range according to the number of 0s
+        // at the lower bits of the physical mask. The rule is that
+        // (address_in_range & mask == mask & base).
+        auto & range = variable[number_of_variable++];
+        range.type = base.memory_type();
+        range.valid = true;
+        range.physical_base = (base.page_number() << 12);
+        range.size = 0x1000;
+        for (auto j = mask.physical_mask(); !(j & 1); j >>= 1) {
+            range.size <<= 1;
+        }
+
+        // Add the range boundaries within the map.
+        if (range.physical_base < end) {
+            boundaries[number_of_boundaries++] = range.physical_base;
+        }
+        if (range.physical_base + range.size < end) {
+            boundaries[number_of_boundaries++] =
+                range.physical_base + range.size;
+        }
+    }
+
+    // Sort the boundaries and remove duplicates.
+    std::sort(boundaries, boundaries + number_of_boundaries);
+    number_of_boundaries =
+        std::unique(boundaries, boundaries + number_of_boundaries) -
+        boundaries;
+
+    // Resolve the type between every two boundaries.
+    for (std::size_t i{}; i + 1 < number_of_boundaries; ++i) {
+        auto address = boundaries[i];
+
+        // Fixed ranges take precedence over the variable ranges.
+        if (fixed && address < fixed_ranges_end) {
+            append(address,
+                   boundaries[i + 1],
+                   fixed_types[fixed_range_index(address)]);
+            continue;
+        }
+
+        // Combine the variable ranges that contain the address.
+        bool found = false;
+        auto type = default_type;
+        for (std::size_t j{}; j < number_of_variable; ++j) {
+            auto & range = variable[j];
+            if (address < range.physical_base ||
+                address >= range.physical_base + range.size) {
+                continue;
+            }
+            type = found ? overlap(type, range.type) : range.type;
+            found = true;
+        }
+        append(address, boundaries[i + 1], type);
+    }
+}
+
+void mtrr_map::append(std::uint64_t begin,
+                      std::uint64_t end,
+                      memory_type type)
+{
+    // Merge into the last range if of the same type.
+    if (m_size && m_ranges[m_size - 1].type == type) {
+        m_ranges[m_size - 1].end = end;
+        return;
+    }
+
+    // Add a new range.
+    m_ranges[m_size++] = {begin, end, type};
+}
+
+} // namespace zpp::x64::intel
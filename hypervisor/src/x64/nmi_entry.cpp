@@ -0,0 +1,14 @@
+#include "zpp/x64/nmi_entry.h"
+
+namespace zpp::x64
+{
+void __attribute__((naked)) nmi_entry()
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        lock inc qword ptr gs:[0x8] // Count the NMI.
+        iretq // Return, which unblocks NMIs.
+    )!!");
+}
+
+} // namespace zpp::x64
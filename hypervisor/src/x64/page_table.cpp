@@ -4,7 +4,7 @@
 
 namespace zpp::x64
 {
-void page_table::map_page(std::uint64_t address,
+bool page_table::map_page(std::uint64_t address,
                           std::uint64_t physical_address,
                           protection protection)
 {
@@ -17,8 +17,15 @@ std::uint64_t page_table::virtual_to_physical(std::uint64_t value) const
     // Parse the virtual address.
     auto address_structure = virtual_address(value);
 
+    // Fetch the page directory pointer table, if none, the address is
+    // not mapped.
+    auto pdpt_index = pdpt_indices[address_structure.pml4e()];
+    if (!pdpt_index) {
+        return 0;
+    }
+
     // Fetch the page directory pointer table entry.
-    auto pdpte = pdpt[address_structure.pdpte()];
+    auto pdpte = pdpts[pdpt_index - 1][address_structure.pdpte()];
 
     // If large, return the address now.
     if (pdpte.large()) {
@@ -26,15 +33,14 @@ std::uint64_t page_table::virtual_to_physical(std::uint64_t value) const
                address_structure.huge_offset();
     }
 
-    // Fetch the page directory according to how many page directories we
-    // have.
-    auto pd_index =
-        address_structure.pdpte() /
-        (std::extent_v<decltype(pdpt)> / std::extent_v<decltype(pds)>);
-    auto pd = pds[pd_index];
+    // Fetch the page directory, if none, the address is not mapped.
+    auto pd_index = pd_indices[pdpt_index - 1][address_structure.pdpte()];
+    if (!pd_index) {
+        return 0;
+    }
 
     // Fetch the page directory entry.
-    auto pde = pd[address_structure.pde()];
+    auto pde = pds[pd_index - 1][address_structure.pde()];
 
     // If large, return the address now.
     if (pde.large()) {
@@ -42,12 +48,21 @@ std::uint64_t page_table::virtual_to_physical(std::uint64_t value) const
                address_structure.large_offset();
     }
 
-    // Fetch the page table according to how many page tables we have.
-    auto pt = pts[pd_index][address_structure.pde()];
+    // Fetch the page table, if none, the address is not mapped.
+    auto pt_index = pt_indices[pd_index - 1][address_structure.pde()];
+    if (!pt_index) {
+        return 0;
+    }
+
+    // Fetch the page table entry, if not present, the address is not
+    // mapped.
+    auto pte = pts[pt_index - 1][address_structure.pte()];
+    if (!pte.present()) {
+        return 0;
+    }
 
     // Return the address.
-    return (pt[address_structure.pte()].page_number() << 12) +
-           address_structure.offset();
+    return (pte.page_number() << 12) + address_structure.offset();
 }
 
 std::uint64_t page_table::virtual_to_physical(const void * value) const
@@ -66,33 +81,45 @@ x64::pte & page_table::page_table_entry(std::uint64_t address)
     auto address_structure = virtual_address(address);
 
     // Fetch the page directory pointer table entry.
-    auto & pdpte = pdpt[address_structure.pdpte()];
+    auto pdpt_index = pdpt_indices[address_structure.pml4e()];
+    auto & pdpte = pdpts[pdpt_index - 1][address_structure.pdpte()];
 
     // If large, return the pte.
     if (pdpte.large()) {
         return pdpte;
     }
 
-    // Fetch the page directory according to how many page directories we
-    // have.
-    auto pd_index =
-        address_structure.pdpte() /
-        (std::extent_v<decltype(pdpt)> / std::extent_v<decltype(pds)>);
-    auto pd = pds[pd_index];
-
     // Fetch the page directory entry.
-    auto & pde = pd[address_structure.pde()];
+    auto pd_index = pd_indices[pdpt_index - 1][address_structure.pdpte()];
+    auto & pde = pds[pd_index - 1][address_structure.pde()];
 
     // If large, return the pte.
     if (pde.large()) {
         return pde;
     }
 
-    // Fetch the page table according to how many page tables we have.
-    auto pt = pts[pd_index][address_structure.pde()];
+    // Fetch the page table entry.
+    auto pt_index = pt_indices[pd_index - 1][address_structure.pde()];
+    return pts[pt_index - 1][address_structure.pte()];
+}
 
-    // Return the address.
-    return pt[address_structure.pte()];
+bool page_table::assign_table(std::uint16_t & index,
+                              std::size_t & count,
+                              std::size_t capacity)
+{
+    // If there is already a table, use it.
+    if (index) {
+        return true;
+    }
+
+    // If out of tables, fail.
+    if (count == capacity) {
+        return false;
+    }
+
+    // Assign the next table.
+    index = static_cast<std::uint16_t>(++count);
+    return true;
 }
 
-} // namespace zpp::x64
\ No newline at end of file
+} // namespace zpp::x64
@@ -10,6 +10,11 @@ extern "C" void zpp_vm_exit(x64::context & host_context)
     x64::restore_context(&host_context);
 }
 
+extern "C" void zpp_gpr_vm_exit(x64::gpr_context & host_context)
+{
+    x64::restore_gpr_context(&host_context);
+}
+
 void __attribute__((naked)) vm_exit_entry()
 {
     asm(R"!!(
@@ -21,4 +26,15 @@ void __attribute__((naked)) vm_exit_entry()
     )!!");
 }
 
+void __attribute__((naked)) gpr_vm_exit_entry()
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        call zpp_x64_capture_gpr_context_into_stack // Capture guest context.
+        lea rdi, [rsp+0xa0] // Move host context pointer to rdi.
+        sub rsp, 0x8 // Align stack to expected value.
+        jmp zpp_gpr_vm_exit // Jump to the vm exit function.
+    )!!");
+}
+
 } // namespace zpp::x64
@@ -24,7 +24,8 @@ ZPP_FLAGS := \
 	-fPIE \
 	-nostdlib \
 	-ffreestanding \
-	-mno-red-zone
+	-mno-red-zone \
+	-DZPP_HYPERVISOR_PROFILER_INTERVAL=$(HYPERVISOR_PROFILER_INTERVAL)
 ZPP_FLAGS_DEBUG := \
 	-g \
 	-DZPP_HYPERVISOR_WAIT_FOR_DEBUGGER=$(HYPERVISOR_WAIT_FOR_DEBUGGER)
@@ -46,7 +47,8 @@ ZPP_CXXFLAGS := \
 	-stdlib=libc++ \
 	-fno-rtti \
 	-fno-threadsafe-statics \
-	-fno-exceptions
+	-fno-exceptions \
+	-mgeneral-regs-only
 ZPP_CXXFLAGS_DEBUG := \
 	$(ZPP_FLAGS_DEBUG)
 ZPP_CXXFLAGS_RELEASE := \
@@ -0,0 +1,359 @@
+#include "benchmark.h"
+#include <asm/cpufeature.h>
+#include <asm/msr.h>
+#include <asm/processor.h>
+#include <asm/tsc.h>
+#include <linux/atomic.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/irqflags.h>
+#include <linux/math64.h>
+#include <linux/printk.h>
+#include <linux/smp.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <zpp/hypervisor/hypercall_abi.h>
+
+/**
+ * The hypervisor CPUID leaf and its ZppZppZppZpp signature.
+ */
+#define ZPP_BENCHMARK_HYPERVISOR_LEAF 0x40000000
+#define ZPP_BENCHMARK_SIGNATURE_EBX 0x5a70705a
+#define ZPP_BENCHMARK_SIGNATURE_ECX 0x705a7070
+#define ZPP_BENCHMARK_SIGNATURE_EDX 0x70705a70
+
+/**
+ * The feature control MSR, which the hypervisor intercepts.
+ */
+#define ZPP_BENCHMARK_FEATURE_CONTROL 0x3a
+
+/**
+ * A measured operation.
+ */
+struct benchmark_operation
+{
+    /**
+     * The operation name.
+     */
+    const char * name;
+
+    /**
+     * Returns true if the operation is supported on this machine.
+     */
+    bool (*supported)(void);
+
+    /**
+     * Executes the operation once.
+     */
+    void (*execute)(void);
+};
+
+/**
+ * The context of measuring an operation on a single CPU.
+ */
+struct benchmark_single_context
+{
+    const struct benchmark_operation * operation;
+    u64 * samples;
+    unsigned int iterations;
+};
+
+/**
+ * The context of measuring an operation on all CPUs at once.
+ */
+struct benchmark_all_context
+{
+    const struct benchmark_operation * operation;
+    unsigned int iterations;
+    unsigned int cpus;
+    atomic_t arrived;
+    atomic_t done;
+    atomic64_t first_start;
+    atomic64_t last_end;
+};
+
+static void benchmark_cpuid(u32 leaf)
+{
+    u32 eax = leaf;
+    u32 ebx;
+    u32 ecx = 0;
+    u32 edx;
+
+    asm volatile("cpuid"
+                 : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx)
+                 :
+                 : "memory");
+}
+
+static bool benchmark_always_supported(void)
+{
+    return true;
+}
+
+static bool benchmark_xsave_supported(void)
+{
+    return boot_cpu_has(X86_FEATURE_OSXSAVE);
+}
+
+static void benchmark_nop(void)
+{
+    asm volatile("" ::: "memory");
+}
+
+static void benchmark_cpuid_basic(void)
+{
+    benchmark_cpuid(1);
+}
+
+static void benchmark_cpuid_hypervisor(void)
+{
+    benchmark_cpuid(ZPP_BENCHMARK_HYPERVISOR_LEAF);
+}
+
+static void benchmark_xsetbv(void)
+{
+    u32 eax;
+    u32 edx;
+
+    // Write back the current XCR0, which leaves it unchanged.
+    asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    asm volatile("xsetbv" ::"a"(eax), "d"(edx), "c"(0) : "memory");
+}
+
+static void benchmark_rdmsr(void)
+{
+    u32 eax;
+    u32 edx;
+
+    asm volatile("rdmsr"
+                 : "=a"(eax), "=d"(edx)
+                 : "c"(ZPP_BENCHMARK_FEATURE_CONTROL)
+                 : "memory");
+}
+
+static void benchmark_vmcall(void)
+{
+    unsigned long rax = ZPP_HYPERCALL_VERSION;
+    unsigned long rcx = ZPP_HYPERCALL_MAGIC;
+    unsigned long rdx = 0;
+    unsigned long r8 = 0;
+
+    asm volatile("mov %[r8], %%r8\n\t"
+                 "vmcall"
+                 : "+a"(rax), "+c"(rcx), "+d"(rdx)
+                 : [r8] "r"(r8)
+                 : "r8", "memory");
+}
+
+/**
+ * The measured operations, the first measures the timing overhead.
+ * The invd instruction discards modified cache lines and therefore is
+ * never executed, an intercepted rdmsr measures an unconditional exit
+ * whose handler does not touch the caches instead.
+ */
+static const struct benchmark_operation g_operations[] = {
+    {"nop", &benchmark_always_supported, &benchmark_nop},
+    {"cpuid.1", &benchmark_always_supported, &benchmark_cpuid_basic},
+    {"cpuid.hv", &benchmark_always_supported, &benchmark_cpuid_hypervisor},
+    {"xsetbv", &benchmark_xsave_supported, &benchmark_xsetbv},
+    {"rdmsr.fc", &benchmark_always_supported, &benchmark_rdmsr},
+    {"vmcall", &benchmark_always_supported, &benchmark_vmcall},
+};
+
+bool zpp_benchmark_hypervisor_present(void)
+{
+    u32 eax = ZPP_BENCHMARK_HYPERVISOR_LEAF;
+    u32 ebx;
+    u32 ecx = 0;
+    u32 edx;
+
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return ZPP_BENCHMARK_SIGNATURE_EBX == ebx &&
+           ZPP_BENCHMARK_SIGNATURE_ECX == ecx &&
+           ZPP_BENCHMARK_SIGNATURE_EDX == edx;
+}
+
+static int benchmark_compare(const void * left, const void * right)
+{
+    u64 left_value = *(const u64 *)left;
+    u64 right_value = *(const u64 *)right;
+
+    if (left_value < right_value) {
+        return -1;
+    }
+    return left_value > right_value;
+}
+
+static void benchmark_single(void * context)
+{
+    struct benchmark_single_context * single = context;
+    unsigned int i;
+
+    // Time every execution separately, interrupts are disabled.
+    for (i = 0; i < single->iterations; ++i) {
+        u64 start = rdtsc_ordered();
+        single->operation->execute();
+        single->samples[i] = rdtsc_ordered() - start;
+    }
+}
+
+static void benchmark_update(atomic64_t * target, u64 value, bool minimum)
+{
+    u64 current_value = atomic64_read(target);
+
+    // Replace the target until it is no longer improved by the value.
+    while (minimum ? value < current_value : value > current_value) {
+        u64 previous = atomic64_cmpxchg(target, current_value, value);
+        if (previous == current_value) {
+            break;
+        }
+        current_value = previous;
+    }
+}
+
+static void benchmark_all(void * context)
+{
+    struct benchmark_all_context * all = context;
+    unsigned long flags;
+    unsigned int i;
+    u64 start;
+    u64 end;
+
+    local_irq_save(flags);
+
+    // Wait for all the CPUs to arrive.
+    atomic_inc(&all->arrived);
+    while (atomic_read(&all->arrived) < all->cpus) {
+        cpu_relax();
+    }
+
+    // Execute back to back.
+    start = rdtsc_ordered();
+    for (i = 0; i < all->iterations; ++i) {
+        all->operation->execute();
+    }
+    end = rdtsc_ordered();
+
+    // Record the earliest start and the latest end.
+    benchmark_update(&all->first_start, start, true);
+    benchmark_update(&all->last_end, end, false);
+
+    local_irq_restore(flags);
+
+    // Signal completion, the context must not be accessed afterwards.
+    atomic_inc(&all->done);
+}
+
+static int benchmark_operation_single(
+    const struct benchmark_operation * operation,
+    u64 * samples,
+    unsigned int iterations)
+{
+    struct benchmark_single_context single = {
+        operation, samples, iterations};
+    unsigned int cpu;
+
+    for_each_online_cpu(cpu) {
+        // Measure on the CPU.
+        if (smp_call_function_single(cpu, &benchmark_single, &single, 1)) {
+            pr_err("zpp: benchmark: cpu %u: failed to run.\n", cpu);
+            return -EIO;
+        }
+
+        // Report the distribution.
+        sort(samples, iterations, sizeof(*samples), &benchmark_compare, 0);
+        pr_info("zpp: benchmark: cpu %3u %-8s min %6llu median %6llu "
+                "p99 %6llu cycles\n",
+                cpu,
+                operation->name,
+                samples[0],
+                samples[iterations / 2],
+                samples[(u64)iterations * 99 / 100]);
+    }
+
+    return 0;
+}
+
+static void
+benchmark_operation_all(const struct benchmark_operation * operation,
+                        unsigned int iterations)
+{
+    struct benchmark_all_context all = {};
+    u64 cycles;
+    u64 total;
+
+    all.operation = operation;
+    all.iterations = iterations;
+    atomic_set(&all.arrived, 0);
+    atomic_set(&all.done, 0);
+    atomic64_set(&all.first_start, S64_MAX);
+    atomic64_set(&all.last_end, 0);
+
+    // Run on all the CPUs at once, the other CPUs are not waited for
+    // by the call, since they wait for this CPU to arrive.
+    preempt_disable();
+    all.cpus = num_online_cpus();
+    smp_call_function(&benchmark_all, &all, 0);
+    benchmark_all(&all);
+    while (atomic_read(&all.done) < all.cpus) {
+        cpu_relax();
+    }
+    preempt_enable();
+
+    // Report the aggregate rate.
+    cycles = atomic64_read(&all.last_end) -
+             atomic64_read(&all.first_start);
+    total = (u64)iterations * all.cpus;
+    pr_info("zpp: benchmark: all %3u %-8s %llu per second\n",
+            all.cpus,
+            operation->name,
+            cycles ? div64_u64(total * tsc_khz * 1000, cycles) : 0);
+}
+
+int zpp_benchmark_run(unsigned int iterations)
+{
+    u64 * samples;
+    size_t i;
+    int result = 0;
+
+    // Validate the number of iterations.
+    if (iterations < 100) {
+        pr_err("zpp: benchmark: at least 100 iterations are needed.\n");
+        return -EINVAL;
+    }
+
+    // Allocate the samples.
+    samples = vmalloc(sizeof(*samples) * iterations);
+    if (!samples) {
+        return -ENOMEM;
+    }
+
+    // Keep the set of online CPUs fixed.
+    get_online_cpus();
+
+    pr_info("zpp: benchmark: %u iterations, tsc %u khz\n",
+            iterations,
+            tsc_khz);
+
+    for (i = 0; i < ARRAY_SIZE(g_operations); ++i) {
+        const struct benchmark_operation * operation = &g_operations[i];
+
+        // Skip unsupported operations.
+        if (!operation->supported()) {
+            pr_info("zpp: benchmark: %s unsupported\n", operation->name);
+            continue;
+        }
+
+        // Measure on every CPU separately, then on all of them at once.
+        result =
+            benchmark_operation_single(operation, samples, iterations);
+        if (result) {
+            break;
+        }
+        benchmark_operation_all(operation, iterations);
+    }
+
+    put_online_cpus();
+    vfree(samples);
+    return result;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <linux/types.h>
+
+/**
+ * Returns true if the hypervisor is running on the current CPU.
+ */
+bool zpp_benchmark_hypervisor_present(void);
+
+/**
+ * Measure the cost of the guest operations that cause a VM exit, on
+ * every online CPU separately and then on all of them at once, with
+ * the given number of iterations per operation and CPU. The results are
+ * written to the kernel log. Returns zero on success.
+ */
+int zpp_benchmark_run(unsigned int iterations);
@@ -1,8 +1,13 @@
+#include "benchmark.h"
+#include <linux/atomic.h>
+#include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/kallsyms.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/printk.h>
 #include <linux/sched.h>
+#include <linux/smp.h>
 #include <linux/types.h>
 
 typedef long (*sched_getaffinity_t)(pid_t pid, struct cpumask * mask);
@@ -14,16 +19,30 @@ static struct driver_state
     cpumask_t previous_mask;
     sched_getaffinity_t sched_getaffinity;
     sched_setaffinity_t sched_setaffinity;
+    bool loaded;
 } g_state;
 
+// Whether to stay resident and run the exit benchmark after loading.
+static bool g_benchmark;
+
+// The number of iterations of every benchmark operation on every CPU.
+static unsigned int g_benchmark_iterations = 10000;
+
 int zpp_load_elf(void * (*allocate_rwx)(size_t),
                  void * (*physical_to_virtual)(unsigned long long),
+                 void * (*allocate_cpu_memory)(size_t),
                  int (*call_on_cpu)(size_t, int (*)(void *), void *),
                  size_t (*number_of_cpus)(void),
                  int (*adjust_launch_calling_convention)(
-                     int (*)(size_t, uintptr_t (*)(uintptr_t)),
+                     int (*)(size_t,
+                             uintptr_t (*)(uintptr_t),
+                             size_t,
+                             void * (*)(size_t)),
+                     size_t,
+                     uintptr_t (*)(uintptr_t),
                      size_t,
-                     uintptr_t (*)(uintptr_t)));
+                     void * (*)(size_t)),
+                 int (*call_on_each_cpu)(int (*)(size_t, void *), void *));
 
 static size_t number_of_cpus(void)
 {
@@ -35,19 +54,57 @@ static size_t number_of_cpus(void)
     return result;
 }
 
+// The hypervisor numbers CPUs densely from zero, the online CPUs are
+// numbered in order, as the kernel CPU numbers may have holes.
+static unsigned int kernel_cpu(size_t cpuid)
+{
+    unsigned int cpu = 0;
+
+    // Find the online CPU of the given index.
+    for_each_online_cpu(cpu) {
+        if (!cpuid--) {
+            return cpu;
+        }
+    }
+
+    return nr_cpu_ids;
+}
+
+static size_t dense_cpu(unsigned int cpu)
+{
+    unsigned int online = 0;
+    size_t cpuid = 0;
+
+    // Count the online CPUs before the given CPU.
+    for_each_online_cpu(online) {
+        if (online == cpu) {
+            break;
+        }
+        ++cpuid;
+    }
+
+    return cpuid;
+}
+
 static int call_on_cpu(size_t cpuid,
                        int (*function)(void *),
                        void * context)
 {
     int result = -1;
+    unsigned int cpu = kernel_cpu(cpuid);
+
+    // Fail if there is no such CPU.
+    if (cpu >= nr_cpu_ids) {
+        return -1;
+    }
 
     // Save previous affinity.
     if (g_state.sched_getaffinity(current->pid, &g_state.previous_mask)) {
         return -1;
     }
 
-    // Set new affinity to only given cpuid.
-    if (g_state.sched_setaffinity(current->pid, cpumask_of(cpuid))) {
+    // Set new affinity to only given CPU.
+    if (g_state.sched_setaffinity(current->pid, cpumask_of(cpu))) {
         return -1;
     }
 
@@ -61,11 +118,83 @@ static int call_on_cpu(size_t cpuid,
     return result;
 }
 
+struct broadcast_state
+{
+    int (*function)(size_t, void *);
+    void * context;
+    atomic_t failures;
+};
+
+static void broadcast_function(void * information)
+{
+    struct broadcast_state * broadcast = information;
+
+    // Call user function with the current CPU, count failures.
+    if (broadcast->function(dense_cpu(smp_processor_id()),
+                            broadcast->context)) {
+        atomic_inc(&broadcast->failures);
+    }
+}
+
+static int call_on_each_cpu(int (*function)(size_t, void *),
+                            void * context)
+{
+    struct broadcast_state broadcast = {
+        .function = function,
+        .context = context,
+        .failures = ATOMIC_INIT(0),
+    };
+
+    // Call user function on all CPUs at once and wait for all of them.
+    on_each_cpu(&broadcast_function, &broadcast, 1);
+
+    // Fail if any of the CPUs failed.
+    return atomic_read(&broadcast.failures) ? -1 : 0;
+}
+
 static void * allocate_rwx(size_t size)
 {
     return __vmalloc(size, GFP_KERNEL, PAGE_KERNEL_EXEC);
 }
 
+static void * allocate_cpu_memory(size_t size)
+{
+    return vmalloc(size);
+}
+
+static int set_benchmark(const char * value,
+                         const struct kernel_param * parameter)
+{
+    // Parse the value.
+    int result = param_set_bool(value, parameter);
+    if (result) {
+        return result;
+    }
+
+    // Once loaded, setting the parameter runs the benchmark again.
+    if (g_state.loaded && g_benchmark) {
+        return zpp_benchmark_run(g_benchmark_iterations);
+    }
+
+    return 0;
+}
+
+static const struct kernel_param_ops g_benchmark_ops = {
+    .set = &set_benchmark,
+    .get = &param_get_bool,
+};
+
+module_param_cb(benchmark, &g_benchmark_ops, &g_benchmark, 0644);
+MODULE_PARM_DESC(benchmark,
+                 "Stay resident and benchmark the VM exit cost, "
+                 "writing 1 once loaded runs the benchmark again.");
+module_param_named(benchmark_iterations,
+                   g_benchmark_iterations,
+                   uint,
+                   0644);
+MODULE_PARM_DESC(benchmark_iterations,
+                 "The number of iterations per operation and CPU.");
+
 static int zpp_init(void)
 {
     int result = 0;
@@ -76,17 +205,40 @@ static int zpp_init(void)
     g_state.sched_setaffinity =
         (sched_setaffinity_t)kallsyms_lookup_name("sched_setaffinity");
 
-    // Load the ELF.
-    result = zpp_load_elf(
-        &allocate_rwx, &phys_to_virt, &call_on_cpu, &number_of_cpus, 0);
+    // Keep the set of online CPUs fixed, as it numbers the CPUs.
+    get_online_cpus();
+
+    // Load the ELF, launching on all CPUs at once.
+    result = zpp_load_elf(&allocate_rwx,
+                          &phys_to_virt,
+                          &allocate_cpu_memory,
+                          &call_on_cpu,
+                          &number_of_cpus,
+                          0,
+                          &call_on_each_cpu);
+
+    // Allow CPUs to go online and offline again.
+    put_online_cpus();
 
     // If we failed, return an arbitrary failure.
     if (result) {
         return -EFAULT;
     }
+    g_state.loaded = true;
+
+    // Return an error so the driver gets unloaded, unless benchmarking.
+    if (!g_benchmark) {
+        return -EPERM;
+    }
+
+    // Make sure that the hypervisor is running.
+    if (!zpp_benchmark_hypervisor_present()) {
+        pr_err("zpp: benchmark: the hypervisor is not present.\n");
+        return -ENODEV;
+    }
 
-    // Return an error so the driver gets unloaded.
-    return -EPERM;
+    // Run the benchmark and stay resident.
+    return zpp_benchmark_run(g_benchmark_iterations);
 }
 
 static void zpp_exit(void)
@@ -7,15 +7,28 @@ namespace zpp
 extern "C" unsigned char zpp_elf_binary[];
 extern "C" std::size_t zpp_elf_binary_size;
 
+/**
+ * The hypervisor entry point, see hypervisor::launch_on_cpu.
+ */
+using entry_type = int (*)(std::size_t cpuid,
+                           std::uintptr_t (*physical_to_virtual)(
+                               std::uintptr_t),
+                           std::size_t number_of_cpus,
+                           void * (*allocate_cpu_memory)(std::size_t));
+
 extern "C" int
 zpp_load_elf(void * (*allocate_rwx)(std::size_t),
              std::uintptr_t (*physical_to_virtual)(std::uintptr_t),
+             void * (*allocate_cpu_memory)(std::size_t),
              int (*call_on_cpu)(std::size_t, int (*)(void *), void *),
              std::size_t (*number_of_cpus)(),
              int (*adjust_launch_calling_convention)(
-                 int (*)(std::size_t, std::uintptr_t (*)(std::uintptr_t)),
+                 entry_type,
+                 std::size_t,
+                 std::uintptr_t (*)(std::uintptr_t),
                  std::size_t,
-                 std::uintptr_t (*)(std::uintptr_t)))
+                 void * (*)(std::size_t)),
+             int (*call_on_each_cpu)(int (*)(std::size_t, void *), void *))
 {
     // Invoke the elf_loader.
     elf_file elf(zpp_elf_binary, elf_file::state::unloaded);
@@ -31,10 +44,7 @@ zpp_load_elf(void * (*allocate_rwx)(std::size_t),
         reinterpret_cast<std::uintptr_t>(base) + elf.entry();
 
     // Convert ELF entry to function pointer.
-    auto entry = reinterpret_cast<int (*)(
-        std::size_t cpuid,
-        std::uintptr_t(*physical_to_virtual)(std::uintptr_t))>(
-        entry_point_address);
+    auto entry = reinterpret_cast<entry_type>(entry_point_address);
 
     // Call entry point on all cpus.
     auto cpus = number_of_cpus();
@@ -44,20 +54,76 @@ zpp_load_elf(void * (*allocate_rwx)(std::size_t),
         return -1;
     }
 
-    for (std::size_t i{}; i < cpus; ++i) {
-        // The launch function.
-        auto launch = [&] {
-            if (adjust_launch_calling_convention) {
-                return adjust_launch_calling_convention(
-                    entry, i, physical_to_virtual);
-            }
-            return entry(i, physical_to_virtual);
+    // The launch function.
+    auto launch = [&](std::size_t cpuid) {
+        // If the CPU identifier is out of range, fail.
+        if (cpuid >= cpus) {
+            return -1;
+        }
+
+        if (adjust_launch_calling_convention) {
+            return adjust_launch_calling_convention(entry,
+                                                    cpuid,
+                                                    physical_to_virtual,
+                                                    cpus,
+                                                    allocate_cpu_memory);
+        }
+        return entry(
+            cpuid, physical_to_virtual, cpus, allocate_cpu_memory);
+    };
+
+    // The launch function of the first CPU.
+    auto launch_first_cpu = [&] { return launch(0); };
+
+    // If supported, launch on all other CPUs concurrently, once the
+    // first CPU launched on its own, as it performs the one time
+    // initialization and allocates the CPU memory, which requires a
+    // context that may block.
+    if (call_on_each_cpu) {
+        // The erased launch function of the first CPU.
+        auto erased_launch_first_cpu = [](void * context) {
+            auto & local_launch =
+                *static_cast<decltype(launch_first_cpu) *>(context);
+            return local_launch();
         };
 
+        // Call on the first CPU.
+        if (call_on_cpu(
+                0,
+                static_cast<int (*)(void *)>(erased_launch_first_cpu),
+                std::addressof(launch_first_cpu))) {
+            return -1;
+        }
+
+        // The erased launch function, skips the first CPU.
+        auto erased_launch = [](std::size_t cpuid, void * context) {
+            auto & local_launch =
+                *static_cast<decltype(launch) *>(context);
+            return cpuid ? local_launch(cpuid) : 0;
+        };
+
+        // Call on every CPU.
+        auto result = call_on_each_cpu(
+            static_cast<int (*)(std::size_t, void *)>(erased_launch),
+            std::addressof(launch));
+
+        // If failed, return failure.
+        if (result) {
+            return -1;
+        }
+
+        // Return success.
+        return 0;
+    }
+
+    for (std::size_t i{}; i < cpus; ++i) {
+        // The launch function of this CPU.
+        auto launch_this_cpu = [&] { return launch(i); };
+
         // The erased launch function.
         auto erased_launch = [](void * context) {
             auto & local_launch =
-                *static_cast<decltype(launch) *>(context);
+                *static_cast<decltype(launch_this_cpu) *>(context);
             return local_launch();
         };
 
@@ -65,7 +131,7 @@ zpp_load_elf(void * (*allocate_rwx)(std::size_t),
         auto result =
             call_on_cpu(i,
                         static_cast<int (*)(void *)>(erased_launch),
-                        std::addressof(launch));
+                        std::addressof(launch_this_cpu));
 
         // If failed, return failure.
         if (result) {
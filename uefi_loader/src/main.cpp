@@ -10,6 +10,7 @@ extern "C" {
 #include <Protocol/LoadedImage.h>
 #include <Protocol/MpService.h>
 }
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <string>
@@ -64,12 +65,20 @@ static EFI_GUID g_efi_mp_service_protocol_guid = {
 extern "C" int
 zpp_load_elf(void * (*allocate_rwx)(std::size_t),
              std::uintptr_t (*physical_to_virtual)(std::uintptr_t),
+             void * (*allocate_cpu_memory)(std::size_t),
              int (*call_on_cpu)(std::size_t, int (*)(void *), void *),
              std::size_t (*number_of_cpus)(void),
              int (*adjust_launch_calling_convention)(
-                 int (*)(std::size_t, std::uintptr_t (*)(std::uintptr_t)),
+                 int (*)(std::size_t,
+                         std::uintptr_t (*)(std::uintptr_t),
+                         std::size_t,
+                         void * (*)(std::size_t)),
                  std::size_t,
-                 std::uintptr_t (*)(std::uintptr_t)));
+                 std::uintptr_t (*)(std::uintptr_t),
+                 std::size_t,
+                 void * (*)(std::size_t)),
+             int (*call_on_each_cpu)(int (*)(std::size_t, void *),
+                                     void *));
 
 static void * allocate_rwx(std::size_t size)
 {
@@ -91,6 +100,24 @@ static void * allocate_rwx(std::size_t size)
     return reinterpret_cast<void *>(physical_address);
 }
 
+extern "C" void * zpp_uefi_loader_allocate_cpu_memory(std::size_t size)
+{
+    return allocate_rwx(size);
+}
+
+static void * __attribute__((naked))
+invoke_allocate_cpu_memory(std::size_t)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        mov rcx, rdi // Forward the size parameter.
+        sub rsp, 0x28 // Make enough room for shadow space and align.
+        call zpp_uefi_loader_allocate_cpu_memory // Invoke function.
+        add rsp, 0x28 // Restore stack.
+        ret // Return.
+    )!!");
+}
+
 static std::size_t number_of_cpus()
 {
     std::size_t cpu_count{};
@@ -169,19 +196,94 @@ close_event:
     return result;
 }
 
+static int call_on_each_cpu(int (*function)(std::size_t, void *),
+                            void * context)
+{
+    // The number of CPUs that failed.
+    std::atomic<int> failures{};
+
+    // The event we will wait for to join all the APs.
+    EFI_EVENT join_event{};
+    std::size_t event_index{};
+
+    // The launch function.
+    auto launch = [&] {
+        std::size_t cpuid{};
+
+        // Call the user function with the current CPU, count failures.
+        if (EFI_ERROR(g_mp_services->WhoAmI(g_mp_services, &cpuid)) ||
+            function(cpuid, context)) {
+            ++failures;
+        }
+    };
+
+    // Erased launch function.
+    auto erased_launch = [](void * parameter) {
+        auto & local_launch = *static_cast<decltype(launch) *>(parameter);
+        return local_launch();
+    };
+
+    // Create the join event.
+    auto status =
+        g_boot_services->CreateEvent(0, 0, nullptr, nullptr, &join_event);
+    if (EFI_ERROR(status)) {
+        return -1;
+    }
+
+    // Startup all the APs without waiting for them, as the main CPU
+    // launches at the same time. If there are no APs, just launch on
+    // the main CPU.
+    status = g_mp_services->StartupAllAPs(
+        g_mp_services,
+        static_cast<void (*)(void *)>(erased_launch),
+        false,
+        join_event,
+        0,
+        &launch,
+        nullptr);
+    if (EFI_ERROR(status) && EFI_NOT_STARTED != status) {
+        g_boot_services->CloseEvent(join_event);
+        return -1;
+    }
+
+    // Launch on the main CPU.
+    launch();
+
+    // Wait for the join event, signaled when all the APs finish.
+    if (EFI_NOT_STARTED != status) {
+        status =
+            g_boot_services->WaitForEvent(1, &join_event, &event_index);
+        if (EFI_ERROR(status)) {
+            ++failures;
+        }
+    }
+
+    // Close the event, and return the result.
+    g_boot_services->CloseEvent(join_event);
+    return failures ? -1 : 0;
+}
+
 static int __attribute__((naked))
-invoke_entry(int (*)(std::size_t, std::uintptr_t (*)(std::uintptr_t)),
+invoke_entry(int (*)(std::size_t,
+                     std::uintptr_t (*)(std::uintptr_t),
+                     std::size_t,
+                     void * (*)(std::size_t)),
+             std::size_t,
+             std::uintptr_t (*)(std::uintptr_t),
              std::size_t,
-             std::uintptr_t (*)(std::uintptr_t))
+             void * (*)(std::size_t))
 {
     asm(R"!!(
         .intel_syntax noprefix
         push rdi // Save rdi before use as it is non-volatile.
         push rsi // Save rsi before use as it is non-volatile.
+        mov rax, rcx // Save the function pointer.
         mov rdi, rdx // Forward first parameter to function.
         mov rsi, r8 // Forward second parameter to function.
+        mov rdx, r9 // Forward third parameter to function.
+        mov rcx, [rsp+0x38] // Forward fourth parameter from the stack.
         sub rsp, 0x8 // Align stack to 16 bytes.
-        call rcx // Call the function pointer.
+        call rax // Call the function pointer.
         add rsp, 0x8 // Restore stack.
         pop rsi // Restore rsi.
         pop rdi // Restore rdi.
@@ -298,8 +400,13 @@ extern "C" EFI_STATUS EFIAPI uefi_main(EFI_HANDLE image_handle,
     }
 
     // Load the ELF.
-    auto result = zpp_load_elf(
-        allocate_rwx, nullptr, call_on_cpu, number_of_cpus, invoke_entry);
+    auto result = zpp_load_elf(allocate_rwx,
+                               nullptr,
+                               invoke_allocate_cpu_memory,
+                               call_on_cpu,
+                               number_of_cpus,
+                               invoke_entry,
+                               call_on_each_cpu);
 
     // If we failed, return an arbitrary failure.
     if (result) {
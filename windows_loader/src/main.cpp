@@ -7,12 +7,20 @@
 extern "C" int
 zpp_load_elf(void * (*allocate_rwx)(std::size_t),
              std::uintptr_t (*physical_to_virtual)(std::uintptr_t),
+             void * (*allocate_cpu_memory)(std::size_t),
              int (*call_on_cpu)(std::size_t, int (*)(void *), void *),
              std::size_t (*number_of_cpus)(void),
              int (*adjust_launch_calling_convention)(
-                 int (*)(std::size_t, std::uintptr_t (*)(std::uintptr_t)),
+                 int (*)(std::size_t,
+                         std::uintptr_t (*)(std::uintptr_t),
+                         std::size_t,
+                         void * (*)(std::size_t)),
                  std::size_t,
-                 std::uintptr_t (*)(std::uintptr_t)));
+                 std::uintptr_t (*)(std::uintptr_t),
+                 std::size_t,
+                 void * (*)(std::size_t)),
+             int (*call_on_each_cpu)(int (*)(std::size_t, void *),
+                                     void *));
 
 static void * allocate_rwx(std::size_t size)
 {
@@ -45,6 +53,35 @@ static int call_on_cpu(std::size_t cpuid,
     return result;
 }
 
+static int call_on_each_cpu(int (*function)(std::size_t, void *),
+                            void * context)
+{
+    // The broadcast state.
+    struct broadcast_state
+    {
+        int (*function)(std::size_t, void *);
+        void * context;
+        volatile LONG failures;
+    } broadcast{function, context, 0};
+
+    // Call user function on all CPUs at once at IPI level, with the
+    // current CPU, count failures.
+    KeIpiGenericCall(
+        [](ULONG_PTR argument) -> ULONG_PTR {
+            auto & broadcast =
+                *reinterpret_cast<broadcast_state *>(argument);
+            if (broadcast.function(KeGetCurrentProcessorNumberEx(nullptr),
+                                   broadcast.context)) {
+                InterlockedIncrement(&broadcast.failures);
+            }
+            return 0;
+        },
+        reinterpret_cast<ULONG_PTR>(&broadcast));
+
+    // Fail if any of the CPUs failed.
+    return broadcast.failures ? -1 : 0;
+}
+
 extern "C" std::uintptr_t
 zpp_windows_loader_physical_to_virtual(std::uintptr_t value)
 {
@@ -67,19 +104,45 @@ invoke_physical_to_virtual(std::uintptr_t)
     )!!");
 }
 
+extern "C" void * zpp_windows_loader_allocate_cpu_memory(std::size_t size)
+{
+    return ExAllocatePool(NonPagedPoolNx, size);
+}
+
+static void * __attribute__((naked))
+invoke_allocate_cpu_memory(std::size_t)
+{
+    asm(R"!!(
+        .intel_syntax noprefix
+        mov rcx, rdi // Forward the size parameter.
+        sub rsp, 0x28 // Make enough room for shadow space and align.
+        call zpp_windows_loader_allocate_cpu_memory // Invoke function.
+        add rsp, 0x28 // Restore stack.
+        ret // Return.
+    )!!");
+}
+
 static int __attribute__((naked))
-invoke_entry(int (*)(std::size_t, std::uintptr_t (*)(std::uintptr_t)),
+invoke_entry(int (*)(std::size_t,
+                     std::uintptr_t (*)(std::uintptr_t),
+                     std::size_t,
+                     void * (*)(std::size_t)),
+             std::size_t,
+             std::uintptr_t (*)(std::uintptr_t),
              std::size_t,
-             std::uintptr_t (*)(std::uintptr_t))
+             void * (*)(std::size_t))
 {
     asm(R"!!(
         .intel_syntax noprefix
         push rdi // Save rdi before use as it is non-volatile.
         push rsi // Save rsi before use as it is non-volatile.
+        mov rax, rcx // Save the function pointer.
         mov rdi, rdx // Forward first parameter to function.
         mov rsi, r8 // Forward second parameter to function.
+        mov rdx, r9 // Forward third parameter to function.
+        mov rcx, [rsp+0x38] // Forward fourth parameter from the stack.
         sub rsp, 0x8 // Align stack to 16 bytes.
-        call rcx // Call the function pointer.
+        call rax // Call the function pointer.
         add rsp, 0x8 // Restore stack.
         pop rsi // Restore rsi.
         pop rdi // Restore rdi.
@@ -95,9 +158,11 @@ extern "C" NTAPI NTSTATUS driver_entry(PDRIVER_OBJECT driver_object,
     // Load the ELF.
     auto result = zpp_load_elf(allocate_rwx,
                                invoke_physical_to_virtual,
+                               invoke_allocate_cpu_memory,
                                call_on_cpu,
                                number_of_cpus,
-                               invoke_entry);
+                               invoke_entry,
+                               call_on_each_cpu);
 
     // If we failed, return an arbitrary failure.
     if (result) {